@@ -73,16 +73,19 @@ extern "C" {
 #define _POSIX_THREAD_ATTR_STACKSIZE            200809L
 #endif
 
+/* We support the priority inheritance and priority ceiling mutex protocols.  */
+#ifndef _POSIX_THREAD_PRIO_INHERIT
+#define _POSIX_THREAD_PRIO_INHERIT  200809L
+#endif
+
+#ifndef _POSIX_THREAD_PRIO_PROTECT
+#define _POSIX_THREAD_PRIO_PROTECT  200809L
+#endif
+
 /* The following options are not supported */
 #undef _POSIX_THREAD_ATTR_STACKADDR
 #define _POSIX_THREAD_ATTR_STACKADDR -1
 
-#undef _POSIX_THREAD_PRIO_INHERIT
-#define _POSIX_THREAD_PRIO_INHERIT -1
-
-#undef _POSIX_THREAD_PRIO_PROTECT
-#define _POSIX_THREAD_PRIO_PROTECT -1
-
 #undef _POSIX_THREAD_PRIORITY_SCHEDULING
 #define _POSIX_THREAD_PRIORITY_SCHEDULING -1
 
@@ -92,6 +95,14 @@ extern "C" {
 /* POSIX Thread Definitions */
 #define PTHREAD_KEYS_MAX            1024
 
+#ifndef PTHREAD_STACK_MIN
+#define PTHREAD_STACK_MIN           65536 /* the allocation granularity */
+#endif
+
+#ifndef PTHREAD_DESTRUCTOR_ITERATIONS
+#define PTHREAD_DESTRUCTOR_ITERATIONS   4
+#endif
+
 #define PTHREAD_PROCESS_PRIVATE     0
 #define PTHREAD_PROCESS_SHARED      1
 
@@ -121,17 +132,39 @@ extern "C" {
 #define PTHREAD_MUTEX_ERRORCHECK    2
 #define PTHREAD_MUTEX_DEFAULT       PTHREAD_MUTEX_NORMAL
 
+#define PTHREAD_MUTEX_SPIN_ADAPTIVE_NP  (-1)
+
 #define PTHREAD_MUTEX_STALLED       0
 #define PTHREAD_MUTEX_ROBUST        1
 
-#define PTHREAD_SPINLOCK_INITIALIZER    {0, 0}
-#define PTHREAD_SPIN_RWLOCK_INITIALIZER {0, 0, 0}
+#define PTHREAD_SPINLOCK_INITIALIZER    {0, 0, 0, 0}
+#define PTHREAD_SPIN_RWLOCK_INITIALIZER {0}
+#define PTHREAD_SEQLOCK_INITIALIZER     {0}
+#define PTHREAD_SPIN_MCS_INITIALIZER    {NULL}
+#define PTHREAD_SPIN_MCS_NUMA_INITIALIZER   {{0}}
+#ifdef PTHREAD_MUTEX_INLINE
+#define PTHREAD_MUTEX_INITIALIZER       {{0}}
+#else
 #define PTHREAD_MUTEX_INITIALIZER       NULL
+#endif
 #define PTHREAD_RWLOCK_INITIALIZER      NULL
 #define PTHREAD_COND_INITIALIZER        NULL
 
 #define PTHREAD_BARRIER_SERIAL_THREAD   -1
 
+#define PTHREAD_TASK_GROUP_INITIALIZER  {0}
+
+#define PTHREAD_BARRIER_SPIN_NP     0 /* spin for a bounded time, then park */
+#define PTHREAD_BARRIER_PARK_NP     1 /* park at once, for more threads than CPUs */
+
+#define PTHREAD_WAKE_ALL_NP         0x7fffffff /* count of pthread_wake_np */
+
+#define PTHREAD_LOCK_MUTEX_NP       0 /* kinds of pthread_lock_stats_np */
+#define PTHREAD_LOCK_SPIN_NP        1
+#define PTHREAD_LOCK_BARRIER_NP     2
+#define PTHREAD_LOCK_SEM_NP         3
+#define PTHREAD_LOCK_SPIN_RWLOCK_NP 4 /* only the lock elision counters */
+
 typedef uintptr_t pthread_t;
 typedef void *pthread_attr_t;
 
@@ -143,21 +176,167 @@ typedef void    *pthread_condattr_t;
 typedef void    *pthread_rwlockattr_t;
 typedef void    *pthread_barrierattr_t;
 
+/*
+ * If the library was configured with LIBPTHREAD_INLINE_MUTEX, mutexes are
+ * stored inline and aligned to a cache line, applications must be compiled
+ * with PTHREAD_MUTEX_INLINE defined as well.
+ */
+#ifdef PTHREAD_MUTEX_INLINE
+#define PTHREAD_MUTEX_SIZE          64
+
+#if defined(_MSC_VER)
+typedef __declspec(align(64)) struct {
+    long __data[PTHREAD_MUTEX_SIZE / sizeof(long)];
+} pthread_mutex_t;
+#else
+typedef struct {
+    long __data[PTHREAD_MUTEX_SIZE / sizeof(long)];
+} __attribute__((aligned(64))) pthread_mutex_t;
+#endif
+#else
 typedef void    *pthread_mutex_t;
+#endif
 typedef void    *pthread_cond_t;
 typedef void    *pthread_rwlock_t;
 typedef void    *pthread_barrier_t;
 
+#define PTHREAD_CACHE_LINE_SIZE     64
+
+/*
+ * Work-stealing task pool: a fixed set of workers, each with its own deque.
+ * Tasks are counted in a group, pthread_task_wait runs pending tasks until
+ * the group is empty.
+ */
+typedef void    *pthread_task_pool_t;
+
+typedef struct {
+    long pending; /* 2 per unfinished task, plus 1 if a thread is parked */
+} pthread_task_group_t;
+
+/*
+ * Bounded multi-producer multi-consumer queue of pointers: a ring of
+ * sequenced cells, producers and consumers claim cells with one
+ * compare-and-swap and park only while the queue is full or empty.
+ */
+typedef void    *pthread_queue_t;
+
 typedef struct {
     long owner;
     long ticket;
+    long waiters; /* parked on owner */
+    long elision; /* credit of lock elision, 0 if off, see pthread_spin_setelision_np */
 } pthread_spinlock_t;
 
+/*
+ * MCS queue spin lock: every waiter spins on its own node, which the caller
+ * provides and must pass again to pthread_spin_mcs_unlock.
+ */
+typedef struct pthread_spin_mcs_node {
+    struct pthread_spin_mcs_node * volatile next;
+    volatile long locked;
+    long numa; /* NUMA node slot, pthread_spin_mcs_numa_t only */
+} pthread_spin_mcs_node_t;
+
 typedef struct {
-    long owner;
-    long ticket;
-    long readers;
+    pthread_spin_mcs_node_t * volatile tail;
+} pthread_spin_mcs_t;
+
+/*
+ * NUMA-aware cohort lock: one MCS lock per NUMA node and a global ticket
+ * lock, handed over within the node up to PTHREAD_SPIN_MCS_NUMA_BATCH times.
+ */
+#define PTHREAD_SPIN_MCS_NUMA_NODES 8
+#define PTHREAD_SPIN_MCS_NUMA_BATCH 64
+
+#if defined(_MSC_VER)
+typedef __declspec(align(64)) struct {
+#else
+typedef struct {
+#endif
+    pthread_spinlock_t global;
+    char __pad0[PTHREAD_CACHE_LINE_SIZE - sizeof(pthread_spinlock_t)];
+    struct {
+        pthread_spin_mcs_t local;
+        long batch; /* consecutive handovers within the node */
+        char __pad1[PTHREAD_CACHE_LINE_SIZE - sizeof(pthread_spin_mcs_t) - sizeof(long)];
+    } node[PTHREAD_SPIN_MCS_NUMA_NODES];
+#if defined(_MSC_VER)
+} pthread_spin_mcs_numa_t;
+#else
+} __attribute__((aligned(64))) pthread_spin_mcs_numa_t;
+#endif
+
+/*
+ * Phase-fair ticket rwlock: readers enter and leave with one atomic add,
+ * the reader entry, reader exit and writer ticket words live on separate
+ * cache lines.
+ */
+#if defined(_MSC_VER)
+typedef __declspec(align(64)) struct {
+#else
+typedef struct {
+#endif
+    long rin; /* reader entries, plus the writer phase bits */
+    char __pad0[PTHREAD_CACHE_LINE_SIZE - sizeof(long)];
+    long rout; /* reader exits */
+    char __pad1[PTHREAD_CACHE_LINE_SIZE - sizeof(long)];
+    long win; /* writer tickets */
+    long wout; /* writer tickets served */
+    long elision; /* credit of lock elision, 0 if off */
+    char __pad2[PTHREAD_CACHE_LINE_SIZE - 3 * sizeof(long)];
+#if defined(_MSC_VER)
 } pthread_spin_rwlock_t;
+#else
+} __attribute__((aligned(64))) pthread_spin_rwlock_t;
+#endif
+
+/*
+ * Sequence lock for small read-mostly data: a writer makes seq odd for the
+ * time of its update, readers copy the data without writing anything and
+ * retry if seq was odd or has moved in the meantime.
+ */
+typedef struct {
+    long seq; /* odd while a writer updates, writers take the lock by making it odd */
+} pthread_seqlock_t;
+
+/*
+ * Read-copy-update: readers of a lock-free structure mark their read
+ * sections, an updater unlinks a node and frees it once every read section
+ * that may still see it has ended. Embed the head in the node, the callback
+ * of pthread_rcu_call gets it back.
+ */
+typedef struct pthread_rcu_head {
+    struct pthread_rcu_head *next;
+    void (* func)(struct pthread_rcu_head *head);
+} pthread_rcu_head_t;
+
+/*
+ * Cleanup frame of pthread_cleanup_push, it lives on the stack of the caller
+ * from pthread_cleanup_push to the matching pthread_cleanup_pop.
+ */
+struct _pthread_cleanup_buffer {
+    void (* __routine)(void *);
+    void *__arg;
+    struct _pthread_cleanup_buffer *__prev;
+};
+
+/*
+ * Contention of a lock, see pthread_lock_stats_np. The library must be
+ * configured with LIBPTHREAD_LOCK_STATS, times are in ns.
+ */
+struct pthread_lock_stats_np {
+    const void *lock; /* the internal lock object, or the pthread_spinlock_t */
+    int kind; /* PTHREAD_LOCK_*_NP */
+    const void *caller; /* where the lock was initialized, NULL if statically */
+    unsigned long long acquisitions;
+    unsigned long long spins; /* acquired while spinning */
+    unsigned long long parks; /* acquired after parking in the kernel */
+    unsigned long long wait_ns;
+    unsigned long long max_wait_ns;
+    unsigned long long hold_ns; /* mutexes and spinlocks only */
+    unsigned long long elided; /* acquisitions run as a hardware transaction */
+    unsigned long long aborts; /* aborted transactions of lock elision */
+};
 
 /*
     #include <signal.h>
@@ -185,23 +364,49 @@ int pthread_attr_getstack(const pthread_attr_t *attr, void **addr, size_t *size)
 int pthread_attr_setstack(pthread_attr_t *attr, void *addr, size_t size);
 int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *size);
 int pthread_attr_setstacksize(pthread_attr_t *attr, size_t size);
+int pthread_attr_getaffinity_np(const pthread_attr_t *attr, size_t cpusetsize, cpu_set_t *cpuset);
+int pthread_attr_setaffinity_np(pthread_attr_t *attr, size_t cpusetsize, const cpu_set_t *cpuset);
+int pthread_attr_getnumanode_np(const pthread_attr_t *attr, int *node);
+int pthread_attr_setnumanode_np(pthread_attr_t *attr, int node);
 int pthread_attr_destroy(pthread_attr_t *attr);
 
 int pthread_create(pthread_t *t, const pthread_attr_t *attr, void *(* start_routine)(void *), void *arg);
+int pthread_getcachesize_np(int *size);
+int pthread_setcachesize_np(int size);
 int pthread_once(pthread_once_t *once_control, void (* init_routine)(void));
 pthread_t pthread_self(void);
 int pthread_equal(pthread_t t1, pthread_t t2);
 int pthread_detach(pthread_t t);
 int pthread_join(pthread_t t, void **value_ptr);
+int pthread_tryjoin_np(pthread_t t, void **value_ptr);
+int pthread_timedjoin_np(pthread_t t, void **value_ptr, const struct timespec *abstime);
+int pthread_join_many_np(int count, const pthread_t *threads, void **value_ptrs, const struct timespec *abstime);
 void pthread_exit(void *value_ptr);
 
 int pthread_setschedprio(pthread_t thread, int priority);
 int pthread_setschedparam(pthread_t thread, int policy, const struct sched_param *param);
 int pthread_getschedparam(pthread_t thread, int *policy, struct sched_param *param);
+int pthread_getaffinity_np(pthread_t thread, size_t cpusetsize, cpu_set_t *cpuset);
+int pthread_setaffinity_np(pthread_t thread, size_t cpusetsize, const cpu_set_t *cpuset);
 
+void _pthread_cleanup_push(struct _pthread_cleanup_buffer *buffer, void (*cleanup_routine)(void *), void *arg);
+void _pthread_cleanup_pop(struct _pthread_cleanup_buffer *buffer, int execute);
 void pthread_cleanup_push(void (*cleanup_routine)(void *), void *arg);
 void pthread_cleanup_pop(int execute);
 
+/*
+ * POSIX allows pthread_cleanup_push and pthread_cleanup_pop to be macros
+ * that open and close a block, the frame is kept in that block.
+ */
+#define pthread_cleanup_push(routine, arg) \
+    do { \
+        struct _pthread_cleanup_buffer __cleanup_buffer; \
+        _pthread_cleanup_push(&__cleanup_buffer, (routine), (arg));
+
+#define pthread_cleanup_pop(execute) \
+        _pthread_cleanup_pop(&__cleanup_buffer, (execute)); \
+    } while (0)
+
 int pthread_kill(pthread_t t, int sig);
 int pthread_cancel(pthread_t t);
 int pthread_setcancelstate(int state, int *oldstate);
@@ -218,6 +423,21 @@ int pthread_spin_lock(pthread_spinlock_t *lock);
 int pthread_spin_trylock(pthread_spinlock_t *lock);
 int pthread_spin_unlock(pthread_spinlock_t *lock);
 int pthread_spin_destroy(pthread_spinlock_t *lock);
+int pthread_spin_getspin_np(int *spin_count, int *yield_count);
+int pthread_spin_setspin_np(int spin_count, int yield_count);
+int pthread_spin_getelision_np(pthread_spinlock_t *lock, int *elide);
+int pthread_spin_setelision_np(pthread_spinlock_t *lock, int elide);
+
+int pthread_spin_mcs_init(pthread_spin_mcs_t *lock, int pshared);
+int pthread_spin_mcs_lock(pthread_spin_mcs_t *lock, pthread_spin_mcs_node_t *node);
+int pthread_spin_mcs_trylock(pthread_spin_mcs_t *lock, pthread_spin_mcs_node_t *node);
+int pthread_spin_mcs_unlock(pthread_spin_mcs_t *lock, pthread_spin_mcs_node_t *node);
+int pthread_spin_mcs_destroy(pthread_spin_mcs_t *lock);
+
+int pthread_spin_mcs_numa_init(pthread_spin_mcs_numa_t *lock, int pshared);
+int pthread_spin_mcs_numa_lock(pthread_spin_mcs_numa_t *lock, pthread_spin_mcs_node_t *node);
+int pthread_spin_mcs_numa_unlock(pthread_spin_mcs_numa_t *lock, pthread_spin_mcs_node_t *node);
+int pthread_spin_mcs_numa_destroy(pthread_spin_mcs_numa_t *lock);
 
 int pthread_spin_rwlock_init(pthread_spin_rwlock_t *lock, int pshared);
 int pthread_spin_rwlock_reader_lock(pthread_spin_rwlock_t *lock);
@@ -225,6 +445,22 @@ int pthread_spin_rwlock_reader_unlock(pthread_spin_rwlock_t *lock);
 int pthread_spin_rwlock_writer_lock(pthread_spin_rwlock_t *lock);
 int pthread_spin_rwlock_writer_unlock(pthread_spin_rwlock_t *lock);
 int pthread_spin_rwlock_destroy(pthread_spin_rwlock_t *lock);
+int pthread_spin_rwlock_getelision_np(pthread_spin_rwlock_t *lock, int *elide);
+int pthread_spin_rwlock_setelision_np(pthread_spin_rwlock_t *lock, int elide);
+
+int pthread_seqlock_init(pthread_seqlock_t *lock, int pshared);
+long pthread_seqlock_read_begin(pthread_seqlock_t *lock);
+int pthread_seqlock_read_retry(pthread_seqlock_t *lock, long seq);
+int pthread_seqlock_write_lock(pthread_seqlock_t *lock);
+int pthread_seqlock_write_trylock(pthread_seqlock_t *lock);
+int pthread_seqlock_write_unlock(pthread_seqlock_t *lock);
+int pthread_seqlock_destroy(pthread_seqlock_t *lock);
+
+int pthread_rcu_read_lock(void);
+int pthread_rcu_read_unlock(void);
+int pthread_rcu_synchronize(void);
+int pthread_rcu_call(pthread_rcu_head_t *head, void (* func)(pthread_rcu_head_t *head));
+int pthread_rcu_barrier(void);
 
 int pthread_mutexattr_init(pthread_mutexattr_t *attr);
 int pthread_mutexattr_getprioceiling(const pthread_mutexattr_t *attr, int *prioceiling);
@@ -237,6 +473,8 @@ int pthread_mutexattr_getrobust(const pthread_mutexattr_t *attr, int *robust);
 int pthread_mutexattr_setrobust(pthread_mutexattr_t *attr, int robust);
 int pthread_mutexattr_gettype(const pthread_mutexattr_t *attr, int *type);
 int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type);
+int pthread_mutexattr_getspin_np(const pthread_mutexattr_t *attr, int *spin_count);
+int pthread_mutexattr_setspin_np(pthread_mutexattr_t *attr, int spin_count);
 int pthread_mutexattr_destroy(pthread_mutexattr_t *attr);
 
 int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
@@ -253,6 +491,8 @@ int pthread_barrierattr_init(pthread_barrierattr_t *attr);
 int pthread_barrierattr_getpshared(const pthread_barrierattr_t *attr, int *s);
 int pthread_barrierattr_setpshared(pthread_barrierattr_t *attr, int s);
 int pthread_barrierattr_destroy(pthread_barrierattr_t *attr);
+int pthread_barrierattr_getkind_np(const pthread_barrierattr_t *attr, int *kind);
+int pthread_barrierattr_setkind_np(pthread_barrierattr_t *attr, int kind);
 
 int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count);
 int pthread_barrier_wait(pthread_barrier_t *barrier);
@@ -276,6 +516,8 @@ int pthread_rwlockattr_init(pthread_rwlockattr_t *attr);
 int pthread_rwlockattr_getpshared(const pthread_rwlockattr_t *attr, int *pshared);
 int pthread_rwlockattr_setpshared(pthread_rwlockattr_t *attr, int pshared);
 int pthread_rwlockattr_destroy(pthread_rwlockattr_t *attr);
+int pthread_rwlockattr_getpercpu_np(const pthread_rwlockattr_t *attr, int *percpu);
+int pthread_rwlockattr_setpercpu_np(pthread_rwlockattr_t *attr, int percpu);
 
 int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr);
 int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock);
@@ -287,6 +529,27 @@ int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock);
 int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock);
 int pthread_rwlock_destroy (pthread_rwlock_t *rwlock);
 
+int pthread_task_pool_init(pthread_task_pool_t *pool, int nworkers);
+int pthread_task_pool_destroy(pthread_task_pool_t *pool);
+int pthread_task_spawn(pthread_task_pool_t *pool, pthread_task_group_t *group, void (* routine)(void *), void *arg);
+int pthread_task_wait(pthread_task_pool_t *pool, pthread_task_group_t *group);
+int pthread_task_self(pthread_task_pool_t *pool);
+
+int pthread_queue_init(pthread_queue_t *queue, int capacity);
+int pthread_queue_destroy(pthread_queue_t *queue);
+int pthread_queue_push(pthread_queue_t *queue, void *item);
+int pthread_queue_trypush(pthread_queue_t *queue, void *item);
+int pthread_queue_push_many(pthread_queue_t *queue, void * const *items, int count);
+int pthread_queue_pop(pthread_queue_t *queue, void **item);
+int pthread_queue_trypop(pthread_queue_t *queue, void **item);
+int pthread_queue_pop_many(pthread_queue_t *queue, void **items, int count, int *popped);
+
+int pthread_wait_on_address_np(volatile long *addr, long expected, clockid_t clock_id, const struct timespec *abstime);
+int pthread_wake_np(volatile long *addr, int count);
+
+int pthread_lock_stats_np(struct pthread_lock_stats_np *stats, int *count);
+int pthread_lock_stats_reset_np(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -76,6 +76,41 @@ extern "C" {
 #define CLOCK_THREAD_CPUTIME_ID     3
 #endif
 
+#ifndef CLOCK_REALTIME_COARSE
+#define CLOCK_REALTIME_COARSE       5
+#endif
+
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE      6
+#endif
+
+#ifndef SIGEV_SIGNAL
+#define SIGEV_SIGNAL    0 /* not supported, there are no signals */
+#define SIGEV_NONE      1 /* no notification, see timer_gettime */
+#define SIGEV_THREAD    2 /* call sigev_notify_function on the timer thread */
+#endif
+
+#ifndef _SIGEVENT_DEFINED
+union sigval {
+    int sival_int;
+    void *sival_ptr;
+};
+
+struct sigevent {
+    int sigev_notify;
+    int sigev_signo;
+    union sigval sigev_value;
+    void (* sigev_notify_function)(union sigval);
+    void *sigev_notify_attributes; /* ignored */
+};
+#define _SIGEVENT_DEFINED       1
+#endif  /* _SIGEVENT_DEFINED */
+
+#ifndef _TIMER_T_DEFINED
+typedef void *timer_t;
+#define _TIMER_T_DEFINED        1
+#endif  /* _TIMER_T_DEFINED */
+
 int nanosleep(const struct timespec *request, struct timespec *remain);
 
 int clock_getres(clockid_t clock_id, struct timespec *res);
@@ -85,6 +120,12 @@ int clock_nanosleep(clockid_t clock_id, int flags,
                            const struct timespec *request,
                            struct timespec *remain);
 
+int timer_create(clockid_t clock_id, struct sigevent *evp, timer_t *timerid);
+int timer_settime(timer_t timerid, int flags, const struct itimerspec *value, struct itimerspec *ovalue);
+int timer_gettime(timer_t timerid, struct itimerspec *value);
+int timer_getoverrun(timer_t timerid);
+int timer_delete(timer_t timerid);
+
 #ifdef __cplusplus
 }
 #endif
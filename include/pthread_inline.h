@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PTHREAD_INLINE_H_
+#define _PTHREAD_INLINE_H_
+
+/**
+ * @file pthread_inline.h
+ * @brief Inline Fast Paths of Spin Locks, Once and Mutexes
+ */
+
+/**
+ * @defgroup inline Inline Fast Paths
+ * @ingroup libpthread
+ * @{
+ */
+
+/*
+ * Opt-in: include this header after pthread.h and the uncontended paths of
+ * pthread_spin_lock, pthread_spin_trylock, pthread_spin_unlock, pthread_once
+ * and pthread_mutex_lock, pthread_mutex_trylock, pthread_mutex_unlock of a
+ * PTHREAD_MUTEX_NORMAL mutex are expanded in the caller, everything else
+ * still calls the library. It works with the DLL and the static library,
+ * the caller must be built with the same PTHREAD_MUTEX_INLINE setting.
+ *
+ * The fast paths do not count lock statistics nor write trace events: they
+ * are left out if LIBPTHREAD_LOCK_STATS is defined, and define
+ * PTHREAD_INLINE_DISABLE to leave them out anyway.
+ */
+
+#include <pthread.h>
+
+#if !defined(LIBPTHREAD_LOCK_STATS) && !defined(PTHREAD_INLINE_DISABLE)
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/* Spinners wait for an event on ARM with Visual C++, the unlocks stay in the library */
+#if defined(_MSC_VER) && (defined(_M_ARM) || defined(_M_ARM64) || defined(_M_ARM64EC))
+#define __PTHREAD_INLINE_UNLOCK     0
+#else
+#define __PTHREAD_INLINE_UNLOCK     1
+#endif
+
+#define __PTHREAD_ONCE_DONE         3 /* ARCH_ONCE_DONE of pthread.c */
+
+#if defined(_MSC_VER)
+#define __pthread_inline            static __forceinline
+#else
+#define __pthread_inline            static __inline __attribute__((always_inline))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __pthread_load(p)           (*(volatile long *) (p))
+
+__pthread_inline long __pthread_load_acquire(volatile long *p)
+{
+#if defined(_MSC_VER) && (defined(_M_ARM) || defined(_M_ARM64))
+    long v = *p;
+    __dmb(0xB); /* _ARM_BARRIER_ISH */
+    return v;
+#elif defined(_MSC_VER)
+    long v = *p;
+    _ReadWriteBarrier();
+    return v;
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+__pthread_inline void *__pthread_load_ptr_acquire(void * volatile *p)
+{
+#if defined(_MSC_VER) && (defined(_M_ARM) || defined(_M_ARM64))
+    void *v = *p;
+    __dmb(0xB);
+    return v;
+#elif defined(_MSC_VER)
+    void *v = *p;
+    _ReadWriteBarrier();
+    return v;
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/* Return 1 if *p was old and is now new */
+__pthread_inline int __pthread_cas_acquire(volatile long *p, long new_value, long old_value)
+{
+#if defined(_MSC_VER)
+    return _InterlockedCompareExchange(p, new_value, old_value) == old_value;
+#else
+    return __atomic_compare_exchange_n(p, &old_value, new_value, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#endif
+}
+
+/* The lock word of a mutex, NULL if it is not allocated yet */
+__pthread_inline volatile long *__pthread_mutex_word(pthread_mutex_t *m)
+{
+#ifdef PTHREAD_MUTEX_INLINE
+    return (volatile long *) m;
+#else
+    return (volatile long *) __pthread_load_ptr_acquire((void * volatile *) m);
+#endif
+}
+
+/*
+ * A spin lock is free if owner equals ticket, the lock and trylock paths
+ * take the next ticket only then. A lock with lock elision goes to the
+ * library, and so does an unlock of a free (elided) lock.
+ */
+__pthread_inline int __pthread_spin_trylock_inline(pthread_spinlock_t *lock)
+{
+    long ticket = __pthread_load(& lock->ticket);
+
+    if (ticket == __pthread_load_acquire(& lock->owner) && __pthread_cas_acquire(& lock->ticket, ticket + 1, ticket))
+        return 0;
+
+    return (pthread_spin_trylock)(lock);
+}
+
+__pthread_inline int __pthread_spin_lock_inline(pthread_spinlock_t *lock)
+{
+    long ticket = __pthread_load(& lock->ticket);
+
+    if (__pthread_load(& lock->elision) == 0 && ticket == __pthread_load_acquire(& lock->owner)
+        && __pthread_cas_acquire(& lock->ticket, ticket + 1, ticket))
+        return 0;
+
+    return (pthread_spin_lock)(lock);
+}
+
+__pthread_inline int __pthread_spin_unlock_inline(pthread_spinlock_t *lock)
+{
+#if __PTHREAD_INLINE_UNLOCK
+    if (__pthread_load(& lock->owner) != __pthread_load(& lock->ticket)) {
+        /* Release, and ordered before the load of waiters */
+#if defined(_MSC_VER)
+        _InterlockedExchangeAdd(& lock->owner, 1);
+#else
+        __atomic_fetch_add(& lock->owner, 1, __ATOMIC_SEQ_CST);
+        /* As memory_barrier_after_atomic: a locked add is a full fence on x86 */
+#if defined(__i386__) || defined(__x86_64__)
+        __asm__ __volatile__("" ::: "memory");
+#else
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+#endif
+        if (__pthread_load(& lock->waiters) != 0)
+            pthread_wake_np(& lock->owner, PTHREAD_WAKE_ALL_NP);
+        return 0;
+    }
+#endif
+
+    return (pthread_spin_unlock)(lock);
+}
+
+__pthread_inline int __pthread_once_inline(pthread_once_t *once_control, void (* init_routine)(void))
+{
+    if (__pthread_load_acquire((volatile long *) once_control) == __PTHREAD_ONCE_DONE)
+        return 0;
+
+    return (pthread_once)(once_control, init_routine);
+}
+
+/*
+ * The first two words of a mutex are the lock word, 0 unlocked, 1 locked
+ * and 2 locked with parked waiters, and the type.
+ */
+__pthread_inline int __pthread_mutex_lock_inline(pthread_mutex_t *m)
+{
+    volatile long *word = __pthread_mutex_word(m);
+
+    if (word != NULL && word[1] == PTHREAD_MUTEX_NORMAL && __pthread_cas_acquire(word, 1, 0))
+        return 0;
+
+    return (pthread_mutex_lock)(m);
+}
+
+__pthread_inline int __pthread_mutex_trylock_inline(pthread_mutex_t *m)
+{
+    volatile long *word = __pthread_mutex_word(m);
+
+    if (word != NULL && word[1] == PTHREAD_MUTEX_NORMAL && __pthread_cas_acquire(word, 1, 0))
+        return 0;
+
+    return (pthread_mutex_trylock)(m);
+}
+
+__pthread_inline int __pthread_mutex_unlock_inline(pthread_mutex_t *m)
+{
+#if __PTHREAD_INLINE_UNLOCK
+    volatile long *word = __pthread_mutex_word(m);
+    long old;
+
+    if (word != NULL && word[1] == PTHREAD_MUTEX_NORMAL) {
+#if defined(_MSC_VER)
+        old = _InterlockedExchange(word, 0);
+#else
+        old = __atomic_exchange_n(word, 0, __ATOMIC_RELEASE);
+#endif
+        if (old == 2)
+            pthread_wake_np(word, 1);
+        return 0;
+    }
+#endif
+
+    return (pthread_mutex_unlock)(m);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#define pthread_spin_lock(lock)         __pthread_spin_lock_inline(lock)
+#define pthread_spin_trylock(lock)      __pthread_spin_trylock_inline(lock)
+#define pthread_spin_unlock(lock)       __pthread_spin_unlock_inline(lock)
+#define pthread_once(control, routine)  __pthread_once_inline(control, routine)
+#define pthread_mutex_lock(m)           __pthread_mutex_lock_inline(m)
+#define pthread_mutex_trylock(m)        __pthread_mutex_trylock_inline(m)
+#define pthread_mutex_unlock(m)         __pthread_mutex_unlock_inline(m)
+
+#endif /* !LIBPTHREAD_LOCK_STATS && !PTHREAD_INLINE_DISABLE */
+
+/** @} */
+
+#endif /* _PTHREAD_INLINE_H_ */
@@ -51,6 +51,42 @@ struct sched_param {
   int sched_priority;
 };
 
+/*
+ * CPU sets: CPU n is the logical processor n % 64 of the processor
+ * group n / 64, so machines with more than 64 CPUs can be addressed.
+ */
+#define CPU_SETSIZE     1024
+#define __NCPUBITS      64
+
+typedef struct {
+    uint64_t __bits[CPU_SETSIZE / __NCPUBITS];
+} cpu_set_t;
+
+#define __CPU_MASK(cpu) ((uint64_t) 1 << ((cpu) % __NCPUBITS))
+
+#define CPU_ZERO(set) do { \
+        int __i; \
+        for (__i = 0; __i < CPU_SETSIZE / __NCPUBITS; __i++) \
+            (set)->__bits[__i] = 0; \
+    } while (0)
+#define CPU_SET(cpu, set) \
+    ((void) ((size_t) (cpu) < CPU_SETSIZE ? ((set)->__bits[(cpu) / __NCPUBITS] |= __CPU_MASK(cpu)) : 0))
+#define CPU_CLR(cpu, set) \
+    ((void) ((size_t) (cpu) < CPU_SETSIZE ? ((set)->__bits[(cpu) / __NCPUBITS] &= ~__CPU_MASK(cpu)) : 0))
+#define CPU_ISSET(cpu, set) \
+    ((size_t) (cpu) < CPU_SETSIZE ? ((set)->__bits[(cpu) / __NCPUBITS] & __CPU_MASK(cpu)) != 0 : 0)
+#define CPU_COUNT(set)  __sched_cpucount(sizeof(cpu_set_t), set)
+
+#define __CPU_OP(dst, src1, src2, op) do { \
+        int __i; \
+        for (__i = 0; __i < CPU_SETSIZE / __NCPUBITS; __i++) \
+            (dst)->__bits[__i] = (src1)->__bits[__i] op (src2)->__bits[__i]; \
+    } while (0)
+#define CPU_AND(dst, src1, src2)    __CPU_OP(dst, src1, src2, &)
+#define CPU_OR(dst, src1, src2)     __CPU_OP(dst, src1, src2, |)
+#define CPU_XOR(dst, src1, src2)    __CPU_OP(dst, src1, src2, ^)
+#define CPU_EQUAL(set1, set2)       (__sched_cpuequal(sizeof(cpu_set_t), set1, set2))
+
 int sched_yield(void);
 int sched_rr_get_interval(pid_t pid, struct timespec * tp);
 int sched_get_priority_min(int pol);
@@ -60,6 +96,13 @@ int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param);
 int sched_getparam(pid_t pid, struct sched_param *param);
 int sched_setparam(pid_t pid, const struct sched_param *param);
 
+int sched_getcpu(void);
+int sched_getnode_np(void);
+int sched_numa_nodes_np(void);
+int sched_numa_cpus_np(int node, size_t cpusetsize, cpu_set_t *cpuset);
+int __sched_cpucount(size_t setsize, const cpu_set_t *set);
+int __sched_cpuequal(size_t setsize, const cpu_set_t *set1, const cpu_set_t *set2);
+
 #ifdef __cplusplus
 }
 #endif
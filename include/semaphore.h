@@ -61,6 +61,7 @@ int sem_wait(sem_t *sem);
 int sem_trywait(sem_t *sem);
 int sem_timedwait(sem_t *sem, const struct timespec *abs_timeout);
 int sem_post(sem_t *sem);
+int sem_post_multiple(sem_t *sem, int count);
 int sem_getvalue(sem_t *sem, int *value);
 int sem_destroy(sem_t *sem);
 
@@ -33,19 +33,24 @@
 
 #include <winsock2.h>
 #include <pthread.h>
+#include <pthread_clock.h>
+#include <setjmp.h>
+
+#define ARCH_CACHE_LINE     PTHREAD_CACHE_LINE_SIZE
 
 typedef struct
 {
-    HANDLE handle;
+    HANDLE handle; /* process-shared or named semaphores, NULL if private */
+    long value; /* the count of a private semaphore */
+    long waiters; /* threads parked on value */
 } arch_sem_t;
 
-struct arch_thread_cleanup_node {
+/* A cleanup frame pushed by the pthread_cleanup_push function, not the macro */
+typedef struct {
+    struct _pthread_cleanup_buffer buffer;
     void (* cleaner)(void *);
     void *arg;
-    struct arch_thread_cleanup_node *next, *prev;
-};
-
-typedef struct arch_thread_cleanup_node arch_thread_cleanup_list;
+} arch_thread_cleanup_node;
 
 typedef struct
 {
@@ -57,17 +62,56 @@ typedef struct
     int scope;
     void *stack_addr;
     size_t stack_size;
+    int has_cpuset;
+    cpu_set_t cpuset;
+    int numa_node; /* -1 if not bound to a node */
 } arch_thread_attr;
 
+struct arch_thread_worker;
+struct arch_mutex;
+
+/* The RCU read-side record of a thread, see rcu.c */
+typedef struct arch_rcu_reader {
+    long epoch; /* the grace period epoch the read section began in, 0 if none */
+    long nesting; /* read sections the thread is in, only it touches this */
+    struct arch_rcu_reader *next, **pprev; /* registry of the readers, pprev NULL if not in it */
+} arch_rcu_reader;
+
 typedef struct {
     HANDLE handle;
     void *(* worker)(void *);
     void *arg;
     void *return_value;
-    unsigned int state;
-    arch_thread_cleanup_list *cleanup_list;
+    long state; /* PTHREAD_CREATE_DETACHED, plus ARCH_THREAD_DONE if cached */
+    struct _pthread_cleanup_buffer *cleanup; /* the innermost cleanup frame */
+    unsigned long guard_size; /* the stack guarantee, 0 for the system guard page */
+    struct arch_thread_worker *cache; /* the cached thread running us, or NULL */
+    void *task_worker; /* the pthread_task_* worker running on us, or NULL */
+    arch_rcu_reader rcu;
+    long pi_lock; /* arch_spin_lock of the priority protocol fields */
+    int pi_base; /* the OS priority without the mutex protocols, valid while pi_held is not NULL */
+    int pi_prio; /* the OS priority set by the mutex protocols */
+    struct arch_mutex *pi_held; /* PTHREAD_PRIO_INHERIT and PTHREAD_PRIO_PROTECT mutexes held */
+    HANDLE pi_handle; /* the thread with THREAD_SET_INFORMATION, whether it is detached or not, or NULL */
+    int sched_policy; /* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+    int sched_priority; /* the priority of an MMCSS thread, its OS priority is not ours */
+    HANDLE mmcss; /* the MMCSS task of a SCHED_FIFO or SCHED_RR thread, or NULL */
 } arch_thread_info;
 
+#define ARCH_THREAD_DONE    0x100 /* the start routine of a cached thread returned */
+#define ARCH_THREAD_AFFINITY    0x200 /* the affinity of a cached thread was changed */
+#define ARCH_THREAD_FOREIGN     0x400 /* the main thread, or one not created by pthread_create */
+#define ARCH_THREAD_ABORTED     0x800 /* pthread_create failed after the thread was created, it must not run */
+
+/* A thread kept by the thread cache, see pthread_setcachesize_np */
+typedef struct arch_thread_worker {
+    HANDLE handle;
+    long seq; /* bumped when a new task is handed over */
+    arch_thread_info *task;
+    jmp_buf exit_jmp; /* pthread_exit returns here */
+    struct arch_thread_worker *next;
+} arch_thread_worker;
+
 /*
     On 32-bit OS:
     sizeof(pthread_attr_t): 4
@@ -101,44 +145,281 @@ typedef struct {
 
     /* from __sched_fifo_min_prio to __sched_fifo_max_prio */
     int prioceiling;
+
+    /* fixed spin count, or PTHREAD_MUTEX_SPIN_ADAPTIVE_NP */
+    int spin_count;
 } arch_mutex_attr;
 
-typedef struct {
-    long wait;
-    long lock_status; /* 0:unlocked, 1:locked */
-    /* long thread_id; debug only */
-    long spin_count;
-    HANDLE sync;
+#define ARCH_MUTEX_PROTOCOL     3 /* type of the mutexes with a priority protocol */
+
+/* lock_status and type come first, pthread_inline.h reads them */
+typedef struct arch_mutex {
+    long lock_status; /* 0:unlocked, 1:locked, 2:locked with waiters */
+    long type; /* PTHREAD_MUTEX_NORMAL, PTHREAD_MUTEX_RECURSIVE, PTHREAD_MUTEX_ERRORCHECK or ARCH_MUTEX_PROTOCOL */
+    long owner; /* owner thread id, not maintained for PTHREAD_MUTEX_NORMAL */
+    long count; /* recursion count of PTHREAD_MUTEX_RECURSIVE */
+    long spin_count; /* adaptive average, or the fixed count if spin_fixed */
+    long spin_fixed;
+    long protocol; /* PTHREAD_PRIO_INHERIT or PTHREAD_PRIO_PROTECT if type is ARCH_MUTEX_PROTOCOL */
+    long kind; /* the type of an ARCH_MUTEX_PROTOCOL mutex, as above */
+    long ceiling; /* the priority ceiling of PTHREAD_PRIO_PROTECT, in sched priority */
+    long pi_lock; /* arch_spin_lock of holder and boost */
+    long boost; /* the highest OS priority of the PTHREAD_PRIO_INHERIT waiters */
+    arch_thread_info *holder; /* the owner of an ARCH_MUTEX_PROTOCOL mutex */
+    struct arch_mutex *held_next; /* the next mutex in holder->pi_held */
 } arch_mutex;
 
 typedef struct {
     int pshared;
+    int kind; /* PTHREAD_BARRIER_SPIN_NP or PTHREAD_BARRIER_PARK_NP */
 } arch_barrier_attr;
 
 typedef struct {
-    long count;
+    long count; /* threads yet to arrive in this phase */
     long total;
-    long index;
-    HANDLE semaphore[2];
+    long spin_count; /* spins before parking */
+    char pad0[ARCH_CACHE_LINE - 3 * sizeof(long)];
+    long phase; /* incremented by the last thread of each phase */
+    long waiters; /* parked on phase */
+    char pad1[ARCH_CACHE_LINE - 2 * sizeof(long)];
 } arch_barrier;
 
 typedef struct {
     int pshared;
-    clockid_t *clock_id;
+    clockid_t clock_id;
 } arch_cond_attr;
 
+typedef struct arch_cond_node {
+    long state; /* 0:waiting, 1:signaled, 2:woken by broadcast, wait for the predecessor */
+    struct arch_cond_node *next, *prev;
+} arch_cond_node;
+
 typedef struct {
-    char cond[8]; /* InitializeConditionVariable */
+    long lock; /* arch_spin_lock of the wait queue */
+    arch_cond_node *head, *tail;
+    clockid_t clock_id;
 } arch_cond;
 
 typedef struct {
     int pshared;
+    int percpu; /* per-CPU reader counts */
 } arch_rwlock_attr;
 
 typedef struct {
-    char rwlock[8]; /* InitializeSRWLock */
+    long count; /* readers holding the lock through this slot */
+    char pad[ARCH_CACHE_LINE - sizeof(long)];
+} arch_rwlock_slot;
+
+typedef struct {
+    long state; /* writer bits, plus the reader count if there are no slots */
+    long writers; /* writers waiting for or owning the lock */
+    long read_seq; /* readers park on it */
+    long write_seq; /* writers park on it */
+    long nslots; /* 0, or the number of per-CPU reader slots (power of 2) */
+    arch_rwlock_slot *slots;
 } arch_rwlock;
 
+typedef struct arch_task {
+    void (* routine)(void *);
+    void *arg;
+    pthread_task_group_t *group;
+    struct arch_task *next; /* injection queue of the pool */
+} arch_task;
+
+#define ARCH_TASK_DEQUE_SIZE    1024 /* power of 2 */
+
+/* A worker of a task pool, with its Chase-Lev deque */
+typedef struct {
+    long top; /* thieves take from here */
+    char pad0[ARCH_CACHE_LINE - sizeof(long)];
+    long bottom; /* the owner pushes and pops here */
+    unsigned long seed; /* victim selection */
+    struct arch_task_pool *pool;
+    pthread_t thread;
+    char pad1[ARCH_CACHE_LINE - 2 * sizeof(long) - sizeof(void *) - sizeof(pthread_t)];
+    arch_task * volatile slots[ARCH_TASK_DEQUE_SIZE];
+} arch_task_worker;
+
+typedef struct arch_task_pool {
+    long nworkers;
+    long stop;
+    long idle; /* workers about to park */
+    long seq; /* idle workers park on it */
+    long lock; /* arch_spin_lock of the injection queue */
+    arch_task * volatile head, *tail; /* tasks spawned by other threads */
+    arch_task_worker *workers;
+} arch_task_pool;
+
+/* A cell of a queue, ready for the producer of position seq when free, for its consumer at seq - 1 when full */
+typedef struct {
+    void * volatile data;
+    long seq;
+} arch_queue_cell;
+
+/* A bounded MPMC queue (see queue.c), the words of producers and consumers on separate cache lines */
+typedef struct {
+    long tail; /* producers claim cells here */
+    char pad0[ARCH_CACHE_LINE - sizeof(long)];
+    long head; /* consumers claim cells here */
+    char pad1[ARCH_CACHE_LINE - sizeof(long)];
+    long pushed; /* consumers park on it, moved by a push if one is parked */
+    long consumers; /* consumers about to park */
+    char pad2[ARCH_CACHE_LINE - 2 * sizeof(long)];
+    long popped; /* producers park on it, moved by a pop if one is parked */
+    long producers; /* producers about to park */
+    char pad3[ARCH_CACHE_LINE - 2 * sizeof(long)];
+    long mask; /* capacity - 1, capacity is a power of 2 */
+    arch_queue_cell *cells;
+} arch_queue;
+
+#define ARCH_TIMER_TICK_NS  1000000 /* resolution of the timing wheel */
+#define ARCH_TIMER_BITS     6
+#define ARCH_TIMER_SLOTS    (1 << ARCH_TIMER_BITS)
+#define ARCH_TIMER_LEVELS   5 /* 2^30 ticks, later timers are cascaded again */
+
+/* A timer of timer_create, in a slot of the timing wheel while armed */
+typedef struct arch_timer {
+    struct arch_timer *next, **pprev; /* pprev is NULL if not in the wheel */
+    struct arch_timer *run_next; /* expired timers of the timer thread */
+    __int64 expires; /* on the CLOCK_MONOTONIC timeline, in ns */
+    __int64 interval; /* in ns, 0 if one-shot */
+    __int64 tick; /* expires in ticks, rounded up */
+    long overrun; /* expirations missed before the last one */
+    long running; /* the timer thread is calling the notify function */
+    long deleted; /* ARCH_TIMER_DELETED_* */
+    clockid_t clock_id;
+    int notify;
+    void (* function)(union sigval);
+    union sigval value;
+} arch_timer;
+
+#define ARCH_TIMER_DELETED_SELF     1 /* by the notify function, the timer thread frees it */
+#define ARCH_TIMER_DELETED_WAIT     2 /* by another thread, waiting for the notify function */
+
+/*
+ * Park the calling thread on an address (see wait.c).
+ * arch_wait_on_address blocks while *addr == expected, returns 0 when woken
+ * (possibly spuriously) or ETIMEDOUT when the timeout in ms elapsed.
+ * arch_wake_by_address_waiters takes the parked count kept by the caller.
+ */
+int arch_wait_init(void);
+void arch_wait_fini(void);
+int arch_wait_on_address(volatile long *addr, long expected, DWORD ms);
+void arch_wake_by_address_single(volatile long *addr);
+void arch_wake_by_address_all(volatile long *addr);
+void arch_wake_by_address(volatile long *addr, int count);
+void arch_wake_by_address_waiters(volatile long *addr, int count, long waiters);
+
+/*
+ * Lock contention statistics (see stats.c), only built with
+ * LIBPTHREAD_LOCK_STATS. ARCH_LOCK_STATS(x) expands to x then, else to nothing.
+ */
+#define ARCH_LOCK_FAST      0 /* acquired without waiting */
+#define ARCH_LOCK_SPIN      1 /* acquired while spinning */
+#define ARCH_LOCK_PARK      2 /* acquired after parking in the kernel */
+
+#ifdef LIBPTHREAD_LOCK_STATS
+void arch_lock_stats_init(const void *lock, int kind, const void *caller);
+void arch_lock_stats_destroy(const void *lock);
+void arch_lock_stats_acquired(const void *lock, int kind, int how, __int64 start);
+void arch_lock_stats_released(const void *lock);
+void arch_lock_stats_elided(const void *lock, int kind);
+void arch_lock_stats_aborted(const void *lock, int kind);
+#define ARCH_LOCK_STATS(x)  x
+#else
+#define ARCH_LOCK_STATS(x)
+#endif
+
+/*
+ * ETW events of the "libpthread" provider (see trace.c), keywords and event
+ * indexes. Check arch_trace_enabled before calling arch_trace.
+ */
+#define ARCH_TRACE_MUTEX    0x1
+#define ARCH_TRACE_BARRIER  0x2
+#define ARCH_TRACE_SEM      0x4
+#define ARCH_TRACE_THREAD   0x8
+#define ARCH_TRACE_ALL      0xF
+
+#define ARCH_TRACE_MUTEX_WAIT_START     0 /* mutex */
+#define ARCH_TRACE_MUTEX_WAIT_STOP      1 /* mutex */
+#define ARCH_TRACE_MUTEX_WAKE           2 /* mutex */
+#define ARCH_TRACE_BARRIER_WAIT_START   3 /* barrier, phase */
+#define ARCH_TRACE_BARRIER_WAIT_STOP    4 /* barrier, phase */
+#define ARCH_TRACE_BARRIER_PHASE        5 /* barrier, phase, count */
+#define ARCH_TRACE_SEM_WAIT_START       6 /* semaphore */
+#define ARCH_TRACE_SEM_WAIT_STOP        7 /* semaphore, timed out */
+#define ARCH_TRACE_THREAD_CREATE        8 /* thread, start routine, arg, stack size */
+#define ARCH_TRACE_THREAD_START         9 /* thread, start routine */
+#define ARCH_TRACE_THREAD_EXIT          10 /* thread, return value */
+#define ARCH_TRACE_EVENTS               11
+
+extern long libpthread_trace_keywords;
+#define arch_trace_enabled(keyword)     (libpthread_trace_keywords & (keyword))
+
+void arch_trace_init(void);
+void arch_trace_fini(void);
+void arch_trace(int event, unsigned __int64 v0, unsigned __int64 v1, unsigned __int64 v2, unsigned __int64 v3);
+
+/* Release the pthread_t of a foreign thread (see pthread.c) */
+void arch_thread_fini(void);
+
+/* Keep the library loaded from now on, before it starts a thread of its own (see init.c) */
+void arch_module_pin(void);
+
+/* Set the base priority of a thread holding priority protocol mutexes, 0 if it holds none (see mutex.c) */
+int arch_mutex_pi_setprio(arch_thread_info *pv, int priority);
+
+/* Scheduling policies of threads (see sched.c) */
+int arch_sched_set(arch_thread_info *pv, int policy, int priority);
+void arch_sched_thread_start(arch_thread_info *pv);
+void arch_sched_thread_fini(arch_thread_info *pv);
+
+/* Read-copy-update (see rcu.c) */
+void arch_rcu_init(void);
+void arch_rcu_fini(void);
+void arch_rcu_thread_fini(arch_thread_info *pv);
+
+/* Thread-specific data of pthread_key_create (see key.c) */
+int arch_key_init(void);
+void arch_key_reset(void);
+void arch_key_thread_fini(void);
+void arch_key_fini(void);
+
+/* CPU sets of processor groups (see sched.c), return 0 or an error number */
+int arch_set_affinity(HANDLE thread, const cpu_set_t *set);
+int arch_get_affinity(HANDLE thread, cpu_set_t *set);
+void arch_cpu_available(cpu_set_t *set);
+
+/* The libgomp profile (see gomp.c), 1 if a new thread is bound to set */
+int arch_gomp_thread_place(cpu_set_t *set);
+
+/* NUMA topology and node-local control blocks (see numa.c) */
+#define ARCH_NUMA_NODES     64 /* arenas, higher nodes share them */
+
+int arch_numa_node(void);
+void *arch_numa_alloc(size_t size, int node);
+void arch_numa_free(void *pv, size_t size);
+void *arch_slab_alloc(size_t size);
+void arch_slab_free(void *pv, size_t size);
+int arch_numa_init(void);
+void arch_numa_thread_fini(void);
+void arch_numa_fini(void);
+
+/* Milli-seconds left until the absolute timeout t of clock_id (see clock.c) */
+DWORD arch_timeout_in_ms(clockid_t clock_id, const struct timespec *t);
+
+/* CLOCK_MONOTONIC in ns, the cached performance counter frequency (see clock.c) */
+void arch_clock_init(void);
+__int64 arch_clock_monotonic_ns(void);
+
+/* High-resolution sleeps on per-thread waitable timers (see nanosleep.c) */
+int arch_sleep_init(void);
+HANDLE arch_sleep_timer(void);
+int arch_sleep_until(__int64 deadline);
+int arch_sleep_until_realtime(const struct timespec *t);
+void arch_sleep_thread_fini(void);
+void arch_sleep_fini(void);
+
 /** @} */
 
 #endif
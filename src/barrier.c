@@ -23,28 +23,40 @@
  */
 
 #include <pthread.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <winsock2.h>
 
 #include "arch.h"
 #include "misc.h"
 
+/*
+ * Sense-reversing barrier: every thread reads the phase before it arrives,
+ * the last thread to arrive resets the count and flips the phase. Waiters
+ * spin on the phase, which lives on its own cache line, for a bounded
+ * number of iterations, then park on it.
+ */
+
+/* About 10 micro seconds of spinning, see test_speed */
+#define BARRIER_SPIN_COUNT  4000
+
 /**
  * Create a barrier attribute object.
  * @param attr The pointer of the barrier attribute object.
- * @return Always return 0.
- * @remark We provide pthread_barrierattr_* functions only for compatibility,
- *         please use pthread_barrier_init(&barrier, NULL, count) for new applications.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, ENOMEM returned to indicate the error.
  */
 int pthread_barrierattr_init(pthread_barrierattr_t *attr)
 {
-    arch_barrier_attr *pv = calloc(1, sizeof(arch_barrier_attr));
+    arch_barrier_attr *pv = arch_slab_alloc(sizeof(arch_barrier_attr));
     if (pv == NULL)
         return ENOMEM;
 
     pv->pshared = PTHREAD_PROCESS_PRIVATE;
+    pv->kind = PTHREAD_BARRIER_SPIN_NP;
 
     *attr = pv;
 
@@ -61,7 +73,7 @@ int pthread_barrierattr_init(pthread_barrierattr_t *attr)
  */
 int pthread_barrierattr_getpshared(const pthread_barrierattr_t *attr, int *pshared)
 {
-    arch_barrier_attr *pv = (arch_barrier_attr *) attr;
+    arch_barrier_attr *pv = (arch_barrier_attr *) *attr;
     *pshared = pv->pshared;
     return 0;
 }
@@ -76,11 +88,45 @@ int pthread_barrierattr_getpshared(const pthread_barrierattr_t *attr, int *pshar
  */
 int pthread_barrierattr_setpshared(pthread_barrierattr_t *attr, int pshared)
 {
-    arch_barrier_attr *pv = (arch_barrier_attr *) attr;
+    arch_barrier_attr *pv = (arch_barrier_attr *) *attr;
     pv->pshared = pshared;
     return 0;
 }
 
+/**
+ * Get the barrier waiting policy attribute.
+ * @param attr The pointer of the barrier attribute object.
+ * @param kind PTHREAD_BARRIER_SPIN_NP or PTHREAD_BARRIER_PARK_NP.
+ * @return Always return 0.
+ */
+int pthread_barrierattr_getkind_np(const pthread_barrierattr_t *attr, int *kind)
+{
+    arch_barrier_attr *pv = (arch_barrier_attr *) *attr;
+    *kind = pv->kind;
+    return 0;
+}
+
+/**
+ * Set the barrier waiting policy attribute.
+ * @param attr The pointer of the barrier attribute object.
+ * @param kind PTHREAD_BARRIER_SPIN_NP (the default) spins for a bounded
+ *        time before parking, PTHREAD_BARRIER_PARK_NP parks at once.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark PTHREAD_BARRIER_SPIN_NP does not spin either if the barrier has
+ *         more threads than CPUs, or when there is only one CPU.
+ */
+int pthread_barrierattr_setkind_np(pthread_barrierattr_t *attr, int kind)
+{
+    arch_barrier_attr *pv = (arch_barrier_attr *) *attr;
+
+    if (kind != PTHREAD_BARRIER_SPIN_NP && kind != PTHREAD_BARRIER_PARK_NP)
+        return EINVAL;
+
+    pv->kind = kind;
+    return 0;
+}
+
 /**
  * Destroy a barrier attribute object.
  * @param attr The pointer of the barrier attribute object.
@@ -90,7 +136,7 @@ int pthread_barrierattr_setpshared(pthread_barrierattr_t *attr, int pshared)
 int pthread_barrierattr_destroy(pthread_barrierattr_t *attr)
 {
     if (attr != NULL) {
-        free(*attr);
+        arch_slab_free(*attr, sizeof(arch_barrier_attr));
         *attr = NULL;
     }
 
@@ -105,65 +151,89 @@ int pthread_barrierattr_destroy(pthread_barrierattr_t *attr)
  *        before  any  of  them successfully return from the call.
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
- *         with errno set to indicate the error (EINVAL, ENOMEM, or EAGAIN).
- * @remark We provide pthread_barrierattr_* functions only for compatibility,
- *         please use pthread_barrier_init(&barrier, NULL, count) for new applications.
+ *         with errno set to indicate the error (EINVAL or ENOMEM).
+ * @remark The waiting policy can be chosen by pthread_barrierattr_setkind_np,
+ *         pthread_barrier_init(&barrier, NULL, count) uses PTHREAD_BARRIER_SPIN_NP.
  */
 int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
 {
     arch_barrier *pv;
 
-    if (count < 1)
+    if (count < 1 || count > LONG_MAX)
         return lc_set_errno(EINVAL);
 
-    if ((pv = calloc(1, sizeof(arch_barrier))) == NULL)
+    if ((pv = arch_numa_alloc(sizeof(arch_barrier), -1)) == NULL)
         return lc_set_errno(ENOMEM);
 
-    if ((pv->semaphore[0] = CreateSemaphore(NULL, 0, count, NULL)) == NULL)
-        return lc_set_errno(EAGAIN);
-
-    if ((pv->semaphore[1] = CreateSemaphore(NULL, 0, count, NULL)) == NULL) {
-        long rc = GetLastError();
-        CloseHandle(pv->semaphore[0]);
-        SetLastError(rc);
-        return lc_set_errno(EAGAIN);
-    }
-
     pv->total = count;
     pv->count = count;
+
+    if (count <= (unsigned int) get_ncpu() &&
+        (attr == NULL || *attr == NULL || ((arch_barrier_attr *) *attr)->kind == PTHREAD_BARRIER_SPIN_NP))
+        pv->spin_count = get_ncpu() > 1 ? BARRIER_SPIN_COUNT : 0;
+
     *barrier = pv;
 
+    ARCH_LOCK_STATS(arch_lock_stats_init(pv, PTHREAD_LOCK_BARRIER_NP, ARCH_RETURN_ADDRESS()));
     return 0;
 }
 
 /**
  * Wait on a barrier lock.
  * @param m The pointer of the barrier object.
- * @return If the function succeeds, the return value is 0.
+ * @return If the function succeeds, the return value is 0, or
+ *         PTHREAD_BARRIER_SERIAL_THREAD for exactly one of the threads.
  *         If the function fails, the return value is -1,
  *         with errno set to indicate the error (EINVAL).
  */
 int pthread_barrier_wait(pthread_barrier_t *barrier)
 {
-    long rc, index;
+    long i, phase;
     arch_barrier *pv = (arch_barrier *) *barrier;
+    ARCH_LOCK_STATS(__int64 start = arch_clock_monotonic_ns();)
 
     if (pv == NULL)
         return lc_set_errno(EINVAL);
 
-    if (atomic_fetch_and_add(& pv->count, -1) != 1) {
-        WaitForSingleObject(pv->semaphore[pv->index], INFINITE);
-        return 0;
+    /* The phase can not flip before we arrive */
+    phase = atomic_read(& pv->phase);
+
+    if (atomic_fetch_and_add(& pv->count, -1) == 1) {
+        if (arch_trace_enabled(ARCH_TRACE_BARRIER))
+            arch_trace(ARCH_TRACE_BARRIER_PHASE, (uintptr_t) pv, (unsigned long) phase, pv->total, 0);
+        atomic_set(& pv->count, pv->total);
+        (void) atomic_fetch_and_add(& pv->phase, 1);
+        memory_barrier_after_atomic();
+        if (atomic_read(& pv->waiters) != 0)
+            arch_wake_by_address_all(& pv->phase);
+        ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_BARRIER_NP, ARCH_LOCK_FAST, 0));
+        return PTHREAD_BARRIER_SERIAL_THREAD;
     }
 
-    index = pv->index;
-    if (index) pv->index = 0; else pv->index = 1;
+    if (arch_trace_enabled(ARCH_TRACE_BARRIER))
+        arch_trace(ARCH_TRACE_BARRIER_WAIT_START, (uintptr_t) pv, (unsigned long) phase, 0, 0);
+
+    for (i = pv->spin_count; i > 0; i--) {
+        if (atomic_read_acquire(& pv->phase) != phase) {
+            if (arch_trace_enabled(ARCH_TRACE_BARRIER))
+                arch_trace(ARCH_TRACE_BARRIER_WAIT_STOP, (uintptr_t) pv, (unsigned long) phase, 0, 0);
+            ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_BARRIER_NP, ARCH_LOCK_SPIN, start));
+            return 0;
+        }
+        cpu_relax();
+    }
 
-    pv->count = pv->total;
-    if (pv->total > 1)
-        ReleaseSemaphore(pv->semaphore[index], pv->total - 1, NULL);
+    (void) atomic_fetch_and_add(& pv->waiters, 1);
+    /* The last thread in sees us, or we see its new phase */
+    memory_barrier_after_atomic();
+    while (atomic_read_acquire(& pv->phase) == phase)
+        arch_wait_on_address(& pv->phase, phase, INFINITE);
+    (void) atomic_fetch_and_add_relaxed(& pv->waiters, -1);
 
-    return PTHREAD_BARRIER_SERIAL_THREAD;
+    if (arch_trace_enabled(ARCH_TRACE_BARRIER))
+        arch_trace(ARCH_TRACE_BARRIER_WAIT_STOP, (uintptr_t) pv, (unsigned long) phase, 0, 0);
+    ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_BARRIER_NP, ARCH_LOCK_PARK, start));
+    return 0;
 }
 
 /**
@@ -175,9 +245,9 @@ int pthread_barrier_destroy(pthread_barrier_t *barrier)
 {
     arch_barrier *pv = (arch_barrier *) *barrier;
     if (pv != NULL) {
-        if (pv->semaphore[0] != NULL) CloseHandle(pv->semaphore[0]);
-        if (pv->semaphore[1] != NULL) CloseHandle(pv->semaphore[1]);
-        free(pv);
+        ARCH_LOCK_STATS(arch_lock_stats_destroy(pv));
+        arch_numa_free(pv, sizeof(arch_barrier));
+        *barrier = NULL;
     }
 
     return 0;
@@ -27,8 +27,90 @@
 
 #include <winsock2.h>
 
+#include "arch.h"
 #include "misc.h"
 
+/*
+ * QueryPerformanceCounter ticks are turned into ns without a division:
+ * ns = ticks * qpc_mul + ticks * (qpc_frac_hi / 2^32 + qpc_frac_lo / 2^64),
+ * the fraction is split so that no product overflows 64 bits.
+ */
+static __int64 qpc_freq;
+static unsigned __int64 qpc_mul, qpc_frac_hi, qpc_frac_lo;
+
+typedef VOID (WINAPI *query_interrupt_time_t)(PULONGLONG);
+typedef ULONGLONG (WINAPI *get_tick_count64_t)(VOID);
+
+static query_interrupt_time_t query_interrupt_time;
+static get_tick_count64_t get_tick_count64;
+
+/**
+ * Cache the performance counter frequency and the multipliers.
+ * @remark Internal routine, called by libpthread_init.
+ */
+void arch_clock_init(void)
+{
+    HMODULE h;
+    LARGE_INTEGER pf;
+    unsigned __int64 rem;
+
+    if ((h = GetModuleHandleA("kernelbase.dll")) != NULL)
+        query_interrupt_time = (query_interrupt_time_t) GetProcAddress(h, "QueryInterruptTime");
+    if ((h = GetModuleHandleA("kernel32.dll")) != NULL)
+        get_tick_count64 = (get_tick_count64_t) GetProcAddress(h, "GetTickCount64");
+
+    /* Never fails on Windows XP or later */
+    if (QueryPerformanceFrequency(&pf) == 0 || pf.QuadPart <= 0)
+        pf.QuadPart = POW10_3;
+
+    qpc_mul = POW10_9 / pf.QuadPart;
+    rem = POW10_9 % pf.QuadPart; /* < 2^30 */
+    qpc_frac_hi = (rem << 32) / pf.QuadPart;
+    qpc_frac_lo = (((rem << 32) % pf.QuadPart) << 32) / pf.QuadPart;
+
+    memory_barrier();
+    qpc_freq = pf.QuadPart;
+}
+
+/**
+ * Get the time of CLOCK_MONOTONIC in ns.
+ * @remark Internal routine, the timeline of the timed waits and sleeps.
+ */
+__int64 arch_clock_monotonic_ns(void)
+{
+    LARGE_INTEGER pc;
+    unsigned __int64 t, hi, lo;
+
+    if (qpc_freq == 0)
+        arch_clock_init();
+
+    QueryPerformanceCounter(&pc);
+    t = (unsigned __int64) pc.QuadPart;
+    hi = t >> 32;
+    lo = t & 0xFFFFFFFF;
+
+    return (__int64) (t * qpc_mul + hi * qpc_frac_hi + ((lo * qpc_frac_hi) >> 32) + ((hi * qpc_frac_lo) >> 32));
+}
+
+/* The interrupt time in 100ns, updated once per clock tick, without a system call */
+static unsigned __int64 arch_clock_coarse(void)
+{
+    ULONGLONG t;
+
+    if (qpc_freq == 0)
+        arch_clock_init();
+
+    if (query_interrupt_time != NULL) {
+        query_interrupt_time(&t);
+        return t;
+    }
+
+    if (get_tick_count64 != NULL)
+        return get_tick_count64() * POW10_4;
+
+    return GetTickCount() * POW10_4; /* Windows XP, wraps after 49.7 days */
+}
+
 /**
  * Get the resolution of the specified clock clock_id and
  * stores it in the struct timespec pointed to by res.
@@ -41,6 +123,9 @@
  *                 time since some unspecified starting point.
  *     CLOCK_PROCESS_CPUTIME_ID High-resolution per-process timer from the CPU.
  *     CLOCK_THREAD_CPUTIME_ID  Thread-specific CPU-time clock.
+ *     CLOCK_REALTIME_COARSE    Same as CLOCK_REALTIME.
+ *     CLOCK_MONOTONIC_COARSE   The interrupt time, faster than CLOCK_MONOTONIC
+ *                 but only updated once per clock tick.
  * </pre>
  * @param  res The pointer to a timespec structure to receive the time
  *         resolution.
@@ -53,13 +138,11 @@ int clock_getres(clockid_t clock_id, struct timespec *res)
     switch(clock_id) {
     case CLOCK_MONOTONIC:
         {
-            LARGE_INTEGER pf;
-
-            if (QueryPerformanceFrequency(&pf) == 0)
-                return lc_set_errno(EINVAL);
+            if (qpc_freq == 0)
+                arch_clock_init();
 
             res->tv_sec = 0;
-            res->tv_nsec = (int) ((POW10_9 + (pf.QuadPart >> 1)) / pf.QuadPart);
+            res->tv_nsec = (int) ((POW10_9 + (qpc_freq >> 1)) / qpc_freq);
             if (res->tv_nsec < 1)
                 res->tv_nsec = 1;
 
@@ -67,6 +150,8 @@ int clock_getres(clockid_t clock_id, struct timespec *res)
         }
 
     case CLOCK_REALTIME:
+    case CLOCK_REALTIME_COARSE:
+    case CLOCK_MONOTONIC_COARSE:
     case CLOCK_PROCESS_CPUTIME_ID:
     case CLOCK_THREAD_CPUTIME_ID:
         {
@@ -98,6 +183,9 @@ int clock_getres(clockid_t clock_id, struct timespec *res)
  *                 time since some unspecified starting point.
  *     CLOCK_PROCESS_CPUTIME_ID High-resolution per-process timer from the CPU.
  *     CLOCK_THREAD_CPUTIME_ID  Thread-specific CPU-time clock.
+ *     CLOCK_REALTIME_COARSE    Same as CLOCK_REALTIME.
+ *     CLOCK_MONOTONIC_COARSE   The interrupt time, faster than CLOCK_MONOTONIC
+ *                 but only updated once per clock tick.
  * </pre>
  * @param  tp The pointer to a timespec structure to receive the time.
  * @return If the function succeeds, the return value is 0.
@@ -107,7 +195,6 @@ int clock_getres(clockid_t clock_id, struct timespec *res)
 int clock_gettime(clockid_t clock_id, struct timespec *tp)
 {
     unsigned __int64 t;
-    LARGE_INTEGER pf, pc;
     union {
         unsigned __int64 u64;
         FILETIME ft;
@@ -115,6 +202,7 @@ int clock_gettime(clockid_t clock_id, struct timespec *tp)
 
     switch(clock_id) {
     case CLOCK_REALTIME:
+    case CLOCK_REALTIME_COARSE:
         {
             GetSystemTimeAsFileTime(&ct.ft);
             t = ct.u64 - DELTA_EPOCH_IN_100NS;
@@ -126,18 +214,18 @@ int clock_gettime(clockid_t clock_id, struct timespec *tp)
 
     case CLOCK_MONOTONIC:
         {
-            if (QueryPerformanceFrequency(&pf) == 0)
-                return lc_set_errno(EINVAL);
+            t = (unsigned __int64) arch_clock_monotonic_ns();
+            tp->tv_sec = t / POW10_9;
+            tp->tv_nsec = (int) (t % POW10_9);
 
-            if (QueryPerformanceCounter(&pc) == 0)
-                return lc_set_errno(EINVAL);
+            return 0;
+        }
 
-            tp->tv_sec = pc.QuadPart / pf.QuadPart;
-            tp->tv_nsec = (int) (((pc.QuadPart % pf.QuadPart) * POW10_9 + (pf.QuadPart >> 1)) / pf.QuadPart);
-            if (tp->tv_nsec >= POW10_9) {
-                tp->tv_sec ++;
-                tp->tv_nsec -= POW10_9;
-            }
+    case CLOCK_MONOTONIC_COARSE:
+        {
+            t = arch_clock_coarse();
+            tp->tv_sec = t / POW10_7;
+            tp->tv_nsec = ((int) (t % POW10_7)) * 100;
 
             return 0;
         }
@@ -173,38 +261,46 @@ int clock_gettime(clockid_t clock_id, struct timespec *tp)
 
 /**
  * Sleep for the specified time.
- * @param  clock_id This argument should always be CLOCK_REALTIME (0).
- * @param  flags 0 for relative sleep interval, others for absolute waking up.
+ * @param  clock_id CLOCK_REALTIME or CLOCK_MONOTONIC.
+ * @param  flags 0 for relative sleep interval, TIMER_ABSTIME for absolute
+ *         waking up.
  * @param  request The desired sleep interval or absolute waking up time.
- * @param  remain The remain amount of time to sleep.
- *         The current implemention just ignore it.
+ * @param  remain The remain amount of time to sleep of a relative sleep.
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
  *         with errno set to indicate the error.
+ * @remark An absolute sleep on CLOCK_MONOTONIC sleeps until the deadline on
+ *         the timeline of clock_gettime(CLOCK_MONOTONIC), so a periodic loop
+ *         advancing its deadline by the period does not drift. An absolute
+ *         sleep on CLOCK_REALTIME follows the changes of the system time.
  */
 int clock_nanosleep(clockid_t clock_id, int flags,
                            const struct timespec *request,
                            struct timespec *remain)
 {
-    struct timespec tp;
+    int rc;
 
-    if (clock_id != CLOCK_REALTIME)
+    if (request == NULL || request->tv_nsec < 0 || request->tv_nsec >= POW10_9)
         return lc_set_errno(EINVAL);
 
-    if (flags == 0)
-        return nanosleep(request, remain);
+    if (clock_id != CLOCK_REALTIME && clock_id != CLOCK_MONOTONIC)
+        return lc_set_errno(EINVAL);
 
-    /* TIMER_ABSTIME = 1 */
-    clock_gettime(CLOCK_REALTIME, &tp);
+    if ((flags & TIMER_ABSTIME) == 0)
+        return nanosleep(request, remain);
 
-    tp.tv_sec = request->tv_sec - tp.tv_sec;
-    tp.tv_nsec = request->tv_nsec - tp.tv_nsec;
-    if (tp.tv_nsec < 0) {
-        tp.tv_nsec += POW10_9;
-        tp.tv_sec --;
+    if (clock_id == CLOCK_MONOTONIC) {
+        if (request->tv_sec >= MAX_SLEEP_IN_SEC)
+            rc = arch_sleep_until(MAX_SLEEP_IN_SEC * POW10_9);
+        else if (request->tv_sec < 0)
+            rc = 0; /* the deadline has passed */
+        else
+            rc = arch_sleep_until(request->tv_sec * POW10_9 + request->tv_nsec);
+    } else {
+        rc = arch_sleep_until_realtime(request);
     }
 
-    return nanosleep(&tp, remain);
+    return lc_set_errno(rc);
 }
 
 /**
@@ -236,3 +332,28 @@ int clock_settime(clockid_t clock_id, const struct timespec *tp)
 
     return 0;
 }
+
+/**
+ * Get the time left until an absolute timeout.
+ * @param  clock_id The clock the timeout is measured by.
+ * @param  t The absolute timeout.
+ * @return The time left in milli-seconds, rounded up so that waiters never
+ *         wake before the timeout. 0 if it has elapsed.
+ * @remark Internal routine of the timed wait functions.
+ */
+DWORD arch_timeout_in_ms(clockid_t clock_id, const struct timespec *t)
+{
+    __int64 ns;
+    struct timespec now;
+
+    clock_gettime(clock_id, &now);
+    ns = (t->tv_sec - now.tv_sec) * POW10_9 + (t->tv_nsec - now.tv_nsec);
+    if (ns <= 0)
+        return 0;
+
+    ns = (ns + POW10_6 - 1) / POW10_6;
+    if (ns >= (__int64) INFINITE)
+        return INFINITE - 1;
+
+    return (DWORD) ns;
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file cond.c
+ * @brief Implementation Code of Condition Variable Routines
+ */
+
+#include <pthread.h>
+#include <pthread_clock.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * Every waiter queues a node on its own stack and parks on the state of
+ * that node, so pthread_cond_signal wakes exactly one waiter.
+ *
+ * pthread_cond_broadcast does not wake the whole queue at once, which would
+ * only make all waiters fight for the mutex. It wakes the first waiter and
+ * hands it the rest of the queue: each waiter, once it owns the mutex again,
+ * wakes the next one, which then parks on the mutex until it is released.
+ * So at most one broadcast waiter is runnable but not yet queued on the mutex.
+ */
+
+#define COND_WAITING    0
+#define COND_SIGNALED   1
+#define COND_REQUEUED   2 /* woken by broadcast, waiting for its predecessor */
+
+/**
+ * Create a condition variable attribute object.
+ * @param attr The pointer of the condition variable attribute object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, ENOMEM returned to indicate the error.
+ */
+int pthread_condattr_init(pthread_condattr_t *attr)
+{
+    arch_cond_attr *pv = arch_slab_alloc(sizeof(arch_cond_attr));
+    if (pv == NULL)
+        return ENOMEM;
+
+    pv->pshared = PTHREAD_PROCESS_PRIVATE;
+    pv->clock_id = CLOCK_REALTIME;
+
+    *attr = pv;
+
+    return 0;
+}
+
+/**
+ * Get the clock attribute.
+ * @param attr The pointer of the condition variable attribute object.
+ * @param clock_id The clock used by pthread_cond_timedwait.
+ * @return Always return 0.
+ */
+int pthread_condattr_getclock(const pthread_condattr_t *attr, clockid_t *clock_id)
+{
+    arch_cond_attr *pv = (arch_cond_attr *) *attr;
+    *clock_id = pv->clock_id;
+    return 0;
+}
+
+/**
+ * Set the clock attribute.
+ * @param attr The pointer of the condition variable attribute object.
+ * @param clock_id The clock used by pthread_cond_timedwait, CLOCK_REALTIME
+ *        (the default) or CLOCK_MONOTONIC.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ */
+int pthread_condattr_setclock(pthread_condattr_t *attr, clockid_t clock_id)
+{
+    arch_cond_attr *pv = (arch_cond_attr *) *attr;
+
+    if (clock_id != CLOCK_REALTIME && clock_id != CLOCK_MONOTONIC)
+        return EINVAL;
+
+    pv->clock_id = clock_id;
+    return 0;
+}
+
+/**
+ * Get the condition variable process-shared attribute.
+ * @param attr The pointer of the condition variable attribute object.
+ * @param pshared The process-shared attribute.
+ * @return Always return 0.
+ * @remark The only type we support is PTHREAD_PROCESS_PRIVATE.
+ * @remark This function is provided for source code compatibility but no effect when called.
+ */
+int pthread_condattr_getpshared(const pthread_condattr_t *attr, int *pshared)
+{
+    arch_cond_attr *pv = (arch_cond_attr *) *attr;
+    *pshared = pv->pshared;
+    return 0;
+}
+
+/**
+ * Set the condition variable process-shared attribute.
+ * @param attr The pointer of the condition variable attribute object.
+ * @param pshared The process-shared attribute.
+ * @return Always return 0.
+ * @remark The only type we support is PTHREAD_PROCESS_PRIVATE.
+ * @remark This function is provided for source code compatibility but no effect when called.
+ */
+int pthread_condattr_setpshared(pthread_condattr_t *attr, int pshared)
+{
+    arch_cond_attr *pv = (arch_cond_attr *) *attr;
+    pv->pshared = pshared;
+    return 0;
+}
+
+/**
+ * Destroy a condition variable attribute object.
+ * @param attr The pointer of the condition variable attribute object.
+ * @return Always return 0.
+ */
+int pthread_condattr_destroy(pthread_condattr_t *attr)
+{
+    if (attr != NULL) {
+        arch_slab_free(*attr, sizeof(arch_cond_attr));
+        *attr = NULL;
+    }
+
+    return 0;
+}
+
+static int arch_cond_init(pthread_cond_t *c, int lock)
+{
+    arch_cond *pv = arch_numa_alloc(sizeof(arch_cond), -1);
+    if (pv == NULL)
+        return ENOMEM;
+
+    pv->clock_id = CLOCK_REALTIME;
+
+    if (!lock) {
+        *c = pv;
+        return 0;
+    }
+
+    if (atomic_cmpxchg_ptr(c, pv, NULL) != NULL) {
+        arch_numa_free(pv, sizeof(arch_cond));
+    }
+
+    return 0;
+}
+
+/* Lazily allocate condition variables initialized with PTHREAD_COND_INITIALIZER */
+static __inline arch_cond *arch_cond_ptr(pthread_cond_t *c)
+{
+    arch_cond *pv = atomic_read_ptr_acquire((void * volatile *) c);
+
+    if (pv == NULL) {
+        if (arch_cond_init(c, 1) != 0)
+            return NULL;
+        pv = atomic_read_ptr_acquire((void * volatile *) c);
+    }
+
+    return pv;
+}
+
+static int arch_cond_wait(arch_cond *pv, pthread_mutex_t *m, const struct timespec *t)
+{
+    int rc = 0;
+    long state;
+    arch_cond_node node;
+
+    node.state = COND_WAITING;
+    node.next = NULL;
+
+    arch_spin_lock(& pv->lock);
+    node.prev = pv->tail;
+    if (pv->tail != NULL) pv->tail->next = &node;
+    else pv->head = &node;
+    pv->tail = &node;
+    arch_spin_unlock(& pv->lock);
+
+    pthread_mutex_unlock(m);
+
+    while ((state = atomic_read_acquire(& node.state)) != COND_SIGNALED) {
+        DWORD ms = INFINITE;
+
+        /* Once requeued by a broadcast, we are a mutex waiter, which can not time out */
+        if (state == COND_WAITING && t != NULL)
+            ms = arch_timeout_in_ms(pv->clock_id, t);
+
+        if (ms == 0 || arch_wait_on_address(& node.state, state, ms) == ETIMEDOUT) {
+            if (state != COND_WAITING || (ms != 0 && arch_timeout_in_ms(pv->clock_id, t) != 0))
+                continue;
+
+            arch_spin_lock(& pv->lock);
+            if (atomic_read(& node.state) == COND_WAITING) {
+                if (node.prev != NULL) node.prev->next = node.next;
+                else pv->head = node.next;
+                if (node.next != NULL) node.next->prev = node.prev;
+                else pv->tail = node.prev;
+                arch_spin_unlock(& pv->lock);
+                rc = ETIMEDOUT;
+                break;
+            }
+            arch_spin_unlock(& pv->lock);
+        }
+    }
+
+    pthread_mutex_lock(m);
+
+    /* Pass the broadcast on, the next waiter will park on the mutex we own */
+    if (rc == 0 && node.next != NULL) {
+        arch_cond_node *next = node.next;
+
+        atomic_set_release(& next->state, COND_SIGNALED);
+        arch_wake_by_address_single(& next->state);
+    }
+
+    return rc;
+}
+
+/**
+ * Create a condition variable.
+ * @param c The pointer of the condition variable object.
+ * @param a The pointer of the condition variable attribute object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, ENOMEM returned to indicate the error.
+ */
+int pthread_cond_init(pthread_cond_t *c, const pthread_condattr_t *a)
+{
+    int rc;
+
+    *c = NULL;
+    if ((rc = arch_cond_init(c, 0)) != 0)
+        return rc;
+
+    if (a != NULL && *a != NULL)
+        ((arch_cond *) *c)->clock_id = ((arch_cond_attr *) *a)->clock_id;
+
+    return 0;
+}
+
+/**
+ * Unblock one thread waiting on a condition variable.
+ * @param c The pointer of the condition variable object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, ENOMEM returned to indicate the error.
+ */
+int pthread_cond_signal(pthread_cond_t *c)
+{
+    arch_cond_node *node;
+    arch_cond *pv = arch_cond_ptr(c);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    /* Racy peek, a waiter queues itself before it releases the mutex */
+    if (atomic_read_ptr((void * volatile *) & pv->head) == NULL)
+        return 0;
+
+    arch_spin_lock(& pv->lock);
+    if ((node = pv->head) != NULL) {
+        pv->head = node->next;
+        if (pv->head != NULL) pv->head->prev = NULL;
+        else pv->tail = NULL;
+        node->next = NULL;
+        atomic_set_release(& node->state, COND_SIGNALED);
+    }
+    arch_spin_unlock(& pv->lock);
+
+    if (node != NULL)
+        arch_wake_by_address_single(& node->state);
+
+    return 0;
+}
+
+/**
+ * Unblock all threads waiting on a condition variable.
+ * @param c The pointer of the condition variable object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, ENOMEM returned to indicate the error.
+ * @remark Only the first waiter is woken up, the others are requeued
+ *         behind it and woken one by one as the mutex becomes available.
+ */
+int pthread_cond_broadcast(pthread_cond_t *c)
+{
+    arch_cond_node *node, *next;
+    arch_cond *pv = arch_cond_ptr(c);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    /* Racy peek, a waiter queues itself before it releases the mutex */
+    if (atomic_read_ptr((void * volatile *) & pv->head) == NULL)
+        return 0;
+
+    arch_spin_lock(& pv->lock);
+    if ((node = pv->head) != NULL) {
+        for (next = node->next; next != NULL; next = next->next)
+            atomic_set_release(& next->state, COND_REQUEUED);
+        pv->head = pv->tail = NULL;
+        atomic_set_release(& node->state, COND_SIGNALED);
+    }
+    arch_spin_unlock(& pv->lock);
+
+    if (node != NULL)
+        arch_wake_by_address_single(& node->state);
+
+    return 0;
+}
+
+/**
+ * Wait on a condition variable.
+ * @param c The pointer of the condition variable object.
+ * @param m The pointer of the mutex object, locked by the calling thread.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, ENOMEM returned to indicate the error.
+ */
+int pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
+{
+    arch_cond *pv = arch_cond_ptr(c);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    return arch_cond_wait(pv, m, NULL);
+}
+
+/**
+ * Wait on a condition variable with a timeout.
+ * @param c The pointer of the condition variable object.
+ * @param m The pointer of the mutex object, locked by the calling thread.
+ * @param t The absolute timeout, measured by the clock attribute of the
+ *        condition variable (CLOCK_REALTIME by default).
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number (ETIMEDOUT, EINVAL or ENOMEM) returned
+ *         to indicate the error.
+ */
+int pthread_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m, const struct timespec *t)
+{
+    arch_cond *pv = arch_cond_ptr(c);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    if (t == NULL || t->tv_nsec < 0 || t->tv_nsec >= POW10_9)
+        return EINVAL;
+
+    return arch_cond_wait(pv, m, t);
+}
+
+/**
+ * Destroy a condition variable.
+ * @param c The pointer of the condition variable object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EBUSY returned if there are threads waiting on it.
+ */
+int pthread_cond_destroy(pthread_cond_t *c)
+{
+    arch_cond *pv = (arch_cond *) *c;
+
+    if (pv != NULL) {
+        if (pv->head != NULL)
+            return EBUSY;
+        arch_numa_free(pv, sizeof(arch_cond));
+        *c = NULL;
+    }
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file gomp.c
+ * @brief Implementation Code of the libgomp Profile
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * libgomp for MinGW runs on the POSIX layer: its team threads are docked on
+ * a barrier of sem_wait/sem_post between parallel regions, it never binds
+ * them, and it ignores OMP_WAIT_POLICY and GOMP_SPINCOUNT. When libgomp-1.dll
+ * is loaded (or LIBPTHREAD_GOMP=1, for a static libgomp) the first
+ * pthread_create switches the process to this profile:
+ *
+ *   - the private semaphores, which are the team barriers, spin as long as
+ *     libgomp spins on Linux before they park: GOMP_SPINCOUNT, or 300000
+ *     (0 if OMP_WAIT_POLICY=passive, unbounded if active),
+ *   - the thread cache keeps up to one thread per CPU, a team which grows
+ *     again reuses the threads libgomp let go,
+ *   - with OMP_PROC_BIND, every new thread is bound to one CPU of the
+ *     process in creation order (close, spread over OMP_NUM_THREADS, or
+ *     primary), and the initial thread to the CPU it runs on.
+ *
+ * LIBPTHREAD_GOMP=0 keeps the defaults. All threads of the process are
+ * placed, libgomp cannot tell us which ones are its own.
+ */
+
+#define GOMP_SPIN_COUNT     300000 /* the default of libgomp */
+
+#define GOMP_BIND_NONE      0
+#define GOMP_BIND_CLOSE     1
+#define GOMP_BIND_SPREAD    2
+#define GOMP_BIND_PRIMARY   3
+
+extern long libpthread_sem_spin_count;
+
+static pthread_once_t gomp_once = PTHREAD_ONCE_INIT;
+static int gomp_bind;
+static int gomp_first; /* the place of the initial thread */
+static int gomp_stride;
+static int gomp_nplaces;
+static int gomp_places[CPU_SETSIZE];
+static long gomp_created; /* threads placed, the initial thread is 0 */
+
+/* The value of an environment variable, 0 if it is not set */
+static int gomp_getenv(const char *name, char *value, DWORD size)
+{
+    DWORD n = GetEnvironmentVariableA(name, value, size);
+
+    return n > 0 && n < size;
+}
+
+/* Does the first item of a list like "spread,close" equal word, ignoring case */
+static int gomp_match(const char *value, const char *word)
+{
+    while (*value == ' ')
+        value++;
+
+    for (; *word != '\0'; value++, word++) {
+        if ((*value | 0x20) != *word)
+            return 0;
+    }
+
+    return *value == '\0' || *value == ',' || *value == ' ';
+}
+
+/* GOMP_SPINCOUNT: a number with an optional k, M, G or T suffix, or infinite */
+static long gomp_spin_count(const char *value)
+{
+    char *end;
+    double n;
+
+    if (gomp_match(value, "infinite") || gomp_match(value, "infinity"))
+        return LONG_MAX;
+
+    n = strtod(value, &end);
+    switch (*end | 0x20) {
+        case 'k': n *= 1e3; break;
+        case 'm': n *= 1e6; break;
+        case 'g': n *= 1e9; break;
+        case 't': n *= 1e12; break;
+    }
+
+    if (n <= 0)
+        return 0;
+    return n >= (double) LONG_MAX ? LONG_MAX : (long) n;
+}
+
+static void arch_gomp_init(void)
+{
+    cpu_set_t set;
+    char value[64];
+    int i, cpu, nthreads;
+    long spin = GOMP_SPIN_COUNT;
+
+    if (gomp_getenv("LIBPTHREAD_GOMP", value, sizeof(value))) {
+        if (value[0] == '0')
+            return;
+    } else if (GetModuleHandleA("libgomp-1.dll") == NULL) {
+        return;
+    }
+
+    if (get_ncpu() == 1)
+        spin = 0;
+    else if (gomp_getenv("GOMP_SPINCOUNT", value, sizeof(value)))
+        spin = gomp_spin_count(value);
+    else if (gomp_getenv("OMP_WAIT_POLICY", value, sizeof(value)))
+        spin = gomp_match(value, "passive") ? 0 : gomp_match(value, "active") ? LONG_MAX : spin;
+    atomic_set(& libpthread_sem_spin_count, spin);
+
+    if (pthread_getcachesize_np(&i) == 0 && i == 0)
+        (void) pthread_setcachesize_np(get_ncpu());
+
+    if (!gomp_getenv("OMP_PROC_BIND", value, sizeof(value)))
+        return;
+    if (gomp_match(value, "true") || gomp_match(value, "close"))
+        gomp_bind = GOMP_BIND_CLOSE;
+    else if (gomp_match(value, "spread"))
+        gomp_bind = GOMP_BIND_SPREAD;
+    else if (gomp_match(value, "primary") || gomp_match(value, "master"))
+        gomp_bind = GOMP_BIND_PRIMARY;
+    else
+        return;
+
+    /* One place per available CPU, in CPU order */
+    arch_cpu_available(&set);
+    cpu = sched_getcpu();
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &set)) {
+            if (i == cpu)
+                gomp_first = gomp_nplaces;
+            gomp_places[gomp_nplaces++] = i;
+        }
+    }
+    if (gomp_nplaces == 0) {
+        gomp_bind = GOMP_BIND_NONE;
+        return;
+    }
+
+    nthreads = gomp_getenv("OMP_NUM_THREADS", value, sizeof(value)) ? atoi(value) : 0;
+    if (nthreads <= 0 || nthreads > gomp_nplaces)
+        nthreads = gomp_nplaces;
+    gomp_stride = gomp_nplaces / nthreads;
+
+    CPU_ZERO(&set);
+    CPU_SET(gomp_places[gomp_first], &set);
+    (void) pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/**
+ * Apply the libgomp profile once, and pick the CPU of a new thread.
+ * @param  set The CPU set of the new thread, if it returns 1.
+ * @return 1 if the new thread is bound to set (OMP_PROC_BIND), 0 otherwise.
+ * @remark Called by pthread_create for threads without an affinity attribute.
+ */
+int arch_gomp_thread_place(cpu_set_t *set)
+{
+    long k;
+    int place = gomp_first;
+
+    pthread_once(& gomp_once, arch_gomp_init);
+    if (gomp_bind == GOMP_BIND_NONE)
+        return 0;
+
+    k = atomic_fetch_and_add(& gomp_created, 1) + 1;
+    if (gomp_bind == GOMP_BIND_CLOSE)
+        place = (int) ((gomp_first + k) % gomp_nplaces);
+    else if (gomp_bind == GOMP_BIND_SPREAD)
+        place = (int) ((gomp_first + k * gomp_stride + k / (gomp_nplaces / gomp_stride)) % gomp_nplaces);
+
+    CPU_ZERO(set);
+    CPU_SET(gomp_places[place], set);
+    return 1;
+}
@@ -22,11 +22,51 @@
  * @brief Initialization Code of Libpthread
  */
 
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 #include <winsock2.h>
 
+#include "arch.h"
+#include "misc.h"
+
 DWORD libpthread_tls_index;
 
+/* Upper bound of the adaptive mutex spinning, see test_speed, 32 spins are about 1/2 the system call */
+long libpthread_mutex_spin_max;
+
+/* pthread_spin_lock spins, then yields, then parks, see pthread_spin_setspin_np */
+long libpthread_spin_count;
+long libpthread_spin_yield_count = 16;
+
+/* Spins of sem_wait before it parks, raised for the team barriers of libgomp (see gomp.c) */
+long libpthread_sem_spin_count;
+
+/* The CPU has usable Intel TSX, see pthread_spin_setelision_np */
+long libpthread_rtm;
+
+/*
+ * The timer and rcu threads run our code until the process exits, they
+ * are never stopped: a thread cannot be joined in DllMain, its exit waits
+ * for the loader lock we hold. So the library pins itself before it starts
+ * one, FreeLibrary does not unload it from then on.
+ */
+void arch_module_pin(void)
+{
+    HMODULE h;
+
+    (void) GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+        (LPCSTR) (void *) arch_module_pin, &h);
+}
+
 static BOOL libpthread_fini(void) {
+    arch_rcu_fini();
+    arch_trace_fini();
+    arch_sleep_fini();
+    arch_key_fini();
+    arch_numa_fini();
+    arch_wait_fini();
     TlsFree(libpthread_tls_index);
     return TRUE;
 }
@@ -35,19 +75,95 @@ static BOOL libpthread_init(void) {
     if ((libpthread_tls_index = TlsAlloc()) == TLS_OUT_OF_INDEXES)
         return FALSE;
 
+    if (!arch_key_init()) {
+        TlsFree(libpthread_tls_index);
+        return FALSE;
+    }
+
+    arch_numa_init();
+    arch_clock_init();
+    arch_rcu_init();
+    arch_sleep_init();
+
+    if (get_ncpu() > 1) {
+        libpthread_mutex_spin_max = 100;
+        libpthread_spin_count = 1000;
+        libpthread_sem_spin_count = 1000;
+    }
+
+#ifdef ARCH_RTM
+    libpthread_rtm = arch_cpu_has_rtm();
+#endif
+
+    if (!arch_wait_init()) {
+        arch_sleep_fini();
+        arch_key_fini();
+        arch_numa_fini();
+        TlsFree(libpthread_tls_index);
+        return FALSE;
+    }
+
+    arch_trace_init();
     return TRUE;
 }
 
-BOOL WINAPI
-DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
+static BOOL libpthread_notify(DWORD fdwReason)
 {
     switch(fdwReason) {
     case DLL_PROCESS_ATTACH:
         return libpthread_init();
 
     case DLL_PROCESS_DETACH:
+        arch_thread_fini();
         return libpthread_fini();
+
+    case DLL_THREAD_DETACH:
+        arch_sleep_thread_fini();
+        arch_key_thread_fini();
+        arch_thread_fini();
+        arch_numa_thread_fini();
+        break;
     }
 
     return TRUE;
 }
+
+#ifdef LIBPTHREAD_STATIC
+
+/*
+ * The static library has no DllMain, a TLS callback of the image it is
+ * linked into gets the same notifications. It runs before the C runtime
+ * is initialized, which is fine, libpthread_init only calls Windows.
+ */
+static VOID NTAPI libpthread_tls_callback(PVOID hModule, DWORD fdwReason, PVOID lpvReserved)
+{
+    (void) libpthread_notify(fdwReason);
+}
+
+#if defined(_MSC_VER)
+/* Keep the TLS directory and our entry, nothing references them */
+#ifdef _M_IX86
+#pragma comment(linker, "/INCLUDE:__tls_used")
+#pragma comment(linker, "/INCLUDE:_libpthread_tls_callback_entry")
+#else
+#pragma comment(linker, "/INCLUDE:_tls_used")
+#pragma comment(linker, "/INCLUDE:libpthread_tls_callback_entry")
+#endif
+#pragma const_seg(".CRT$XLB")
+extern const PIMAGE_TLS_CALLBACK libpthread_tls_callback_entry;
+const PIMAGE_TLS_CALLBACK libpthread_tls_callback_entry = libpthread_tls_callback;
+#pragma const_seg()
+#else
+/* The C runtime of mingw-w64 always has a TLS directory */
+PIMAGE_TLS_CALLBACK libpthread_tls_callback_entry __attribute__((section(".CRT$XLB"), used)) = libpthread_tls_callback;
+#endif
+
+#else
+
+BOOL WINAPI
+DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
+{
+    return libpthread_notify(fdwReason);
+}
+
+#endif
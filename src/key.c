@@ -24,6 +24,7 @@
 
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <winsock2.h>
 
@@ -35,21 +36,60 @@
  * thread local storage = TLS
  */
 
+/*
+ * The keys live in a table of the library, not in TLS slots. A thread keeps
+ * its values in pages of ARCH_KEY_PAGE slots, allocated by the first
+ * pthread_setspecific in the page, reached from one TLS slot.
+ *
+ * The sequence number of a key is odd while it is in use, and is bumped by
+ * pthread_key_create and pthread_key_delete. A value is only seen if it was
+ * set under the current sequence number of its key, so pthread_key_delete
+ * needs not visit the threads.
+ */
+
+#define ARCH_KEY_PAGE   32
+#define ARCH_KEY_PAGES  (PTHREAD_KEYS_MAX / ARCH_KEY_PAGE)
+
+typedef struct {
+    long seq;
+    void (* destructor)(void *);
+} arch_key;
+
+typedef struct {
+    void *value;
+    long seq; /* of the key when value was set */
+} arch_key_slot;
+
+typedef struct {
+    arch_key_slot *pages[ARCH_KEY_PAGES];
+} arch_key_table;
+
+static arch_key keys[PTHREAD_KEYS_MAX];
+static DWORD key_tls_index = TLS_OUT_OF_INDEXES;
+
 /**
  * Create thread-specific data key.
  * @param  key The thread-specific data key.
- * @param  destructor Ignored.
+ * @param  destructor NULL, or the routine called with the non-NULL value
+ *         of the key when a thread exits.
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
  *         with errno set to indicate the error (EAGAIN).
- * @bug We do not support thread-specific data key destructor (yet).
  */
 int pthread_key_create(pthread_key_t *key, void (* destructor)(void *))
 {
-    if ((*key = TlsAlloc()) == TLS_OUT_OF_INDEXES)
-        return lc_set_errno(EAGAIN);
+    long i, seq;
 
-    return 0;
+    for (i = 0; i < PTHREAD_KEYS_MAX; i++) {
+        seq = atomic_read(& keys[i].seq);
+        if ((seq & 1) == 0 && atomic_cmpxchg(& keys[i].seq, seq + 1, seq) == seq) {
+            keys[i].destructor = destructor;
+            *key = i;
+            return 0;
+        }
+    }
+
+    return lc_set_errno(EAGAIN);
 }
 
 /**
@@ -58,13 +98,37 @@ int pthread_key_create(pthread_key_t *key, void (* destructor)(void *))
  * @param  value The thread-specific value.
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
- *         with errno set to indicate the error (EINVAL).
+ *         with errno set to indicate the error (EINVAL or ENOMEM).
  */
 int pthread_setspecific(pthread_key_t key, const void *value)
 {
-    if (TlsSetValue(key, (LPVOID) value) == 0)
+    long seq;
+    arch_key_slot *page;
+    arch_key_table *table;
+
+    if (key < 0 || key >= PTHREAD_KEYS_MAX || ((seq = keys[key].seq) & 1) == 0)
         return lc_set_errno(EINVAL);
 
+    if ((table = arch_tls_get(key_tls_index)) == NULL) {
+        if (value == NULL)
+            return 0;
+        if ((table = arch_slab_alloc(sizeof(arch_key_table))) == NULL)
+            return lc_set_errno(ENOMEM);
+        TlsSetValue(key_tls_index, table);
+    }
+
+    if ((page = table->pages[key / ARCH_KEY_PAGE]) == NULL) {
+        if (value == NULL)
+            return 0;
+        if ((page = arch_slab_alloc(ARCH_KEY_PAGE * sizeof(arch_key_slot))) == NULL)
+            return lc_set_errno(ENOMEM);
+        table->pages[key / ARCH_KEY_PAGE] = page;
+    }
+
+    page += key % ARCH_KEY_PAGE;
+    page->value = (void *) value;
+    page->seq = seq;
+
     return 0;
 }
 
@@ -77,12 +141,23 @@ int pthread_setspecific(pthread_key_t key, const void *value)
  */
 void *pthread_getspecific(pthread_key_t key)
 {
-    void *rp = TlsGetValue(key);
+    arch_key_slot *page;
+    arch_key_table *table;
 
-    if ((rp == NULL) && (GetLastError() != ERROR_SUCCESS))
+    if (key < 0 || key >= PTHREAD_KEYS_MAX) {
         lc_set_errno(EINVAL);
+        return NULL;
+    }
+
+    if ((table = arch_tls_get(key_tls_index)) == NULL
+        || (page = table->pages[key / ARCH_KEY_PAGE]) == NULL)
+        return NULL;
+
+    page += key % ARCH_KEY_PAGE;
+    if (page->seq != keys[key].seq)
+        return NULL;
 
-    return rp;
+    return page->value;
 }
 
 /**
@@ -91,11 +166,106 @@ void *pthread_getspecific(pthread_key_t key)
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
  *         with errno set to indicate the error (EINVAL).
+ * @remark The destructor is not called, as required by POSIX.
  */
 int pthread_key_delete(pthread_key_t key)
 {
-    if (TlsFree(key) == 0)
+    long seq;
+
+    if (key < 0 || key >= PTHREAD_KEYS_MAX)
+        return lc_set_errno(EINVAL);
+
+    seq = atomic_read(& keys[key].seq);
+    if ((seq & 1) == 0 || atomic_cmpxchg(& keys[key].seq, seq + 1, seq) != seq)
         return lc_set_errno(EINVAL);
 
     return 0;
 }
+
+/**
+ * Call the destructors of the keys with a value in the calling thread,
+ * and clear the values.
+ * @remark Internal routine, called when a thread exits, and by a cached
+ * thread between two start routines.
+ */
+void arch_key_reset(void)
+{
+    int round, called;
+    long i, j, seq;
+    void *value;
+    arch_key_slot *page;
+    void (* destructor)(void *);
+    arch_key_table *table = TlsGetValue(key_tls_index);
+
+    if (table == NULL)
+        return;
+
+    /* A destructor may set values again, POSIX allows us to give up */
+    for (round = 0; round < PTHREAD_DESTRUCTOR_ITERATIONS; round++) {
+        called = 0;
+        for (i = 0; i < ARCH_KEY_PAGES; i++) {
+            if ((page = table->pages[i]) == NULL)
+                continue;
+            for (j = 0; j < ARCH_KEY_PAGE; j++) {
+                if ((value = page[j].value) == NULL)
+                    continue;
+                seq = page[j].seq;
+                destructor = keys[i * ARCH_KEY_PAGE + j].destructor;
+                page[j].value = NULL;
+                if (destructor != NULL && seq == keys[i * ARCH_KEY_PAGE + j].seq) {
+                    destructor(value);
+                    called = 1;
+                }
+            }
+        }
+        if (!called)
+            break;
+    }
+
+    for (i = 0; i < ARCH_KEY_PAGES; i++) {
+        if ((page = table->pages[i]) != NULL)
+            memset(page, 0, ARCH_KEY_PAGE * sizeof(arch_key_slot));
+    }
+}
+
+/**
+ * Free the values of the calling thread, the destructors are not called.
+ * @remark Internal routine, called on DLL_THREAD_DETACH.
+ */
+void arch_key_thread_fini(void)
+{
+    long i;
+    arch_key_table *table = TlsGetValue(key_tls_index);
+
+    if (table == NULL)
+        return;
+
+    TlsSetValue(key_tls_index, NULL);
+    for (i = 0; i < ARCH_KEY_PAGES; i++) {
+        if (table->pages[i] != NULL)
+            arch_slab_free(table->pages[i], ARCH_KEY_PAGE * sizeof(arch_key_slot));
+    }
+    arch_slab_free(table, sizeof(arch_key_table));
+}
+
+/**
+ * Allocate the TLS slot of the key tables.
+ * @return 1 if it succeeds, 0 if there is no more TLS slot.
+ * @remark Internal routine, called by libpthread_init.
+ */
+int arch_key_init(void)
+{
+    return (key_tls_index = TlsAlloc()) != TLS_OUT_OF_INDEXES;
+}
+
+/**
+ * Free the TLS slot of the key tables.
+ * @remark Internal routine, called by libpthread_fini.
+ */
+void arch_key_fini(void)
+{
+    if (key_tls_index != TLS_OUT_OF_INDEXES) {
+        TlsFree(key_tls_index);
+        key_tls_index = TLS_OUT_OF_INDEXES;
+    }
+}
@@ -31,12 +31,28 @@
  * @{
  */
 
+/* ARM64EC code is x64 to the compiler (_M_X64 is defined) but runs on ARM64 cores */
+#if defined(_M_ARM64) || defined(_M_ARM64EC) || defined(__aarch64__)
+#define ARCH_ARM64      1
+#endif
+#if defined(ARCH_ARM64) || defined(_M_ARM) || defined(__arm__)
+#define ARCH_ARM        1
+#endif
+
 #ifdef _MSC_VER
 #include <intrin.h>
-#pragma intrinsic(_InterlockedCompareExchange, _InterlockedDecrement, _InterlockedIncrement, _mm_pause)
+#pragma intrinsic(_InterlockedCompareExchange, _InterlockedExchange, _InterlockedDecrement, _InterlockedIncrement)
+#pragma intrinsic(_ReturnAddress)
+#ifdef ARCH_ARM
+#pragma intrinsic(__yield, __wfe, __sev, __dmb, __dsb)
+#elif defined(_M_X64)
+#pragma intrinsic(_mm_pause, __readgsqword)
+#elif defined(_M_IX86)
+#pragma intrinsic(_mm_pause, __readfsdword)
+#endif
 
 #ifdef _WIN64
-#pragma intrinsic(_InterlockedCompareExchangePointer)
+#pragma intrinsic(_InterlockedCompareExchangePointer, _InterlockedExchangePointer)
 #endif
 #endif
 
@@ -47,6 +63,9 @@
 
 #define MAX_SLEEP_IN_MS         4294967294UL
 
+/* Seconds a deadline is clamped to, so that it fits in ns and leaves room for the uptime */
+#define MAX_SLEEP_IN_SEC        INT64_C(4611686018)
+
 #define POW10_2     INT64_C(100)
 #define POW10_3     INT64_C(1000)
 #define POW10_4     INT64_C(10000)
@@ -54,6 +73,13 @@
 #define POW10_7     INT64_C(10000000)
 #define POW10_9     INT64_C(1000000000)
 
+/* The return address of the calling function, where a lock was created */
+#ifdef _MSC_VER
+#define ARCH_RETURN_ADDRESS()   _ReturnAddress()
+#else
+#define ARCH_RETURN_ADDRESS()   __builtin_return_address(0)
+#endif
+
 static __inline void lc_assert(char *message, char *file, unsigned int line)
 {
     fprintf(stderr, "Assertion failed: %s , file %s, line %u\n", message, file, line);
@@ -193,6 +219,39 @@ static __inline int os_priority_to_sched_priority(int os_priority)
  * http://msdn.microsoft.com/zh-cn/library/26td21ds.aspx [Compiler Intrinsics]
  */
 
+/*
+ * TlsGetValue without the call: the first 64 TLS slots live in the TEB
+ * (TlsSlots, at gs:[0x1480] on x64 and fs:[0xE10] on x86), read them with
+ * one segment-relative load. Unlike __declspec(thread), this works in a DLL
+ * loaded by LoadLibrary on Windows XP, and with GCC without emulated TLS.
+ * ARM keeps the TEB in a register (x18 on ARM64), the offsets are the same.
+ */
+#ifndef _MSC_VER
+__attribute__((always_inline))
+#endif
+static __inline void *arch_tls_get(DWORD index)
+{
+    if (index < 64) {
+#if defined(ARCH_ARM)
+        return ((void **) ((char *) NtCurrentTeb() + (sizeof(void *) == 8 ? 0x1480 : 0xE10)))[index];
+#elif defined(_MSC_VER) && defined(_M_X64)
+        return (void *) __readgsqword(0x1480 + index * sizeof(void *));
+#elif defined(_MSC_VER) && defined(_M_IX86)
+        return (void *) __readfsdword(0xE10 + index * sizeof(void *));
+#elif defined(__GNUC__) && defined(__x86_64__)
+        void *value;
+        asm volatile("movq %%gs:0x1480(,%1,8), %0" : "=r" (value) : "r" ((uintptr_t) index));
+        return value;
+#elif defined(__GNUC__) && defined(__i386__)
+        void *value;
+        asm volatile("movl %%fs:0xE10(,%1,4), %0" : "=r" (value) : "r" (index));
+        return value;
+#endif
+    }
+
+    return TlsGetValue(index);
+}
+
 #ifndef _MSC_VER
 __attribute__((always_inline))
 #endif
@@ -215,97 +274,581 @@ static __inline void cpu_relax(void)
 {
 #ifdef _MSC_VER
     YieldProcessor();
-    /* _mm_pause(); */
+    /* _mm_pause(); __yield(); */
     /* __asm rep nop */
-#else
+#elif defined(__i386__) || defined(__x86_64__)
     /* __builtin_ia32_pause(); */
     asm volatile("rep; nop" ::: "memory");
+#elif defined(ARCH_ARM)
+    asm volatile("yield" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
 #endif
 }
 
-#ifndef _MSC_VER
-__attribute__((always_inline))
+/*
+ * Atomics with explicit memory orders. Without a suffix, read and set are
+ * relaxed and the read-modify-write operations are sequentially consistent.
+ * _acquire keeps later accesses after the operation, _release keeps earlier
+ * ones before it, _relaxed only makes the operation itself atomic.
+ *
+ * GCC: the __atomic builtins. MSVC: on ARM, the _acq/_rel/_nf interlocked
+ * intrinsics and __iso_volatile loads and stores with dmb ish fences. On
+ * x86/x64 every locked instruction is a full barrier and plain loads and
+ * stores are acquire and release in hardware, only the compiler has to be
+ * kept from reordering.
+ *
+ * <stdatomic.h> is not used: its functions need _Atomic objects, and the lock
+ * words live in public structures as plain longs.
+ */
+#ifdef _MSC_VER
+#define arch_atomic static __forceinline
+#else
+#define arch_atomic static __inline __attribute__((always_inline))
 #endif
-static __inline void atomic_set(long volatile *__ptr, long value)
+
+#if defined(_MSC_VER) && defined(ARCH_ARM)
+#define ARCH_ATOMIC_WEAK            1
+#define arch_fence_acquire()        __dmb(0xB) /* _ARM_BARRIER_ISH */
+#define arch_fence_release()        __dmb(0xB)
+#define arch_load32(p)              __iso_volatile_load32((const volatile __int32 *) (p))
+#define arch_store32(p, v)          __iso_volatile_store32((volatile __int32 *) (p), (__int32) (v))
+#define arch_load64(p)              __iso_volatile_load64((const volatile __int64 *) (p))
+#define arch_store64(p, v)          __iso_volatile_store64((volatile __int64 *) (p), (v))
+#define ARCH_INTERLOCKED(op, order) op##order
+#elif defined(_MSC_VER)
+#define arch_fence_acquire()        _ReadWriteBarrier()
+#define arch_fence_release()        _ReadWriteBarrier()
+#define arch_load32(p)              (*(p))
+#define arch_store32(p, v)          (*(p) = (v))
+#define ARCH_INTERLOCKED(op, order) op
+#endif
+
+arch_atomic long atomic_read(long volatile *__ptr)
 {
-    *__ptr = value;
+#ifdef _MSC_VER
+    return arch_load32(__ptr);
+#else
+    return __atomic_load_n(__ptr, __ATOMIC_RELAXED);
+#endif
 }
 
-#ifndef _MSC_VER
-__attribute__((always_inline))
+arch_atomic long atomic_read_acquire(long volatile *__ptr)
+{
+#ifdef _MSC_VER
+    long value = arch_load32(__ptr);
+    arch_fence_acquire();
+    return value;
+#else
+    return __atomic_load_n(__ptr, __ATOMIC_ACQUIRE);
 #endif
-static __inline long atomic_read(long volatile *__ptr)
+}
+
+arch_atomic void atomic_set(long volatile *__ptr, long value)
 {
-    return *__ptr;
+#ifdef _MSC_VER
+    arch_store32(__ptr, value);
+#else
+    __atomic_store_n(__ptr, value, __ATOMIC_RELAXED);
+#endif
 }
 
-#ifndef _MSC_VER
-__attribute__((always_inline))
+arch_atomic void atomic_set_release(long volatile *__ptr, long value)
+{
+#ifdef _MSC_VER
+    arch_fence_release();
+    arch_store32(__ptr, value);
+#else
+    __atomic_store_n(__ptr, value, __ATOMIC_RELEASE);
 #endif
-static __inline long atomic_fetch_and_add(long volatile *__ptr, long value)
+}
+
+arch_atomic long atomic_fetch_and_add(long volatile *__ptr, long value)
 {
 #ifdef _MSC_VER
     return _InterlockedExchangeAdd(__ptr, value);
 #else
-    return __sync_fetch_and_add(__ptr, value);
+    return __atomic_fetch_add(__ptr, value, __ATOMIC_SEQ_CST);
 #endif
 }
 
-#ifndef _MSC_VER
-__attribute__((always_inline))
+arch_atomic long atomic_fetch_and_add_acquire(long volatile *__ptr, long value)
+{
+#ifdef _MSC_VER
+    return ARCH_INTERLOCKED(_InterlockedExchangeAdd, _acq)(__ptr, value);
+#else
+    return __atomic_fetch_add(__ptr, value, __ATOMIC_ACQUIRE);
 #endif
-static __inline long atomic_cmpxchg(long volatile *__ptr, long __new, long __old)
+}
+
+arch_atomic long atomic_fetch_and_add_release(long volatile *__ptr, long value)
+{
+#ifdef _MSC_VER
+    return ARCH_INTERLOCKED(_InterlockedExchangeAdd, _rel)(__ptr, value);
+#else
+    return __atomic_fetch_add(__ptr, value, __ATOMIC_RELEASE);
+#endif
+}
+
+arch_atomic long atomic_fetch_and_add_relaxed(long volatile *__ptr, long value)
+{
+#ifdef _MSC_VER
+    return ARCH_INTERLOCKED(_InterlockedExchangeAdd, _nf)(__ptr, value);
+#else
+    return __atomic_fetch_add(__ptr, value, __ATOMIC_RELAXED);
+#endif
+}
+
+arch_atomic long atomic_xchg(long volatile *__ptr, long value)
+{
+#ifdef _MSC_VER
+    return _InterlockedExchange(__ptr, value);
+#else
+    return __atomic_exchange_n(__ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+arch_atomic long atomic_xchg_acquire(long volatile *__ptr, long value)
+{
+#ifdef _MSC_VER
+    return ARCH_INTERLOCKED(_InterlockedExchange, _acq)(__ptr, value);
+#else
+    return __atomic_exchange_n(__ptr, value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+arch_atomic long atomic_xchg_release(long volatile *__ptr, long value)
+{
+#ifdef _MSC_VER
+    return ARCH_INTERLOCKED(_InterlockedExchange, _rel)(__ptr, value);
+#else
+    return __atomic_exchange_n(__ptr, value, __ATOMIC_RELEASE);
+#endif
+}
+
+/* Compare *__ptr with __old, store __new if equal, return the old *__ptr */
+arch_atomic long atomic_cmpxchg(long volatile *__ptr, long __new, long __old)
 {
 #ifdef _MSC_VER
     return _InterlockedCompareExchange(__ptr, __new, __old);
 #else
-    return __sync_val_compare_and_swap (__ptr, __old, __new);
+    (void) __atomic_compare_exchange_n(__ptr, &__old, __new, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __old;
+#endif
+}
+
+arch_atomic long atomic_cmpxchg_acquire(long volatile *__ptr, long __new, long __old)
+{
+#ifdef _MSC_VER
+    return ARCH_INTERLOCKED(_InterlockedCompareExchange, _acq)(__ptr, __new, __old);
+#else
+    (void) __atomic_compare_exchange_n(__ptr, &__old, __new, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+    return __old;
+#endif
+}
+
+arch_atomic long atomic_cmpxchg_release(long volatile *__ptr, long __new, long __old)
+{
+#ifdef _MSC_VER
+    return ARCH_INTERLOCKED(_InterlockedCompareExchange, _rel)(__ptr, __new, __old);
+#else
+    (void) __atomic_compare_exchange_n(__ptr, &__old, __new, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    return __old;
+#endif
+}
+
+/* 64-bit atomics, also on 32-bit systems (cmpxchg8b) */
+arch_atomic __int64 atomic_cmpxchg64(__int64 volatile *__ptr, __int64 __new, __int64 __old)
+{
+#ifdef _MSC_VER
+    return _InterlockedCompareExchange64(__ptr, __new, __old);
+#else
+    (void) __atomic_compare_exchange_n(__ptr, &__old, __new, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __old;
+#endif
+}
+
+arch_atomic __int64 atomic_read64(__int64 volatile *__ptr)
+{
+#if defined(_MSC_VER) && defined(_M_IX86)
+    return _InterlockedCompareExchange64(__ptr, 0, 0);
+#elif defined(_MSC_VER) && defined(ARCH_ATOMIC_WEAK)
+    return arch_load64(__ptr);
+#elif defined(_MSC_VER)
+    return *__ptr;
+#else
+    return __atomic_load_n(__ptr, __ATOMIC_RELAXED);
+#endif
+}
+
+arch_atomic void atomic_set64(__int64 volatile *__ptr, __int64 value)
+{
+#if defined(_MSC_VER) && defined(_M_IX86)
+    __int64 old = *__ptr, prev;
+
+    while ((prev = _InterlockedCompareExchange64(__ptr, value, old)) != old)
+        old = prev;
+#elif defined(_MSC_VER) && defined(ARCH_ATOMIC_WEAK)
+    arch_store64(__ptr, value);
+#elif defined(_MSC_VER)
+    *__ptr = value;
+#else
+    __atomic_store_n(__ptr, value, __ATOMIC_RELAXED);
+#endif
+}
+
+arch_atomic __int64 atomic_fetch_and_add64(__int64 volatile *__ptr, __int64 value)
+{
+#if defined(_MSC_VER) && defined(_M_IX86)
+    __int64 old = *__ptr, prev;
+
+    while ((prev = _InterlockedCompareExchange64(__ptr, old + value, old)) != old)
+        old = prev;
+    return old;
+#elif defined(_MSC_VER)
+    return _InterlockedExchangeAdd64(__ptr, value);
+#else
+    return __atomic_fetch_add(__ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Pointer atomics, the orders are those of the long ones */
+arch_atomic void *atomic_read_ptr(void * volatile *__ptr)
+{
+#if defined(_MSC_VER) && defined(ARCH_ATOMIC_WEAK) && defined(_WIN64)
+    return (void *) arch_load64(__ptr);
+#elif defined(_MSC_VER) && defined(ARCH_ATOMIC_WEAK)
+    return (void *) arch_load32(__ptr);
+#elif defined(_MSC_VER)
+    return *__ptr;
+#else
+    return __atomic_load_n(__ptr, __ATOMIC_RELAXED);
+#endif
+}
+
+arch_atomic void *atomic_read_ptr_acquire(void * volatile *__ptr)
+{
+#ifdef _MSC_VER
+    void *value = atomic_read_ptr(__ptr);
+    arch_fence_acquire();
+    return value;
+#else
+    return __atomic_load_n(__ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+arch_atomic void atomic_set_ptr(void * volatile *__ptr, void *value)
+{
+#if defined(_MSC_VER) && defined(ARCH_ATOMIC_WEAK) && defined(_WIN64)
+    arch_store64(__ptr, (__int64) value);
+#elif defined(_MSC_VER) && defined(ARCH_ATOMIC_WEAK)
+    arch_store32(__ptr, value);
+#elif defined(_MSC_VER)
+    *__ptr = value;
+#else
+    __atomic_store_n(__ptr, value, __ATOMIC_RELAXED);
+#endif
+}
+
+arch_atomic void atomic_set_ptr_release(void * volatile *__ptr, void *value)
+{
+#ifdef _MSC_VER
+    arch_fence_release();
+    atomic_set_ptr(__ptr, value);
+#else
+    __atomic_store_n(__ptr, value, __ATOMIC_RELEASE);
+#endif
+}
+
+arch_atomic void *atomic_cmpxchg_ptr(void * volatile *__ptr, void *__new, void *__old)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    return _InterlockedCompareExchangePointer(__ptr, __new, __old);
+#elif defined(_MSC_VER)
+    return (void *) _InterlockedCompareExchange((volatile long *) __ptr, (long) __new, (long) __old);
+#else
+    (void) __atomic_compare_exchange_n(__ptr, &__old, __new, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __old;
+#endif
+}
+
+arch_atomic void *atomic_cmpxchg_ptr_acquire(void * volatile *__ptr, void *__new, void *__old)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    return ARCH_INTERLOCKED(_InterlockedCompareExchangePointer, _acq)(__ptr, __new, __old);
+#elif defined(_MSC_VER)
+    return (void *) ARCH_INTERLOCKED(_InterlockedCompareExchange, _acq)((volatile long *) __ptr, (long) __new, (long) __old);
+#else
+    (void) __atomic_compare_exchange_n(__ptr, &__old, __new, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+    return __old;
+#endif
+}
+
+arch_atomic void *atomic_cmpxchg_ptr_release(void * volatile *__ptr, void *__new, void *__old)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    return ARCH_INTERLOCKED(_InterlockedCompareExchangePointer, _rel)(__ptr, __new, __old);
+#elif defined(_MSC_VER)
+    return (void *) ARCH_INTERLOCKED(_InterlockedCompareExchange, _rel)((volatile long *) __ptr, (long) __new, (long) __old);
+#else
+    (void) __atomic_compare_exchange_n(__ptr, &__old, __new, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    return __old;
+#endif
+}
+
+arch_atomic void *atomic_xchg_ptr(void * volatile *__ptr, void *value)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    return _InterlockedExchangePointer(__ptr, value);
+#elif defined(_MSC_VER)
+    return (void *) _InterlockedExchange((volatile long *) __ptr, (long) value);
+#else
+    return __atomic_exchange_n(__ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
 /*
-    long prev;
-    asm volatile("lock ; cmpxchgl %2, %1" : "=a" (prev), "+m" (*__ptr) : "q" (__new), "0" (__old) : "memory");
-    return prev;
+ * Order an atomic read-modify-write before a later load from another word,
+ * for handshakes where both sides store then load (a lock word against its
+ * waiter count). Locked x86 instructions and the MSVC interlocked intrinsics
+ * without a suffix are full barriers already.
  */
+arch_atomic void memory_barrier_after_atomic(void)
+{
+#ifdef _MSC_VER
+    _ReadWriteBarrier();
+#elif defined(__i386__) || defined(__x86_64__)
+    asm volatile("" ::: "memory");
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 #endif
 }
 
-#ifndef _MSC_VER
-__attribute__((always_inline))
+/* Standalone fences: earlier loads before later accesses, earlier accesses before later stores */
+arch_atomic void memory_barrier_acquire(void)
+{
+#ifdef _MSC_VER
+    arch_fence_acquire();
+#else
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
 #endif
-static __inline void *atomic_cmpxchg_ptr(void * volatile *__ptr, void *__new, void *__old)
+}
+
+arch_atomic void memory_barrier_release(void)
 {
 #ifdef _MSC_VER
-#ifdef _WIN64
-    return _InterlockedCompareExchangePointer(__ptr, __new, __old);
+    arch_fence_release();
 #else
-    return (void *) _InterlockedCompareExchange((volatile long *) __ptr, (long) __new, (long) __old);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 #endif
+}
+
+/*
+ * One round of a spin wait on *p while it holds value, in place of cpu_relax.
+ * ARM64 sleeps in WFE instead of polling the line: GCC arms the exclusive
+ * monitor with LDAXR, so the store that changes *p wakes the core. MSVC has
+ * no exclusive load intrinsic, the writer sends the event with cpu_wake. An
+ * interrupt also ends the WFE, so a preempted holder only delays the caller's
+ * yield and park phases. Elsewhere this is cpu_relax.
+ */
+arch_atomic void cpu_wait(long volatile *p, long value)
+{
+#if defined(_MSC_VER) && defined(ARCH_ARM)
+    if (arch_load32(p) == value)
+        __wfe();
+#elif defined(__GNUC__) && defined(__aarch64__)
+    long v;
+
+    asm volatile("ldaxr %w0, [%1]" : "=&r" (v) : "r" (p) : "memory");
+    if (v == value)
+        asm volatile("wfe" ::: "memory");
 #else
-    return __sync_val_compare_and_swap (__ptr, __old, __new);
+    (void) p;
+    (void) value;
+    cpu_relax();
+#endif
+}
+
+/* After a store that cpu_wait callers may sleep on, wake them (MSVC on ARM) */
+arch_atomic void cpu_wake(void)
+{
+#if defined(_MSC_VER) && defined(ARCH_ARM)
+    __dsb(0xB); /* the store is visible before the event */
+    __sev();
+#endif
+}
+
 /*
-  void *prev;
-#ifdef _WIN64
-    asm volatile("lock ; cmpxchgq %2, %1" : "=a" (prev),"+m" (*__ptr) : "q" (__new), "0" (__old) : "memory");
+ * Intel TSX restricted transactional memory, used for lock elision. GCC gets
+ * the instructions as bytes, so no -mrtm is needed and the library still
+ * runs on CPUs without it; arch_cpu_has_rtm must be true before any of them
+ * is executed. MSVC has the intrinsics since Visual C++ 2012.
+ */
+#if (defined(_MSC_VER) && _MSC_VER >= 1700 && (defined(_M_IX86) || defined(_M_X64)) && !defined(ARCH_ARM)) \
+    || (defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)))
+#define ARCH_RTM                1
+
+#ifndef _MSC_VER
+#include <cpuid.h>
+#endif
+
+#define ARCH_XBEGIN_STARTED     (~0u)
+#define ARCH_XABORT_EXPLICIT    (1 << 0)
+#define ARCH_XABORT_RETRY       (1 << 1)
+#define ARCH_XABORT_CONFLICT    (1 << 2)
+#define ARCH_XABORT_CAPACITY    (1 << 3)
+#define ARCH_XABORT_CODE(s)     (((s) >> 24) & 0xFF)
+
+#define ARCH_XABORT_BUSY        0xFF /* the lock was taken for real */
+
+/* RTM is there, and not disabled by the microcode (RTM_ALWAYS_ABORT) */
+static __inline int arch_cpu_has_rtm(void)
+{
+#ifdef _MSC_VER
+    int r[4];
+
+    __cpuid(r, 0);
+    if (r[0] < 7)
+        return 0;
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 11)) != 0 && (r[3] & (1 << 11)) == 0;
+#else
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & (1 << 11)) != 0 && (d & (1 << 11)) == 0;
+#endif
+}
+
+arch_atomic unsigned int arch_xbegin(void)
+{
+#ifdef _MSC_VER
+    return _xbegin();
+#else
+    unsigned int status = ARCH_XBEGIN_STARTED;
+
+    /* xbegin to the next instruction, eax is the status after an abort */
+    asm volatile(".byte 0xc7,0xf8 ; .long 0" : "+a" (status) :: "memory");
+    return status;
+#endif
+}
+
+arch_atomic void arch_xend(void)
+{
+#ifdef _MSC_VER
+    _xend();
+#else
+    asm volatile(".byte 0x0f,0x01,0xd5" ::: "memory");
+#endif
+}
+
+/* 1 if running in a transaction */
+arch_atomic int arch_xtest(void)
+{
+#ifdef _MSC_VER
+    return _xtest() != 0;
 #else
-    asm volatile("lock ; cmpxchgl %2, %1" : "=a" (prev),"+m" (*__ptr) : "q" (__new), "0" (__old) : "memory");
+    unsigned char in;
+
+    asm volatile(".byte 0x0f,0x01,0xd6 ; setnz %0" : "=r" (in) :: "memory");
+    return in;
 #endif
-  return prev;
+}
+
+#ifdef _MSC_VER
+#define arch_xabort(code)       _xabort(code)
+#define arch_rdtsc()            __rdtsc()
+#else
+#define arch_xabort(code)       asm volatile(".byte 0xc6,0xf8,%P0" :: "i" (code) : "memory")
+#define arch_rdtsc()            __builtin_ia32_rdtsc()
+#endif
+
+/*
+ * The elision credit of a lock: 0 (or less) is off, pthread_*_setelision_np
+ * sets it to ARCH_ELIDE_CREDIT. Every abort costs one credit, about one
+ * commit in ARCH_ELIDE_REFUND gives one back, so a lock whose transactions
+ * abort more often than that falls back to plain locking for good. The
+ * credit lives in the lock, it is only written on aborts and refunds.
  */
+#define ARCH_ELIDE_CREDIT       64
+#define ARCH_ELIDE_REFUND       16 /* must be a power of 2 */
+#define ARCH_ELIDE_RETRIES      3
+
+/* Charge an abort, 1 if worth retrying: not when the lock was busy or the credit ran out */
+arch_atomic int arch_elide_aborted(long volatile *credit, unsigned int status)
+{
+    if (atomic_fetch_and_add_relaxed(credit, -1) <= 1)
+        return 0;
+
+    return (status & ARCH_XABORT_RETRY) != 0 && (status & ARCH_XABORT_EXPLICIT) == 0;
+}
+
+/* After a commit, give back a credit now and then, sampled by the TSC */
+arch_atomic void arch_elide_committed(long volatile *credit)
+{
+    long c = atomic_read(credit);
+
+    if (c > 0 && c < ARCH_ELIDE_CREDIT && (arch_rdtsc() & (ARCH_ELIDE_REFUND - 1)) == 0)
+        (void) atomic_cmpxchg(credit, c + 1, c);
+}
 #endif
+
+/*
+ * Internal test-and-set lock, for short critical sections that never block
+ * (wait queues of the library itself). Zero is unlocked.
+ */
+static __inline void arch_spin_lock(long volatile *lock)
+{
+    while (atomic_cmpxchg_acquire(lock, 1, 0) != 0) {
+        while (atomic_read(lock) != 0)
+            cpu_relax();
+    }
+}
+
+static __inline void arch_spin_unlock(long volatile *lock)
+{
+    atomic_set_release(lock, 0);
 }
 
+#ifndef ALL_PROCESSOR_GROUPS
+#define ALL_PROCESSOR_GROUPS    0xffff
+#endif
+
+typedef WORD (WINAPI *get_active_processor_group_count_t)(VOID);
+typedef DWORD (WINAPI *get_active_processor_count_t)(WORD);
+
+/* Counted once, racing callers store the same value */
 static __inline int get_ncpu()
 {
-    int n = 0;
+    static volatile int ncpu;
+    int n = ncpu;
     DWORD_PTR pm, sm;
+    HMODULE h;
+
+    if (n != 0)
+        return n;
+
+    /* More than one processor group, the affinity mask only covers one (Windows 7 or later) */
+    if ((h = GetModuleHandleA("kernel32.dll")) != NULL) {
+        get_active_processor_group_count_t group_count =
+            (get_active_processor_group_count_t) GetProcAddress(h, "GetActiveProcessorGroupCount");
+        get_active_processor_count_t processor_count =
+            (get_active_processor_count_t) GetProcAddress(h, "GetActiveProcessorCount");
+
+        if (group_count != NULL && processor_count != NULL && group_count() > 1)
+            n = (int) processor_count(ALL_PROCESSOR_GROUPS);
+    }
 
-    if (GetProcessAffinityMask(GetCurrentProcess(), &pm, &sm)) {
+    if (n == 0 && GetProcessAffinityMask(GetCurrentProcess(), &pm, &sm)) {
         while(pm > 0) {
             n += pm & 1;
             pm >>= 1;
         }
     }
 
-    return n > 0 ? n : 1;
+    return ncpu = n > 0 ? n : 1;
 }
 
 /** @} */
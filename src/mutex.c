@@ -25,12 +25,15 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <winsock2.h>
 
 #include "arch.h"
 #include "misc.h"
 
+extern DWORD libpthread_tls_index;
+
 /**
  * Create a mutex attribute object.
  * @param attr The pointer of the mutex attribute object.
@@ -40,13 +43,16 @@
  */
 int pthread_mutexattr_init(pthread_mutexattr_t *attr)
 {
-    arch_mutex_attr *pv = calloc(1, sizeof(arch_mutex_attr));
+    arch_mutex_attr *pv = arch_slab_alloc(sizeof(arch_mutex_attr));
     if (pv == NULL)
         return ENOMEM;
 
     pv->type = PTHREAD_MUTEX_DEFAULT;
     pv->pshared = PTHREAD_PROCESS_PRIVATE;
     pv->robust = PTHREAD_MUTEX_STALLED;
+    pv->protocol = PTHREAD_PRIO_NONE;
+    pv->prioceiling = sched_get_priority_max(SCHED_FIFO);
+    pv->spin_count = PTHREAD_MUTEX_SPIN_ADAPTIVE_NP;
 
     *attr = pv;
 
@@ -62,7 +68,7 @@ int pthread_mutexattr_init(pthread_mutexattr_t *attr)
  */
 int pthread_mutexattr_getrobust(const pthread_mutexattr_t *attr, int *robust)
 {
-    arch_mutex_attr *pv = (arch_mutex_attr *) attr;
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
     *robust = pv->robust;
     return 0;
 }
@@ -76,7 +82,7 @@ int pthread_mutexattr_getrobust(const pthread_mutexattr_t *attr, int *robust)
  */
 int pthread_mutexattr_setrobust(pthread_mutexattr_t *attr, int robust)
 {
-    arch_mutex_attr *pv = (arch_mutex_attr *) attr;
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
     pv->robust = robust;
     return 0;
 }
@@ -86,11 +92,10 @@ int pthread_mutexattr_setrobust(pthread_mutexattr_t *attr, int robust)
  * @param attr The pointer of the mutex attribute object.
  * @param type The mutex type.
  * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
  */
 int pthread_mutexattr_gettype(const pthread_mutexattr_t *attr, int *type)
 {
-    arch_mutex_attr *pv = (arch_mutex_attr *) attr;
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
     *type = pv->type;
     return 0;
 }
@@ -98,13 +103,18 @@ int pthread_mutexattr_gettype(const pthread_mutexattr_t *attr, int *type)
 /**
  * Set the mutex type attribute.
  * @param attr The pointer of the mutex attribute object.
- * @param type The mutex type.
- * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
+ * @param type The mutex type: PTHREAD_MUTEX_NORMAL, PTHREAD_MUTEX_RECURSIVE,
+ *        PTHREAD_MUTEX_ERRORCHECK or PTHREAD_MUTEX_DEFAULT.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
  */
 int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type)
 {
-    arch_mutex_attr *pv = (arch_mutex_attr *) attr;
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
+
+    if (type < PTHREAD_MUTEX_NORMAL || type > PTHREAD_MUTEX_ERRORCHECK)
+        return EINVAL;
+
     pv->type = type;
     return 0;
 }
@@ -119,7 +129,7 @@ int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type)
  */
 int pthread_mutexattr_getpshared(const pthread_mutexattr_t *attr, int *pshared)
 {
-    arch_mutex_attr *pv = (arch_mutex_attr *) attr;
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
     *pshared = pv->pshared;
     return 0;
 }
@@ -134,7 +144,7 @@ int pthread_mutexattr_getpshared(const pthread_mutexattr_t *attr, int *pshared)
  */
 int pthread_mutexattr_setpshared(pthread_mutexattr_t *attr, int pshared)
 {
-    arch_mutex_attr *pv = (arch_mutex_attr *) attr;
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
     pv->pshared = pshared;
     return 0;
 }
@@ -144,11 +154,10 @@ int pthread_mutexattr_setpshared(pthread_mutexattr_t *attr, int pshared)
  * @param attr The pointer of the mutex attribute object.
  * @param protocol The mutex protocol.
  * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
  */
 int pthread_mutexattr_getprotocol(const pthread_mutexattr_t *attr, int *protocol)
 {
-    arch_mutex_attr *pv = (arch_mutex_attr *) attr;
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
     *protocol = pv->protocol;
     return 0;
 }
@@ -156,13 +165,21 @@ int pthread_mutexattr_getprotocol(const pthread_mutexattr_t *attr, int *protocol
 /**
  * Set the mutex protocol attribute.
  * @param attr The pointer of the mutex attribute object.
- * @param protocol The mutex protocol.
- * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
+ * @param protocol The mutex protocol: PTHREAD_PRIO_NONE (the default),
+ *        PTHREAD_PRIO_INHERIT or PTHREAD_PRIO_PROTECT.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark The owner of a PTHREAD_PRIO_INHERIT mutex runs at least at the
+ *         priority of its highest priority waiter, the owner of a
+ *         PTHREAD_PRIO_PROTECT mutex at least at the prioceiling attribute.
  */
 int pthread_mutexattr_setprotocol(pthread_mutexattr_t *attr, int protocol)
 {
-    arch_mutex_attr *pv = (arch_mutex_attr *) attr;
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
+
+    if (protocol != PTHREAD_PRIO_NONE && protocol != PTHREAD_PRIO_INHERIT && protocol != PTHREAD_PRIO_PROTECT)
+        return EINVAL;
+
     pv->protocol = protocol;
     return 0;
 }
@@ -172,11 +189,10 @@ int pthread_mutexattr_setprotocol(pthread_mutexattr_t *attr, int protocol)
  * @param attr The pointer of the mutex attribute object.
  * @param prioceiling The mutex prioceiling attribute.
  * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
  */
 int pthread_mutexattr_getprioceiling(const pthread_mutexattr_t *attr, int *prioceiling)
 {
-    arch_mutex_attr *pv = (arch_mutex_attr *) attr;
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
     *prioceiling = pv->prioceiling;
     return 0;
 }
@@ -184,17 +200,56 @@ int pthread_mutexattr_getprioceiling(const pthread_mutexattr_t *attr, int *prioc
 /**
  * Set the mutex prioceiling attribute.
  * @param attr The pointer of the mutex attribute object.
- * @param prioceiling The mutex prioceiling attribute.
- * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
+ * @param prioceiling The priority ceiling of PTHREAD_PRIO_PROTECT, from
+ *        sched_get_priority_min(SCHED_FIFO) to sched_get_priority_max(SCHED_FIFO),
+ *        the default.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
  */
 int pthread_mutexattr_setprioceiling(pthread_mutexattr_t *attr, int prioceiling)
 {
-    arch_mutex_attr *pv = (arch_mutex_attr *) attr;
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
+
+    if (prioceiling < sched_get_priority_min(SCHED_FIFO) || prioceiling > sched_get_priority_max(SCHED_FIFO))
+        return EINVAL;
+
     pv->prioceiling = prioceiling;
     return 0;
 }
 
+/**
+ * Get the mutex spin count attribute.
+ * @param attr The pointer of the mutex attribute object.
+ * @param spin_count The fixed spin count, or PTHREAD_MUTEX_SPIN_ADAPTIVE_NP.
+ * @return Always return 0.
+ */
+int pthread_mutexattr_getspin_np(const pthread_mutexattr_t *attr, int *spin_count)
+{
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
+    *spin_count = pv->spin_count;
+    return 0;
+}
+
+/**
+ * Set the mutex spin count attribute.
+ * @param attr The pointer of the mutex attribute object.
+ * @param spin_count The number of times pthread_mutex_lock spins before it
+ *        parks the calling thread, or PTHREAD_MUTEX_SPIN_ADAPTIVE_NP (the
+ *        default) to let each mutex learn it from the observed spin times.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ */
+int pthread_mutexattr_setspin_np(pthread_mutexattr_t *attr, int spin_count)
+{
+    arch_mutex_attr *pv = (arch_mutex_attr *) *attr;
+
+    if (spin_count < PTHREAD_MUTEX_SPIN_ADAPTIVE_NP)
+        return EINVAL;
+
+    pv->spin_count = spin_count;
+    return 0;
+}
+
 /**
  * Destroy a mutex attribute object.
  * @param attr The pointer of the mutex attribute object.
@@ -204,67 +259,542 @@ int pthread_mutexattr_setprioceiling(pthread_mutexattr_t *attr, int prioceiling)
 int pthread_mutexattr_destroy(pthread_mutexattr_t *attr)
 {
     if (attr != NULL) {
-        free(*attr);
+        arch_slab_free(*attr, sizeof(arch_mutex_attr));
         *attr = NULL;
     }
 
     return 0;
 }
 
+extern long libpthread_mutex_spin_max;
+
+#ifdef PTHREAD_MUTEX_INLINE
+
+/* arch_mutex must fit in the storage reserved by pthread.h */
+typedef char arch_mutex_size_check[sizeof(arch_mutex) <= sizeof(pthread_mutex_t) ? 1 : -1];
+
+/* All zero is a valid unlocked mutex, PTHREAD_MUTEX_INITIALIZER needs no work */
+static __inline arch_mutex *arch_mutex_ptr(pthread_mutex_t *m)
+{
+    return (arch_mutex *) m;
+}
+
+#else
+
 static int arch_mutex_init(pthread_mutex_t *m, int lock)
 {
-    int cpu_count = get_ncpu();
-    arch_mutex *pv = calloc(1, sizeof(arch_mutex));
+    arch_mutex *pv = arch_numa_alloc(sizeof(arch_mutex), -1);
     if (pv == NULL)
         return ENOMEM;
 
-    /* see test_speed, about 1/2 the system call*/
-    if (cpu_count > 1) pv->spin_count = 32;
-
     if (!lock) {
         *m = pv;
         return 0;
     }
 
     if (atomic_cmpxchg_ptr(m, pv, NULL) != NULL) {
-        free(pv);
+        arch_numa_free(pv, sizeof(arch_mutex));
     }
 
     return 0;
 }
 
+/* Lazily allocate mutexes initialized with PTHREAD_MUTEX_INITIALIZER */
+static __inline arch_mutex *arch_mutex_ptr(pthread_mutex_t *m)
+{
+    arch_mutex *pv = atomic_read_ptr_acquire((void * volatile *) m);
+
+    if (pv == NULL) {
+        if (arch_mutex_init(m, 1) != 0)
+            return NULL;
+        pv = atomic_read_ptr_acquire((void * volatile *) m);
+    }
+
+    return pv;
+}
+
+#endif
+
+/*
+ * The lock word has three states (Ulrich Drepper, "Futexes Are Tricky"):
+ *   0: unlocked
+ *   1: locked, no waiters
+ *   2: locked, one or more threads may be parked on the word
+ * Lockers that have to park mark the word 2 first, so unlock only needs to
+ * wake when it swaps out a 2.
+ */
+
 static __inline int spin_lock_with_count(volatile long *lock, int count)
 {
     int i = 0;
+    long v;
 
     do {
-        if (atomic_cmpxchg((volatile long *) lock, 1, 0) == 0)
+        if ((v = atomic_read(lock)) == 0 && atomic_cmpxchg_acquire(lock, 1, 0) == 0)
             return 1;
-        cpu_relax();
+        cpu_wait(lock, v);
     } while(++i < count);
 
     return 0;
 }
 
-static __inline void spin_unlock(volatile long *lock)
+/*
+ * Adaptive spinning, similar to glibc PTHREAD_MUTEX_ADAPTIVE_NP: spin_count
+ * is a running average of the spins that were needed to get the lock, and
+ * we allow up to twice of it (plus a little) before parking. A failed spin
+ * means the lock is held for longer than worth spinning, so the average
+ * decays instead, down to a few spins for long critical sections.
+ */
+static __inline int spin_lock_adaptive(arch_mutex *pv)
+{
+    long i = 0, v, count = pv->spin_count, max = count * 2 + 10;
+
+    if (max > libpthread_mutex_spin_max)
+        max = libpthread_mutex_spin_max;
+
+    while (i < max) {
+        if ((v = atomic_read(& pv->lock_status)) == 0 && atomic_cmpxchg_acquire(& pv->lock_status, 1, 0) == 0) {
+            pv->spin_count = count + (i - count) / 8;
+            return 1;
+        }
+        cpu_wait(& pv->lock_status, v);
+        i++;
+    }
+
+    pv->spin_count = count - count / 8;
+    return 0;
+}
+
+static int arch_mutex_lock_slow(arch_mutex *pv)
+{
+    int spun;
+    ARCH_LOCK_STATS(__int64 start = arch_clock_monotonic_ns();)
+
+    if (pv->spin_fixed)
+        spun = spin_lock_with_count(& pv->lock_status, pv->spin_count);
+    else
+        spun = spin_lock_adaptive(pv);
+
+    if (spun) {
+        ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_MUTEX_NP, ARCH_LOCK_SPIN, start));
+        return 0;
+    }
+
+    /* Whoever we got it from, there may be others parked behind us */
+    if (atomic_xchg_acquire(& pv->lock_status, 2) != 0) {
+        if (arch_trace_enabled(ARCH_TRACE_MUTEX))
+            arch_trace(ARCH_TRACE_MUTEX_WAIT_START, (uintptr_t) pv, 0, 0, 0);
+        do {
+            (void) arch_wait_on_address(& pv->lock_status, 2, INFINITE);
+        } while (atomic_xchg_acquire(& pv->lock_status, 2) != 0);
+        if (arch_trace_enabled(ARCH_TRACE_MUTEX))
+            arch_trace(ARCH_TRACE_MUTEX_WAIT_STOP, (uintptr_t) pv, 0, 0, 0);
+    }
+
+    ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_MUTEX_NP, ARCH_LOCK_PARK, start));
+    return 0;
+}
+
+static __inline int arch_mutex_lock_normal(arch_mutex *pv)
+{
+    if (atomic_cmpxchg_acquire(& pv->lock_status, 1, 0) == 0) {
+        ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_MUTEX_NP, ARCH_LOCK_FAST, 0));
+        return 0;
+    }
+
+    return arch_mutex_lock_slow(pv);
+}
+
+static __inline int arch_mutex_trylock_normal(arch_mutex *pv)
+{
+    if (atomic_cmpxchg_acquire(& pv->lock_status, 1, 0) == 0) {
+        ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_MUTEX_NP, ARCH_LOCK_FAST, 0));
+        return 0;
+    }
+
+    return EBUSY;
+}
+
+static __inline int arch_mutex_unlock_normal(arch_mutex *pv)
+{
+    long old;
+
+    ARCH_LOCK_STATS(arch_lock_stats_released(pv));
+
+    /* The old value tells if anyone parked, no load of another word follows */
+    old = atomic_xchg_release(& pv->lock_status, 0);
+    cpu_wake();
+
+    if (old == 2) {
+        if (arch_trace_enabled(ARCH_TRACE_MUTEX))
+            arch_trace(ARCH_TRACE_MUTEX_WAKE, (uintptr_t) pv, 0, 0, 0);
+        arch_wake_by_address_single(& pv->lock_status);
+    }
+
+    return 0;
+}
+
+/*
+ * PTHREAD_MUTEX_RECURSIVE and PTHREAD_MUTEX_ERRORCHECK track the owner thread,
+ * they are dispatched through arch_mutex_ops so the PTHREAD_MUTEX_NORMAL path
+ * only pays for one predictable branch on the type.
+ */
+
+static int arch_mutex_lock_recursive(arch_mutex *pv)
+{
+    long tid = (long) GetCurrentThreadId();
+
+    if (atomic_read(& pv->owner) == tid) {
+        if (pv->count == LONG_MAX)
+            return EAGAIN;
+        pv->count++;
+        return 0;
+    }
+
+    (void) arch_mutex_lock_normal(pv);
+    atomic_set(& pv->owner, tid);
+    pv->count = 1;
+    return 0;
+}
+
+static int arch_mutex_trylock_recursive(arch_mutex *pv)
+{
+    long tid = (long) GetCurrentThreadId();
+
+    if (atomic_read(& pv->owner) == tid) {
+        if (pv->count == LONG_MAX)
+            return EAGAIN;
+        pv->count++;
+        return 0;
+    }
+
+    if (arch_mutex_trylock_normal(pv) != 0)
+        return EBUSY;
+
+    atomic_set(& pv->owner, tid);
+    pv->count = 1;
+    return 0;
+}
+
+static int arch_mutex_unlock_recursive(arch_mutex *pv)
+{
+    if (atomic_read(& pv->owner) != (long) GetCurrentThreadId())
+        return EPERM;
+
+    if (--pv->count > 0)
+        return 0;
+
+    atomic_set(& pv->owner, 0);
+    return arch_mutex_unlock_normal(pv);
+}
+
+static int arch_mutex_lock_errorcheck(arch_mutex *pv)
+{
+    long tid = (long) GetCurrentThreadId();
+
+    if (atomic_read(& pv->owner) == tid)
+        return EDEADLK;
+
+    (void) arch_mutex_lock_normal(pv);
+    atomic_set(& pv->owner, tid);
+    return 0;
+}
+
+static int arch_mutex_trylock_errorcheck(arch_mutex *pv)
+{
+    if (arch_mutex_trylock_normal(pv) != 0)
+        return EBUSY;
+
+    atomic_set(& pv->owner, (long) GetCurrentThreadId());
+    return 0;
+}
+
+static int arch_mutex_unlock_errorcheck(arch_mutex *pv)
+{
+    if (atomic_read(& pv->owner) != (long) GetCurrentThreadId())
+        return EPERM;
+
+    atomic_set(& pv->owner, 0);
+    return arch_mutex_unlock_normal(pv);
+}
+
+/*
+ * PTHREAD_PRIO_INHERIT and PTHREAD_PRIO_PROTECT mutexes have the type
+ * ARCH_MUTEX_PROTOCOL, their own type is in kind. The owner links them
+ * into the pi_held list of its pthread_t, and runs at the highest of its
+ * base priority, the ceilings of its PTHREAD_PRIO_PROTECT mutexes and the
+ * boosts of its PTHREAD_PRIO_INHERIT mutexes.
+ *
+ * A PTHREAD_PRIO_INHERIT locker that has to park first raises the boost
+ * of the mutex to its own priority, and the priority of the holder with
+ * it. Unlock drops the boost and wakes all the waiters, so the ones still
+ * waiting raise the boost of the next owner again. The boost is not
+ * passed on to the owner of a mutex the holder itself waits for.
+ *
+ * Lock order: the pi_lock of the mutex, then the pi_lock of its holder.
+ * Priorities are compared as Windows thread priorities.
+ */
+
+#define MUTEX_NO_BOOST      (THREAD_PRIORITY_IDLE - 1)
+
+/* Set the priority the held mutexes ask for, with t->pi_lock held */
+static void arch_mutex_pi_update(arch_thread_info *t)
 {
-    *lock = 0;
+    int prio = t->pi_base, p;
+    arch_mutex *m;
+
+    for (m = t->pi_held; m != NULL; m = m->held_next) {
+        if (m->protocol == PTHREAD_PRIO_PROTECT)
+            p = sched_priority_to_os_priority((int) m->ceiling);
+        else
+            p = (int) atomic_read(& m->boost);
+        if (p > prio)
+            prio = p;
+    }
+
+    /* t->handle is NULL or closed once t is detached, t->pi_handle is not */
+    if (prio != t->pi_prio && SetThreadPriority(t == arch_tls_get(libpthread_tls_index)
+            ? GetCurrentThread() : t->pi_handle, prio))
+        t->pi_prio = prio;
 }
 
-static __inline void arch_mutex_init_handle(HANDLE *sync)
+/**
+ * Set the base priority of a thread that may hold protocol mutexes.
+ * @param  pv The thread.
+ * @param  priority The OS priority.
+ * @return 1 if the thread holds protocol mutexes and runs at the priority
+ *         they ask for now, 0 if it holds none and the caller sets it.
+ */
+int arch_mutex_pi_setprio(arch_thread_info *pv, int priority)
 {
-    HANDLE handle;
+    int held;
 
-    while (*sync == NULL) {
-        handle = CreateEvent(NULL, FALSE, FALSE, NULL);
-        if (handle != NULL) {
-            if (atomic_cmpxchg_ptr(sync, handle, NULL) != NULL)
-                (void) CloseHandle(handle);
-            return;
-        } else {
-            (void) SleepEx(1000, TRUE); /* Waiting for resources available */
+    arch_spin_lock(& pv->pi_lock);
+    if ((held = pv->pi_held != NULL) != 0) {
+        pv->pi_base = priority;
+        arch_mutex_pi_update(pv);
+    }
+    arch_spin_unlock(& pv->pi_lock);
+
+    return held;
+}
+
+/* Make the calling thread the holder of a locked protocol mutex */
+static void arch_mutex_pi_acquired(arch_mutex *pv, arch_thread_info *self)
+{
+    arch_spin_lock(& pv->pi_lock);
+    arch_spin_lock(& self->pi_lock);
+
+    if (self->pi_held == NULL)
+        self->pi_base = self->pi_prio = GetThreadPriority(GetCurrentThread());
+    if (self->pi_handle == NULL) /* for the waiters which boost us */
+        self->pi_handle = OpenThread(THREAD_SET_INFORMATION | THREAD_QUERY_INFORMATION, FALSE, GetCurrentThreadId());
+    pv->held_next = self->pi_held;
+    self->pi_held = pv;
+    pv->holder = self;
+    arch_mutex_pi_update(self);
+
+    arch_spin_unlock(& self->pi_lock);
+    arch_spin_unlock(& pv->pi_lock);
+}
+
+/* Take a protocol mutex out of the pi_held list of its holder, before it is unlocked */
+static void arch_mutex_pi_release(arch_mutex *pv, arch_thread_info *self)
+{
+    arch_mutex **pp;
+
+    arch_spin_lock(& pv->pi_lock);
+    arch_spin_lock(& self->pi_lock);
+
+    for (pp = & self->pi_held; *pp != NULL; pp = & (*pp)->held_next) {
+        if (*pp == pv) {
+            *pp = pv->held_next;
+            break;
         }
     }
+    pv->held_next = NULL;
+    pv->holder = NULL;
+    atomic_set(& pv->boost, MUTEX_NO_BOOST);
+
+    arch_spin_unlock(& self->pi_lock);
+    arch_spin_unlock(& pv->pi_lock);
+}
+
+/* Raise the boost of a PTHREAD_PRIO_INHERIT mutex to the priority of the calling thread */
+static void arch_mutex_pi_inherit(arch_mutex *pv)
+{
+    int prio = GetThreadPriority(GetCurrentThread());
+    arch_thread_info *t;
+
+    arch_spin_lock(& pv->pi_lock);
+    if (prio > pv->boost) {
+        atomic_set(& pv->boost, prio);
+        if ((t = pv->holder) != NULL) {
+            arch_spin_lock(& t->pi_lock);
+            arch_mutex_pi_update(t);
+            arch_spin_unlock(& t->pi_lock);
+        }
+    }
+    arch_spin_unlock(& pv->pi_lock);
+}
+
+static int arch_mutex_lock_inherit(arch_mutex *pv)
+{
+    ARCH_LOCK_STATS(__int64 start = arch_clock_monotonic_ns();)
+
+    if (atomic_cmpxchg_acquire(& pv->lock_status, 1, 0) == 0) {
+        ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_MUTEX_NP, ARCH_LOCK_FAST, 0));
+        return 0;
+    }
+
+    /* No spinning, the holder may be a lower priority thread we keep from running */
+    if (arch_trace_enabled(ARCH_TRACE_MUTEX))
+        arch_trace(ARCH_TRACE_MUTEX_WAIT_START, (uintptr_t) pv, 0, 0, 0);
+    while (atomic_xchg_acquire(& pv->lock_status, 2) != 0) {
+        arch_mutex_pi_inherit(pv);
+        (void) arch_wait_on_address(& pv->lock_status, 2, INFINITE);
+    }
+    if (arch_trace_enabled(ARCH_TRACE_MUTEX))
+        arch_trace(ARCH_TRACE_MUTEX_WAIT_STOP, (uintptr_t) pv, 0, 0, 0);
+
+    ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_MUTEX_NP, ARCH_LOCK_PARK, start));
+    return 0;
+}
+
+static int arch_mutex_unlock_inherit(arch_mutex *pv)
+{
+    long old;
+
+    ARCH_LOCK_STATS(arch_lock_stats_released(pv));
+
+    old = atomic_xchg_release(& pv->lock_status, 0);
+    cpu_wake();
+
+    /* Every waiter boosts the next owner again */
+    if (old == 2) {
+        if (arch_trace_enabled(ARCH_TRACE_MUTEX))
+            arch_trace(ARCH_TRACE_MUTEX_WAKE, (uintptr_t) pv, 0, 0, 0);
+        arch_wake_by_address_all(& pv->lock_status);
+    }
+
+    return 0;
+}
+
+/* Recursion and deadlock checks of the kind of a protocol mutex, -1 if the thread must lock it */
+static __inline int arch_mutex_protocol_owned(arch_mutex *pv, long tid)
+{
+    if (atomic_read(& pv->owner) != tid)
+        return -1;
+
+    if (pv->kind == PTHREAD_MUTEX_RECURSIVE) {
+        if (pv->count == LONG_MAX)
+            return EAGAIN;
+        pv->count++;
+        return 0;
+    }
+
+    return pv->kind == PTHREAD_MUTEX_ERRORCHECK ? EDEADLK : -1;
+}
+
+static int arch_mutex_lock_protocol_common(arch_mutex *pv, int try)
+{
+    int rc;
+    long tid = (long) GetCurrentThreadId();
+    arch_thread_info *self;
+
+    if ((rc = arch_mutex_protocol_owned(pv, tid)) >= 0)
+        return rc;
+
+    if ((self = (arch_thread_info *) pthread_self()) == NULL)
+        return ENOMEM;
+
+    /* A thread above the ceiling would break the protocol for the others */
+    if (pv->protocol == PTHREAD_PRIO_PROTECT &&
+        (self->pi_held != NULL ? self->pi_base : GetThreadPriority(GetCurrentThread())) >
+        sched_priority_to_os_priority((int) pv->ceiling))
+        return EINVAL;
+
+    if (try) {
+        if (arch_mutex_trylock_normal(pv) != 0)
+            return EBUSY;
+    } else if (pv->protocol == PTHREAD_PRIO_INHERIT) {
+        (void) arch_mutex_lock_inherit(pv);
+    } else {
+        (void) arch_mutex_lock_normal(pv);
+    }
+
+    arch_mutex_pi_acquired(pv, self);
+    atomic_set(& pv->owner, tid);
+    pv->count = 1;
+    return 0;
+}
+
+static int arch_mutex_lock_protocol(arch_mutex *pv)
+{
+    return arch_mutex_lock_protocol_common(pv, 0);
+}
+
+static int arch_mutex_trylock_protocol(arch_mutex *pv)
+{
+    return arch_mutex_lock_protocol_common(pv, 1);
+}
+
+static int arch_mutex_unlock_protocol(arch_mutex *pv)
+{
+    arch_thread_info *self = pv->holder;
+
+    if (atomic_read(& pv->owner) != (long) GetCurrentThreadId())
+        return EPERM;
+
+    if (pv->kind == PTHREAD_MUTEX_RECURSIVE && --pv->count > 0)
+        return 0;
+
+    atomic_set(& pv->owner, 0);
+    arch_mutex_pi_release(pv, self);
+
+    if (pv->protocol == PTHREAD_PRIO_INHERIT)
+        (void) arch_mutex_unlock_inherit(pv);
+    else
+        (void) arch_mutex_unlock_normal(pv);
+
+    /* Only drop the priority once the mutex is free, or we are preempted holding it */
+    arch_spin_lock(& self->pi_lock);
+    arch_mutex_pi_update(self);
+    arch_spin_unlock(& self->pi_lock);
+
+    return 0;
+}
+
+typedef struct {
+    int (* lock)(arch_mutex *pv);
+    int (* trylock)(arch_mutex *pv);
+    int (* unlock)(arch_mutex *pv);
+} arch_mutex_ops;
+
+/* Indexed by type, PTHREAD_MUTEX_NORMAL never goes through the table */
+static const arch_mutex_ops arch_mutex_type_ops[] = {
+    {NULL, NULL, NULL},
+    {arch_mutex_lock_recursive, arch_mutex_trylock_recursive, arch_mutex_unlock_recursive},
+    {arch_mutex_lock_errorcheck, arch_mutex_trylock_errorcheck, arch_mutex_unlock_errorcheck},
+    {arch_mutex_lock_protocol, arch_mutex_trylock_protocol, arch_mutex_unlock_protocol}
+};
+
+static void arch_mutex_init_attr(arch_mutex *pv, const arch_mutex_attr *attr)
+{
+    pv->type = attr->type;
+
+    if (attr->protocol != PTHREAD_PRIO_NONE) {
+        pv->type = ARCH_MUTEX_PROTOCOL;
+        pv->kind = attr->type;
+        pv->protocol = attr->protocol;
+        pv->ceiling = attr->prioceiling;
+        pv->boost = MUTEX_NO_BOOST;
+    }
+
+    if (attr->spin_count != PTHREAD_MUTEX_SPIN_ADAPTIVE_NP) {
+        pv->spin_fixed = 1;
+        pv->spin_count = attr->spin_count;
+    }
 }
 
 /**
@@ -279,34 +809,86 @@ static __inline void arch_mutex_init_handle(HANDLE *sync)
  */
 int pthread_mutex_init(pthread_mutex_t *m, const pthread_mutexattr_t *a)
 {
+#ifdef PTHREAD_MUTEX_INLINE
+    memset(m, 0, sizeof(pthread_mutex_t));
+#else
+    int rc;
+
     *m = NULL;
-    return arch_mutex_init(m, 0);
+    if ((rc = arch_mutex_init(m, 0)) != 0)
+        return rc;
+#endif
+
+    if (a != NULL && *a != NULL)
+        arch_mutex_init_attr(arch_mutex_ptr(m), (const arch_mutex_attr *) *a);
+
+    ARCH_LOCK_STATS(arch_lock_stats_init(arch_mutex_ptr(m), PTHREAD_LOCK_MUTEX_NP, ARCH_RETURN_ADDRESS()));
+    return 0;
 }
 
 /**
- * Get the mutex prioceiling attribute.
+ * Get the priority ceiling of a mutex.
  * @param mutex The pointer of the mutex object.
- * @param prioceiling The mutex prioceiling attribute.
- * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
+ * @param prioceiling The priority ceiling.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned if the mutex is not PTHREAD_PRIO_PROTECT,
+ *         or ENOMEM returned to indicate the error.
  */
 int pthread_mutex_getprioceiling(const pthread_mutex_t *mutex, int *prioceiling)
 {
-    *prioceiling = 0;
+    arch_mutex *pv = arch_mutex_ptr((pthread_mutex_t *) mutex);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    if (pv->type != ARCH_MUTEX_PROTOCOL || pv->protocol != PTHREAD_PRIO_PROTECT)
+        return EINVAL;
+
+    *prioceiling = (int) pv->ceiling;
     return 0;
 }
 
 /**
- * Set the mutex prioceiling attribute.
+ * Change the priority ceiling of a mutex.
  * @param mutex The pointer of the mutex object.
- * @param prioceiling The new mutex prioceiling attribute.
- * @param old_ceiling The old mutex prioceiling attribute.
- * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
+ * @param prioceiling The new priority ceiling.
+ * @param old_ceiling The pointer that receives the old priority ceiling, or NULL.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned if the mutex is not PTHREAD_PRIO_PROTECT
+ *         or the ceiling is out of range, or ENOMEM returned to indicate the error.
+ * @remark It waits for the mutex to be free, without the ceiling check of
+ *         pthread_mutex_lock, unless the calling thread owns it. An owner
+ *         is moved to the new ceiling at once.
  */
 int pthread_mutex_setprioceiling(pthread_mutex_t *mutex, int prioceiling, int *old_ceiling)
 {
-    *old_ceiling = 0;
+    arch_mutex *pv = arch_mutex_ptr(mutex);
+    arch_thread_info *self;
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    if (pv->type != ARCH_MUTEX_PROTOCOL || pv->protocol != PTHREAD_PRIO_PROTECT ||
+        prioceiling < sched_get_priority_min(SCHED_FIFO) || prioceiling > sched_get_priority_max(SCHED_FIFO))
+        return EINVAL;
+
+    if (atomic_read(& pv->owner) == (long) GetCurrentThreadId()) {
+        self = pv->holder;
+        arch_spin_lock(& self->pi_lock);
+        if (old_ceiling != NULL)
+            *old_ceiling = (int) pv->ceiling;
+        pv->ceiling = prioceiling;
+        arch_mutex_pi_update(self);
+        arch_spin_unlock(& self->pi_lock);
+        return 0;
+    }
+
+    (void) arch_mutex_lock_normal(pv);
+    if (old_ceiling != NULL)
+        *old_ceiling = (int) pv->ceiling;
+    pv->ceiling = prioceiling;
+    (void) arch_mutex_unlock_normal(pv);
+
     return 0;
 }
 
@@ -326,40 +908,19 @@ int pthread_mutex_consistent(pthread_mutex_t *mutex)
  * @param m The pointer of the mutex object.
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
- *         with errno set to indicate the error (ENOMEM, EDEADLK).
+ *         with errno set to indicate the error (ENOMEM, EDEADLK or EAGAIN).
  */
 int pthread_mutex_lock(pthread_mutex_t *m)
 {
-    arch_mutex *pv;
-
-    if (*m == NULL) {
-        int rc = arch_mutex_init(m, 1);
-        if (rc != 0) return rc;
-    }
+    arch_mutex *pv = arch_mutex_ptr(m);
 
-    pv = (arch_mutex *) *m;
-
-    while(1) {
-        if (spin_lock_with_count(& pv->lock_status, pv->spin_count)) {
-            /* pv->thread_id = GetCurrentThreadId(); */
-            return 0;
-        }
+    if (pv == NULL)
+        return ENOMEM;
 
-        if (pv->sync == NULL)
-            arch_mutex_init_handle(& pv->sync);
+    if (pv->type != PTHREAD_MUTEX_NORMAL)
+        return arch_mutex_type_ops[pv->type].lock(pv);
 
-        (void) atomic_fetch_and_add(& pv->wait, 1);
-        /* Small probability event, but we must examine it. */
-        if (atomic_cmpxchg((volatile long *) & pv->lock_status, 1, 0) == 0) {
-            /* pv->thread_id = GetCurrentThreadId(); */
-            (void) atomic_fetch_and_add(& pv->wait, -1);
-            return 0;
-        }
-        (void) WaitForSingleObject(pv->sync, INFINITE);
-        (void) atomic_fetch_and_add(& pv->wait, -1);
-    }
-
-    return 0;
+    return arch_mutex_lock_normal(pv);
 }
 
 /**
@@ -367,25 +928,19 @@ int pthread_mutex_lock(pthread_mutex_t *m)
  * @param m The pointer of the mutex object.
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
- *         with errno set to indicate the error (ENOMEM or EBUSY).
+ *         with errno set to indicate the error (ENOMEM, EBUSY or EAGAIN).
  */
 int pthread_mutex_trylock(pthread_mutex_t *m)
 {
-    arch_mutex *pv;
+    arch_mutex *pv = arch_mutex_ptr(m);
 
-    if (*m == NULL) {
-        int rc = arch_mutex_init(m, 1);
-        if (rc != 0) return rc;
-    }
-
-    pv = (arch_mutex *) *m;
+    if (pv == NULL)
+        return ENOMEM;
 
-    if (spin_lock_with_count(& pv->lock_status, pv->spin_count)) {
-        /* pv->thread_id = GetCurrentThreadId(); */
-        return 0;
-    }
+    if (pv->type != PTHREAD_MUTEX_NORMAL)
+        return arch_mutex_type_ops[pv->type].trylock(pv);
 
-    return EBUSY;
+    return arch_mutex_trylock_normal(pv);
 }
 
 /**
@@ -393,17 +948,20 @@ int pthread_mutex_trylock(pthread_mutex_t *m)
  * @param m The pointer of the mutex object.
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
- *         with errno set to indicate the error (EINVAL).
+ *         with errno set to indicate the error (EINVAL, EPERM).
  */
 int pthread_mutex_unlock(pthread_mutex_t *m)
 {
+#ifdef PTHREAD_MUTEX_INLINE
+    arch_mutex *pv = (arch_mutex *) m;
+#else
     arch_mutex *pv = (arch_mutex *) *m;
+#endif
     if (pv != NULL) {
-        /* pv->thread_id = 0; */
-        atomic_set(& pv->lock_status, 0);
-        if (atomic_read(& pv->wait))
-            SetEvent(pv->sync);
-        return 0;
+        if (pv->type != PTHREAD_MUTEX_NORMAL)
+            return arch_mutex_type_ops[pv->type].unlock(pv);
+
+        return arch_mutex_unlock_normal(pv);
     }
 
     return EINVAL;
@@ -416,11 +974,15 @@ int pthread_mutex_unlock(pthread_mutex_t *m)
  */
 int pthread_mutex_destroy(pthread_mutex_t *m)
 {
+#ifdef PTHREAD_MUTEX_INLINE
+    ARCH_LOCK_STATS(arch_lock_stats_destroy(m));
+#else
     arch_mutex *pv = (arch_mutex *) *m;
     if (pv != NULL) {
-        if (pv->sync != NULL) CloseHandle(pv->sync);
-        free(pv);
+        ARCH_LOCK_STATS(arch_lock_stats_destroy(pv));
+        arch_numa_free(pv, sizeof(arch_mutex));
     }
+#endif
 
     return 0;
 }
@@ -27,8 +27,156 @@
 
 #include <winsock2.h>
 
+#include "arch.h"
 #include "misc.h"
 
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION   0x00000002
+#endif
+
+/*
+ * A sleep waits on a high-resolution waitable timer (Windows 10 1803 or
+ * later) cached per thread, armed ARCH_SLEEP_SPIN_NS before the deadline,
+ * and spins on the performance counter for the rest. Without such timers,
+ * it falls back to SleepEx, rounded up to whole milli-seconds.
+ */
+#define ARCH_SLEEP_SPIN_NS  20000
+
+typedef HANDLE (WINAPI *create_waitable_timer_ex_t)(LPSECURITY_ATTRIBUTES, LPCWSTR, DWORD, DWORD);
+
+static create_waitable_timer_ex_t create_waitable_timer_ex;
+static DWORD timer_tls_index = TLS_OUT_OF_INDEXES;
+
+/**
+ * Resolve the high-resolution timers, and allocate the TLS slot of them.
+ * @return Always 1, sleeps fall back to SleepEx without the timers.
+ * @remark Internal routine, called by libpthread_init.
+ */
+int arch_sleep_init(void)
+{
+    HMODULE h = GetModuleHandleA("kernel32.dll");
+
+    if (h != NULL && (timer_tls_index = TlsAlloc()) != TLS_OUT_OF_INDEXES)
+        create_waitable_timer_ex = (create_waitable_timer_ex_t) GetProcAddress(h, "CreateWaitableTimerExW");
+
+    return 1;
+}
+
+/**
+ * Close the timer of the calling thread.
+ * @remark Internal routine, called on DLL_THREAD_DETACH.
+ */
+void arch_sleep_thread_fini(void)
+{
+    HANDLE timer;
+
+    if (timer_tls_index != TLS_OUT_OF_INDEXES && (timer = TlsGetValue(timer_tls_index)) != NULL) {
+        TlsSetValue(timer_tls_index, NULL);
+        CloseHandle(timer);
+    }
+}
+
+/**
+ * Free the TLS slot of the timers.
+ * @remark Internal routine, called by libpthread_fini.
+ */
+void arch_sleep_fini(void)
+{
+    arch_sleep_thread_fini();
+    if (timer_tls_index != TLS_OUT_OF_INDEXES) {
+        TlsFree(timer_tls_index);
+        timer_tls_index = TLS_OUT_OF_INDEXES;
+    }
+}
+
+/**
+ * Get the high-resolution timer of the calling thread.
+ * @return The timer, or NULL if high-resolution timers are not supported.
+ * @remark Internal routine, the timer is closed on DLL_THREAD_DETACH.
+ */
+HANDLE arch_sleep_timer(void)
+{
+    HANDLE timer;
+
+    if (create_waitable_timer_ex == NULL)
+        return NULL;
+
+    if ((timer = TlsGetValue(timer_tls_index)) == NULL) {
+        timer = create_waitable_timer_ex(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (timer == NULL) {
+            /* Not supported before Windows 10 1803 */
+            if (GetLastError() == ERROR_INVALID_PARAMETER)
+                create_waitable_timer_ex = NULL;
+            return NULL;
+        }
+        TlsSetValue(timer_tls_index, timer);
+    }
+
+    return timer;
+}
+
+/**
+ * Sleep until a deadline of CLOCK_MONOTONIC.
+ * @param  deadline The deadline in ns, see arch_clock_monotonic_ns.
+ * @return 0, or EINTR if an APC was run.
+ * @remark Internal routine of nanosleep and clock_nanosleep.
+ */
+int arch_sleep_until(__int64 deadline)
+{
+    __int64 left;
+    LARGE_INTEGER due;
+    HANDLE timer = arch_sleep_timer();
+
+    while ((left = deadline - arch_clock_monotonic_ns()) > ARCH_SLEEP_SPIN_NS) {
+        if (timer != NULL) {
+            due.QuadPart = -((left - ARCH_SLEEP_SPIN_NS) / 100);
+            if (due.QuadPart == 0)
+                break;
+            if (SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE) != 0) {
+                if (WaitForSingleObjectEx(timer, INFINITE, TRUE) == WAIT_IO_COMPLETION)
+                    return EINTR;
+                continue;
+            }
+            timer = NULL;
+        }
+
+        left = (left + POW10_6 - 1) / POW10_6;
+        if (SleepEx(left >= MAX_SLEEP_IN_MS ? MAX_SLEEP_IN_MS : (DWORD) left, TRUE) != 0)
+            return EINTR; /* WAIT_IO_COMPLETION (192) */
+    }
+
+    while (arch_clock_monotonic_ns() < deadline)
+        cpu_relax();
+
+    return 0;
+}
+
+/**
+ * Sleep until an absolute time of CLOCK_REALTIME.
+ * @param  t The absolute time.
+ * @return 0, or EINTR if an APC was run.
+ * @remark Internal routine of clock_nanosleep, the timer is armed with the
+ *         absolute due time so that the sleep follows the changes of the
+ *         system time.
+ */
+int arch_sleep_until_realtime(const struct timespec *t)
+{
+    DWORD ms;
+    LARGE_INTEGER due;
+    HANDLE timer = arch_sleep_timer();
+
+    due.QuadPart = t->tv_sec * POW10_7 + (t->tv_nsec + 99) / 100 + DELTA_EPOCH_IN_100NS;
+    if (timer != NULL && due.QuadPart > 0 && SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE) != 0)
+        return WaitForSingleObjectEx(timer, INFINITE, TRUE) == WAIT_IO_COMPLETION ? EINTR : 0;
+
+    while ((ms = arch_timeout_in_ms(CLOCK_REALTIME, t)) != 0) {
+        if (SleepEx(ms, TRUE) != 0)
+            return EINTR;
+    }
+
+    return 0;
+}
+
 /**
  * Sleep for the specified time.
  * @param  request The desired amount of time to sleep.
@@ -39,40 +187,24 @@
  */
 int nanosleep(const struct timespec *request, struct timespec *remain)
 {
-    unsigned long ms, rc = 0;
-    unsigned __int64 u64, want, real;
-
-    union {
-        unsigned __int64 ns100;
-        FILETIME ft;
-    }  _start, _end;
+    __int64 deadline, left;
 
     if (request->tv_sec < 0 || request->tv_nsec < 0 || request->tv_nsec >= POW10_9) {
         errno = EINVAL;
         return -1;
     }
 
-    if (remain != NULL) GetSystemTimeAsFileTime(&_start.ft);
-
-    want = u64 = request->tv_sec * POW10_3 + request->tv_nsec / POW10_6;
-    while (u64 > 0 && rc == 0) {
-        if (u64 >= MAX_SLEEP_IN_MS) ms = MAX_SLEEP_IN_MS;
-        else ms = (unsigned long) u64;
-
-        u64 -= ms;
-        rc = SleepEx(ms, TRUE);
-    }
-
-    if (rc != 0) { /* WAIT_IO_COMPLETION (192) */
+    if (request->tv_sec >= MAX_SLEEP_IN_SEC)
+        deadline = arch_clock_monotonic_ns() + MAX_SLEEP_IN_SEC * POW10_9;
+    else
+        deadline = arch_clock_monotonic_ns() + request->tv_sec * POW10_9 + request->tv_nsec;
+    if (arch_sleep_until(deadline) != 0) {
         if (remain != NULL) {
-            GetSystemTimeAsFileTime(&_end.ft);
-            real = (_end.ns100 - _start.ns100) / POW10_4;
-
-            if (real >= want) u64 = 0;
-            else u64 = want - real;
+            if ((left = deadline - arch_clock_monotonic_ns()) < 0)
+                left = 0;
 
-            remain->tv_sec = u64 / POW10_3;
-            remain->tv_nsec = (long) (u64 % POW10_3) * POW10_6;
+            remain->tv_sec = left / POW10_9;
+            remain->tv_nsec = (long) (left % POW10_9);
         }
 
         errno = EINTR;
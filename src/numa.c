@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file numa.c
+ * @brief Implementation Code of NUMA Topology Routines and Node-local Allocation
+ */
+
+#include <pthread.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * Control blocks of the library are carved from 64 KB chunks committed on
+ * one NUMA node with VirtualAllocExNuma, so a lock lives on the node of the
+ * thread which created it. A chunk serves one size class and its first
+ * cache line records the node and the class. Chunks are aligned to the
+ * allocation granularity of VirtualAlloc, the header of a block is found
+ * by masking its address.
+ *
+ * The free blocks of a node are kept in lock-free SLISTs, one per class,
+ * and every thread caches up to NUMA_CACHE_MAX blocks per class of its own
+ * node in front of them, so most allocations and frees touch no shared
+ * cache line. The caches are flushed when their thread exits.
+ */
+
+#define NUMA_CHUNK_SIZE     65536
+#define NUMA_MIN_SIZE       32
+#define NUMA_CLASSES        5 /* 32, 64, 128, 256 and 512 bytes */
+#define NUMA_MAX_SIZE       (NUMA_MIN_SIZE << (NUMA_CLASSES - 1))
+
+#define NUMA_CACHE_MAX      32 /* blocks of a class cached by a thread */
+#define NUMA_CACHE_BATCH    16 /* blocks moved between a cache and the arena at once */
+
+typedef struct numa_chunk {
+    long node;
+    long cls;
+    struct numa_chunk *next; /* all chunks of the arena */
+} numa_chunk;
+
+#if defined(_MSC_VER)
+typedef __declspec(align(64)) struct {
+#else
+typedef struct {
+#endif
+    SLIST_HEADER free[NUMA_CLASSES];
+    long lock; /* arch_spin_lock of growing the arena */
+    numa_chunk *chunks;
+#if defined(_MSC_VER)
+} numa_arena;
+#else
+} __attribute__((aligned(64))) numa_arena;
+#endif
+
+typedef struct {
+    long node;
+    long count[NUMA_CLASSES];
+    PSLIST_ENTRY head[NUMA_CLASSES];
+} numa_cache;
+
+static numa_arena arenas[ARCH_NUMA_NODES];
+static DWORD numa_tls_index = TLS_OUT_OF_INDEXES;
+
+typedef VOID (WINAPI *get_current_processor_number_ex_t)(PPROCESSOR_NUMBER);
+typedef BOOL (WINAPI *get_numa_processor_node_ex_t)(PPROCESSOR_NUMBER, PUSHORT);
+typedef BOOL (WINAPI *get_numa_node_processor_mask_ex_t)(USHORT, PGROUP_AFFINITY);
+typedef LPVOID (WINAPI *virtual_alloc_ex_numa_t)(HANDLE, LPVOID, SIZE_T, DWORD, DWORD, DWORD);
+
+static long numa_resolved;
+static get_current_processor_number_ex_t get_current_processor_number_ex;
+static get_numa_processor_node_ex_t get_numa_processor_node_ex;
+static get_numa_node_processor_mask_ex_t get_numa_node_processor_mask_ex;
+static virtual_alloc_ex_numa_t virtual_alloc_ex_numa;
+
+static void arch_numa_resolve(void)
+{
+    HMODULE h;
+
+    if (atomic_read_acquire(& numa_resolved))
+        return;
+
+    if ((h = GetModuleHandleA("kernel32.dll")) != NULL) {
+        get_current_processor_number_ex = (get_current_processor_number_ex_t) GetProcAddress(h, "GetCurrentProcessorNumberEx");
+        get_numa_processor_node_ex = (get_numa_processor_node_ex_t) GetProcAddress(h, "GetNumaProcessorNodeEx");
+        get_numa_node_processor_mask_ex = (get_numa_node_processor_mask_ex_t) GetProcAddress(h, "GetNumaNodeProcessorMaskEx");
+        virtual_alloc_ex_numa = (virtual_alloc_ex_numa_t) GetProcAddress(h, "VirtualAllocExNuma");
+    }
+
+    atomic_set_release(& numa_resolved, 1);
+}
+
+/* The NUMA node of the current processor, 0 if unknown (Windows 7 or later) */
+int arch_numa_node(void)
+{
+    USHORT node;
+    PROCESSOR_NUMBER pn;
+
+    arch_numa_resolve();
+
+    if (get_current_processor_number_ex == NULL || get_numa_processor_node_ex == NULL)
+        return 0;
+
+    get_current_processor_number_ex(&pn);
+    if (!get_numa_processor_node_ex(&pn, &node))
+        return 0;
+
+    return node;
+}
+
+/**
+ * Get the NUMA node the calling thread is running on.
+ * @return The NUMA node number, 0 if it is unknown (before Windows 7).
+ */
+int sched_getnode_np(void)
+{
+    return arch_numa_node();
+}
+
+/**
+ * Get the number of NUMA nodes.
+ * @return The highest NUMA node number plus one, at least 1.
+ */
+int sched_numa_nodes_np(void)
+{
+    ULONG highest;
+
+    if (!GetNumaHighestNodeNumber(&highest))
+        return 1;
+
+    return (int) highest + 1;
+}
+
+/**
+ * Get the CPUs of a NUMA node.
+ * @param node The NUMA node number.
+ * @param cpusetsize The size of cpuset in bytes.
+ * @param cpuset The CPUs of the node, see cpu_set_t.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ */
+int sched_numa_cpus_np(int node, size_t cpusetsize, cpu_set_t *cpuset)
+{
+    ULONGLONG mask;
+    GROUP_AFFINITY ga;
+
+    if (node < 0 || node >= sched_numa_nodes_np() || cpusetsize < sizeof(uint64_t))
+        return EINVAL;
+
+    arch_numa_resolve();
+
+    memset(cpuset, 0, cpusetsize);
+
+    if (get_numa_node_processor_mask_ex != NULL) {
+        if (!get_numa_node_processor_mask_ex((USHORT) node, &ga))
+            return EINVAL;
+        if ((size_t) (ga.Group + 1) * sizeof(uint64_t) > cpusetsize)
+            return EINVAL;
+        cpuset->__bits[ga.Group] = ga.Mask;
+        return 0;
+    }
+
+    if (!GetNumaNodeProcessorMask((UCHAR) node, &mask))
+        return EINVAL;
+    cpuset->__bits[0] = mask;
+
+    return 0;
+}
+
+static int arch_numa_class(size_t size)
+{
+    int cls = 0;
+
+    while ((size_t) (NUMA_MIN_SIZE << cls) < size)
+        cls++;
+
+    return cls;
+}
+
+/* Carve a new chunk of node into blocks of cls, return one of them */
+static PSLIST_ENTRY arch_numa_grow(numa_arena *a, int node, int cls)
+{
+    size_t size = NUMA_MIN_SIZE << cls, offset;
+    size_t first = size >= ARCH_CACHE_LINE ? size : ARCH_CACHE_LINE;
+    numa_chunk *chunk = NULL;
+    PSLIST_ENTRY e;
+
+    arch_spin_lock(& a->lock);
+
+    /* Someone else may have grown it meanwhile */
+    if ((e = InterlockedPopEntrySList(& a->free[cls])) != NULL) {
+        arch_spin_unlock(& a->lock);
+        return e;
+    }
+
+    if (virtual_alloc_ex_numa != NULL)
+        chunk = virtual_alloc_ex_numa(GetCurrentProcess(), NULL, NUMA_CHUNK_SIZE,
+            MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, (DWORD) node);
+    if (chunk == NULL)
+        chunk = VirtualAlloc(NULL, NUMA_CHUNK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (chunk == NULL) {
+        arch_spin_unlock(& a->lock);
+        return NULL;
+    }
+
+    chunk->node = node;
+    chunk->cls = cls;
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+
+    /* The header takes the first cache line, blocks keep their natural alignment */
+    for (offset = NUMA_CHUNK_SIZE - size; offset > first; offset -= size)
+        InterlockedPushEntrySList(& a->free[cls], (PSLIST_ENTRY) ((char *) chunk + offset));
+    arch_spin_unlock(& a->lock);
+
+    return (PSLIST_ENTRY) ((char *) chunk + first);
+}
+
+static PSLIST_ENTRY arch_numa_pop(int node, int cls)
+{
+    numa_arena *a = arenas + node % ARCH_NUMA_NODES;
+    PSLIST_ENTRY e = InterlockedPopEntrySList(& a->free[cls]);
+
+    return e != NULL ? e : arch_numa_grow(a, node, cls);
+}
+
+static void arch_numa_push(int node, int cls, PSLIST_ENTRY e)
+{
+    InterlockedPushEntrySList(& arenas[node % ARCH_NUMA_NODES].free[cls], e);
+}
+
+/* The block cache of the calling thread, created on its first allocation */
+static numa_cache *arch_numa_cache(int node)
+{
+    numa_cache *c;
+
+    if (numa_tls_index == TLS_OUT_OF_INDEXES)
+        return NULL;
+
+    if ((c = (numa_cache *) TlsGetValue(numa_tls_index)) != NULL)
+        return c;
+
+    if ((c = (numa_cache *) arch_numa_pop(node, arch_numa_class(sizeof(numa_cache)))) == NULL)
+        return NULL;
+
+    memset(c, 0, sizeof(numa_cache));
+    c->node = node;
+    TlsSetValue(numa_tls_index, c);
+
+    return c;
+}
+
+static void *arch_numa_alloc_class(int cls, int node)
+{
+    int i;
+    numa_cache *c;
+    PSLIST_ENTRY e;
+
+    if (node < 0)
+        node = arch_numa_node();
+    else
+        arch_numa_resolve();
+
+    if ((c = arch_numa_cache(node)) == NULL || c->node != node) {
+        e = arch_numa_pop(node, cls);
+    } else {
+        if (c->head[cls] == NULL) {
+            for (i = 0; i < NUMA_CACHE_BATCH; i++) {
+                if ((e = arch_numa_pop(node, cls)) == NULL)
+                    break;
+                e->Next = c->head[cls];
+                c->head[cls] = e;
+                c->count[cls]++;
+            }
+        }
+
+        if ((e = c->head[cls]) != NULL) {
+            c->head[cls] = e->Next;
+            c->count[cls]--;
+        }
+    }
+
+    if (e != NULL)
+        memset(e, 0, NUMA_MIN_SIZE << cls);
+
+    return e;
+}
+
+/*
+ * Allocate a zeroed, cache line aligned control block on a NUMA node, the
+ * node of the calling thread if node is -1. Free it with arch_numa_free.
+ */
+void *arch_numa_alloc(size_t size, int node)
+{
+    if (size > NUMA_MAX_SIZE) {
+        void *pv = _aligned_malloc(size, ARCH_CACHE_LINE);
+        if (pv != NULL)
+            memset(pv, 0, size);
+        return pv;
+    }
+
+    if (size < ARCH_CACHE_LINE)
+        size = ARCH_CACHE_LINE;
+
+    return arch_numa_alloc_class(arch_numa_class(size), node);
+}
+
+/* Free a block of arch_numa_alloc, size is the size it was allocated with */
+void arch_numa_free(void *pv, size_t size)
+{
+    numa_cache *c;
+    numa_chunk *chunk;
+    PSLIST_ENTRY e = (PSLIST_ENTRY) pv;
+    int i, cls;
+
+    if (pv == NULL)
+        return;
+
+    if (size > NUMA_MAX_SIZE) {
+        _aligned_free(pv);
+        return;
+    }
+
+    chunk = (numa_chunk *) ((uintptr_t) pv & ~((uintptr_t) NUMA_CHUNK_SIZE - 1));
+    cls = chunk->cls;
+
+    /* Blocks of other nodes go home at once */
+    if (numa_tls_index == TLS_OUT_OF_INDEXES
+        || (c = (numa_cache *) TlsGetValue(numa_tls_index)) == NULL || c->node != chunk->node) {
+        arch_numa_push(chunk->node, cls, e);
+        return;
+    }
+
+    e->Next = c->head[cls];
+    c->head[cls] = e;
+    if (++c->count[cls] > NUMA_CACHE_MAX) {
+        for (i = 0; i < NUMA_CACHE_BATCH; i++) {
+            e = c->head[cls];
+            c->head[cls] = e->Next;
+            arch_numa_push(c->node, cls, e);
+        }
+        c->count[cls] -= NUMA_CACHE_BATCH;
+    }
+}
+
+/*
+ * Allocate a small zeroed block which is not shared between CPUs (attribute
+ * objects, clean-up nodes), on the node of the calling thread. It is not
+ * padded to a cache line. Free it with arch_slab_free.
+ */
+void *arch_slab_alloc(size_t size)
+{
+    if (size > NUMA_MAX_SIZE) {
+        void *pv = malloc(size);
+        if (pv != NULL)
+            memset(pv, 0, size);
+        return pv;
+    }
+
+    return arch_numa_alloc_class(arch_numa_class(size), -1);
+}
+
+/* Free a block of arch_slab_alloc, size is the size it was allocated with */
+void arch_slab_free(void *pv, size_t size)
+{
+    if (size > NUMA_MAX_SIZE) {
+        free(pv);
+        return;
+    }
+
+    arch_numa_free(pv, 0);
+}
+
+/* Allocate the thread caches, at library load */
+int arch_numa_init(void)
+{
+    int i, j;
+
+    for (i = 0; i < ARCH_NUMA_NODES; i++) {
+        for (j = 0; j < NUMA_CLASSES; j++)
+            InitializeSListHead(& arenas[i].free[j]);
+    }
+
+    /* Without it every allocation goes to the arenas */
+    numa_tls_index = TlsAlloc();
+
+    return 1;
+}
+
+/* Give the cached blocks of the calling thread back, it is exiting */
+void arch_numa_thread_fini(void)
+{
+    int cls;
+    numa_cache *c;
+    PSLIST_ENTRY e;
+
+    if (numa_tls_index == TLS_OUT_OF_INDEXES || (c = (numa_cache *) TlsGetValue(numa_tls_index)) == NULL)
+        return;
+
+    TlsSetValue(numa_tls_index, NULL);
+    for (cls = 0; cls < NUMA_CLASSES; cls++) {
+        while ((e = c->head[cls]) != NULL) {
+            c->head[cls] = e->Next;
+            arch_numa_push(c->node, cls, e);
+        }
+    }
+
+    arch_numa_free(c, sizeof(numa_cache));
+}
+
+/* Release all chunks at once, the library is unloaded */
+void arch_numa_fini(void)
+{
+    int i, j;
+    numa_chunk *chunk, *next;
+
+    if (numa_tls_index != TLS_OUT_OF_INDEXES) {
+        TlsFree(numa_tls_index);
+        numa_tls_index = TLS_OUT_OF_INDEXES;
+    }
+
+    for (i = 0; i < ARCH_NUMA_NODES; i++) {
+        for (chunk = arenas[i].chunks; chunk != NULL; chunk = next) {
+            next = chunk->next;
+            VirtualFree(chunk, 0, MEM_RELEASE);
+        }
+        arenas[i].chunks = NULL;
+        for (j = 0; j < NUMA_CLASSES; j++)
+            InitializeSListHead(& arenas[i].free[j]);
+    }
+}
@@ -25,6 +25,7 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <winsock2.h>
 
@@ -33,6 +34,61 @@
 
 extern DWORD libpthread_tls_index;
 
+static void arch_thread_info_free(arch_thread_info *pv)
+{
+    if (pv->pi_handle != NULL)
+        CloseHandle(pv->pi_handle);
+    arch_numa_free(pv, sizeof(arch_thread_info));
+}
+
+/*
+ * The main thread and threads not created by pthread_create get a detached
+ * pthread_t on their first call, released when they exit (arch_thread_fini).
+ */
+static arch_thread_info *arch_thread_attach(void)
+{
+    HANDLE process = GetCurrentProcess();
+    arch_thread_info *pv = arch_numa_alloc(sizeof(arch_thread_info), -1);
+
+    if (pv == NULL)
+        return NULL;
+
+    if (!DuplicateHandle(process, GetCurrentThread(), process, &pv->handle, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        arch_thread_info_free(pv);
+        return NULL;
+    }
+
+    pv->state = PTHREAD_CREATE_DETACHED | ARCH_THREAD_FOREIGN;
+    TlsSetValue(libpthread_tls_index, pv);
+    return pv;
+}
+
+static __inline arch_thread_info *arch_thread_self(void)
+{
+    arch_thread_info *pv = arch_tls_get(libpthread_tls_index);
+
+    if (pv != NULL)
+        return pv;
+
+    return arch_thread_attach();
+}
+
+/**
+ * Release the pthread_t of an exiting foreign thread, called from DllMain.
+ */
+void arch_thread_fini(void)
+{
+    arch_thread_info *pv = TlsGetValue(libpthread_tls_index);
+
+    if (pv != NULL && (pv->state & ARCH_THREAD_FOREIGN) != 0) {
+        arch_rcu_thread_fini(pv);
+        arch_sched_thread_fini(pv);
+        TlsSetValue(libpthread_tls_index, NULL);
+        CloseHandle(pv->handle);
+        arch_thread_info_free(pv);
+    }
+}
+
 /**
  * Register fork handlers.
  * @param  prepare The prepare fork handler shall be called before fork() processing commences.
@@ -69,6 +125,36 @@ int pthread_setconcurrency(int new_level)
     return 0;
 }
 
+#ifndef STACK_SIZE_PARAM_IS_A_RESERVATION
+#define STACK_SIZE_PARAM_IS_A_RESERVATION   0x00010000
+#endif
+
+typedef BOOL (WINAPI *set_thread_stack_guarantee_t)(PULONG);
+
+static set_thread_stack_guarantee_t set_thread_stack_guarantee;
+static long page_size;
+
+static size_t arch_page_size(void)
+{
+    SYSTEM_INFO si;
+
+    if (atomic_read(&page_size) == 0) {
+        GetSystemInfo(&si);
+        atomic_set(&page_size, (long) si.dwPageSize);
+    }
+
+    return (size_t) page_size;
+}
+
+/* Enlarge the guard region of the calling thread, Vista or later */
+static void arch_thread_set_guard(unsigned long size)
+{
+    ULONG guarantee = (ULONG) size;
+
+    if (set_thread_stack_guarantee != NULL)
+        (void) set_thread_stack_guarantee(&guarantee);
+}
+
 /**
  * Initialize thread attributes object.
  * @param  attr The thread attributes object.
@@ -76,12 +162,14 @@ int pthread_setconcurrency(int new_level)
  */
 int pthread_attr_init(pthread_attr_t *attr)
 {
-    arch_thread_attr *pv = calloc(1, sizeof(arch_thread_attr));
+    arch_thread_attr *pv = arch_slab_alloc(sizeof(arch_thread_attr));
     if (pv == NULL)
         return lc_set_errno(ENOMEM);
 
     pv->sched_policy = SCHED_OTHER;
     pv->sched_param.sched_priority = 8;
+    pv->numa_node = -1;
+    pv->guard_size = arch_page_size();
 
     *attr = pv;
 
@@ -96,7 +184,7 @@ int pthread_attr_init(pthread_attr_t *attr)
  */
 int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *flag)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
     *flag = pv->detach_state;
     return 0;
 }
@@ -109,32 +197,44 @@ int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *flag)
  */
 int pthread_attr_setdetachstate(pthread_attr_t *attr, int flag)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
     pv->detach_state = flag;
     return 0;
 }
 
 /**
  * Get the thread guardsize attribute.
+ * @param  attr The thread attributes object.
+ * @param  size The guard size, a multiple of the page size.
  * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
  */
 int pthread_attr_getguardsize(const pthread_attr_t *attr, size_t *size)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
     *size = pv->guard_size;
     return 0;
 }
 
 /**
  * Set the thread guardsize attribute.
- * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
+ * @param  attr The thread attributes object.
+ * @param  size The guard size, rounded up to a multiple of the page size.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark Windows keeps one guard page below the committed stack. A larger
+ *         guard size becomes the stack guarantee of the new thread (see
+ *         SetThreadStackGuarantee, Windows Vista and later): the stack left
+ *         to handle a stack overflow exception.
  */
 int pthread_attr_setguardsize(pthread_attr_t *attr, size_t size)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
-    pv->guard_size = size;
+    size_t page = arch_page_size();
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
+
+    if (size > ULONG_MAX - page)
+        return EINVAL;
+
+    pv->guard_size = (size + page - 1) & ~(page - 1);
     return 0;
 }
 
@@ -146,7 +246,7 @@ int pthread_attr_setguardsize(pthread_attr_t *attr, size_t size)
  */
 int pthread_attr_getinheritsched(const pthread_attr_t *attr, int *flag)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
     *flag = pv->inherit_sched;
     return 0;
 }
@@ -159,7 +259,7 @@ int pthread_attr_getinheritsched(const pthread_attr_t *attr, int *flag)
  */
 int pthread_attr_setinheritsched(pthread_attr_t *attr, int flag)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
     pv->inherit_sched = flag;
     return 0;
 }
@@ -172,7 +272,7 @@ int pthread_attr_setinheritsched(pthread_attr_t *attr, int flag)
  */
 int pthread_attr_setschedparam(pthread_attr_t *attr, const struct sched_param *param)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
     pv->sched_param.sched_priority = param->sched_priority;
     return 0;
 }
@@ -185,21 +285,20 @@ int pthread_attr_setschedparam(pthread_attr_t *attr, const struct sched_param *p
  */
 int pthread_attr_getschedparam(const pthread_attr_t *attr, struct sched_param *param)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
     param->sched_priority = pv->sched_param.sched_priority;
     return 0;
 }
 
 /**
- * Set the scheduling policy attribute.
+ * Get the scheduling policy attribute.
  * @param  attr The thread attributes object.
  * @param  policy The scheduling policy parameter.
  * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
  */
 int pthread_attr_getschedpolicy(const pthread_attr_t *attr, int *policy)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
     *policy = pv->sched_policy;
     return 0;
 }
@@ -207,13 +306,19 @@ int pthread_attr_getschedpolicy(const pthread_attr_t *attr, int *policy)
 /**
  * Set the scheduling policy attribute.
  * @param  attr The thread attributes object.
- * @param  policy The scheduling policy parameter.
- * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
+ * @param  policy SCHED_OTHER, SCHED_FIFO or SCHED_RR.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark The new thread applies SCHED_FIFO and SCHED_RR itself before its
+ *         start routine runs, see sched_setscheduler.
  */
 int pthread_attr_setschedpolicy(pthread_attr_t *attr, int policy)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
+
+    if (policy < SCHED_MIN || policy > SCHED_MAX)
+        return EINVAL;
+
     pv->sched_policy = policy;
     return 0;
 }
@@ -227,7 +332,7 @@ int pthread_attr_setschedpolicy(pthread_attr_t *attr, int policy)
  */
 int pthread_attr_getscope(const pthread_attr_t *attr, int *scope)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
     *scope = pv->scope;
     return 0;
 }
@@ -241,7 +346,7 @@ int pthread_attr_getscope(const pthread_attr_t *attr, int *scope)
  */
 int pthread_attr_setscope(pthread_attr_t *attr, int scope)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
     pv->scope = scope;
     return 0;
 }
@@ -252,11 +357,10 @@ int pthread_attr_setscope(pthread_attr_t *attr, int scope)
  * @param  addr The stack address parameter.
  * @param  size The stack size parameter.
  * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
  */
 int pthread_attr_getstack(const pthread_attr_t *attr, void **addr, size_t *size)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
 
     if (addr != NULL) *addr = pv->stack_addr;
     if (size != NULL) *size = pv->stack_size;
@@ -267,14 +371,21 @@ int pthread_attr_getstack(const pthread_attr_t *attr, void **addr, size_t *size)
 /**
  * Set the stack attribute.
  * @param  attr The thread attributes object.
- * @param  addr The stack address parameter.
- * @param  size The stack size parameter.
- * @return Always return 0.
- * @remark This function is provided for source code compatibility but no effect when called.
+ * @param  addr The lowest address of the stack.
+ * @param  size The stack size, at least PTHREAD_STACK_MIN.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark Windows cannot start a thread on memory of the caller. The size is
+ *         reserved for the stack of the new thread like a stack size would
+ *         be, and the memory at addr is left to the caller. To reuse stacks,
+ *         see the thread cache of pthread_setcachesize_np.
  */
 int pthread_attr_setstack(pthread_attr_t *attr, void *addr, size_t size)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
+
+    if (addr == NULL || size < PTHREAD_STACK_MIN || size > UINT_MAX)
+        return EINVAL;
 
     pv->stack_addr = addr;
     pv->stack_size = size;
@@ -298,16 +409,170 @@ int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *size)
 /**
  * Set stack size attribute in thread attributes object.
  * @param  attr The thread attributes object.
- * @param  size The stack size pointer.
- * @return Always return 0.
+ * @param  size The stack size, at least PTHREAD_STACK_MIN.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark The stack size is reserved, not committed: the stack of the new
+ *         thread starts with the commit size of the executable, and grows
+ *         on demand up to the stack size.
  */
 int pthread_attr_setstacksize(pthread_attr_t *attr, size_t size)
 {
-    arch_thread_attr *pv = (arch_thread_attr *) attr;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
+
+    if (size < PTHREAD_STACK_MIN || size > UINT_MAX)
+        return EINVAL;
+
     pv->stack_size = size;
     return 0;
 }
 
+/* Copy a CPU set of setsize bytes into a full one */
+static int arch_cpu_set_in(cpu_set_t *dst, size_t setsize, const cpu_set_t *src)
+{
+    size_t i;
+
+    memset(dst, 0, sizeof(cpu_set_t));
+    if (setsize > sizeof(cpu_set_t)) {
+        /* CPUs beyond CPU_SETSIZE can not exist */
+        for (i = sizeof(cpu_set_t); i < setsize; i++) {
+            if (((const char *) src)[i] != 0)
+                return EINVAL;
+        }
+        setsize = sizeof(cpu_set_t);
+    }
+    memcpy(dst, src, setsize);
+
+    return 0;
+}
+
+/* Copy a full CPU set into one of setsize bytes */
+static int arch_cpu_set_out(cpu_set_t *dst, size_t setsize, const cpu_set_t *src)
+{
+    size_t i;
+
+    if (setsize < sizeof(cpu_set_t)) {
+        for (i = setsize; i < sizeof(cpu_set_t); i++) {
+            if (((const char *) src)[i] != 0)
+                return EINVAL;
+        }
+    } else {
+        memset(dst, 0, setsize);
+        setsize = sizeof(cpu_set_t);
+    }
+    memcpy(dst, src, setsize);
+
+    return 0;
+}
+
+/**
+ * Get the CPU affinity attribute in thread attributes object.
+ * @param  attr The thread attributes object.
+ * @param  cpusetsize The size of cpuset in bytes.
+ * @param  cpuset The CPU set the new thread will run on, empty if none was set.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned if the set does not fit in cpusetsize bytes.
+ */
+int pthread_attr_getaffinity_np(const pthread_attr_t *attr, size_t cpusetsize, cpu_set_t *cpuset)
+{
+    cpu_set_t empty;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
+
+    if (!pv->has_cpuset) {
+        memset(&empty, 0, sizeof(empty));
+        return arch_cpu_set_out(cpuset, cpusetsize, &empty);
+    }
+
+    return arch_cpu_set_out(cpuset, cpusetsize, &pv->cpuset);
+}
+
+/**
+ * Set the CPU affinity attribute in thread attributes object.
+ * @param  attr The thread attributes object.
+ * @param  cpusetsize The size of cpuset in bytes.
+ * @param  cpuset The CPU set the new thread will run on, NULL to inherit the
+ *         affinity of the process.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark A set spanning several processor groups needs Windows 11 or later.
+ */
+int pthread_attr_setaffinity_np(pthread_attr_t *attr, size_t cpusetsize, const cpu_set_t *cpuset)
+{
+    int rc;
+    cpu_set_t set;
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
+
+    if (cpuset == NULL || cpusetsize == 0) {
+        pv->has_cpuset = 0;
+        return 0;
+    }
+
+    if ((rc = arch_cpu_set_in(&set, cpusetsize, cpuset)) != 0)
+        return rc;
+
+    if (__sched_cpucount(sizeof(set), &set) == 0)
+        return EINVAL;
+
+    pv->cpuset = set;
+    pv->has_cpuset = 1;
+    return 0;
+}
+
+/**
+ * Get the NUMA node attribute in thread attributes object.
+ * @param  attr The thread attributes object.
+ * @param  node The NUMA node the new thread will run on, -1 if none was set.
+ * @return Always return 0.
+ */
+int pthread_attr_getnumanode_np(const pthread_attr_t *attr, int *node)
+{
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
+    *node = pv->numa_node;
+    return 0;
+}
+
+/**
+ * Set the NUMA node attribute in thread attributes object.
+ * @param  attr The thread attributes object.
+ * @param  node The NUMA node the new thread will run on, or -1.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark The thread runs on the CPUs of the node, restricted further by
+ *         the affinity attribute if both are set. Its control block is
+ *         allocated on the node.
+ */
+int pthread_attr_setnumanode_np(pthread_attr_t *attr, int node)
+{
+    arch_thread_attr *pv = (arch_thread_attr *) *attr;
+
+    if (node < -1 || node >= sched_numa_nodes_np())
+        return EINVAL;
+
+    pv->numa_node = node;
+    return 0;
+}
+
+/* The CPUs a new thread runs on, from the affinity and NUMA node attributes */
+static int arch_thread_attr_cpuset(arch_thread_attr *pa, cpu_set_t *set)
+{
+    cpu_set_t node;
+
+    if (pa->numa_node < 0) {
+        *set = pa->cpuset;
+        return 0;
+    }
+
+    if (sched_numa_cpus_np(pa->numa_node, sizeof(node), &node) != 0)
+        return EINVAL;
+
+    if (pa->has_cpuset)
+        CPU_AND(set, &node, &pa->cpuset);
+    else
+        *set = node;
+
+    return __sched_cpucount(sizeof(cpu_set_t), set) != 0 ? 0 : EINVAL;
+}
+
 /**
  * Destroy thread attributes object.
  * @param  attr The thread attributes object.
@@ -316,7 +581,7 @@ int pthread_attr_setstacksize(pthread_attr_t *attr, size_t size)
 int pthread_attr_destroy(pthread_attr_t *attr)
 {
     if (attr != NULL) {
-        free(*attr);
+        arch_slab_free(*attr, sizeof(arch_thread_attr));
         *attr = NULL;
     }
 
@@ -399,35 +664,86 @@ void pthread_testcancel(void)
     return;
 }
 
+/**
+ * Push a cleanup frame on the stack of the caller.
+ * This is the function behind the pthread_cleanup_push macro, the frame
+ * lives in the block opened by the macro, so nothing is allocated.
+ *
+ * @param  buffer The cleanup frame.
+ * @param  cleanup_routine The cleanup routine to be called.
+ * @param  arg The argument of cleanup routine.
+ */
+void _pthread_cleanup_push(struct _pthread_cleanup_buffer *buffer, void (*cleanup_routine)(void *), void *arg)
+{
+    arch_thread_info *pv = arch_thread_self();
+
+    buffer->__routine = cleanup_routine;
+    buffer->__arg = arg;
+    if (pv != NULL) {
+        buffer->__prev = pv->cleanup;
+        pv->cleanup = buffer;
+    } else {
+        buffer->__prev = NULL;
+    }
+}
+
+/**
+ * Pop a cleanup frame pushed by _pthread_cleanup_push.
+ * This is the function behind the pthread_cleanup_pop macro.
+ *
+ * @param  buffer The cleanup frame, the innermost one of the calling thread.
+ * @param  execute If execute is non-zero, the clean-up handler of the
+ * frame is executed.
+ */
+void _pthread_cleanup_pop(struct _pthread_cleanup_buffer *buffer, int execute)
+{
+    arch_thread_info *pv = arch_tls_get(libpthread_tls_index);
+
+    if (pv != NULL)
+        pv->cleanup = buffer->__prev;
+
+    if (execute)
+        buffer->__routine(buffer->__arg);
+}
+
+/* Runs the handler of a frame pushed by the pthread_cleanup_push function */
+static void arch_thread_cleanup_node_run(void *arg)
+{
+    arch_thread_cleanup_node *node = (arch_thread_cleanup_node *) arg;
+    void (* cleaner)(void *) = node->cleaner;
+
+    arg = node->arg;
+    arch_slab_free(node, sizeof(arch_thread_cleanup_node));
+    cleaner(arg);
+}
+
+#undef pthread_cleanup_push
+#undef pthread_cleanup_pop
+
 /**
  * Add a cleanup function for thread exit.
+ * Only binaries built before pthread_cleanup_push became a macro call this,
+ * the frame is allocated.
  *
  * @param  cleanup_routine The cleanup routine to be called.
  * @param  arg The argument of cleanup routine.
- * @bug The main thread do not support cleanup routines.
  */
 void pthread_cleanup_push(void (*cleanup_routine)(void *), void *arg)
 {
-    arch_thread_cleanup_list *next;
-    arch_thread_info *pv = TlsGetValue(libpthread_tls_index);
+    arch_thread_info *pv = arch_thread_self();
 
     if (pv != NULL) {
-        arch_thread_cleanup_list *node = calloc(1, sizeof(arch_thread_cleanup_list));
+        arch_thread_cleanup_node *node = arch_slab_alloc(sizeof(arch_thread_cleanup_node));
 
-        node->arg = arg;
-        node->cleaner = cleanup_routine;
-
-        if (pv->cleanup_list == NULL) {
-            pv->cleanup_list = node;
+        if (node == NULL)
             return;
-        }
-
-        next = pv->cleanup_list;
-        while(next->next != NULL)
-            next = next->next;
 
-        next->next = node;
-        node->prev = next;
+        node->cleaner = cleanup_routine;
+        node->arg = arg;
+        node->buffer.__routine = arch_thread_cleanup_node_run;
+        node->buffer.__arg = node;
+        node->buffer.__prev = pv->cleanup;
+        pv->cleanup = &node->buffer;
     }
 }
 
@@ -440,65 +756,245 @@ void pthread_cleanup_push(void (*cleanup_routine)(void *), void *arg)
  *
  * @param  execute If execute is non-zero, the top-most clean-up handler
  * is popped and executed.
- * @bug The main thread do not support cleanup routines.
  */
 void pthread_cleanup_pop(int execute)
 {
-    arch_thread_info *pv = TlsGetValue(libpthread_tls_index);
-    if (pv != NULL) {
-        arch_thread_cleanup_list *node = pv->cleanup_list, *prev;
+    arch_thread_info *pv = arch_tls_get(libpthread_tls_index);
 
-        if (node == NULL) return;
-        while(node->next != NULL)
-            node = node->next;
+    if (pv != NULL && pv->cleanup != NULL) {
+        arch_thread_cleanup_node *node = (arch_thread_cleanup_node *) pv->cleanup;
 
+        pv->cleanup = node->buffer.__prev;
         if (execute) {
-            node->cleaner(node->arg);
+            node->buffer.__routine(node->buffer.__arg);
+        } else {
+            arch_slab_free(node, sizeof(arch_thread_cleanup_node));
         }
+    }
+}
 
-        prev = node->prev;
-        free(node);
-        if(prev == NULL)
-            pv->cleanup_list = NULL;
-        else
-            prev->next = NULL;
+/* Drop the cleanup frames, freeing the allocated ones */
+static void arch_thread_cleanup_free(arch_thread_info *pv)
+{
+    struct _pthread_cleanup_buffer *buffer = pv->cleanup;
+
+    while (buffer != NULL) {
+        struct _pthread_cleanup_buffer *prev = buffer->__prev;
+        /* Cleanup handlers are not called if the thread terminates by
+         * performing a return from the thread start function.
+         */
+        if (buffer->__routine == arch_thread_cleanup_node_run)
+            arch_slab_free(buffer, sizeof(arch_thread_cleanup_node));
+        buffer = prev;
     }
+    pv->cleanup = NULL;
 }
 
 static unsigned int __stdcall worker_proxy (void *arg)
 {
     arch_thread_info *pv = (arch_thread_info *) arg;
 
+    /* pthread_create gave up on us, it joins and frees us */
+    if ((pv->state & ARCH_THREAD_ABORTED) != 0)
+        return 0;
+
     TlsSetValue(libpthread_tls_index, pv);
 
+    if (pv->guard_size != 0)
+        arch_thread_set_guard(pv->guard_size);
+
+    arch_sched_thread_start(pv);
+
+    if (arch_trace_enabled(ARCH_TRACE_THREAD))
+        arch_trace(ARCH_TRACE_THREAD_START, (uintptr_t) pv, (uintptr_t) pv->worker, 0, 0);
+
     pv->return_value = pv->worker(pv->arg);
 
-    /* Free memory used by clean-up handlers */
-    if (pv->cleanup_list) {
-        arch_thread_cleanup_list *node = pv->cleanup_list;
-        do {
-            arch_thread_cleanup_list *next = node->next;
-            /* Cleanup handlers are not called if the thread terminates by
-             * performing a return from the thread start function.
-             *
-             * node->cleaner(node->arg);
-             */
-            free(node);
-            node = next;
-        } while(node != NULL);
-        pv->cleanup_list = NULL;
-    }
-
-    /* Make sure we free ourselves if we are detached */
+    if (arch_trace_enabled(ARCH_TRACE_THREAD))
+        arch_trace(ARCH_TRACE_THREAD_EXIT, (uintptr_t) pv, (uintptr_t) pv->return_value, 0, 0);
+
+    arch_thread_cleanup_free(pv);
+    arch_key_reset();
+    arch_rcu_thread_fini(pv);
+    arch_sched_thread_fini(pv);
+
+    /* Make sure we free ourselves if we are detached, the handle is closed already */
     if ((pv->state & PTHREAD_CREATE_DETACHED) == PTHREAD_CREATE_DETACHED) {
-        CloseHandle (pv->handle);
-        free(pv);
+        arch_thread_info_free(pv);
+        TlsSetValue(libpthread_tls_index, NULL);
+    }
+
+    return 0;
+}
+
+/*
+ * Thread cache: with pthread_setcachesize_np(n), up to n threads are parked
+ * when their start routine returns, and pthread_create hands the next start
+ * routine to one of them instead of creating a new thread. The pthread_t of
+ * a cached thread lives until it is joined or detached, whichever of that
+ * and the end of the start routine (ARCH_THREAD_DONE) comes last frees it.
+ */
+
+static long cache_size;
+static long cache_idle;
+static long cache_lock;
+static arch_thread_worker *cache_head;
+
+static long arch_thread_set_state(arch_thread_info *pv, long flag)
+{
+    long old;
+
+    do {
+        old = atomic_read(& pv->state);
+    } while (atomic_cmpxchg(& pv->state, old | flag, old) != old);
+
+    return old;
+}
+
+static unsigned int __stdcall cache_worker_proxy (void *arg)
+{
+    long seq, state;
+    arch_thread_worker *w = (arch_thread_worker *) arg;
+    arch_thread_info *pv = w->task;
+
+    for (;;) {
+        TlsSetValue(libpthread_tls_index, pv);
+        arch_sched_thread_start(pv);
+
+        if (arch_trace_enabled(ARCH_TRACE_THREAD))
+            arch_trace(ARCH_TRACE_THREAD_START, (uintptr_t) pv, (uintptr_t) pv->worker, 0, 0);
+
+        if (setjmp(w->exit_jmp) == 0)
+            pv->return_value = pv->worker(pv->arg);
+
+        if (arch_trace_enabled(ARCH_TRACE_THREAD))
+            arch_trace(ARCH_TRACE_THREAD_EXIT, (uintptr_t) pv, (uintptr_t) pv->return_value, 0, 0);
+
+        /* Start the next routine like a new thread would */
+        arch_thread_cleanup_free(pv);
+        arch_key_reset();
+        arch_rcu_thread_fini(pv);
+        arch_sched_thread_fini(pv);
         TlsSetValue(libpthread_tls_index, NULL);
+        if (GetThreadPriority(GetCurrentThread()) != THREAD_PRIORITY_NORMAL)
+            SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+
+        if ((state = arch_thread_set_state(pv, ARCH_THREAD_DONE)) & PTHREAD_CREATE_DETACHED)
+            arch_thread_info_free(pv);
+        else
+            arch_wake_by_address_all(& pv->state);
+
+        seq = atomic_read(& w->seq);
+        arch_spin_lock(& cache_lock);
+        /* Threads pinned by pthread_setaffinity_np are not reused, we do not know the affinity to restore */
+        if (cache_idle >= cache_size || (state & ARCH_THREAD_AFFINITY) != 0) {
+            arch_spin_unlock(& cache_lock);
+            break;
+        }
+        w->next = cache_head;
+        cache_head = w;
+        cache_idle++;
+        arch_spin_unlock(& cache_lock);
+
+        while (atomic_read_acquire(& w->seq) == seq)
+            arch_wait_on_address(& w->seq, seq, INFINITE);
+        pv = w->task;
+    }
+
+    CloseHandle(w->handle);
+    free(w);
+
+    return 0;
+}
+
+/*
+ * Run pv on a cached thread, or on a new one which will be cached. A set of
+ * the libgomp profile, or NULL, is applied to the thread for this task: it
+ * is not marked ARCH_THREAD_AFFINITY, every task of a cached thread gets a
+ * set while OMP_PROC_BIND is on, so the thread can be reused.
+ */
+static int arch_thread_cache_create(arch_thread_info *pv, int priority, const cpu_set_t *set)
+{
+    int created = 0;
+    arch_thread_worker *w;
+
+    arch_spin_lock(& cache_lock);
+    if ((w = cache_head) != NULL) {
+        cache_head = w->next;
+        cache_idle--;
+    }
+    arch_spin_unlock(& cache_lock);
+
+    if (w == NULL) {
+        if ((w = calloc(1, sizeof(arch_thread_worker))) == NULL)
+            return ENOMEM;
+
+        w->task = pv;
+        w->handle = (HANDLE) _beginthreadex(NULL, 0, cache_worker_proxy, w, CREATE_SUSPENDED, NULL);
+        if (w->handle == NULL) {
+            free(w);
+            return EAGAIN;
+        }
+        created = 1;
+    }
+
+    pv->cache = w;
+    if ((pv->state & PTHREAD_CREATE_DETACHED) == 0) {
+        if (!DuplicateHandle(GetCurrentProcess(), w->handle, GetCurrentProcess(), &pv->handle, 0, FALSE, DUPLICATE_SAME_ACCESS))
+            pv->handle = NULL;
+    }
+
+    if (priority != THREAD_PRIORITY_NORMAL)
+        SetThreadPriority(w->handle, priority);
+
+    /* The thread runs anyway if it fails, as an uncached one would */
+    if (set != NULL)
+        (void) arch_set_affinity(w->handle, set);
+
+    if (created) {
+        ResumeThread(w->handle);
+    } else {
+        w->task = pv;
+        (void) atomic_fetch_and_add_release(& w->seq, 1);
+        arch_wake_by_address_single(& w->seq);
     }
 
     return 0;
 }
 
+/**
+ * Get the size of the thread cache.
+ * @param size The maximum number of idle threads kept for reuse.
+ * @return Always return 0.
+ */
+int pthread_getcachesize_np(int *size)
+{
+    *size = (int) atomic_read(& cache_size);
+    return 0;
+}
+
+/**
+ * Set the size of the thread cache.
+ * @param size The maximum number of idle threads kept for reuse, 0 (the
+ *        default) disables the cache.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark Threads created with the default stack and guard size are kept
+ *         parked when their start routine returns or calls pthread_exit, and
+ *         run the start routine of a later pthread_create. Thread-specific data,
+ *         clean-up handlers and the priority are reset in between, and
+ *         pthread_self() returns a new thread ID for every start routine.
+ * @remark Idle threads beyond a smaller new size exit when they are reused.
+ */
+int pthread_setcachesize_np(int size)
+{
+    if (size < 0)
+        return EINVAL;
+
+    atomic_set(& cache_size, size);
+    return 0;
+}
+
 /**
  * Create a new thread.
  * @param thread The new thread.
@@ -511,35 +1007,103 @@ static unsigned int __stdcall worker_proxy (void *arg)
  */
 int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg)
 {
+    HANDLE handle;
+    cpu_set_t set;
+    int rc, pinned = 0;
     unsigned stack_size = 0;
-    arch_thread_info *pv = calloc(1, sizeof(arch_thread_info));
+    int priority = THREAD_PRIORITY_NORMAL;
+    arch_thread_attr *pa = (attr != NULL) ? (arch_thread_attr *) *attr : NULL;
+    arch_thread_info *pv;
+
+    if (pa != NULL && (pa->has_cpuset || pa->numa_node >= 0)) {
+        if ((rc = arch_thread_attr_cpuset(pa, &set)) != 0)
+            return rc;
+        pinned = 1;
+    } else {
+        /* OMP_PROC_BIND of the libgomp profile, the thread runs anyway if it fails */
+        pinned = arch_gomp_thread_place(&set) ? 2 : 0;
+    }
+
+    /* On the node the thread will run on */
+    pv = arch_numa_alloc(sizeof(arch_thread_info), pa != NULL ? pa->numa_node : -1);
     if (pv == NULL)
         return lc_set_errno(ENOMEM);
 
-    if (attr != NULL) stack_size = ((arch_thread_attr * ) attr)->stack_size;
+    if (pa != NULL) {
+        stack_size = (unsigned) pa->stack_size;
+        priority = sched_priority_to_os_priority(pa->sched_param.sched_priority);
+        pv->sched_policy = pa->sched_policy;
+        pv->sched_priority = pa->sched_param.sched_priority;
+
+        /* More than the guard page of the system */
+        if (pa->guard_size > arch_page_size()) {
+            if (set_thread_stack_guarantee == NULL) {
+                HMODULE h = GetModuleHandleA("kernel32.dll");
+                if (h != NULL)
+                    set_thread_stack_guarantee = (set_thread_stack_guarantee_t) GetProcAddress(h, "SetThreadStackGuarantee");
+            }
+            pv->guard_size = (unsigned long) pa->guard_size;
+        }
+    }
 
     pv->arg = arg;
     pv->worker = start_routine;
     pv->state = PTHREAD_CREATE_JOINABLE;
-    pv->handle = (HANDLE) _beginthreadex(NULL, stack_size, worker_proxy, pv, CREATE_SUSPENDED, NULL);
 
-    if (pv->handle == INVALID_HANDLE_VALUE) {
-        free(pv);
+    if (arch_trace_enabled(ARCH_TRACE_THREAD))
+        arch_trace(ARCH_TRACE_THREAD_CREATE, (uintptr_t) pv, (uintptr_t) start_routine, (uintptr_t) arg, stack_size);
+
+    if (stack_size == 0 && pv->guard_size == 0 && pinned != 1 && atomic_read(& cache_size) > 0) {
+        if (pa != NULL && (pa->detach_state & PTHREAD_CREATE_DETACHED) != 0)
+            pv->state = PTHREAD_CREATE_DETACHED;
+
+        /* The thread may be gone once it is handed over */
+        *thread = (pthread_t) pv;
+        if ((rc = arch_thread_cache_create(pv, priority, pinned ? &set : NULL)) != 0) {
+            arch_thread_info_free(pv);
+            return lc_set_errno(rc);
+        }
+
+        return 0;
+    }
+
+    /* Reserve the stack size, commit pages as the stack grows */
+    pv->handle = (HANDLE) _beginthreadex(NULL, stack_size, worker_proxy, pv,
+        CREATE_SUSPENDED | STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+
+    if (pv->handle == NULL) {
+        arch_thread_info_free(pv);
         return errno;
     }
 
-    if (attr != NULL) {
-        SetThreadPriority(pv->handle, sched_priority_to_os_priority(((arch_thread_attr * ) attr)->sched_param.sched_priority));
+    handle = pv->handle;
+    if (pinned && (rc = arch_set_affinity(handle, &set)) != 0 && pinned == 1) {
+        /* It never ran, let it return at once so the C runtime and the DLLs see it exit */
+        pv->state |= ARCH_THREAD_ABORTED;
+        ResumeThread(handle);
+        WaitForSingleObject(handle, INFINITE);
+        CloseHandle(handle);
+        arch_thread_info_free(pv);
+        return rc;
+    }
 
-        if ((((arch_thread_attr * ) attr)->detach_state & PTHREAD_CREATE_DETACHED) != 0) {
-            CloseHandle(pv->handle);
+    if (pa != NULL) {
+        SetThreadPriority(handle, priority);
+
+        if ((pa->detach_state & PTHREAD_CREATE_DETACHED) != 0) {
             pv->state = PTHREAD_CREATE_DETACHED;
             pv->handle = NULL;
         }
     }
 
-    ResumeThread(pv->handle);
+    /* A detached thread may be gone once resumed */
     *thread = (pthread_t) pv;
+    if (pv->handle == NULL) {
+        ResumeThread(handle);
+        CloseHandle(handle);
+    } else {
+        ResumeThread(handle);
+    }
     return 0;
 }
 
@@ -549,41 +1113,48 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_
  */
 void pthread_exit(void *value_ptr)
 {
-    arch_thread_info *pv = TlsGetValue(libpthread_tls_index);
+    arch_thread_info *pv = arch_thread_self();
     if (pv != NULL) {
         pv->return_value = value_ptr;
 
-        /* Call clean-up handlers, and free memory */
-        if (pv->cleanup_list) {
-            arch_thread_cleanup_list *node = pv->cleanup_list;
-            while(node->next != NULL)
-                node = node->next;
-            do {
-                arch_thread_cleanup_list *prev = node->prev;
-                node->cleaner(node->arg);
-                free(node);
-                node = prev;
-            } while(node != NULL);
-            pv->cleanup_list = NULL;
+        /* Call clean-up handlers, innermost first, the frames are still live */
+        while (pv->cleanup != NULL) {
+            struct _pthread_cleanup_buffer *buffer = pv->cleanup;
+            pv->cleanup = buffer->__prev;
+            buffer->__routine(buffer->__arg);
         }
 
-        /* Make sure we free ourselves if we are detached */
+        /* A cached thread goes back to the cache */
+        if (pv->cache != NULL)
+            longjmp(pv->cache->exit_jmp, 1);
+
+        if (arch_trace_enabled(ARCH_TRACE_THREAD))
+            arch_trace(ARCH_TRACE_THREAD_EXIT, (uintptr_t) pv, (uintptr_t) value_ptr, 0, 0);
+
+        arch_key_reset();
+        arch_rcu_thread_fini(pv);
+        arch_sched_thread_fini(pv);
+
+        /* The process lives on until its last thread exits, DllMain frees us */
+        if ((pv->state & ARCH_THREAD_FOREIGN) != 0)
+            ExitThread(0);
+
+        /* Make sure we free ourselves if we are detached, the handle is closed already */
         if ((pv->state & PTHREAD_CREATE_DETACHED) == PTHREAD_CREATE_DETACHED) {
-            CloseHandle (pv->handle);
-            free(pv);
+            arch_thread_info_free(pv);
             TlsSetValue(libpthread_tls_index, NULL);
         }
 
         _endthreadex(0);
     } else {
-        exit(1); /* User should not call pthread_exit in the main thread */
+        exit(1); /* Out of memory for a foreign thread */
     }
 }
 
 /**
  * Get scheduling policy and parameters of a thread.
  * @param thread The target thread.
- * @param  policy Always return SCHED_OTHER.
+ * @param  policy The thread scheduling policy.
  * @param  param The thread scheduling priority.
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
@@ -591,13 +1162,20 @@ void pthread_exit(void *value_ptr)
  */
 int pthread_getschedparam(pthread_t thread, int *policy, struct sched_param *param)
 {
+    arch_thread_info *pv = (arch_thread_info *) thread;
+
     if (policy != NULL)
-        *policy = SCHED_OTHER;
+        *policy = pv != NULL ? pv->sched_policy : SCHED_OTHER;
 
     if (param != NULL) {
         int priority;
         HANDLE handle;
-        arch_thread_info *pv = (arch_thread_info *) thread;
+
+        /* MMCSS runs the thread in the real-time band */
+        if (pv != NULL && pv->mmcss != NULL) {
+            param->sched_priority = pv->sched_priority;
+            return 0;
+        }
 
         if (pv != NULL) handle = pv->handle;
         else handle = GetCurrentThread();
@@ -614,17 +1192,29 @@ int pthread_getschedparam(pthread_t thread, int *policy, struct sched_param *par
 /**
  * Set scheduling policy and parameters of a thread.
  * @param thread The target thread.
- * @param  policy Ignored.
+ * @param  policy SCHED_OTHER, SCHED_FIFO or SCHED_RR.
  * @param  param The thread scheduling priority.
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
- *         with errno set to indicate the error (ESRCH).
+ *         with errno set to indicate the error (EINVAL, ESRCH, EPERM).
+ * @remark A thread registers itself with MMCSS for SCHED_FIFO and SCHED_RR,
+ *         other threads get the priority level with the priority boost off,
+ *         see sched_setscheduler.
  */
 int pthread_setschedparam(pthread_t thread, int policy, const struct sched_param *param)
 {
-    if (param != NULL)
+    int rc;
+    arch_thread_info *pv = (arch_thread_info *) thread;
+
+    if (param == NULL)
+        return lc_set_errno(EINVAL);
+
+    if (pv == NULL && (pv = (arch_thread_info *) pthread_self()) == NULL)
         return pthread_setschedprio(thread, param->sched_priority);
 
+    if ((rc = arch_sched_set(pv, policy, param->sched_priority)) != 0)
+        return lc_set_errno(rc);
+
     return 0;
 }
 
@@ -638,18 +1228,93 @@ int pthread_setschedparam(pthread_t thread, int policy, const struct sched_param
  */
 int pthread_setschedprio(pthread_t thread, int priority)
 {
+    int rc;
     HANDLE handle;
     arch_thread_info *pv = (arch_thread_info *) thread;
 
+    /* Keep the policy, MMCSS has its own priorities */
+    if (pv != NULL && pv->sched_policy != SCHED_OTHER) {
+        if ((rc = arch_sched_set(pv, pv->sched_policy, priority)) != 0)
+            return lc_set_errno(rc);
+        return 0;
+    }
+
     if (pv != NULL) handle = pv->handle;
     else handle = GetCurrentThread();
 
+    /* The mutex protocols restore the base priority when the mutexes are unlocked */
+    if (pv != NULL && arch_mutex_pi_setprio(pv, sched_priority_to_os_priority(priority)))
+        return 0;
+
     if (SetThreadPriority(handle, sched_priority_to_os_priority(priority)) == 0)
         return lc_set_errno(ESRCH);
 
     return 0;
 }
 
+static HANDLE arch_thread_handle(arch_thread_info *pv)
+{
+    if (pv == NULL || pv == (arch_thread_info *) pthread_self())
+        return GetCurrentThread();
+
+    return pv->handle;
+}
+
+/**
+ * Get the CPU affinity of a thread.
+ * @param  thread The target thread.
+ * @param  cpusetsize The size of cpuset in bytes.
+ * @param  cpuset The CPU set the thread may run on.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number will be returned to indicate the error
+ *         (ESRCH for a detached thread other than the caller).
+ */
+int pthread_getaffinity_np(pthread_t thread, size_t cpusetsize, cpu_set_t *cpuset)
+{
+    int rc;
+    cpu_set_t set;
+    HANDLE handle = arch_thread_handle((arch_thread_info *) thread);
+
+    if (handle == NULL)
+        return ESRCH;
+
+    if ((rc = arch_get_affinity(handle, &set)) != 0)
+        return rc;
+
+    return arch_cpu_set_out(cpuset, cpusetsize, &set);
+}
+
+/**
+ * Set the CPU affinity of a thread.
+ * @param  thread The target thread.
+ * @param  cpusetsize The size of cpuset in bytes.
+ * @param  cpuset The CPU set the thread may run on, CPU n is the processor
+ *         n % 64 of the processor group n / 64.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number will be returned to indicate the error.
+ * @remark A set in one processor group maps to SetThreadGroupAffinity, a set
+ *         in several groups to SetThreadSelectedCpuSetMasks (Windows 11 or
+ *         later), EINVAL is returned if it is not available.
+ */
+int pthread_setaffinity_np(pthread_t thread, size_t cpusetsize, const cpu_set_t *cpuset)
+{
+    int rc;
+    cpu_set_t set;
+    arch_thread_info *pv = (arch_thread_info *) thread;
+    HANDLE handle = arch_thread_handle(pv);
+
+    if (handle == NULL)
+        return ESRCH;
+
+    if ((rc = arch_cpu_set_in(&set, cpusetsize, cpuset)) != 0 || (rc = arch_set_affinity(handle, &set)) != 0)
+        return rc;
+
+    if (pv != NULL && pv->cache != NULL)
+        (void) arch_thread_set_state(pv, ARCH_THREAD_AFFINITY);
+
+    return 0;
+}
+
 /**
  * Detach a thread.
  *
@@ -657,12 +1322,28 @@ int pthread_setschedprio(pthread_t thread, int priority)
  * @return If the function succeeds, the return value is 0.
  *         If the function fails, the return value is -1,
  *         with errno set to indicate the error.
- * @bug The main thread do not support detach.
  */
 int pthread_detach (pthread_t t)
 {
     DWORD dwFlags;
     arch_thread_info *pv = (arch_thread_info *) t;
+    if (pv != NULL && (pv->state & ARCH_THREAD_FOREIGN) != 0)
+        return EINVAL; /* detached already */
+
+    if (pv != NULL && pv->cache != NULL) {
+        HANDLE handle = pv->handle;
+
+        if (handle == NULL || (pv->state & PTHREAD_CREATE_DETACHED) != 0)
+            return ESRCH;
+
+        pv->handle = NULL;
+        CloseHandle(handle);
+        if (arch_thread_set_state(pv, PTHREAD_CREATE_DETACHED) & ARCH_THREAD_DONE)
+            arch_thread_info_free(pv);
+
+        return 0;
+    }
+
     if (pv != NULL) {
         pv->state |= PTHREAD_CREATE_DETACHED;
 
@@ -679,12 +1360,12 @@ int pthread_detach (pthread_t t)
 /**
  * Get the calling thread's ID.
  * @return The calling thread's ID.
- * @bug The pthread_self() function returns NULL for main thread.
- * I don't think the main thread should support join, detach, or cleanup routines.
+ * @remark The main thread and threads not created by pthread_create get a
+ *         detached thread ID on their first call, they cannot be joined.
  */
 pthread_t pthread_self(void)
 {
-    return (pthread_t) TlsGetValue(libpthread_tls_index);
+    return (pthread_t) arch_thread_self();
 }
 
 /**
@@ -697,52 +1378,314 @@ int pthread_equal(pthread_t t1, pthread_t t2)
     return t1 == t2;
 }
 
+/* Return 0 if the calling thread may join the thread, or an error number */
+static int arch_thread_join_check(arch_thread_info *pv)
+{
+    DWORD dwFlags;
+
+    if (pv == NULL || pv->handle == NULL || !GetHandleInformation(pv->handle, &dwFlags))
+        return ESRCH;
+
+    if ((pv->state & PTHREAD_CREATE_DETACHED) != 0)
+        return EINVAL;
+
+    if (pthread_equal(pthread_self(), (pthread_t) pv))
+        return EDEADLK;
+
+    return 0;
+}
+
+/* Wait up to ms for the start routine of a cached thread to return */
+static int arch_thread_wait_done(arch_thread_info *pv, DWORD ms)
+{
+    long state;
+
+    /* The cached thread does not exit, wait for the start routine */
+    while (((state = atomic_read_acquire(& pv->state)) & ARCH_THREAD_DONE) == 0) {
+        if (ms == 0 || arch_wait_on_address(& pv->state, state, ms) == ETIMEDOUT)
+            return (atomic_read_acquire(& pv->state) & ARCH_THREAD_DONE) ? 0 : ETIMEDOUT;
+    }
+
+    return 0;
+}
+
+/* Wait up to ms for a thread, return 0 or ETIMEDOUT */
+static int arch_thread_wait(arch_thread_info *pv, DWORD ms)
+{
+    if (pv->cache != NULL)
+        return arch_thread_wait_done(pv, ms);
+
+    return WaitForSingleObject(pv->handle, ms) == WAIT_OBJECT_0 ? 0 : ETIMEDOUT;
+}
+
+/* Collect the return value of a terminated thread, and free it */
+static void arch_thread_reap(arch_thread_info *pv, void **value_ptr)
+{
+    CloseHandle(pv->handle);
+
+    if (value_ptr)
+        *value_ptr = pv->return_value;
+
+    arch_thread_info_free(pv);
+}
+
+/* Wait until the CLOCK_REALTIME time abstime for a thread */
+static int arch_thread_timedwait(arch_thread_info *pv, const struct timespec *abstime)
+{
+    int rc;
+    DWORD ms;
+
+    /* The timeout in ms is rounded up, and clamped below INFINITE */
+    do {
+        ms = arch_timeout_in_ms(CLOCK_REALTIME, abstime);
+    } while ((rc = arch_thread_wait(pv, ms)) == ETIMEDOUT && ms != 0);
+
+    return rc;
+}
+
+/* Wait for all of n thread handles, until abstime if not NULL */
+static int arch_thread_wait_handles(HANDLE *handles, int n, const struct timespec *abstime)
+{
+    DWORD ms = INFINITE, wait;
+
+    for (;;) {
+        if (abstime != NULL)
+            ms = arch_timeout_in_ms(CLOCK_REALTIME, abstime);
+
+        wait = WaitForMultipleObjects((DWORD) n, handles, TRUE, ms);
+        if (wait < WAIT_OBJECT_0 + (DWORD) n)
+            return 0;
+        if (wait != WAIT_TIMEOUT)
+            return EINVAL; /* a thread listed twice */
+        if (ms == 0)
+            return ETIMEDOUT;
+    }
+}
+
 /**
  * Wait for thread termination.
  * @param thread The target thread wait for termination.
  * @param value_ptr The pointer of the target thread return value.
  * @return If the function succeeds, the return value is 0.
  *         Otherwise an error number will be returned to indicate the error.
- * @bug The main thread do not support join.
+ * @remark The main thread and threads not created by pthread_create are detached.
  */
 int pthread_join(pthread_t thread, void **value_ptr)
 {
-    DWORD dwFlags;
+    int rc;
     arch_thread_info *pv = (arch_thread_info *) thread;
 
-    if (pv == NULL || pv->handle == NULL || !GetHandleInformation(pv->handle, &dwFlags))
-        return ESRCH;
+    if ((rc = arch_thread_join_check(pv)) != 0)
+        return rc;
 
-    if ((pv->state & PTHREAD_CREATE_DETACHED) != 0)
+    (void) arch_thread_wait(pv, INFINITE);
+    arch_thread_reap(pv, value_ptr);
+    return 0;
+}
+
+/**
+ * Join a thread if it has terminated, without waiting.
+ * @param thread The target thread.
+ * @param value_ptr The pointer of the target thread return value.
+ * @return If the function succeeds, the return value is 0.
+ *         EBUSY if the thread is still running, otherwise an error number
+ *         will be returned to indicate the error.
+ */
+int pthread_tryjoin_np(pthread_t thread, void **value_ptr)
+{
+    int rc;
+    arch_thread_info *pv = (arch_thread_info *) thread;
+
+    if ((rc = arch_thread_join_check(pv)) != 0)
+        return rc;
+
+    if (arch_thread_wait(pv, 0) != 0)
+        return EBUSY;
+
+    arch_thread_reap(pv, value_ptr);
+    return 0;
+}
+
+/**
+ * Wait for thread termination, with a timeout.
+ * @param thread The target thread wait for termination.
+ * @param value_ptr The pointer of the target thread return value.
+ * @param abstime The absolute timeout of CLOCK_REALTIME.
+ * @return If the function succeeds, the return value is 0.
+ *         ETIMEDOUT if the thread is still running at abstime, otherwise
+ *         an error number will be returned to indicate the error.
+ */
+int pthread_timedjoin_np(pthread_t thread, void **value_ptr, const struct timespec *abstime)
+{
+    int rc;
+    arch_thread_info *pv = (arch_thread_info *) thread;
+
+    if ((rc = arch_thread_join_check(pv)) != 0)
+        return rc;
+
+    if (abstime == NULL || abstime->tv_nsec < 0 || abstime->tv_nsec >= POW10_9)
         return EINVAL;
 
-    if (pthread_equal(pthread_self(), thread))
-        return EDEADLK;
+    if ((rc = arch_thread_timedwait(pv, abstime)) != 0)
+        return rc;
 
-    WaitForSingleObject(pv->handle, INFINITE);
-    CloseHandle(pv->handle);
+    arch_thread_reap(pv, value_ptr);
+    return 0;
+}
 
-    if (value_ptr)
-        *value_ptr = pv->return_value;
+/**
+ * Wait for the termination of many threads.
+ * @param count The number of threads.
+ * @param threads The target threads, each of them listed once.
+ * @param value_ptrs NULL, or an array of count return values.
+ * @param abstime NULL to wait without timeout, or the absolute timeout of
+ *        CLOCK_REALTIME.
+ * @return If the function succeeds, the return value is 0.
+ *         ETIMEDOUT if a thread is still running at abstime, otherwise an
+ *         error number will be returned to indicate the error.
+ * @remark The threads are joined all or none: on any error no thread is
+ *         joined, and all of them may be joined again. Up to
+ *         MAXIMUM_WAIT_OBJECTS threads are waited for with one system call.
+ */
+int pthread_join_many_np(int count, const pthread_t *threads, void **value_ptrs, const struct timespec *abstime)
+{
+    int i, j, n, rc;
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    arch_thread_info *pv;
+
+    if (count < 0 || (count > 0 && threads == NULL))
+        return EINVAL;
+
+    if (abstime != NULL && (abstime->tv_nsec < 0 || abstime->tv_nsec >= POW10_9))
+        return EINVAL;
+
+    for (i = 0; i < count; i++) {
+        if ((rc = arch_thread_join_check((arch_thread_info *) threads[i])) != 0)
+            return rc;
+    }
+
+    /* Threads which exit, a group of them a system call */
+    for (i = 0; i < count; i = j) {
+        for (n = 0, j = i; j < count && n < MAXIMUM_WAIT_OBJECTS; j++) {
+            if ((pv = (arch_thread_info *) threads[j])->cache == NULL)
+                handles[n++] = pv->handle;
+        }
+        if (n > 0 && (rc = arch_thread_wait_handles(handles, n, abstime)) != 0)
+            return rc;
+    }
+
+    /* Cached threads do not exit, wait for their start routines */
+    for (i = 0; i < count; i++) {
+        if ((pv = (arch_thread_info *) threads[i])->cache == NULL)
+            continue;
+        rc = abstime == NULL ? arch_thread_wait(pv, INFINITE) : arch_thread_timedwait(pv, abstime);
+        if (rc != 0)
+            return rc;
+    }
+
+    for (i = 0; i < count; i++)
+        arch_thread_reap((arch_thread_info *) threads[i], value_ptrs != NULL ? & value_ptrs[i] : NULL);
 
     return 0;
 }
 
+#define ARCH_ONCE_INIT      0 /* PTHREAD_ONCE_INIT */
+#define ARCH_ONCE_RUNNING   1 /* a thread runs the init routine */
+#define ARCH_ONCE_WAITING   2 /* running, and other threads park on the control */
+#define ARCH_ONCE_DONE      3 /* also checked inline by pthread_inline.h */
+
+typedef struct {
+    volatile long *control;
+    struct _pthread_cleanup_buffer buffer;
+} arch_once_guard;
+
+/* The init routine did not return: let the next caller run it */
+static void arch_once_abort(void *arg)
+{
+    arch_once_guard *guard = (arch_once_guard *) arg;
+    volatile long *control = guard->control;
+
+    if (control == NULL)
+        return; /* the frame and the unwinder both call us */
+
+    guard->control = NULL;
+    if (atomic_xchg_release(control, ARCH_ONCE_INIT) == ARCH_ONCE_WAITING)
+        arch_wake_by_address_all(control);
+}
+
+/* The init routine threw: unlink the frame it skipped, then abort */
+static void arch_once_unwind(arch_once_guard *guard)
+{
+    arch_thread_info *pv = arch_tls_get(libpthread_tls_index);
+
+    if (guard->control == NULL)
+        return;
+
+    if (pv != NULL && pv->cleanup == &guard->buffer)
+        pv->cleanup = guard->buffer.__prev;
+    arch_once_abort((void *) guard);
+}
+
+/* Run the init routine, with the control reset if it exits or throws */
+static void arch_once_run(volatile long *control, void (* init_routine)(void))
+{
+#if defined(__GNUC__)
+    arch_once_guard guard __attribute__((cleanup(arch_once_unwind)));
+#else
+    arch_once_guard guard;
+#endif
+
+    guard.control = control;
+    _pthread_cleanup_push(&guard.buffer, arch_once_abort, (void *) &guard);
+#if defined(_MSC_VER)
+    __try {
+        init_routine();
+    } __finally {
+        if (AbnormalTermination())
+            arch_once_unwind(&guard);
+    }
+#else
+    init_routine();
+#endif
+    _pthread_cleanup_pop(&guard.buffer, 0);
+    guard.control = NULL;
+}
+
 /**
  * Once-only initialization.
  * @param  once_control The control variable which initialized to PTHREAD_ONCE_INIT.
  * @param  init_routine The initialization code which executed at most once.
  * @return Always return 0.
+ * @remark Once done, a call is one acquire load. Later callers park on
+ *         once_control while the init routine runs. If the init routine
+ *         calls pthread_exit or throws a C++ exception, once_control is
+ *         reset and one of the waiting threads runs it again.
  */
 int pthread_once(pthread_once_t *once_control, void (* init_routine)(void))
 {
-    if (atomic_cmpxchg((long volatile *) once_control, 1, 0) == 0) {
-        init_routine();
-        *(volatile int *) once_control = 2;
-    } else {
-        while(*(volatile int *) once_control != 2)
-            SwitchToThread();
+    long state;
+    volatile long *control = (volatile long *) once_control;
+
+    if (atomic_read_acquire(control) == ARCH_ONCE_DONE)
+        return 0;
+
+    for (;;) {
+        state = atomic_cmpxchg_acquire(control, ARCH_ONCE_RUNNING, ARCH_ONCE_INIT);
+        if (state == ARCH_ONCE_INIT)
+            break;
+        if (state == ARCH_ONCE_DONE)
+            return 0;
+
+        if (state == ARCH_ONCE_WAITING
+            || atomic_cmpxchg(control, ARCH_ONCE_WAITING, ARCH_ONCE_RUNNING) == ARCH_ONCE_RUNNING)
+            arch_wait_on_address(control, ARCH_ONCE_WAITING, INFINITE);
     }
 
+    arch_once_run(control, init_routine);
+
+    /* Release the results of the init routine, and wake the parked callers */
+    if (atomic_xchg_release(control, ARCH_ONCE_DONE) == ARCH_ONCE_WAITING)
+        arch_wake_by_address_all(control);
+
     return 0;
 }
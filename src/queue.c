@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file queue.c
+ * @brief Implementation Code of Bounded MPMC Queue Routines
+ */
+
+#include <pthread.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * Bounded MPMC queue (Vyukov, "Bounded MPMC queue", 1024cores.net).
+ *
+ * Every cell carries the position it is ready for: a producer of position
+ * pos waits for seq == pos, fills the cell and publishes seq = pos + 1; the
+ * consumer of pos waits for seq == pos + 1, empties it and hands it to the
+ * next lap with seq = pos + capacity. Producers claim positions by moving
+ * tail with one compare-and-swap, consumers by moving head, so the two
+ * sides only share the cells they hand over.
+ *
+ * A batch claims a run of ready cells with the same compare-and-swap: no
+ * other thread can claim a cell between the check and the move, so the
+ * run stays ready, and one wake-up is paid per batch.
+ *
+ * A side without cells spins for libpthread_spin_count rounds, then counts
+ * itself in and parks on the sequence the other side moves; a handover
+ * checks the count after a full fence (Dekker), so the cost of the parking
+ * is one load per batch while nobody waits.
+ */
+
+#define QUEUE_MAX_CAPACITY  (1L << 30)
+
+/* seq - pos, wrap-around safe */
+#define QUEUE_DIFF(s, p)    ((long) ((unsigned long) (s) - (unsigned long) (p)))
+
+extern long libpthread_spin_count;
+
+/*
+ * Claim up to n cells whose seq is their position plus ready (0 for
+ * producers at tail, 1 for consumers at head), return how many.
+ */
+static long queue_claim(arch_queue *q, volatile long *end, long ready, long n, long *first)
+{
+    long pos, k, dif;
+
+    for (;;) {
+        pos = atomic_read(end);
+        for (k = 0, dif = 0; k < n; k++) {
+            /* Acquire: the cell was released by the other side */
+            dif = QUEUE_DIFF(atomic_read_acquire(& q->cells[(pos + k) & q->mask].seq), pos + k + ready);
+            if (dif != 0)
+                break;
+        }
+
+        if (k == 0) {
+            /* Full or empty, or pos is stale */
+            if (dif < 0)
+                return 0;
+            continue;
+        }
+
+        if (atomic_cmpxchg(end, pos + k, pos) == pos) {
+            *first = pos;
+            return k;
+        }
+    }
+}
+
+/* Claim up to n cells, waiting while there is none: spin, then park on seq */
+static long queue_claim_wait(arch_queue *q, volatile long *end, long ready, long n, long *first,
+    volatile long *seq, volatile long *waiters)
+{
+    long k, s, spins;
+
+    for (spins = 0; (k = queue_claim(q, end, ready, n, first)) == 0; spins++) {
+        if (spins < libpthread_spin_count) {
+            cpu_relax();
+            continue;
+        }
+
+        s = atomic_read(seq);
+        atomic_fetch_and_add(waiters, 1);
+        /* The count is seen before the cells are loaded, pairs with queue_signal */
+        memory_barrier_after_atomic();
+        k = queue_claim(q, end, ready, n, first);
+        if (k == 0)
+            arch_wait_on_address(seq, s, INFINITE);
+        atomic_fetch_and_add(waiters, -1);
+        if (k != 0)
+            break;
+    }
+
+    return k;
+}
+
+/* Wake up to n threads parked on seq, after handing over n cells */
+static void queue_signal(volatile long *seq, volatile long *waiters, long n)
+{
+    long w;
+
+    /* The cells are published before waiters is loaded */
+    memory_barrier();
+    if ((w = atomic_read(waiters)) == 0)
+        return;
+
+    atomic_fetch_and_add(seq, 1);
+    arch_wake_by_address_waiters(seq, (int) n, w);
+}
+
+static void queue_fill(arch_queue *q, void * const *items, long first, long n)
+{
+    long i;
+    arch_queue_cell *c;
+
+    for (i = 0; i < n; i++) {
+        c = & q->cells[(first + i) & q->mask];
+        c->data = items[i];
+        atomic_set_release(& c->seq, first + i + 1);
+    }
+
+    queue_signal(& q->pushed, & q->consumers, n);
+}
+
+static void queue_drain(arch_queue *q, void **items, long first, long n)
+{
+    long i;
+    arch_queue_cell *c;
+
+    for (i = 0; i < n; i++) {
+        c = & q->cells[(first + i) & q->mask];
+        items[i] = c->data;
+        atomic_set_release(& c->seq, first + i + q->mask + 1);
+    }
+
+    queue_signal(& q->popped, & q->producers, n);
+}
+
+/**
+ * Create a bounded MPMC queue.
+ * @param queue The pointer of the queue.
+ * @param capacity The number of items the queue holds, rounded up to a
+ *        power of 2, at least 2.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL or ENOMEM returned to indicate the error.
+ */
+int pthread_queue_init(pthread_queue_t *queue, int capacity)
+{
+    long i, size;
+    arch_queue *q;
+
+    if (queue == NULL || capacity <= 0 || capacity > QUEUE_MAX_CAPACITY)
+        return EINVAL;
+
+    for (size = 2; size < capacity; size <<= 1)
+        ;
+
+    if ((q = (arch_queue *) _aligned_malloc(sizeof(arch_queue), ARCH_CACHE_LINE)) == NULL)
+        return ENOMEM;
+
+    memset(q, 0, sizeof(arch_queue));
+    q->mask = size - 1;
+    q->cells = (arch_queue_cell *) _aligned_malloc(size * sizeof(arch_queue_cell), ARCH_CACHE_LINE);
+    if (q->cells == NULL) {
+        _aligned_free(q);
+        return ENOMEM;
+    }
+
+    for (i = 0; i < size; i++) {
+        q->cells[i].data = NULL;
+        q->cells[i].seq = i;
+    }
+
+    *queue = q;
+    return 0;
+}
+
+/**
+ * Destroy a bounded MPMC queue.
+ * @param queue The pointer of the queue.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned if the queue is invalid, or EBUSY
+ *         returned if a thread is parked on it.
+ * @remark The items left in the queue are dropped.
+ */
+int pthread_queue_destroy(pthread_queue_t *queue)
+{
+    arch_queue *q;
+
+    if (queue == NULL || (q = (arch_queue *) *queue) == NULL)
+        return EINVAL;
+
+    if (atomic_read(& q->consumers) != 0 || atomic_read(& q->producers) != 0)
+        return EBUSY;
+
+    _aligned_free(q->cells);
+    _aligned_free(q);
+    *queue = NULL;
+
+    return 0;
+}
+
+/**
+ * Push an item, waiting while the queue is full.
+ * @param queue The pointer of the queue.
+ * @param item The item.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ */
+int pthread_queue_push(pthread_queue_t *queue, void *item)
+{
+    return pthread_queue_push_many(queue, &item, 1);
+}
+
+/**
+ * Try to push an item.
+ * @param queue The pointer of the queue.
+ * @param item The item.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EAGAIN returned if the queue is full, or EINVAL
+ *         returned to indicate the error.
+ */
+int pthread_queue_trypush(pthread_queue_t *queue, void *item)
+{
+    long first;
+    arch_queue *q;
+
+    if (queue == NULL || (q = (arch_queue *) *queue) == NULL)
+        return EINVAL;
+
+    if (queue_claim(q, & q->tail, 0, 1, &first) == 0)
+        return EAGAIN;
+
+    queue_fill(q, &item, first, 1);
+    return 0;
+}
+
+/**
+ * Push items, waiting while the queue is full.
+ * @param queue The pointer of the queue.
+ * @param items The items.
+ * @param count The number of items.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark The items are pushed in runs of consecutive cells, the items of
+ *         a run are next to each other in the queue, the runs may be
+ *         interleaved with the items of other producers. Parked consumers
+ *         are woken once per run.
+ */
+int pthread_queue_push_many(pthread_queue_t *queue, void * const *items, int count)
+{
+    long n, first;
+    arch_queue *q;
+
+    if (queue == NULL || (q = (arch_queue *) *queue) == NULL || count < 0 || (items == NULL && count != 0))
+        return EINVAL;
+
+    while (count > 0) {
+        n = queue_claim_wait(q, & q->tail, 0, count, &first, & q->popped, & q->producers);
+        queue_fill(q, items, first, n);
+        items += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Pop an item, waiting while the queue is empty.
+ * @param queue The pointer of the queue.
+ * @param item The pointer that receives the item.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ */
+int pthread_queue_pop(pthread_queue_t *queue, void **item)
+{
+    return pthread_queue_pop_many(queue, item, 1, NULL);
+}
+
+/**
+ * Try to pop an item.
+ * @param queue The pointer of the queue.
+ * @param item The pointer that receives the item.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EAGAIN returned if the queue is empty, or EINVAL
+ *         returned to indicate the error.
+ */
+int pthread_queue_trypop(pthread_queue_t *queue, void **item)
+{
+    long first;
+    arch_queue *q;
+
+    if (queue == NULL || (q = (arch_queue *) *queue) == NULL || item == NULL)
+        return EINVAL;
+
+    if (queue_claim(q, & q->head, 1, 1, &first) == 0)
+        return EAGAIN;
+
+    queue_drain(q, item, first, 1);
+    return 0;
+}
+
+/**
+ * Pop up to count items, waiting while the queue is empty.
+ * @param queue The pointer of the queue.
+ * @param items The array that receives the items.
+ * @param count The size of items, at least 1.
+ * @param popped The pointer that receives the number of items popped, or
+ *        NULL.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark It returns as soon as it got at least one item, with the run of
+ *         consecutive items available at that time, in queue order.
+ */
+int pthread_queue_pop_many(pthread_queue_t *queue, void **items, int count, int *popped)
+{
+    long n, first;
+    arch_queue *q;
+
+    if (queue == NULL || (q = (arch_queue *) *queue) == NULL || items == NULL || count <= 0)
+        return EINVAL;
+
+    n = queue_claim_wait(q, & q->head, 1, count, &first, & q->pushed, & q->consumers);
+    queue_drain(q, items, first, n);
+
+    if (popped != NULL)
+        *popped = (int) n;
+
+    return 0;
+}
@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file rcu.c
+ * @brief Implementation Code of Read-Copy-Update
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * Read-copy-update with epochs (McKenney and Slingwine, "Read-Copy Update:
+ * Using Execution History to Solve Concurrency Problems"; the asymmetric
+ * fence as in the userspace RCU of Desnoyers et al., "User-Level
+ * Implementations of Read-Copy Update").
+ *
+ * A reader stores the global epoch into its record when it enters its
+ * outermost read section, and 0 when it leaves it: a store to a line no
+ * other thread writes. An updater starts a new grace period by moving the
+ * epoch on, then waits for every registered reader that is still in a
+ * section of an older epoch. Readers that enter after the move see the new
+ * epoch, so they cannot hold what the updater unlinked before it.
+ *
+ * The store of the reader record must be visible before the reader loads
+ * the protected data, a store-load order that costs a full fence on x86 as
+ * on ARM. With FlushProcessWriteBuffers (Vista and later) the updater pays
+ * that fence for all the readers at once, an IPI to every processor, and
+ * the reader only needs the compiler not to move its loads; on XP a reader
+ * fences itself.
+ *
+ * pthread_rcu_call queues callbacks on a lock-free list, a reclaimer thread
+ * started on the first call takes the whole list, waits one grace period
+ * and runs them, so a batch of callbacks shares one grace period.
+ */
+
+#ifdef _MSC_VER
+#define arch_compiler_barrier()     _ReadWriteBarrier()
+#else
+#define arch_compiler_barrier()     __asm__ __volatile__("" ::: "memory")
+#endif
+
+extern DWORD libpthread_tls_index;
+extern long libpthread_spin_count;
+extern long libpthread_spin_yield_count;
+
+typedef VOID (WINAPI *flush_process_write_buffers_t)(VOID);
+
+static struct {
+    long epoch; /* the current grace period epoch, never 0 */
+    arch_rcu_reader *readers; /* registered readers, under rcu_lock */
+    long queued, done; /* callbacks queued, and run */
+    long seq; /* moves when pending becomes non-empty */
+    pthread_rcu_head_t *pending; /* callbacks to run, newest first */
+    HANDLE thread;
+    DWORD thread_id;
+} rcu = {1};
+
+/* Serializes the grace periods, and guards the reader registry */
+static pthread_mutex_t rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t rcu_once = PTHREAD_ONCE_INIT;
+static flush_process_write_buffers_t flush_process_write_buffers;
+
+/**
+ * Resolve the process wide write buffer flush, called from DllMain before
+ * any reader runs, so that readers and updaters agree on the fences.
+ */
+void arch_rcu_init(void)
+{
+    HMODULE h = GetModuleHandleA("kernel32.dll");
+
+    if (h != NULL)
+        flush_process_write_buffers = (flush_process_write_buffers_t) GetProcAddress(h, "FlushProcessWriteBuffers");
+}
+
+/* Order the store of the reader record before the loads of the read section */
+static __inline void arch_rcu_reader_fence(void)
+{
+    if (flush_process_write_buffers != NULL)
+        arch_compiler_barrier();
+    else
+        memory_barrier();
+}
+
+/* Order the unlinks and the epoch move before the loads of the reader records */
+static __inline void arch_rcu_updater_fence(void)
+{
+    memory_barrier();
+    if (flush_process_write_buffers != NULL)
+        flush_process_write_buffers();
+}
+
+/* The reader record of the calling thread, NULL if it has none yet */
+static __inline arch_rcu_reader *arch_rcu_current(void)
+{
+    arch_thread_info *pv = arch_tls_get(libpthread_tls_index);
+
+    return pv != NULL ? & pv->rcu : NULL;
+}
+
+/* Put the record of the calling thread into the registry */
+static int arch_rcu_register(arch_rcu_reader *r)
+{
+    int rc;
+
+    if ((rc = pthread_mutex_lock(&rcu_lock)) != 0)
+        return rc;
+
+    if ((r->next = rcu.readers) != NULL)
+        r->next->pprev = & r->next;
+    r->pprev = & rcu.readers;
+    rcu.readers = r;
+
+    pthread_mutex_unlock(&rcu_lock);
+    return 0;
+}
+
+/**
+ * Take an exiting thread out of the reader registry, called before its
+ * pthread_t is released or reused.
+ * @param  pv The thread of the record.
+ * @remark A thread that exits inside a read section leaves it.
+ */
+void arch_rcu_thread_fini(arch_thread_info *pv)
+{
+    arch_rcu_reader *r = & pv->rcu;
+
+    if (r->pprev == NULL)
+        return;
+
+    r->nesting = 0;
+    atomic_set_release(& r->epoch, 0);
+
+    pthread_mutex_lock(&rcu_lock);
+    if ((*r->pprev = r->next) != NULL)
+        r->next->pprev = r->pprev;
+    r->pprev = NULL;
+    r->next = NULL;
+    pthread_mutex_unlock(&rcu_lock);
+}
+
+/* Wait for a reader to move: spin, then yield, then sleep */
+static void arch_rcu_wait(long *spins)
+{
+    if (*spins < libpthread_spin_count) {
+        cpu_relax();
+    } else if (*spins < libpthread_spin_count + libpthread_spin_yield_count) {
+        SwitchToThread();
+    } else {
+        Sleep(1);
+        return;
+    }
+    (*spins)++;
+}
+
+/**
+ * Enter a read section.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, ENOMEM returned if the calling thread cannot be
+ *         registered as a reader.
+ * @remark Read sections nest. A reader must not block on anything the
+ *         updaters hold while they wait for a grace period, nor call
+ *         pthread_rcu_synchronize or pthread_rcu_barrier.
+ */
+int pthread_rcu_read_lock(void)
+{
+    int rc;
+    arch_rcu_reader *r = arch_rcu_current();
+
+    if (r == NULL) {
+        arch_thread_info *pv = (arch_thread_info *) pthread_self();
+        if (pv == NULL)
+            return ENOMEM;
+        r = & pv->rcu;
+    }
+
+    if (r->nesting++ != 0)
+        return 0;
+
+    if (r->pprev == NULL && (rc = arch_rcu_register(r)) != 0) {
+        r->nesting = 0;
+        return rc;
+    }
+
+    /* Acquire: pairs with the release of the epoch in pthread_rcu_synchronize */
+    atomic_set(& r->epoch, atomic_read_acquire(& rcu.epoch));
+    arch_rcu_reader_fence();
+
+    return 0;
+}
+
+/**
+ * Leave a read section.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EPERM returned if the calling thread is not in a read
+ *         section.
+ */
+int pthread_rcu_read_unlock(void)
+{
+    arch_rcu_reader *r = arch_rcu_current();
+
+    if (r == NULL || r->nesting == 0)
+        return EPERM;
+
+    /* Release: the loads of the section are done before the updater sees 0 */
+    if (--r->nesting == 0)
+        atomic_set_release(& r->epoch, 0);
+
+    return 0;
+}
+
+/**
+ * Wait for a grace period: return after all the read sections that were
+ * in progress when it was called have ended.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EDEADLK returned if the calling thread is in a read
+ *         section, or the error of locking the registry.
+ * @remark Once it returns, what the caller unlinked before the call can
+ *         be freed. The read sections entered in the meantime do not delay
+ *         it.
+ */
+int pthread_rcu_synchronize(void)
+{
+    int rc;
+    long epoch;
+    arch_rcu_reader *r = arch_rcu_current();
+
+    if (r != NULL && r->nesting != 0)
+        return EDEADLK;
+
+    if ((rc = pthread_mutex_lock(&rcu_lock)) != 0)
+        return rc;
+
+    /*
+     * Only the holder of rcu_lock moves the epoch. Release: a reader that
+     * sees the new epoch also sees the unlinks made before the call.
+     */
+    if ((epoch = rcu.epoch + 1) == 0)
+        epoch = 1;
+    atomic_set_release(& rcu.epoch, epoch);
+    arch_rcu_updater_fence();
+
+    for (r = rcu.readers; r != NULL; r = r->next) {
+        long e, spins = 0;
+
+        while ((e = atomic_read_acquire(& r->epoch)) != 0 && e != epoch)
+            arch_rcu_wait(&spins);
+    }
+
+    pthread_mutex_unlock(&rcu_lock);
+    return 0;
+}
+
+/* Take the pending callbacks, in the order they were queued */
+static pthread_rcu_head_t *arch_rcu_take(long *n)
+{
+    pthread_rcu_head_t *head, *next, *fifo;
+
+    head = atomic_xchg_ptr((void * volatile *) & rcu.pending, NULL);
+    for (fifo = NULL, *n = 0; head != NULL; head = next, (*n)++) {
+        next = head->next;
+        head->next = fifo;
+        fifo = head;
+    }
+
+    return fifo;
+}
+
+static void arch_rcu_run(pthread_rcu_head_t *fifo)
+{
+    pthread_rcu_head_t *next;
+
+    for (; fifo != NULL; fifo = next) {
+        next = fifo->next;
+        fifo->func(fifo);
+    }
+}
+
+static unsigned __stdcall arch_rcu_thread(void *arg)
+{
+    long s, n;
+    pthread_rcu_head_t *fifo;
+
+    for (;;) {
+        /* Acquire: a push after the xchg moves seq after this load */
+        s = atomic_read_acquire(& rcu.seq);
+        if ((fifo = arch_rcu_take(&n)) == NULL) {
+            arch_wait_on_address(& rcu.seq, s, INFINITE);
+            continue;
+        }
+
+        pthread_rcu_synchronize();
+        arch_rcu_run(fifo);
+
+        atomic_fetch_and_add_release(& rcu.done, n);
+        arch_wake_by_address_all(& rcu.done);
+    }
+
+    return 0;
+}
+
+static void arch_rcu_start(void)
+{
+    arch_module_pin();
+    rcu.thread = (HANDLE) _beginthreadex(NULL, 0, arch_rcu_thread, NULL, 0, (unsigned int *) & rcu.thread_id);
+}
+
+/**
+ * Run the callbacks still queued, and release the reclaimer thread, called
+ * from DllMain at process detach.
+ * @remark The library is pinned once the reclaimer runs, so it only gets
+ *         here with one at process exit, when the other threads are gone:
+ *         the reclaimer is stopped, and no reader is left to wait for.
+ */
+void arch_rcu_fini(void)
+{
+    long n;
+    HANDLE thread = rcu.thread;
+
+    if (thread == NULL)
+        return;
+
+    rcu.thread = NULL; /* pthread_rcu_call fails from now on */
+    rcu.thread_id = 0;
+    arch_rcu_run(arch_rcu_take(&n));
+    atomic_fetch_and_add_release(& rcu.done, n);
+    CloseHandle(thread);
+}
+
+/**
+ * Queue a callback to run after a grace period.
+ * @param  head The callback record, usually embedded in the unlinked object.
+ * @param  func The callback, called with head on the reclaimer thread.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned if head or func is NULL, or EAGAIN
+ *         returned if the reclaimer thread cannot be created.
+ * @remark It does not wait, and may be called inside a read section. The
+ *         callbacks run in the order they were queued, one at a time, they
+ *         may queue more callbacks but must not call pthread_rcu_barrier.
+ */
+int pthread_rcu_call(pthread_rcu_head_t *head, void (* func)(pthread_rcu_head_t *head))
+{
+    pthread_rcu_head_t *old;
+
+    if (head == NULL || func == NULL)
+        return EINVAL;
+
+    pthread_once(&rcu_once, arch_rcu_start);
+    if (rcu.thread == NULL)
+        return EAGAIN;
+
+    head->func = func;
+    atomic_fetch_and_add(& rcu.queued, 1);
+
+    do {
+        old = atomic_read_ptr((void * volatile *) & rcu.pending);
+        head->next = old;
+    } while (atomic_cmpxchg_ptr((void * volatile *) & rcu.pending, head, old) != old);
+
+    /* The reclaimer may be parked on an empty list */
+    if (old == NULL) {
+        atomic_fetch_and_add(& rcu.seq, 1);
+        arch_wake_by_address_single(& rcu.seq);
+    }
+
+    return 0;
+}
+
+/**
+ * Wait for the callbacks queued so far to run.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EDEADLK returned if it is called from a read section
+ *         or from a callback.
+ * @remark Call it before unloading the code or freeing the data the
+ *         callbacks use.
+ */
+int pthread_rcu_barrier(void)
+{
+    long queued, done;
+    arch_rcu_reader *r = arch_rcu_current();
+
+    if ((r != NULL && r->nesting != 0) || GetCurrentThreadId() == rcu.thread_id)
+        return EDEADLK;
+
+    queued = atomic_read(& rcu.queued);
+    while ((long) ((unsigned long) (done = atomic_read_acquire(& rcu.done)) - (unsigned long) queued) < 0)
+        arch_wait_on_address(& rcu.done, done, INFINITE);
+
+    return 0;
+}
@@ -0,0 +1,494 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file rwlock.c
+ * @brief Implementation Code of Read-Write Lock Routines
+ */
+
+#include <pthread.h>
+#include <pthread_clock.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * Writers are preferred: once a writer waits, new readers park until all
+ * writers are gone, so a steady stream of readers can not starve writers.
+ *
+ * By default readers are counted in the state word. With the per-CPU
+ * attribute every reader increments one of ncpu counters, picked by thread
+ * id and padded to a cache line each, and a writer first blocks new readers,
+ * then waits for all the counters to drop to zero.
+ */
+
+#define RW_WRITER   1 /* a writer owns the lock */
+#define RW_DRAIN    2 /* a writer waits for the per-CPU readers to leave */
+#define RW_READER   4 /* one reader, when counted in the state word */
+
+/* pthread_rwlock_try* are timed locks which time out at once */
+static const struct timespec arch_rwlock_now = {0, 0};
+
+/**
+ * Create a read-write lock attribute object.
+ * @param attr The pointer of the read-write lock attribute object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, ENOMEM returned to indicate the error.
+ */
+int pthread_rwlockattr_init(pthread_rwlockattr_t *attr)
+{
+    arch_rwlock_attr *pv = arch_slab_alloc(sizeof(arch_rwlock_attr));
+    if (pv == NULL)
+        return ENOMEM;
+
+    pv->pshared = PTHREAD_PROCESS_PRIVATE;
+
+    *attr = pv;
+
+    return 0;
+}
+
+/**
+ * Get the read-write lock process-shared attribute.
+ * @param attr The pointer of the read-write lock attribute object.
+ * @param pshared The process-shared attribute.
+ * @return Always return 0.
+ * @remark The only type we support is PTHREAD_PROCESS_PRIVATE.
+ * @remark This function is provided for source code compatibility but no effect when called.
+ */
+int pthread_rwlockattr_getpshared(const pthread_rwlockattr_t *attr, int *pshared)
+{
+    arch_rwlock_attr *pv = (arch_rwlock_attr *) *attr;
+    *pshared = pv->pshared;
+    return 0;
+}
+
+/**
+ * Set the read-write lock process-shared attribute.
+ * @param attr The pointer of the read-write lock attribute object.
+ * @param pshared The process-shared attribute.
+ * @return Always return 0.
+ * @remark The only type we support is PTHREAD_PROCESS_PRIVATE.
+ * @remark This function is provided for source code compatibility but no effect when called.
+ */
+int pthread_rwlockattr_setpshared(pthread_rwlockattr_t *attr, int pshared)
+{
+    arch_rwlock_attr *pv = (arch_rwlock_attr *) *attr;
+    pv->pshared = pshared;
+    return 0;
+}
+
+/**
+ * Get the per-CPU reader count attribute.
+ * @param attr The pointer of the read-write lock attribute object.
+ * @param percpu Non-zero if readers are counted per-CPU.
+ * @return Always return 0.
+ */
+int pthread_rwlockattr_getpercpu_np(const pthread_rwlockattr_t *attr, int *percpu)
+{
+    arch_rwlock_attr *pv = (arch_rwlock_attr *) *attr;
+    *percpu = pv->percpu;
+    return 0;
+}
+
+/**
+ * Set the per-CPU reader count attribute.
+ * @param attr The pointer of the read-write lock attribute object.
+ * @param percpu Non-zero to count readers per-CPU, zero (the default) to
+ *        count them in one shared word.
+ * @return Always return 0.
+ * @remark Per-CPU readers never write a shared cache line, at the cost of
+ *         ncpu cache lines per lock and slower writers. It suits read-mostly
+ *         data on many cores.
+ */
+int pthread_rwlockattr_setpercpu_np(pthread_rwlockattr_t *attr, int percpu)
+{
+    arch_rwlock_attr *pv = (arch_rwlock_attr *) *attr;
+    pv->percpu = percpu != 0;
+    return 0;
+}
+
+/**
+ * Destroy a read-write lock attribute object.
+ * @param attr The pointer of the read-write lock attribute object.
+ * @return Always return 0.
+ */
+int pthread_rwlockattr_destroy(pthread_rwlockattr_t *attr)
+{
+    if (attr != NULL) {
+        arch_slab_free(*attr, sizeof(arch_rwlock_attr));
+        *attr = NULL;
+    }
+
+    return 0;
+}
+
+static int arch_rwlock_init(pthread_rwlock_t *rwlock, int percpu, int lock)
+{
+    long n;
+    arch_rwlock *pv = arch_numa_alloc(sizeof(arch_rwlock), -1);
+    if (pv == NULL)
+        return ENOMEM;
+
+    if (percpu) {
+        for (n = 1; n < get_ncpu(); n <<= 1);
+
+        pv->slots = _aligned_malloc(n * sizeof(arch_rwlock_slot), ARCH_CACHE_LINE);
+        if (pv->slots == NULL) {
+            arch_numa_free(pv, sizeof(arch_rwlock));
+            return ENOMEM;
+        }
+
+        memset(pv->slots, 0, n * sizeof(arch_rwlock_slot));
+        pv->nslots = n;
+    }
+
+    if (!lock) {
+        *rwlock = pv;
+        return 0;
+    }
+
+    if (atomic_cmpxchg_ptr(rwlock, pv, NULL) != NULL) {
+        arch_numa_free(pv, sizeof(arch_rwlock));
+    }
+
+    return 0;
+}
+
+/* Lazily allocate read-write locks initialized with PTHREAD_RWLOCK_INITIALIZER */
+static __inline arch_rwlock *arch_rwlock_ptr(pthread_rwlock_t *rwlock)
+{
+    if (*rwlock == NULL && arch_rwlock_init(rwlock, 0, 1) != 0)
+        return NULL;
+
+    return (arch_rwlock *) *rwlock;
+}
+
+/* The per-CPU reader count of the calling thread, thread ids are multiples of 4 */
+static __inline arch_rwlock_slot *arch_rwlock_slot_of(arch_rwlock *pv)
+{
+    return & pv->slots[(GetCurrentThreadId() >> 2) & (pv->nslots - 1)];
+}
+
+/* Park on *seq while it is value, 0 if woken or ETIMEDOUT */
+static int arch_rwlock_park(long volatile *seq, long value, const struct timespec *t)
+{
+    DWORD ms = INFINITE;
+
+    if (t != NULL && (ms = arch_timeout_in_ms(CLOCK_REALTIME, t)) == 0)
+        return ETIMEDOUT;
+
+    if (arch_wait_on_address(seq, value, ms) == ETIMEDOUT && arch_timeout_in_ms(CLOCK_REALTIME, t) == 0)
+        return ETIMEDOUT;
+
+    return 0;
+}
+
+/* A writer releases the lock or gives up waiting, wake the next writer or all readers */
+static void arch_rwlock_writer_leave(arch_rwlock *pv)
+{
+    if (atomic_fetch_and_add(& pv->writers, -1) > 1) {
+        (void) atomic_fetch_and_add(& pv->write_seq, 1);
+        arch_wake_by_address_single(& pv->write_seq);
+    } else {
+        (void) atomic_fetch_and_add(& pv->read_seq, 1);
+        arch_wake_by_address_all(& pv->read_seq);
+    }
+}
+
+/* A per-CPU reader leaves, a writer may be waiting for its counter */
+static void arch_rwlock_reader_leave(arch_rwlock *pv, arch_rwlock_slot *slot)
+{
+    (void) atomic_fetch_and_add(& slot->count, -1);
+    memory_barrier_after_atomic();
+    if (atomic_read(& pv->writers) != 0) {
+        (void) atomic_fetch_and_add(& pv->write_seq, 1);
+        arch_wake_by_address_all(& pv->write_seq);
+    }
+}
+
+static int arch_rwlock_rdlock(arch_rwlock *pv, const struct timespec *t)
+{
+    long s, seq;
+    arch_rwlock_slot *slot = pv->nslots != 0 ? arch_rwlock_slot_of(pv) : NULL;
+
+    for (;;) {
+        if (atomic_read(& pv->writers) == 0) {
+            if (slot != NULL) {
+                (void) atomic_fetch_and_add(& slot->count, 1);
+                memory_barrier_after_atomic();
+                if (atomic_read(& pv->writers) == 0)
+                    return 0;
+                arch_rwlock_reader_leave(pv, slot);
+            } else {
+                s = atomic_read(& pv->state);
+                if ((s & RW_WRITER) == 0) {
+                    if (s > LONG_MAX - RW_READER)
+                        return EAGAIN;
+                    if (atomic_cmpxchg_acquire(& pv->state, s + RW_READER, s) == s)
+                        return 0;
+                    continue;
+                }
+            }
+        }
+
+        seq = atomic_read(& pv->read_seq);
+        if (atomic_read(& pv->writers) != 0 && arch_rwlock_park(& pv->read_seq, seq, t) == ETIMEDOUT)
+            return ETIMEDOUT;
+    }
+}
+
+static int arch_rwlock_wrlock(arch_rwlock *pv, const struct timespec *t)
+{
+    long i, seq;
+    long claim = pv->nslots != 0 ? RW_DRAIN : RW_WRITER;
+
+    (void) atomic_fetch_and_add(& pv->writers, 1);
+    memory_barrier_after_atomic();
+
+    while (atomic_cmpxchg(& pv->state, claim, 0) != 0) {
+        seq = atomic_read(& pv->write_seq);
+        if (atomic_read(& pv->state) != 0 && arch_rwlock_park(& pv->write_seq, seq, t) == ETIMEDOUT) {
+            arch_rwlock_writer_leave(pv);
+            return ETIMEDOUT;
+        }
+    }
+
+    /* New readers are blocked by pv->writers, wait for the old ones to leave */
+    for (i = 0; i < pv->nslots; i++) {
+        while (atomic_read_acquire(& pv->slots[i].count) != 0) {
+            seq = atomic_read(& pv->write_seq);
+            if (atomic_read(& pv->slots[i].count) != 0 && arch_rwlock_park(& pv->write_seq, seq, t) == ETIMEDOUT) {
+                atomic_set_release(& pv->state, 0);
+                arch_rwlock_writer_leave(pv);
+                return ETIMEDOUT;
+            }
+        }
+    }
+
+    if (claim != RW_WRITER)
+        (void) atomic_xchg(& pv->state, RW_WRITER);
+
+    return 0;
+}
+
+/**
+ * Create a read-write lock.
+ * @param rwlock The pointer of the read-write lock object.
+ * @param attr The pointer of the read-write lock attribute object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, ENOMEM returned to indicate the error.
+ */
+int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr)
+{
+    int percpu = 0;
+
+    if (attr != NULL && *attr != NULL)
+        percpu = ((arch_rwlock_attr *) *attr)->percpu;
+
+    *rwlock = NULL;
+    return arch_rwlock_init(rwlock, percpu, 0);
+}
+
+/**
+ * Acquire a read-write lock for writing.
+ * @param rwlock The pointer of the read-write lock object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, ENOMEM returned to indicate the error.
+ */
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)
+{
+    arch_rwlock *pv = arch_rwlock_ptr(rwlock);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    return arch_rwlock_wrlock(pv, NULL);
+}
+
+/**
+ * Acquire a read-write lock for writing, with a timeout.
+ * @param rwlock The pointer of the read-write lock object.
+ * @param abs_timeout The absolute timeout, measured by CLOCK_REALTIME.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number (ETIMEDOUT, EINVAL or ENOMEM) returned
+ *         to indicate the error.
+ */
+int pthread_rwlock_timedwrlock(pthread_rwlock_t *rwlock, const struct timespec *abs_timeout)
+{
+    arch_rwlock *pv = arch_rwlock_ptr(rwlock);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    if (abs_timeout == NULL || abs_timeout->tv_nsec < 0 || abs_timeout->tv_nsec >= POW10_9)
+        return EINVAL;
+
+    return arch_rwlock_wrlock(pv, abs_timeout);
+}
+
+/**
+ * Acquire a read-write lock for reading.
+ * @param rwlock The pointer of the read-write lock object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number (EAGAIN or ENOMEM) returned to
+ *         indicate the error.
+ * @remark Writers are preferred, so a thread which already holds the lock
+ *         for reading may deadlock if it acquires it again while a writer
+ *         is waiting.
+ */
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)
+{
+    arch_rwlock *pv = arch_rwlock_ptr(rwlock);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    return arch_rwlock_rdlock(pv, NULL);
+}
+
+/**
+ * Acquire a read-write lock for reading, with a timeout.
+ * @param rwlock The pointer of the read-write lock object.
+ * @param abs_timeout The absolute timeout, measured by CLOCK_REALTIME.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number (ETIMEDOUT, EAGAIN, EINVAL or ENOMEM)
+ *         returned to indicate the error.
+ */
+int pthread_rwlock_timedrdlock(pthread_rwlock_t *rwlock, const struct timespec *abs_timeout)
+{
+    arch_rwlock *pv = arch_rwlock_ptr(rwlock);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    if (abs_timeout == NULL || abs_timeout->tv_nsec < 0 || abs_timeout->tv_nsec >= POW10_9)
+        return EINVAL;
+
+    return arch_rwlock_rdlock(pv, abs_timeout);
+}
+
+/**
+ * Release a read-write lock.
+ * @param rwlock The pointer of the read-write lock object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EPERM returned if the lock is not held.
+ */
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock)
+{
+    long s;
+    arch_rwlock *pv = (arch_rwlock *) *rwlock;
+
+    if (pv == NULL)
+        return EPERM;
+
+    if (atomic_read(& pv->state) & RW_WRITER) {
+        atomic_set_release(& pv->state, 0);
+        arch_rwlock_writer_leave(pv);
+        return 0;
+    }
+
+    if (pv->nslots != 0) {
+        arch_rwlock_reader_leave(pv, arch_rwlock_slot_of(pv));
+        return 0;
+    }
+
+    s = atomic_fetch_and_add(& pv->state, -RW_READER) - RW_READER;
+    memory_barrier_after_atomic();
+    if (s == 0 && atomic_read(& pv->writers) != 0) {
+        (void) atomic_fetch_and_add(& pv->write_seq, 1);
+        arch_wake_by_address_single(& pv->write_seq);
+    }
+
+    return 0;
+}
+
+/**
+ * Try to acquire a read-write lock for reading.
+ * @param rwlock The pointer of the read-write lock object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number (EBUSY, EAGAIN or ENOMEM) returned to
+ *         indicate the error.
+ */
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)
+{
+    int rc;
+    arch_rwlock *pv = arch_rwlock_ptr(rwlock);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    rc = arch_rwlock_rdlock(pv, &arch_rwlock_now);
+    return rc == ETIMEDOUT ? EBUSY : rc;
+}
+
+/**
+ * Try to acquire a read-write lock for writing.
+ * @param rwlock The pointer of the read-write lock object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number (EBUSY or ENOMEM) returned to
+ *         indicate the error.
+ */
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock)
+{
+    int rc;
+    arch_rwlock *pv = arch_rwlock_ptr(rwlock);
+
+    if (pv == NULL)
+        return ENOMEM;
+
+    rc = arch_rwlock_wrlock(pv, &arch_rwlock_now);
+    return rc == ETIMEDOUT ? EBUSY : rc;
+}
+
+/**
+ * Destroy a read-write lock.
+ * @param rwlock The pointer of the read-write lock object.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EBUSY returned if the lock is held or waited for.
+ */
+int pthread_rwlock_destroy(pthread_rwlock_t *rwlock)
+{
+    long i;
+    arch_rwlock *pv = (arch_rwlock *) *rwlock;
+
+    if (pv == NULL)
+        return 0;
+
+    if (pv->state != 0 || pv->writers != 0)
+        return EBUSY;
+
+    for (i = 0; i < pv->nslots; i++) {
+        if (pv->slots[i].count != 0)
+            return EBUSY;
+    }
+
+    if (pv->slots != NULL)
+        _aligned_free(pv->slots);
+    arch_numa_free(pv, sizeof(arch_rwlock));
+    *rwlock = NULL;
+
+    return 0;
+}
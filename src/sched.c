@@ -24,9 +24,11 @@
 
 #include <sched.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <winsock2.h>
 
+#include "arch.h"
 #include "misc.h"
 
 /*
@@ -45,34 +47,210 @@ int sched_yield(void)
     return 0;
 }
 
+/*
+ * SCHED_FIFO and SCHED_RR threads are registered with the Multimedia Class
+ * Scheduler Service (Windows Vista or later), which runs them in the real-time
+ * band without raising the priority class of the whole process. avrt.dll is
+ * loaded on the first use, never from DllMain. Threads which cannot register
+ * keep the mapped priority level of SCHED_OTHER with the priority boost off,
+ * and run in the real-time band when the process uses REALTIME_PRIORITY_CLASS.
+ */
+
+#define AVRT_PRIORITY_LOW           -1
+#define AVRT_PRIORITY_NORMAL        0
+#define AVRT_PRIORITY_HIGH          1
+#define AVRT_PRIORITY_CRITICAL      2
+
+typedef HANDLE (WINAPI *av_set_mm_thread_characteristics_t)(LPCSTR, LPDWORD);
+typedef BOOL (WINAPI *av_set_mm_thread_priority_t)(HANDLE, int);
+typedef BOOL (WINAPI *av_revert_mm_thread_characteristics_t)(HANDLE);
+
+extern DWORD libpthread_tls_index;
+
+static pthread_once_t avrt_once = PTHREAD_ONCE_INIT;
+static av_set_mm_thread_characteristics_t av_set_mm_thread_characteristics;
+static av_set_mm_thread_priority_t av_set_mm_thread_priority;
+static av_revert_mm_thread_characteristics_t av_revert_mm_thread_characteristics;
+
+static void arch_avrt_resolve(void)
+{
+    HMODULE h;
+
+    if ((h = LoadLibraryA("avrt.dll")) == NULL)
+        return;
+
+    av_set_mm_thread_characteristics = (av_set_mm_thread_characteristics_t) GetProcAddress(h, "AvSetMmThreadCharacteristicsA");
+    av_set_mm_thread_priority = (av_set_mm_thread_priority_t) GetProcAddress(h, "AvSetMmThreadPriority");
+    av_revert_mm_thread_characteristics = (av_revert_mm_thread_characteristics_t) GetProcAddress(h, "AvRevertMmThreadCharacteristics");
+
+    if (av_set_mm_thread_characteristics == NULL || av_set_mm_thread_priority == NULL
+        || av_revert_mm_thread_characteristics == NULL) {
+        av_set_mm_thread_characteristics = NULL;
+        FreeLibrary(h);
+    }
+}
+
+/* The MMCSS priority of a sched_priority, 1 .. 15 */
+static int arch_avrt_priority(int priority)
+{
+    if (priority <= 4)
+        return AVRT_PRIORITY_LOW;
+    if (priority <= 9)
+        return AVRT_PRIORITY_NORMAL;
+    if (priority <= 13)
+        return AVRT_PRIORITY_HIGH;
+    return AVRT_PRIORITY_CRITICAL;
+}
+
+/* Register the calling thread with MMCSS, 0 if it is not available */
+static int arch_sched_set_mmcss(arch_thread_info *pv, int priority)
+{
+    DWORD index = 0;
+
+    pthread_once(& avrt_once, arch_avrt_resolve);
+    if (av_set_mm_thread_characteristics == NULL)
+        return 0;
+
+    if (pv->mmcss == NULL && (pv->mmcss = av_set_mm_thread_characteristics("Pro Audio", &index)) == NULL)
+        return 0;
+
+    if (!av_set_mm_thread_priority(pv->mmcss, arch_avrt_priority(priority))) {
+        av_revert_mm_thread_characteristics(pv->mmcss);
+        pv->mmcss = NULL;
+        return 0;
+    }
+
+    pv->sched_priority = priority;
+    return 1;
+}
+
+/**
+ * Set the scheduling policy and priority of a thread.
+ * @param  pv The target thread.
+ * @param  policy SCHED_OTHER, SCHED_FIFO or SCHED_RR.
+ * @param  priority The sched_priority, 1 .. 15.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number will be returned to indicate the error
+ *         (EINVAL, ESRCH, or EPERM for an MMCSS thread other than the caller).
+ * @remark Only the calling thread can register with MMCSS, the policy of
+ *         another thread is applied with the priority level and boost.
+ */
+int arch_sched_set(arch_thread_info *pv, int policy, int priority)
+{
+    HANDLE handle;
+    int self = (pv == (arch_thread_info *) arch_tls_get(libpthread_tls_index));
+
+    if (policy < SCHED_MIN || policy > SCHED_MAX)
+        return EINVAL;
+    if (priority < sched_get_priority_min(policy) || priority > sched_get_priority_max(policy))
+        return EINVAL;
+
+    if (pv->mmcss != NULL && !self)
+        return EPERM;
+
+    if (self && policy != SCHED_OTHER && arch_sched_set_mmcss(pv, priority)) {
+        SetThreadPriorityBoost(GetCurrentThread(), TRUE);
+        pv->sched_policy = policy;
+        return 0;
+    }
+
+    if (pv->mmcss != NULL) {
+        av_revert_mm_thread_characteristics(pv->mmcss);
+        pv->mmcss = NULL;
+    }
+
+    if ((handle = self ? GetCurrentThread() : pv->handle) == NULL)
+        return ESRCH;
+
+    /* The mutex protocols restore the base priority when the mutexes are unlocked */
+    if (!arch_mutex_pi_setprio(pv, sched_priority_to_os_priority(priority))
+        && !SetThreadPriority(handle, sched_priority_to_os_priority(priority)))
+        return ESRCH;
+
+    /* Dynamic boosts would reorder real-time threads of the same level */
+    SetThreadPriorityBoost(handle, policy != SCHED_OTHER);
+    pv->sched_policy = policy;
+    return 0;
+}
+
+/**
+ * Apply the scheduling policy of a new thread, called from the thread itself.
+ */
+void arch_sched_thread_start(arch_thread_info *pv)
+{
+    if (pv->sched_policy != SCHED_OTHER)
+        (void) arch_sched_set(pv, pv->sched_policy, pv->sched_priority);
+}
+
+/**
+ * Leave MMCSS and SCHED_FIFO or SCHED_RR, called when a thread ends.
+ */
+void arch_sched_thread_fini(arch_thread_info *pv)
+{
+    if (pv->mmcss != NULL) {
+        av_revert_mm_thread_characteristics(pv->mmcss);
+        pv->mmcss = NULL;
+    }
+
+    if (pv->sched_policy != SCHED_OTHER) {
+        SetThreadPriorityBoost(GetCurrentThread(), FALSE);
+        pv->sched_policy = SCHED_OTHER;
+    }
+}
+
+/* The thread of pid, 0 or getpid() is the calling thread, NULL for another process */
+static arch_thread_info *arch_sched_thread(pid_t pid)
+{
+    if (pid != 0 && (DWORD) pid != GetCurrentProcessId())
+        return NULL;
+
+    return (arch_thread_info *) pthread_self();
+}
+
 /**
  * Get the scheduling policy.
- * @param  pid Ignored.
- * @return Always return SCHED_OTHER.
+ * @param  pid The process identifier, 0 for the calling thread.
+ * @return The scheduling policy of the calling thread if pid is 0 or the
+ *         calling process, otherwise SCHED_OTHER.
  */
 int sched_getscheduler(pid_t pid)
 {
-    return SCHED_OTHER;
+    arch_thread_info *pv = arch_sched_thread(pid);
+
+    return pv != NULL ? pv->sched_policy : SCHED_OTHER;
 }
 
 /**
  * Set the scheduling parameters.
- * @param  pid The process identifier.
+ * @param  pid The process identifier, 0 for the calling thread.
  * @param  policy The scheduling policy.
  * @param  param The scheduling parameters.
- * @return Always return 0.
- *         If pid is 0 and policy is SCHED_OTHER, then call SetThreadPriority with the mapped priority.
- *         Otherwise, do nothing.
+ * @return If the function succeeds, the return value is the former policy.
+ *         If the function fails, the return value is -1,
+ *         with errno set to indicate the error (EINVAL, EPERM, or ESRCH
+ *         if pid is another process).
+ * @remark SCHED_FIFO and SCHED_RR register the calling thread with MMCSS, or
+ *         turn its priority boost off before Windows Vista. The priority class
+ *         of the process is left to SetPriorityClass.
  */
 int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param)
 {
-    if (pid == 0 && policy == SCHED_OTHER && param != NULL) {
-        int priority = sched_priority_to_os_priority(param->sched_priority);
-        if(!SetThreadPriority(GetCurrentThread(), priority))
-            return lc_set_errno(EPERM);
-    }
+    int rc, old;
+    arch_thread_info *pv;
 
-    return 0;
+    if (param == NULL)
+        return lc_set_errno(EINVAL);
+
+    if (pid != 0 && (DWORD) pid != GetCurrentProcessId())
+        return lc_set_errno(ESRCH); /* we do not change another process */
+    if ((pv = arch_sched_thread(pid)) == NULL)
+        return lc_set_errno(EPERM); /* Out of memory for a foreign thread */
+
+    old = pv->sched_policy;
+    if ((rc = arch_sched_set(pv, policy, param->sched_priority)) != 0)
+        return lc_set_errno(rc == ESRCH ? EPERM : rc);
+
+    return old;
 }
 
 /**
@@ -99,11 +277,13 @@ int sched_get_priority_max(int policy)
  * Set scheduling parameters.
  * @param  pid The process identifier.
  * @param  param The scheduling parameters.
- * @return sched_setscheduler(pid, SCHED_OTHER, param).
+ * @return sched_setscheduler(pid, sched_getscheduler(pid), param), 0 on success.
  */
 int sched_setparam(pid_t pid, const struct sched_param *param)
 {
-    return sched_setscheduler(pid, SCHED_OTHER, param);
+    int rc = sched_setscheduler(pid, sched_getscheduler(pid), param);
+
+    return rc < 0 ? rc : 0;
 }
 
 /**
@@ -116,27 +296,282 @@ int sched_setparam(pid_t pid, const struct sched_param *param)
  */
 int sched_getparam(pid_t pid, struct sched_param *param)
 {
+    arch_thread_info *pv;
+
     param->sched_priority = 8; /* THREAD_PRIORITY_NORMAL */
-    if (pid == 0)
-        param->sched_priority = os_priority_to_sched_priority(GetThreadPriority(GetCurrentThread()));
+    if (pid == 0) {
+        pv = arch_tls_get(libpthread_tls_index);
+        if (pv != NULL && pv->mmcss != NULL)
+            param->sched_priority = pv->sched_priority;
+        else
+            param->sched_priority = os_priority_to_sched_priority(GetThreadPriority(GetCurrentThread()));
+    }
 
     return 0;
 }
 
+/* Quantum units of a background thread, 3 per clock tick, [long][fixed] */
+static const int quantum_units[2][2] = { { 6, 18 }, { 12, 36 } };
+
+static int arch_is_server(void)
+{
+    OSVERSIONINFOEXA osvi;
+    DWORDLONG mask = VerSetConditionMask(0, VER_PRODUCT_TYPE, VER_EQUAL);
+
+    memset(&osvi, 0, sizeof(osvi));
+    osvi.dwOSVersionInfoSize = sizeof(osvi);
+    osvi.wProductType = VER_NT_WORKSTATION;
+
+    return !VerifyVersionInfoA(&osvi, VER_PRODUCT_TYPE, mask);
+}
+
 /**
  * Get the SCHED_RR interval.
  * @param  pid The process identifier.
  * @param  tp The SCHED_RR interval.
  * @return Always return 0.
+ * @remark The interval is the quantum Win32PrioritySeparation selects, short
+ *         and variable on client systems, long and fixed on servers. A
+ *         foreground process on a client system gets up to 3 times of it.
  */
 int sched_rr_get_interval(pid_t pid, struct timespec * tp)
 {
+    HKEY key;
+    int server, is_long, is_fixed;
+    unsigned long long ns;
+    DWORD value = 0, size = sizeof(value), type;
     DWORD   timeAdjustment, timeIncrement;
     BOOL    isTimeAdjustmentDisabled;
 
     (void) GetSystemTimeAdjustment(&timeAdjustment, &timeIncrement, &isTimeAdjustmentDisabled);
-    tp->tv_sec = 0;
-    tp->tv_nsec = timeIncrement * 100;
+
+    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, "SYSTEM\\CurrentControlSet\\Control\\PriorityControl",
+        0, KEY_QUERY_VALUE, &key) == ERROR_SUCCESS) {
+        if (RegQueryValueExA(key, "Win32PrioritySeparation", NULL, &type, (LPBYTE) &value, &size) != ERROR_SUCCESS
+            || type != REG_DWORD)
+            value = 0;
+        RegCloseKey(key);
+    }
+
+    /* 1 is long and variable, 2 is short and fixed, 0 and 3 the default of the system */
+    server = arch_is_server();
+    is_long = ((value >> 4) & 3) == 1 || (((value >> 4) & 3) != 2 && server);
+    is_fixed = ((value >> 2) & 3) == 2 || (((value >> 2) & 3) != 1 && server);
+
+    ns = (unsigned long long) quantum_units[is_long][is_fixed] * timeIncrement * 100 / 3;
+    tp->tv_sec = (time_t) (ns / 1000000000);
+    tp->tv_nsec = (long) (ns % 1000000000);
+
+    return 0;
+}
+
+/*
+ * Processor groups (Windows 7 or later) hold up to 64 logical processors
+ * each, a thread runs in one group unless it selects CPU sets in several
+ * groups (Windows 11 or later). The APIs are resolved at run time and we
+ * fall back to the plain affinity mask of group 0 without them.
+ */
+
+#define ARCH_CPU_GROUPS     (CPU_SETSIZE / __NCPUBITS)
+
+typedef VOID (WINAPI *get_current_processor_number_ex_t)(PPROCESSOR_NUMBER);
+typedef DWORD (WINAPI *get_current_processor_number_t)(VOID);
+typedef BOOL (WINAPI *set_thread_group_affinity_t)(HANDLE, const GROUP_AFFINITY *, PGROUP_AFFINITY);
+typedef BOOL (WINAPI *get_thread_group_affinity_t)(HANDLE, PGROUP_AFFINITY);
+typedef BOOL (WINAPI *set_thread_selected_cpu_set_masks_t)(HANDLE, PGROUP_AFFINITY, USHORT);
+typedef BOOL (WINAPI *get_thread_selected_cpu_set_masks_t)(HANDLE, PGROUP_AFFINITY, USHORT, PUSHORT);
+
+static long group_resolved;
+static get_current_processor_number_ex_t get_current_processor_number_ex;
+static get_current_processor_number_t get_current_processor_number;
+static get_active_processor_group_count_t get_active_processor_group_count;
+static get_active_processor_count_t get_active_processor_count;
+static set_thread_group_affinity_t set_thread_group_affinity;
+static get_thread_group_affinity_t get_thread_group_affinity;
+static set_thread_selected_cpu_set_masks_t set_thread_selected_cpu_set_masks;
+static get_thread_selected_cpu_set_masks_t get_thread_selected_cpu_set_masks;
+
+static void arch_group_resolve(void)
+{
+    HMODULE h;
+
+    if (atomic_read_acquire(& group_resolved))
+        return;
+
+    if ((h = GetModuleHandleA("kernel32.dll")) != NULL) {
+        get_current_processor_number_ex = (get_current_processor_number_ex_t) GetProcAddress(h, "GetCurrentProcessorNumberEx");
+        get_current_processor_number = (get_current_processor_number_t) GetProcAddress(h, "GetCurrentProcessorNumber");
+        get_active_processor_group_count = (get_active_processor_group_count_t) GetProcAddress(h, "GetActiveProcessorGroupCount");
+        get_active_processor_count = (get_active_processor_count_t) GetProcAddress(h, "GetActiveProcessorCount");
+        set_thread_group_affinity = (set_thread_group_affinity_t) GetProcAddress(h, "SetThreadGroupAffinity");
+        get_thread_group_affinity = (get_thread_group_affinity_t) GetProcAddress(h, "GetThreadGroupAffinity");
+        set_thread_selected_cpu_set_masks = (set_thread_selected_cpu_set_masks_t) GetProcAddress(h, "SetThreadSelectedCpuSetMasks");
+        get_thread_selected_cpu_set_masks = (get_thread_selected_cpu_set_masks_t) GetProcAddress(h, "GetThreadSelectedCpuSetMasks");
+    }
+
+    atomic_set_release(& group_resolved, 1);
+}
+
+/**
+ * Get the CPU the calling thread is running on.
+ * @return The CPU number, group * 64 + number in the group, see cpu_set_t.
+ *         If the function fails, the return value is -1,
+ *         with errno set to indicate the error (ENOSYS before Windows Vista).
+ */
+int sched_getcpu(void)
+{
+    PROCESSOR_NUMBER pn;
+
+    arch_group_resolve();
+
+    if (get_current_processor_number_ex != NULL) {
+        get_current_processor_number_ex(&pn);
+        return pn.Group * __NCPUBITS + pn.Number;
+    }
+
+    if (get_current_processor_number != NULL)
+        return (int) get_current_processor_number();
+
+    return lc_set_errno(ENOSYS);
+}
+
+/**
+ * Count the CPUs in a CPU set, see CPU_COUNT.
+ * @param  setsize The size of the CPU set in bytes.
+ * @param  set The CPU set.
+ * @return The number of CPUs in the set.
+ */
+int __sched_cpucount(size_t setsize, const cpu_set_t *set)
+{
+    int n = 0;
+    size_t i;
+
+    for (i = 0; i < setsize / sizeof(uint64_t); i++) {
+        uint64_t bits = set->__bits[i];
+        while (bits != 0) {
+            bits &= bits - 1;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Compare two CPU sets, see CPU_EQUAL.
+ * @param  setsize The size of the CPU sets in bytes.
+ * @param  set1 The first CPU set.
+ * @param  set2 The second CPU set.
+ * @return Non-zero if the sets hold the same CPUs, otherwise zero.
+ */
+int __sched_cpuequal(size_t setsize, const cpu_set_t *set1, const cpu_set_t *set2)
+{
+    return memcmp(set1, set2, setsize) == 0;
+}
+
+/* Restrict the thread to the CPUs of set, return 0 or an error number */
+int arch_set_affinity(HANDLE thread, const cpu_set_t *set)
+{
+    int i, n = 0;
+    GROUP_AFFINITY ga[ARCH_CPU_GROUPS];
+
+    arch_group_resolve();
+
+    memset(ga, 0, sizeof(ga));
+    for (i = 0; i < ARCH_CPU_GROUPS; i++) {
+        if (set->__bits[i] == 0)
+            continue;
+
+        /* Groups of 32-bit Windows have 32 processors at most */
+        if ((uint64_t) (KAFFINITY) set->__bits[i] != set->__bits[i])
+            return EINVAL;
+
+        ga[n].Mask = (KAFFINITY) set->__bits[i];
+        ga[n].Group = (WORD) i;
+        n++;
+    }
+
+    if (n == 0)
+        return EINVAL;
+
+    if (n > 1) {
+        if (set_thread_selected_cpu_set_masks == NULL)
+            return EINVAL;
+        return set_thread_selected_cpu_set_masks(thread, ga, (USHORT) n) ? 0 : EINVAL;
+    }
+
+    if (set_thread_group_affinity == NULL) {
+        if (ga[0].Group != 0)
+            return EINVAL;
+        return SetThreadAffinityMask(thread, ga[0].Mask) != 0 ? 0 : EINVAL;
+    }
+
+    /* Drop the CPU sets of an earlier multi-group affinity */
+    if (set_thread_selected_cpu_set_masks != NULL)
+        (void) set_thread_selected_cpu_set_masks(thread, NULL, 0);
+
+    return set_thread_group_affinity(thread, ga, NULL) ? 0 : EINVAL;
+}
+
+/* Get the CPUs the thread may run on, return 0 or an error number */
+int arch_get_affinity(HANDLE thread, cpu_set_t *set)
+{
+    USHORT i, n = 0;
+    DWORD_PTR pm, sm, old;
+    GROUP_AFFINITY ga[ARCH_CPU_GROUPS];
+
+    arch_group_resolve();
+
+    memset(set, 0, sizeof(cpu_set_t));
+
+    if (get_thread_selected_cpu_set_masks != NULL
+        && get_thread_selected_cpu_set_masks(thread, ga, ARCH_CPU_GROUPS, &n) && n > 0) {
+        for (i = 0; i < n; i++) {
+            if (ga[i].Group < ARCH_CPU_GROUPS)
+                set->__bits[ga[i].Group] |= ga[i].Mask;
+        }
+        return 0;
+    }
+
+    if (get_thread_group_affinity != NULL) {
+        if (!get_thread_group_affinity(thread, ga) || ga[0].Group >= ARCH_CPU_GROUPS)
+            return ESRCH;
+        set->__bits[ga[0].Group] = ga[0].Mask;
+        return 0;
+    }
+
+    /* No way to read it before Windows 7 but to replace it */
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &pm, &sm) || (old = SetThreadAffinityMask(thread, pm)) == 0)
+        return ESRCH;
+    (void) SetThreadAffinityMask(thread, old);
+    set->__bits[0] = old;
 
     return 0;
 }
+
+/* Get the CPUs available to the threads of the process, in all processor groups */
+void arch_cpu_available(cpu_set_t *set)
+{
+    WORD g, groups;
+    DWORD n;
+    DWORD_PTR pm, sm;
+
+    arch_group_resolve();
+
+    memset(set, 0, sizeof(cpu_set_t));
+
+    if (get_active_processor_group_count != NULL && get_active_processor_count != NULL
+        && (groups = get_active_processor_group_count()) > 1) {
+        /* The active processors of a group are numbered from 0 */
+        for (g = 0; g < groups && g < ARCH_CPU_GROUPS; g++) {
+            n = get_active_processor_count(g);
+            set->__bits[g] = n >= __NCPUBITS ? ~(uint64_t) 0 : ((uint64_t) 1 << n) - 1;
+        }
+        return;
+    }
+
+    if (GetProcessAffinityMask(GetCurrentProcess(), &pm, &sm))
+        set->__bits[0] = pm;
+    else
+        set->__bits[0] = 1;
+}
@@ -31,6 +31,69 @@
 #include "arch.h"
 #include "misc.h"
 
+extern long libpthread_sem_spin_count;
+
+/*
+ * A process-private semaphore keeps its count in value, sem_post and an
+ * uncontended sem_wait are a single interlocked operation, and a waiter
+ * parks on value only when the count is zero. Process-shared and named
+ * semaphores are kernel semaphore objects.
+ */
+
+/* Take one count of a private semaphore, 0 or EAGAIN */
+static __inline int arch_sem_trydown(arch_sem_t *pv)
+{
+    long value;
+
+    while ((value = atomic_read(& pv->value)) > 0) {
+        if (atomic_cmpxchg_acquire(& pv->value, value - 1, value) == value)
+            return 0;
+    }
+
+    return EAGAIN;
+}
+
+/* Take one count of a private semaphore, spin then park, 0 or ETIMEDOUT */
+static int arch_sem_down(arch_sem_t *pv, const struct timespec *t)
+{
+    long i;
+    int rc = 0;
+    DWORD ms = INFINITE;
+    ARCH_LOCK_STATS(__int64 start = arch_clock_monotonic_ns();)
+
+    for (i = atomic_read(& libpthread_sem_spin_count); i > 0; i--) {
+        if (arch_sem_trydown(pv) == 0) {
+            ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_SEM_NP, ARCH_LOCK_SPIN, start));
+            return 0;
+        }
+        cpu_relax();
+    }
+
+    if (arch_trace_enabled(ARCH_TRACE_SEM))
+        arch_trace(ARCH_TRACE_SEM_WAIT_START, (uintptr_t) pv, 0, 0, 0);
+
+    (void) atomic_fetch_and_add(& pv->waiters, 1);
+    /* A post sees us, or we see its value */
+    memory_barrier_after_atomic();
+    while (arch_sem_trydown(pv) != 0) {
+        if (t != NULL && (ms = arch_timeout_in_ms(CLOCK_REALTIME, t)) == 0) {
+            rc = ETIMEDOUT;
+            break;
+        }
+        arch_wait_on_address(& pv->value, 0, ms);
+    }
+    (void) atomic_fetch_and_add_relaxed(& pv->waiters, -1);
+
+    /* We may have taken the wake-up of a post, pass it on */
+    if (rc != 0 && atomic_read(& pv->value) > 0 && atomic_read(& pv->waiters) > 0)
+        arch_wake_by_address_single(& pv->value);
+
+    if (arch_trace_enabled(ARCH_TRACE_SEM))
+        arch_trace(ARCH_TRACE_SEM_WAIT_STOP, (uintptr_t) pv, rc != 0, 0, 0);
+    ARCH_LOCK_STATS(if (rc == 0) arch_lock_stats_acquired(pv, PTHREAD_LOCK_SEM_NP, ARCH_LOCK_PARK, start));
+    return rc;
+}
+
 /**
  * Create an unnamed semaphore.
  * @param sem The pointer of the semaphore object.
@@ -51,15 +114,19 @@ int sem_init(sem_t *sem, int pshared, unsigned int value)
     if (sem == NULL || value > (unsigned int) SEM_VALUE_MAX)
         return lc_set_errno(EINVAL);
 
-    if (NULL == (pv = (arch_sem_t *)calloc(1, sizeof(arch_sem_t))))
+    if (NULL == (pv = (arch_sem_t *)arch_slab_alloc(sizeof(arch_sem_t))))
         return lc_set_errno(ENOMEM);
 
-    if (pshared != PTHREAD_PROCESS_PRIVATE) {
-        sprintf(buf, "Global\\%p", pv);
+    if (pshared == PTHREAD_PROCESS_PRIVATE) {
+        pv->value = (long) value;
+        *sem = pv;
+        ARCH_LOCK_STATS(arch_lock_stats_init(pv, PTHREAD_LOCK_SEM_NP, ARCH_RETURN_ADDRESS()));
+        return 0;
     }
 
+    sprintf(buf, "Global\\%p", pv);
     if ((pv->handle = CreateSemaphore (NULL, value, SEM_VALUE_MAX, buf)) == NULL) {
-        free(pv);
+        arch_slab_free(pv, sizeof(arch_sem_t));
         return lc_set_errno(ENOSPC);
     }
 
@@ -81,6 +148,15 @@ int sem_wait(sem_t *sem)
     if (sem == NULL || pv == NULL)
         return lc_set_errno(EINVAL);
 
+    if (pv->handle == NULL) {
+        if (arch_sem_trydown(pv) == 0) {
+            ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_SEM_NP, ARCH_LOCK_FAST, 0));
+            return 0;
+        }
+        (void) arch_sem_down(pv, NULL);
+        return 0;
+    }
+
     if (WaitForSingleObject(pv->handle, INFINITE) != WAIT_OBJECT_0)
         return lc_set_errno(EINVAL);
 
@@ -102,6 +178,13 @@ int sem_trywait(sem_t *sem)
     if (sem == NULL || pv == NULL)
         return lc_set_errno(EINVAL);
 
+    if (pv->handle == NULL) {
+        if (arch_sem_trydown(pv) != 0)
+            return lc_set_errno(EAGAIN);
+        ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_SEM_NP, ARCH_LOCK_FAST, 0));
+        return 0;
+    }
+
     if ((rc = WaitForSingleObject(pv->handle, 0)) == WAIT_OBJECT_0)
         return 0;
 
@@ -129,6 +212,16 @@ int sem_timedwait(sem_t *sem, const struct timespec *abs_timeout)
     if (sem == NULL || pv == NULL)
         return lc_set_errno(EINVAL);
 
+    if (pv->handle == NULL) {
+        if (arch_sem_trydown(pv) == 0) {
+            ARCH_LOCK_STATS(arch_lock_stats_acquired(pv, PTHREAD_LOCK_SEM_NP, ARCH_LOCK_FAST, 0));
+            return 0;
+        }
+        if (arch_sem_down(pv, abs_timeout) != 0)
+            return lc_set_errno(ETIMEDOUT);
+        return 0;
+    }
+
     if ((rc = WaitForSingleObject(pv->handle, arch_rel_time_in_ms(abs_timeout))) == WAIT_OBJECT_0)
         return 0;
 
@@ -152,6 +245,20 @@ int sem_post(sem_t *sem)
     if (sem == NULL || pv == NULL)
         return lc_set_errno(EINVAL);
 
+    if (pv->handle == NULL) {
+        long value;
+
+        do {
+            if ((value = atomic_read(& pv->value)) == SEM_VALUE_MAX)
+                return lc_set_errno(EOVERFLOW);
+        } while (atomic_cmpxchg(& pv->value, value + 1, value) != value);
+        memory_barrier_after_atomic();
+
+        if (atomic_read(& pv->waiters) > 0)
+            arch_wake_by_address_single(& pv->value);
+        return 0;
+    }
+
     if (ReleaseSemaphore(pv->handle, 1, NULL) == 0) {
         if (ERROR_TOO_MANY_POSTS == GetLastError())
             return lc_set_errno(EOVERFLOW);
@@ -161,6 +268,47 @@ int sem_post(sem_t *sem)
     return 0;
 }
 
+/**
+ * Release a semaphore count times.
+ * @param sem The pointer of the semaphore object.
+ * @param count The number of counts to add, at least 1.
+ * @return If the function succeeds, the return value is 0.
+ *         If the function fails, the return value is -1,
+ *         with errno set to indicate the error.
+ * @remark Adds all the counts at once or none: the value of a private
+ *         semaphore moves with one interlocked operation, and wakes the
+ *         waiters with one call when there are no more than count of them.
+ *         A process-shared semaphore is released with one ReleaseSemaphore.
+ */
+int sem_post_multiple(sem_t *sem, int count)
+{
+    arch_sem_t *pv = (arch_sem_t *) sem;
+
+    if (sem == NULL || pv == NULL || count <= 0)
+        return lc_set_errno(EINVAL);
+
+    if (pv->handle == NULL) {
+        long value;
+
+        do {
+            if ((value = atomic_read(& pv->value)) > SEM_VALUE_MAX - count)
+                return lc_set_errno(EOVERFLOW);
+        } while (atomic_cmpxchg(& pv->value, value + count, value) != value);
+        memory_barrier_after_atomic();
+
+        arch_wake_by_address_waiters(& pv->value, count, atomic_read(& pv->waiters));
+        return 0;
+    }
+
+    if (ReleaseSemaphore(pv->handle, count, NULL) == 0) {
+        if (ERROR_TOO_MANY_POSTS == GetLastError())
+            return lc_set_errno(EOVERFLOW);
+        return lc_set_errno(EINVAL);
+    }
+
+    return 0;
+}
+
 /**
  * Get the value of a semaphore.
  * @param sem The pointer of the semaphore object.
@@ -174,6 +322,14 @@ int sem_getvalue(sem_t *sem, int *value)
     long previous;
     arch_sem_t *pv = (arch_sem_t *) sem;
 
+    if (pv == NULL || value == NULL)
+        return lc_set_errno(EINVAL);
+
+    if (pv->handle == NULL) {
+        *value = (int) atomic_read(& pv->value);
+        return 0;
+    }
+
     switch (WaitForSingleObject(pv->handle, 0)) {
     case WAIT_OBJECT_0:
         if (!ReleaseSemaphore(pv->handle, 1, &previous))
@@ -202,11 +358,12 @@ int sem_destroy(sem_t *sem)
     if (pv == NULL)
         return lc_set_errno(EINVAL);
 
-    if (CloseHandle (pv->handle) == 0)
+    if (pv->handle != NULL && CloseHandle (pv->handle) == 0)
         return lc_set_errno(EINVAL);
 
-    free(pv);
-    *sem = NULL;
+    ARCH_LOCK_STATS(arch_lock_stats_destroy(pv));
+    /* sem is the block itself, nothing to clear once it is freed */
+    arch_slab_free(pv, sizeof(arch_sem_t));
 
     return 0;
 }
@@ -236,7 +393,7 @@ sem_t *sem_open(const char *name, int oflag, mode_t mode, unsigned int value)
         return NULL;
     }
 
-    if (NULL == (pv = (arch_sem_t *)calloc(1, sizeof(arch_sem_t)))) {
+    if (NULL == (pv = (arch_sem_t *)arch_slab_alloc(sizeof(arch_sem_t)))) {
         lc_set_errno(ENOMEM);
         return NULL;
     }
@@ -258,20 +415,20 @@ sem_t *sem_open(const char *name, int oflag, mode_t mode, unsigned int value)
                 lc_set_errno(ENOSPC);
                 break;
         }
-        free(pv);
+        arch_slab_free(pv, sizeof(arch_sem_t));
         return NULL;
     } else {
         if (GetLastError() == ERROR_ALREADY_EXISTS) {
             if ((oflag & O_CREAT) && (oflag & O_EXCL)) {
                 CloseHandle(pv->handle);
-                free(pv);
+                arch_slab_free(pv, sizeof(arch_sem_t));
                 lc_set_errno(EEXIST);
                 return NULL;
             }
             return (sem_t *) pv;
         } else {
             if (!(oflag & O_CREAT)) {
-                free(pv);
+                arch_slab_free(pv, sizeof(arch_sem_t));
                 lc_set_errno(ENOENT);
                 return NULL;
             }
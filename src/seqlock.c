@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file seqlock.c
+ * @brief Implementation Code of Sequence Lock Routines
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * Sequence lock (Lameter, "Effective Synchronization on Linux/NUMA Systems";
+ * the fences as in Boehm, "Can Seqlocks Get Along With Programming Language
+ * Memory Models?").
+ *
+ * A reader loads seq, copies the data and loads seq again: two loads, and no
+ * store to share the cache line with other readers. It retries if a writer
+ * was inside (seq odd) or came and went (seq moved). Writers serialize by
+ * making seq odd with a compare-and-swap, and even again when they are done.
+ *
+ * The data is read while it may be written, so the reader must only copy it
+ * between read_begin and read_retry, and never follow a pointer out of it
+ * before read_retry said the copy is good.
+ */
+
+extern long libpthread_spin_count;
+
+/* Wait for seq to move off s: spin, then give the CPU to a possibly preempted writer */
+static void arch_seqlock_wait(pthread_seqlock_t *lock, long s, long *spins)
+{
+    if (*spins < libpthread_spin_count) {
+        (*spins)++;
+        cpu_wait(& lock->seq, s);
+    } else {
+        SwitchToThread();
+    }
+}
+
+/**
+ * Initialize a sequence lock.
+ * @param  lock The sequence lock object.
+ * @param  pshared Must be PTHREAD_PROCESS_PRIVATE (0).
+ * @return If the pshared is PTHREAD_PROCESS_PRIVATE, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ */
+int pthread_seqlock_init(pthread_seqlock_t *lock, int pshared)
+{
+    if (PTHREAD_PROCESS_PRIVATE != pshared)
+        return EINVAL;
+
+    lock->seq = 0;
+
+    return 0;
+}
+
+/**
+ * Start a read of the data protected by a sequence lock.
+ * @param  lock The sequence lock object.
+ * @return The sequence to pass to pthread_seqlock_read_retry.
+ * @remark Waits while a writer is inside, then copy the data and call
+ *         pthread_seqlock_read_retry:
+ *         do {
+ *             seq = pthread_seqlock_read_begin(&lock);
+ *             copy = data;
+ *         } while (pthread_seqlock_read_retry(&lock, seq));
+ */
+long pthread_seqlock_read_begin(pthread_seqlock_t *lock)
+{
+    long s, spins = 0;
+
+    /* Acquire: the copy is not loaded before seq */
+    while ((s = atomic_read_acquire(& lock->seq)) & 1)
+        arch_seqlock_wait(lock, s, &spins);
+
+    return s;
+}
+
+/**
+ * Tell if a read of the data protected by a sequence lock must be retried.
+ * @param  lock The sequence lock object.
+ * @param  seq The return value of pthread_seqlock_read_begin.
+ * @return 0 if the copy is consistent, 1 if a writer changed the data.
+ */
+int pthread_seqlock_read_retry(pthread_seqlock_t *lock, long seq)
+{
+    /* The loads of the copy are done before seq is loaded again */
+    memory_barrier_acquire();
+
+    return atomic_read(& lock->seq) != seq;
+}
+
+/**
+ * Acquire a sequence lock for writing.
+ * @param  lock The sequence lock object.
+ * @return Always return 0.
+ */
+int pthread_seqlock_write_lock(pthread_seqlock_t *lock)
+{
+    long s, spins = 0;
+
+    for (;;) {
+        if (((s = atomic_read(& lock->seq)) & 1) == 0 && atomic_cmpxchg_acquire(& lock->seq, s + 1, s) == s)
+            break;
+        arch_seqlock_wait(lock, s, &spins);
+    }
+
+    /* Readers that see a store of the update also see seq odd */
+    memory_barrier_release();
+
+    return 0;
+}
+
+/**
+ * Try to acquire a sequence lock for writing.
+ * @param  lock The sequence lock object.
+ * @return If it can acquire lock immediately, the return value is 0.
+ *         Otherwise, EBUSY returned to indicate the error.
+ */
+int pthread_seqlock_write_trylock(pthread_seqlock_t *lock)
+{
+    long s = atomic_read(& lock->seq);
+
+    if ((s & 1) != 0 || atomic_cmpxchg_acquire(& lock->seq, s + 1, s) != s)
+        return EBUSY;
+
+    memory_barrier_release();
+
+    return 0;
+}
+
+/**
+ * Release a sequence lock held for writing.
+ * @param  lock The sequence lock object.
+ * @return Always return 0.
+ */
+int pthread_seqlock_write_unlock(pthread_seqlock_t *lock)
+{
+    /* Only the writer stores seq now, the update is released with it */
+    atomic_set_release(& lock->seq, atomic_read(& lock->seq) + 1);
+    cpu_wake();
+
+    return 0;
+}
+
+/**
+ * Destroy a sequence lock.
+ * @param  lock The sequence lock object.
+ * @return Always return 0.
+ */
+int pthread_seqlock_destroy(pthread_seqlock_t *lock)
+{
+    lock->seq = 0;
+
+    return 0;
+}
@@ -24,12 +24,76 @@
 
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <winsock2.h>
 
 #include "arch.h"
 #include "misc.h"
 
+extern long libpthread_spin_count;
+extern long libpthread_spin_yield_count;
+extern long libpthread_rtm;
+
+/*
+ * Wait for our ticket: spin, then give the CPU to a possibly preempted
+ * holder, then park on owner. Parked waiters are counted in lock->waiters
+ * so that unlock only enters the kernel when someone sleeps.
+ */
+static int arch_spin_wait(pthread_spinlock_t *lock, long ticket)
+{
+    long i, owner;
+
+    for (i = libpthread_spin_count; i > 0; i--) {
+        if ((owner = atomic_read_acquire(& lock->owner)) == ticket)
+            return ARCH_LOCK_SPIN;
+        cpu_wait(& lock->owner, owner);
+    }
+
+    for (i = libpthread_spin_yield_count; i > 0; i--) {
+        SwitchToThread();
+        if (atomic_read_acquire(& lock->owner) == ticket)
+            return ARCH_LOCK_SPIN;
+    }
+
+    (void) atomic_fetch_and_add(& lock->waiters, 1);
+    /* Ordered before the load of owner, as the unlock orders its add before waiters */
+    memory_barrier_after_atomic();
+    while ((owner = atomic_read_acquire(& lock->owner)) != ticket)
+        arch_wait_on_address(& lock->owner, owner, INFINITE);
+    (void) atomic_fetch_and_add_relaxed(& lock->waiters, -1);
+
+    return ARCH_LOCK_PARK;
+}
+
+#ifdef ARCH_RTM
+/*
+ * Lock elision: run the critical section as a transaction that only reads
+ * owner and ticket, threads whose accesses do not conflict run it at the
+ * same time. A real acquisition writes the words and aborts them all.
+ * Return 1 in a transaction with the lock free, 0 to take it for real.
+ */
+static int arch_spin_elide(pthread_spinlock_t *lock)
+{
+    int i;
+    unsigned int status;
+
+    for (i = 0; i < ARCH_ELIDE_RETRIES; i++) {
+        if ((status = arch_xbegin()) == ARCH_XBEGIN_STARTED) {
+            if (lock->owner == lock->ticket)
+                return 1;
+            arch_xabort(ARCH_XABORT_BUSY);
+        }
+
+        ARCH_LOCK_STATS(arch_lock_stats_aborted(lock, PTHREAD_LOCK_SPIN_NP));
+        if (!arch_elide_aborted(& lock->elision, status))
+            break;
+    }
+
+    return 0;
+}
+#endif
+
 /**
  * Initialize a spin lock.
  * @param  lock The spin lock object.
@@ -44,7 +108,10 @@ int pthread_spin_init(pthread_spinlock_t *lock, int pshared)
 
     lock->owner = 0;
     lock->ticket = 0;
+    lock->waiters = 0;
+    lock->elision = 0;
 
+    ARCH_LOCK_STATS(arch_lock_stats_init(lock, PTHREAD_LOCK_SPIN_NP, ARCH_RETURN_ADDRESS()));
     return 0;
 }
 
@@ -55,10 +122,30 @@ int pthread_spin_init(pthread_spinlock_t *lock, int pshared)
  */
 int pthread_spin_lock(pthread_spinlock_t *lock)
 {
-    long ticket = atomic_fetch_and_add(& lock->ticket, 1) ;
+    long ticket;
+#ifdef LIBPTHREAD_LOCK_STATS
+    __int64 start;
+    int how = ARCH_LOCK_FAST;
+#endif
 
-    while (atomic_read(& lock->owner) != ticket)
-        cpu_relax();
+#ifdef ARCH_RTM
+    if (atomic_read(& lock->elision) > 0 && arch_spin_elide(lock))
+        return 0;
+#endif
+
+    /* The acquire is the load of owner, taking a ticket orders nothing */
+    ticket = atomic_fetch_and_add_relaxed(& lock->ticket, 1);
+#ifdef LIBPTHREAD_LOCK_STATS
+    start = arch_clock_monotonic_ns();
+    if (atomic_read_acquire(& lock->owner) != ticket)
+        how = arch_spin_wait(lock, ticket);
+
+    arch_lock_stats_acquired(lock, PTHREAD_LOCK_SPIN_NP, how, start);
+#else
+
+    if (atomic_read_acquire(& lock->owner) != ticket)
+        arch_spin_wait(lock, ticket);
+#endif
 
     return 0;
 }
@@ -73,8 +160,10 @@ int pthread_spin_trylock(pthread_spinlock_t *lock)
 {
     long tmp = atomic_read(& lock->ticket);
     if (tmp == atomic_read(& lock->owner)) {
-        if (atomic_cmpxchg(& lock->ticket, tmp + 1, tmp) == tmp)
+        if (atomic_cmpxchg_acquire(& lock->ticket, tmp + 1, tmp) == tmp) {
+            ARCH_LOCK_STATS(arch_lock_stats_acquired(lock, PTHREAD_LOCK_SPIN_NP, ARCH_LOCK_FAST, 0));
             return 0;
+        }
     }
 
     return EBUSY;
@@ -87,7 +176,25 @@ int pthread_spin_trylock(pthread_spinlock_t *lock)
  */
 int pthread_spin_unlock(pthread_spinlock_t *lock)
 {
-    lock->owner++;
+#ifdef ARCH_RTM
+    /* Held for real, owner is behind ticket: free means elided */
+    if (libpthread_rtm && atomic_read(& lock->owner) == atomic_read(& lock->ticket) && arch_xtest()) {
+        arch_xend();
+        ARCH_LOCK_STATS(arch_lock_stats_elided(lock, PTHREAD_LOCK_SPIN_NP));
+        arch_elide_committed(& lock->elision);
+        return 0;
+    }
+#endif
+
+    ARCH_LOCK_STATS(arch_lock_stats_released(lock));
+    /* Release, and ordered before the load of waiters */
+    (void) atomic_fetch_and_add(& lock->owner, 1);
+    memory_barrier_after_atomic();
+    cpu_wake();
+
+    /* Tickets are served in order, wake them all and let the next one win */
+    if (atomic_read(& lock->waiters) != 0)
+        arch_wake_by_address_all(& lock->owner);
 
     return 0;
 }
@@ -99,8 +206,301 @@ int pthread_spin_unlock(pthread_spinlock_t *lock)
  */
 int pthread_spin_destroy(pthread_spinlock_t *lock)
 {
+    ARCH_LOCK_STATS(arch_lock_stats_destroy(lock));
     lock->owner = 0;
     lock->ticket = 0;
+    lock->waiters = 0;
+    lock->elision = 0;
+
+    return 0;
+}
+
+/**
+ * Get the process-wide waiting policy of pthread_spin_lock.
+ * @param  spin_count The number of busy-wait iterations.
+ * @param  yield_count The number of SwitchToThread calls after spinning,
+ *         before the waiter sleeps.
+ * @return Always return 0.
+ */
+int pthread_spin_getspin_np(int *spin_count, int *yield_count)
+{
+    *spin_count = (int) libpthread_spin_count;
+    *yield_count = (int) libpthread_spin_yield_count;
+
+    return 0;
+}
+
+/**
+ * Set the process-wide waiting policy of pthread_spin_lock.
+ * @param  spin_count The number of busy-wait iterations.
+ * @param  yield_count The number of SwitchToThread calls after spinning,
+ *         before the waiter sleeps.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark The defaults are 1000 and 16, or 0 and 16 on a single CPU where
+ *         spinning can not make progress. With more threads than CPUs, a
+ *         smaller spin count keeps waiters from burning the quantum of a
+ *         preempted lock holder.
+ */
+int pthread_spin_setspin_np(int spin_count, int yield_count)
+{
+    if (spin_count < 0 || yield_count < 0)
+        return EINVAL;
+
+    libpthread_spin_count = spin_count;
+    libpthread_spin_yield_count = yield_count;
+
+    return 0;
+}
+
+/**
+ * Tell if a spin lock is elided.
+ * @param  lock The spin lock object.
+ * @param  elide Set to 1 if elision is on, 0 if it is off or was turned
+ *         off because the transactions aborted too often.
+ * @return Always return 0.
+ */
+int pthread_spin_getelision_np(pthread_spinlock_t *lock, int *elide)
+{
+    *elide = atomic_read(& lock->elision) > 0;
+
+    return 0;
+}
+
+/**
+ * Turn hardware lock elision (Intel TSX) of a spin lock on or off.
+ * @param  lock The spin lock object, not held.
+ * @param  elide 1 to run the critical sections as transactions, 0 not to.
+ * @return If the function succeeds, the return value is 0.
+ *         ENOTSUP if elide is 1 and the CPU has no usable RTM.
+ * @remark Threads holding an elided lock at the same time only serialize
+ *         if their accesses conflict. After 3 aborts a thread takes the
+ *         lock for real, and a lock which aborts more than about one
+ *         transaction in 16 turns elision off by itself. System calls
+ *         and page faults abort, they do not belong in an elided critical
+ *         section. The aborts are counted by pthread_lock_stats_np.
+ */
+int pthread_spin_setelision_np(pthread_spinlock_t *lock, int elide)
+{
+#ifdef ARCH_RTM
+    if (elide && !libpthread_rtm)
+        return ENOTSUP;
+
+    atomic_set(& lock->elision, elide ? ARCH_ELIDE_CREDIT : 0);
+    return 0;
+#else
+    if (elide)
+        return ENOTSUP;
+
+    lock->elision = 0;
+    return 0;
+#endif
+}
+
+/*
+ * MCS queue lock (Mellor-Crummey and Scott): waiters are queued on caller
+ * provided nodes and each one spins on its own node, an unlock only touches
+ * the cache line of the next waiter.
+ */
+
+#define MCS_WAITING     1 /* queued, the lock is not ours yet */
+#define MCS_GRANTED     0 /* ours, pthread_spin_mcs_numa_t must take the global lock too */
+#define MCS_COHORT      2 /* ours, together with the global lock of the cohort */
+
+/* Queue node on lock, return the state it was granted the lock with */
+static __inline long arch_spin_mcs_lock(pthread_spin_mcs_t *lock, pthread_spin_mcs_node_t *node)
+{
+    long locked;
+    pthread_spin_mcs_node_t *pred;
+
+    node->next = NULL;
+    node->locked = MCS_WAITING;
+
+    /* Publishes the node, and acquires the lock if the queue was empty */
+    pred = atomic_xchg_ptr((void * volatile *) & lock->tail, node);
+    if (pred == NULL)
+        return MCS_GRANTED;
+
+    atomic_set_ptr_release((void * volatile *) & pred->next, node);
+    while ((locked = atomic_read_acquire(& node->locked)) == MCS_WAITING)
+        cpu_wait(& node->locked, MCS_WAITING);
+
+    return locked;
+}
+
+/* Wait for the successor of node, NULL if there is none and the lock is released */
+static __inline pthread_spin_mcs_node_t *arch_spin_mcs_next(pthread_spin_mcs_t *lock, pthread_spin_mcs_node_t *node)
+{
+    pthread_spin_mcs_node_t *next = atomic_read_ptr_acquire((void * volatile *) & node->next);
+
+    if (next == NULL) {
+        if (atomic_cmpxchg_ptr_release((void * volatile *) & lock->tail, NULL, node) == node)
+            return NULL;
+
+        /* A successor swapped the tail but has not linked itself yet */
+        while ((next = atomic_read_ptr_acquire((void * volatile *) & node->next)) == NULL)
+            cpu_relax();
+    }
+
+    return next;
+}
+
+/**
+ * Initialize a MCS spin lock.
+ * @param  lock The MCS spin lock object.
+ * @param  pshared Must be PTHREAD_PROCESS_PRIVATE (0).
+ * @return If the pshared is PTHREAD_PROCESS_PRIVATE, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ */
+int pthread_spin_mcs_init(pthread_spin_mcs_t *lock, int pshared)
+{
+    if (PTHREAD_PROCESS_PRIVATE != pshared)
+        return EINVAL;
+
+    lock->tail = NULL;
+
+    return 0;
+}
+
+/**
+ * Acquire a MCS spin lock.
+ * @param  lock The MCS spin lock object.
+ * @param  node The queue node of the caller, it must stay valid until
+ *         pthread_spin_mcs_unlock(lock, node) returns.
+ * @return Always return 0.
+ */
+int pthread_spin_mcs_lock(pthread_spin_mcs_t *lock, pthread_spin_mcs_node_t *node)
+{
+    (void) arch_spin_mcs_lock(lock, node);
+
+    return 0;
+}
+
+/**
+ * Try acquire a MCS spin lock.
+ * @param  lock The MCS spin lock object.
+ * @param  node The queue node of the caller.
+ * @return If it can acquire lock immediately, the return value is 0.
+ *         Otherwise, EBUSY returned to indicate the error.
+ */
+int pthread_spin_mcs_trylock(pthread_spin_mcs_t *lock, pthread_spin_mcs_node_t *node)
+{
+    node->next = NULL;
+    node->locked = MCS_GRANTED;
+
+    /* Full order, as the xchg of arch_spin_mcs_lock: next is NULL before the node is seen */
+    if (atomic_cmpxchg_ptr((void * volatile *) & lock->tail, node, NULL) == NULL)
+        return 0;
+
+    return EBUSY;
+}
+
+/**
+ * Release a MCS spin lock.
+ * @param  lock The MCS spin lock object.
+ * @param  node The queue node passed to pthread_spin_mcs_lock.
+ * @return Always return 0.
+ */
+int pthread_spin_mcs_unlock(pthread_spin_mcs_t *lock, pthread_spin_mcs_node_t *node)
+{
+    pthread_spin_mcs_node_t *next = arch_spin_mcs_next(lock, node);
+
+    if (next != NULL) {
+        atomic_set_release(& next->locked, MCS_GRANTED);
+        cpu_wake();
+    }
+
+    return 0;
+}
+
+/**
+ * Destroy a MCS spin lock (reset to unlocked state).
+ * @param  lock The MCS spin lock object.
+ * @return Always return 0.
+ */
+int pthread_spin_mcs_destroy(pthread_spin_mcs_t *lock)
+{
+    lock->tail = NULL;
+
+    return 0;
+}
+
+/**
+ * Initialize a NUMA-aware MCS spin lock.
+ * @param  lock The NUMA-aware MCS spin lock object.
+ * @param  pshared Must be PTHREAD_PROCESS_PRIVATE (0).
+ * @return If the pshared is PTHREAD_PROCESS_PRIVATE, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ */
+int pthread_spin_mcs_numa_init(pthread_spin_mcs_numa_t *lock, int pshared)
+{
+    if (PTHREAD_PROCESS_PRIVATE != pshared)
+        return EINVAL;
+
+    memset(lock, 0, sizeof(pthread_spin_mcs_numa_t));
+
+    return 0;
+}
+
+/**
+ * Acquire a NUMA-aware MCS spin lock.
+ * @param  lock The NUMA-aware MCS spin lock object.
+ * @param  node The queue node of the caller, it must stay valid until
+ *         pthread_spin_mcs_numa_unlock(lock, node) returns.
+ * @return Always return 0.
+ * @remark Threads queue on the MCS lock of their NUMA node, the head of
+ *         each node queue competes for the global ticket lock. The global
+ *         lock is handed to the next thread of the same node without
+ *         releasing it, at most PTHREAD_SPIN_MCS_NUMA_BATCH times in a row.
+ */
+int pthread_spin_mcs_numa_lock(pthread_spin_mcs_numa_t *lock, pthread_spin_mcs_node_t *node)
+{
+    node->numa = arch_numa_node() % PTHREAD_SPIN_MCS_NUMA_NODES;
+
+    if (arch_spin_mcs_lock(& lock->node[node->numa].local, node) != MCS_COHORT)
+        pthread_spin_lock(& lock->global);
+
+    return 0;
+}
+
+/**
+ * Release a NUMA-aware MCS spin lock.
+ * @param  lock The NUMA-aware MCS spin lock object.
+ * @param  node The queue node passed to pthread_spin_mcs_numa_lock.
+ * @return Always return 0.
+ */
+int pthread_spin_mcs_numa_unlock(pthread_spin_mcs_numa_t *lock, pthread_spin_mcs_node_t *node)
+{
+    pthread_spin_mcs_node_t *next = atomic_read_ptr_acquire((void * volatile *) & node->next);
+    pthread_spin_mcs_t *local = & lock->node[node->numa].local;
+    long *batch = & lock->node[node->numa].batch;
+
+    /* Hand the global lock over within the node */
+    if (next != NULL && ++(*batch) < PTHREAD_SPIN_MCS_NUMA_BATCH) {
+        atomic_set_release(& next->locked, MCS_COHORT);
+        cpu_wake();
+        return 0;
+    }
+
+    *batch = 0;
+    pthread_spin_unlock(& lock->global);
+
+    if ((next = arch_spin_mcs_next(local, node)) != NULL) {
+        atomic_set_release(& next->locked, MCS_GRANTED);
+        cpu_wake();
+    }
+
+    return 0;
+}
+
+/**
+ * Destroy a NUMA-aware MCS spin lock (reset to unlocked state).
+ * @param  lock The NUMA-aware MCS spin lock object.
+ * @return Always return 0.
+ */
+int pthread_spin_mcs_numa_destroy(pthread_spin_mcs_numa_t *lock)
+{
+    memset(lock, 0, sizeof(pthread_spin_mcs_numa_t));
 
     return 0;
 }
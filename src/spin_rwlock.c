@@ -31,6 +31,64 @@
 #include "arch.h"
 #include "misc.h"
 
+/*
+ * Phase-fair ticket rwlock (Brandenburg and Anderson, "Spin-Based
+ * Reader-Writer Synchronization for Multiprocessor Real-Time Systems").
+ *
+ * Readers add RW_RINC to rin when they enter and to rout when they leave.
+ * Writers take a ticket in win, and when served set their phase bits in the
+ * low byte of rin: readers arriving after that wait until the writer clears
+ * them, and the writer waits until rout catches up with the readers already
+ * in. At most one writer phase separates a reader from the lock, and readers
+ * never wait for more than one writer.
+ */
+
+#define RW_RINC     0x100 /* one reader */
+#define RW_WBITS    0x3 /* writer bits of rin */
+#define RW_PRES     0x2 /* a writer is present */
+#define RW_PHID     0x1 /* phase id, the parity of the writer ticket */
+
+extern long libpthread_rtm;
+
+#ifdef ARCH_RTM
+/*
+ * Lock elision, see arch_spin_elide: a reader transaction reads rin, free
+ * for it means no writer phase, a writer transaction also reads rout, free
+ * means no reader inside either. rin and rout are written by every real
+ * acquisition, which aborts the transactions. The credit is read in the
+ * transaction too, so an elided reader finds it still positive at unlock:
+ * that is how reader_unlock tells it from a real reader.
+ */
+static int arch_spin_rwlock_elide(pthread_spin_rwlock_t *lock, int writer)
+{
+    int i;
+    unsigned int status;
+
+    for (i = 0; i < ARCH_ELIDE_RETRIES; i++) {
+        if ((status = arch_xbegin()) == ARCH_XBEGIN_STARTED) {
+            if (lock->elision > 0 && (lock->rin & RW_WBITS) == 0 && (!writer || lock->rin == lock->rout))
+                return 1;
+            arch_xabort(ARCH_XABORT_BUSY);
+        }
+
+        ARCH_LOCK_STATS(arch_lock_stats_aborted(lock, PTHREAD_LOCK_SPIN_RWLOCK_NP));
+        if (!arch_elide_aborted(& lock->elision, status))
+            break;
+    }
+
+    return 0;
+}
+
+/* The unlock of an elided section ends the transaction */
+static __inline int arch_spin_rwlock_commit(pthread_spin_rwlock_t *lock)
+{
+    arch_xend();
+    ARCH_LOCK_STATS(arch_lock_stats_elided(lock, PTHREAD_LOCK_SPIN_RWLOCK_NP));
+    arch_elide_committed(& lock->elision);
+    return 0;
+}
+#endif
+
 /**
  * Initialize a spin rwlock.
  * @param  lock The spin rwlock object.
@@ -43,9 +101,11 @@ int pthread_spin_rwlock_init(pthread_spin_rwlock_t *lock, int pshared)
     if (PTHREAD_PROCESS_PRIVATE != pshared)
         return EINVAL;
 
-    lock->owner = 0;
-    lock->ticket = 0;
-    lock->readers = 0;
+    lock->rin = 0;
+    lock->rout = 0;
+    lock->win = 0;
+    lock->wout = 0;
+    lock->elision = 0;
 
     return 0;
 }
@@ -57,12 +117,18 @@ int pthread_spin_rwlock_init(pthread_spin_rwlock_t *lock, int pshared)
  */
 int pthread_spin_rwlock_reader_lock(pthread_spin_rwlock_t *lock)
 {
-    int id = atomic_fetch_and_add(& lock->ticket, 1);
-    while (atomic_read(& lock->owner) != id)
-        cpu_relax();
+    long w;
 
-    atomic_fetch_and_add(& lock->readers, 1);
-    lock->owner++;
+#ifdef ARCH_RTM
+    if (atomic_read(& lock->elision) > 0 && arch_spin_rwlock_elide(lock, 0))
+        return 0;
+#endif
+
+    w = atomic_fetch_and_add_acquire(& lock->rin, RW_RINC) & RW_WBITS;
+    if (w != 0) {
+        while ((atomic_read_acquire(& lock->rin) & RW_WBITS) == w)
+            cpu_relax();
+    }
 
     return 0;
 }
@@ -74,7 +140,12 @@ int pthread_spin_rwlock_reader_lock(pthread_spin_rwlock_t *lock)
  */
 int pthread_spin_rwlock_reader_unlock(pthread_spin_rwlock_t *lock)
 {
-    atomic_fetch_and_add(& lock->readers, -1);
+#ifdef ARCH_RTM
+    if (libpthread_rtm && atomic_read(& lock->elision) > 0 && arch_xtest())
+        return arch_spin_rwlock_commit(lock);
+#endif
+
+    atomic_fetch_and_add_release(& lock->rout, RW_RINC);
 
     return 0;
 }
@@ -86,11 +157,20 @@ int pthread_spin_rwlock_reader_unlock(pthread_spin_rwlock_t *lock)
  */
 int pthread_spin_rwlock_writer_lock(pthread_spin_rwlock_t *lock)
 {
-    int id = atomic_fetch_and_add(& lock->ticket, 1);
-    while (atomic_read(& lock->owner) != id)
+    long readers, ticket;
+
+#ifdef ARCH_RTM
+    if (atomic_read(& lock->elision) > 0 && arch_spin_rwlock_elide(lock, 1))
+        return 0;
+#endif
+
+    ticket = atomic_fetch_and_add_relaxed(& lock->win, 1);
+    while (atomic_read_acquire(& lock->wout) != ticket)
         cpu_relax();
 
-    while (atomic_read(& lock->readers) > 0)
+    /* Block new readers, then wait for the readers already in, rin is a single word so no full fence */
+    readers = atomic_fetch_and_add_acquire(& lock->rin, RW_PRES | (ticket & RW_PHID));
+    while (atomic_read_acquire(& lock->rout) != readers)
         cpu_relax();
 
     return 0;
@@ -103,7 +183,14 @@ int pthread_spin_rwlock_writer_lock(pthread_spin_rwlock_t *lock)
  */
 int pthread_spin_rwlock_writer_unlock(pthread_spin_rwlock_t *lock)
 {
-    lock->owner++;
+#ifdef ARCH_RTM
+    /* Held for real, the writer bits are set: none means elided */
+    if (libpthread_rtm && (atomic_read(& lock->rin) & RW_WBITS) == 0 && arch_xtest())
+        return arch_spin_rwlock_commit(lock);
+#endif
+
+    atomic_fetch_and_add_release(& lock->rin, - (RW_PRES | (atomic_read(& lock->wout) & RW_PHID)));
+    atomic_fetch_and_add_release(& lock->wout, 1);
 
     return 0;
 }
@@ -115,9 +202,50 @@ int pthread_spin_rwlock_writer_unlock(pthread_spin_rwlock_t *lock)
  */
 int pthread_spin_rwlock_destroy(pthread_spin_rwlock_t *lock)
 {
-    lock->owner = 0;
-    lock->ticket = 0;
-    lock->readers = 0;
+    lock->rin = 0;
+    lock->rout = 0;
+    lock->win = 0;
+    lock->wout = 0;
+    lock->elision = 0;
+
+    return 0;
+}
+
+/**
+ * Tell if a spin rwlock is elided.
+ * @param  lock The spin rwlock object.
+ * @param  elide Set to 1 if elision is on, 0 if it is off or was turned
+ *         off because the transactions aborted too often.
+ * @return Always return 0.
+ */
+int pthread_spin_rwlock_getelision_np(pthread_spin_rwlock_t *lock, int *elide)
+{
+    *elide = atomic_read(& lock->elision) > 0;
+
+    return 0;
+}
+
+/**
+ * Turn hardware lock elision (Intel TSX) of a spin rwlock on or off.
+ * @param  lock The spin rwlock object, not held.
+ * @param  elide 1 to run the critical sections as transactions, 0 not to.
+ * @return If the function succeeds, the return value is 0.
+ *         ENOTSUP if elide is 1 and the CPU has no usable RTM.
+ * @remark As pthread_spin_setelision_np, readers and writers both elide.
+ */
+int pthread_spin_rwlock_setelision_np(pthread_spin_rwlock_t *lock, int elide)
+{
+#ifdef ARCH_RTM
+    if (elide && !libpthread_rtm)
+        return ENOTSUP;
+
+    atomic_set(& lock->elision, elide ? ARCH_ELIDE_CREDIT : 0);
+    return 0;
+#else
+    if (elide)
+        return ENOTSUP;
 
+    lock->elision = 0;
     return 0;
+#endif
 }
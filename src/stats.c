@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file stats.c
+ * @brief Implementation Code of Lock Contention Statistics
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+#ifdef LIBPTHREAD_LOCK_STATS
+
+/*
+ * Built with LIBPTHREAD_LOCK_STATS, mutexes, spinlocks, barriers and private
+ * semaphores report every acquisition here (see ARCH_LOCK_STATS in arch.h),
+ * elided spinlocks and spin rwlocks their commits and aborts.
+ * The records live in a hashed table keyed by the lock object, so they need
+ * no room in the lock itself: spinlocks are user memory, and locks set up by
+ * a static initializer get a record on their first acquisition.
+ *
+ * Times come from the cached performance counter (arch_clock_monotonic_ns).
+ * Without LIBPTHREAD_LOCK_STATS the hooks compile to nothing.
+ */
+
+#define STATS_TABLE_SIZE    1024 /* must be a power of 2 */
+
+typedef struct arch_lock_stats {
+    const void *lock;
+    const void *caller;
+    int kind;
+    unsigned __int64 acquisitions, spins, parks;
+    unsigned __int64 wait_ns, max_wait_ns, hold_ns;
+    unsigned __int64 elided, aborts;
+    __int64 acquired_at; /* of the current owner, 0 if not held */
+    struct arch_lock_stats *next;
+} arch_lock_stats;
+
+typedef struct {
+    long lock;
+    arch_lock_stats *head;
+} arch_stats_bucket;
+
+static arch_stats_bucket stats_table[STATS_TABLE_SIZE];
+
+static __inline arch_stats_bucket *stats_bucket(const void *lock)
+{
+    uintptr_t h = (uintptr_t) lock;
+
+    h = (h >> 4) ^ (h >> 14);
+    return & stats_table[h & (STATS_TABLE_SIZE - 1)];
+}
+
+/* Find or create the record of lock, with the bucket lock held */
+static arch_lock_stats *stats_find(arch_stats_bucket *b, const void *lock, int kind)
+{
+    arch_lock_stats *s;
+
+    for (s = b->head; s != NULL; s = s->next) {
+        if (s->lock == lock)
+            return s;
+    }
+
+    if ((s = arch_slab_alloc(sizeof(arch_lock_stats))) == NULL)
+        return NULL;
+
+    s->lock = lock;
+    s->kind = kind;
+    s->next = b->head;
+    b->head = s;
+    return s;
+}
+
+/**
+ * Start the record of a lock, called by its init function.
+ * @param lock The lock object.
+ * @param kind PTHREAD_LOCK_MUTEX_NP, PTHREAD_LOCK_SPIN_NP,
+ *        PTHREAD_LOCK_BARRIER_NP or PTHREAD_LOCK_SEM_NP.
+ * @param caller The return address of the init function.
+ */
+void arch_lock_stats_init(const void *lock, int kind, const void *caller)
+{
+    arch_lock_stats *s, *next;
+    arch_stats_bucket *b = stats_bucket(lock);
+
+    arch_spin_lock(& b->lock);
+    if ((s = stats_find(b, lock, kind)) != NULL) {
+        /* The memory of a lock destroyed without telling us */
+        next = s->next;
+        memset(s, 0, sizeof(arch_lock_stats));
+        s->lock = lock;
+        s->kind = kind;
+        s->caller = caller;
+        s->next = next;
+    }
+    arch_spin_unlock(& b->lock);
+}
+
+/**
+ * Drop the record of a lock, called by its destroy function.
+ * @param lock The lock object.
+ */
+void arch_lock_stats_destroy(const void *lock)
+{
+    arch_lock_stats **pp, *s = NULL;
+    arch_stats_bucket *b = stats_bucket(lock);
+
+    arch_spin_lock(& b->lock);
+    for (pp = & b->head; *pp != NULL; pp = & (*pp)->next) {
+        if ((*pp)->lock == lock) {
+            s = *pp;
+            *pp = s->next;
+            break;
+        }
+    }
+    arch_spin_unlock(& b->lock);
+
+    if (s != NULL)
+        arch_slab_free(s, sizeof(arch_lock_stats));
+}
+
+/**
+ * Count an acquisition of a lock.
+ * @param lock The lock object.
+ * @param kind The kind of lock, for a lock without a record yet.
+ * @param how ARCH_LOCK_FAST, ARCH_LOCK_SPIN or ARCH_LOCK_PARK.
+ * @param start When the caller began to spin or park, ignored for
+ *        ARCH_LOCK_FAST.
+ */
+void arch_lock_stats_acquired(const void *lock, int kind, int how, __int64 start)
+{
+    arch_lock_stats *s;
+    __int64 now = arch_clock_monotonic_ns();
+    arch_stats_bucket *b = stats_bucket(lock);
+
+    arch_spin_lock(& b->lock);
+    if ((s = stats_find(b, lock, kind)) != NULL) {
+        s->acquisitions++;
+        if (how != ARCH_LOCK_FAST) {
+            unsigned __int64 wait = (unsigned __int64) (now - start);
+
+            if (how == ARCH_LOCK_SPIN)
+                s->spins++;
+            else
+                s->parks++;
+            s->wait_ns += wait;
+            if (wait > s->max_wait_ns)
+                s->max_wait_ns = wait;
+        }
+        s->acquired_at = now;
+    }
+    arch_spin_unlock(& b->lock);
+}
+
+/**
+ * Count the hold time of a lock, called before it is released.
+ * @param lock The lock object.
+ */
+void arch_lock_stats_released(const void *lock)
+{
+    arch_lock_stats *s;
+    __int64 now = arch_clock_monotonic_ns();
+    arch_stats_bucket *b = stats_bucket(lock);
+
+    arch_spin_lock(& b->lock);
+    for (s = b->head; s != NULL; s = s->next) {
+        if (s->lock == lock) {
+            if (s->acquired_at != 0)
+                s->hold_ns += (unsigned __int64) (now - s->acquired_at);
+            s->acquired_at = 0;
+            break;
+        }
+    }
+    arch_spin_unlock(& b->lock);
+}
+
+/**
+ * Count an acquisition run as a hardware transaction, called after it commits.
+ * @param lock The lock object.
+ * @param kind The kind of lock, for a lock without a record yet.
+ */
+void arch_lock_stats_elided(const void *lock, int kind)
+{
+    arch_lock_stats *s;
+    arch_stats_bucket *b = stats_bucket(lock);
+
+    arch_spin_lock(& b->lock);
+    if ((s = stats_find(b, lock, kind)) != NULL) {
+        s->acquisitions++;
+        s->elided++;
+    }
+    arch_spin_unlock(& b->lock);
+}
+
+/**
+ * Count an aborted transaction of lock elision.
+ * @param lock The lock object.
+ * @param kind The kind of lock, for a lock without a record yet.
+ */
+void arch_lock_stats_aborted(const void *lock, int kind)
+{
+    arch_lock_stats *s;
+    arch_stats_bucket *b = stats_bucket(lock);
+
+    arch_spin_lock(& b->lock);
+    if ((s = stats_find(b, lock, kind)) != NULL)
+        s->aborts++;
+    arch_spin_unlock(& b->lock);
+}
+
+/* The more time waited, the more contended */
+static __inline int stats_before(const arch_lock_stats *s, const struct pthread_lock_stats_np *t)
+{
+    if (s->wait_ns != t->wait_ns)
+        return s->wait_ns > t->wait_ns;
+
+    return s->parks + s->spins + s->aborts > t->parks + t->spins + t->aborts;
+}
+
+static void stats_copy(struct pthread_lock_stats_np *t, const arch_lock_stats *s)
+{
+    t->lock = s->lock;
+    t->kind = s->kind;
+    t->caller = s->caller;
+    t->acquisitions = s->acquisitions;
+    t->spins = s->spins;
+    t->parks = s->parks;
+    t->wait_ns = s->wait_ns;
+    t->max_wait_ns = s->max_wait_ns;
+    t->hold_ns = s->hold_ns;
+    t->elided = s->elided;
+    t->aborts = s->aborts;
+}
+
+/**
+ * Get the most contended locks.
+ * @param stats An array of *count records.
+ * @param count The size of stats, set to the number of records stored.
+ * @return If the function succeeds, the return value is 0.
+ *         EINVAL if an argument is invalid, or ENOSYS if the library was
+ *         built without LIBPTHREAD_LOCK_STATS.
+ * @remark The records are sorted by the total time spent waiting, the
+ *         locks never waited for come last.
+ */
+int pthread_lock_stats_np(struct pthread_lock_stats_np *stats, int *count)
+{
+    int i, j, n = 0;
+    arch_lock_stats *s;
+
+    if (count == NULL || *count < 0 || (*count > 0 && stats == NULL))
+        return EINVAL;
+
+    for (i = 0; i < STATS_TABLE_SIZE; i++) {
+        arch_stats_bucket *b = & stats_table[i];
+
+        if (b->head == NULL)
+            continue;
+
+        arch_spin_lock(& b->lock);
+        for (s = b->head; s != NULL; s = s->next) {
+            /* Insertion into the top *count */
+            for (j = n; j > 0 && stats_before(s, & stats[j - 1]); j--) {
+                if (j < *count)
+                    stats[j] = stats[j - 1];
+            }
+            if (j < *count) {
+                stats_copy(& stats[j], s);
+                if (n < *count)
+                    n++;
+            }
+        }
+        arch_spin_unlock(& b->lock);
+    }
+
+    *count = n;
+    return 0;
+}
+
+/**
+ * Reset the counters of all locks.
+ * @return If the function succeeds, the return value is 0.
+ *         ENOSYS if the library was built without LIBPTHREAD_LOCK_STATS.
+ */
+int pthread_lock_stats_reset_np(void)
+{
+    int i;
+    arch_lock_stats *s;
+
+    for (i = 0; i < STATS_TABLE_SIZE; i++) {
+        arch_stats_bucket *b = & stats_table[i];
+
+        arch_spin_lock(& b->lock);
+        for (s = b->head; s != NULL; s = s->next) {
+            s->acquisitions = s->spins = s->parks = 0;
+            s->wait_ns = s->max_wait_ns = s->hold_ns = 0;
+            s->elided = s->aborts = 0;
+        }
+        arch_spin_unlock(& b->lock);
+    }
+
+    return 0;
+}
+
+#else
+
+int pthread_lock_stats_np(struct pthread_lock_stats_np *stats, int *count)
+{
+    return ENOSYS;
+}
+
+int pthread_lock_stats_reset_np(void)
+{
+    return ENOSYS;
+}
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file task.c
+ * @brief Implementation Code of Work-stealing Task Routines
+ */
+
+#include <pthread.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * Every worker owns a Chase-Lev deque: the owner pushes and pops at the
+ * bottom without atomic operations except for the last task, thieves take
+ * from the top with one compare-and-swap. Tasks spawned by threads outside
+ * the pool go to a locked injection queue. Workers out of work spin for
+ * libpthread_spin_count rounds, then park on the sequence of the pool,
+ * which every spawn bumps if a worker is idle.
+ *
+ * The pending count of a group is kept in units of TASK_PENDING, the low
+ * bit tells the last task to wake the parked waiters, so the group is not
+ * touched again once the count drops to zero.
+ */
+
+#define TASK_WAITERS    1
+#define TASK_PENDING    2
+
+#define TASK_DEQUE_MASK (ARCH_TASK_DEQUE_SIZE - 1)
+
+/* Number of tasks between top and bottom, wrap-around safe */
+#define TASK_DEQUE_LEN(b, t)    ((long) ((unsigned long) (b) - (unsigned long) (t)))
+
+extern long libpthread_spin_count;
+
+static int task_push(arch_task_worker *w, arch_task *task)
+{
+    long b = w->bottom;
+
+    if (TASK_DEQUE_LEN(b, atomic_read_acquire(& w->top)) >= ARCH_TASK_DEQUE_SIZE)
+        return 0;
+
+    /* The release store makes the task visible before the new bottom */
+    w->slots[b & TASK_DEQUE_MASK] = task;
+    atomic_set_release(& w->bottom, b + 1);
+    return 1;
+}
+
+static arch_task *task_pop(arch_task_worker *w)
+{
+    long b = w->bottom - 1, t;
+    arch_task *task;
+
+    /* Full barrier: thieves must see the new bottom before we read top */
+    (void) atomic_xchg(& w->bottom, b);
+    memory_barrier_after_atomic();
+    t = atomic_read(& w->top);
+
+    if (TASK_DEQUE_LEN(b, t) < 0) {
+        atomic_set(& w->bottom, b + 1);
+        return NULL;
+    }
+
+    task = w->slots[b & TASK_DEQUE_MASK];
+    if (b != t)
+        return task;
+
+    /* The last task, race the thieves for it */
+    if (atomic_cmpxchg(& w->top, t + 1, t) != t)
+        task = NULL;
+    atomic_set(& w->bottom, b + 1);
+    return task;
+}
+
+static arch_task *task_steal(arch_task_worker *w)
+{
+    long t = atomic_read_acquire(& w->top), b;
+    arch_task *task;
+
+    /* Full barrier: pairs with the one of task_pop, top is read before bottom */
+    memory_barrier();
+    b = atomic_read_acquire(& w->bottom);
+    if (TASK_DEQUE_LEN(b, t) <= 0)
+        return NULL;
+
+    task = w->slots[t & TASK_DEQUE_MASK];
+    if (atomic_cmpxchg(& w->top, t + 1, t) != t)
+        return NULL;
+
+    return task;
+}
+
+static arch_task *task_take_injected(arch_task_pool *p)
+{
+    arch_task *task;
+
+    if (p->head == NULL)
+        return NULL;
+
+    arch_spin_lock(& p->lock);
+    if ((task = p->head) != NULL) {
+        p->head = task->next;
+        if (p->head == NULL)
+            p->tail = NULL;
+    }
+    arch_spin_unlock(& p->lock);
+
+    return task;
+}
+
+/* Find a task for w, or for a thread outside the pool if w is NULL */
+static arch_task *task_find(arch_task_pool *p, arch_task_worker *w)
+{
+    long i, n = p->nworkers, start;
+    arch_task *task;
+
+    if (w != NULL && (task = task_pop(w)) != NULL)
+        return task;
+
+    if ((task = task_take_injected(p)) != NULL)
+        return task;
+
+    /* Start from a random victim, then sweep all of them */
+    if (w != NULL) {
+        w->seed ^= w->seed << 13;
+        w->seed ^= w->seed >> 17;
+        w->seed ^= w->seed << 5;
+        start = (long) (w->seed % n);
+    } else
+        start = (long) (GetCurrentThreadId() % n);
+
+    for (i = 0; i < n; i++) {
+        arch_task_worker *victim = p->workers + (start + i) % n;
+        if (victim != w && (task = task_steal(victim)) != NULL)
+            return task;
+    }
+
+    return NULL;
+}
+
+static void task_run(arch_task *task)
+{
+    pthread_task_group_t *group = task->group;
+
+    task->routine(task->arg);
+    arch_slab_free(task, sizeof(arch_task));
+
+    if (group != NULL && atomic_fetch_and_add(& group->pending, -TASK_PENDING) == TASK_PENDING + TASK_WAITERS)
+        arch_wake_by_address_all(& group->pending);
+}
+
+static arch_task_worker *task_current(arch_task_pool *p)
+{
+    arch_thread_info *pv = (arch_thread_info *) pthread_self();
+    arch_task_worker *w;
+
+    if (pv == NULL || (w = (arch_task_worker *) pv->task_worker) == NULL || w->pool != p)
+        return NULL;
+
+    return w;
+}
+
+static void *task_worker_proxy(void *arg)
+{
+    arch_task_worker *w = (arch_task_worker *) arg;
+    arch_task_pool *p = w->pool;
+    arch_task *task;
+    long seq, spins = 0;
+
+    ((arch_thread_info *) pthread_self())->task_worker = w;
+
+    for (;;) {
+        if ((task = task_find(p, w)) != NULL) {
+            task_run(task);
+            spins = 0;
+            continue;
+        }
+
+        if (atomic_read(& p->stop) != 0)
+            break;
+
+        if (spins++ < libpthread_spin_count) {
+            cpu_relax();
+            continue;
+        }
+
+        /* Announce us before the last look, spawn wakes us if it missed it */
+        seq = atomic_read(& p->seq);
+        atomic_fetch_and_add(& p->idle, 1);
+        memory_barrier_after_atomic();
+        if ((task = task_find(p, w)) == NULL && atomic_read(& p->stop) == 0)
+            (void) arch_wait_on_address(& p->seq, seq, INFINITE);
+        atomic_fetch_and_add(& p->idle, -1);
+
+        if (task != NULL)
+            task_run(task);
+        spins = 0;
+    }
+
+    return NULL;
+}
+
+/**
+ * Create a work-stealing task pool.
+ * @param pool The pointer of the task pool.
+ * @param nworkers The number of worker threads, or 0 for one per CPU.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number will be returned to indicate the error.
+ * @remark If there are no more workers than CPUs, every worker is pinned to
+ *         its own CPU.
+ */
+int pthread_task_pool_init(pthread_task_pool_t *pool, int nworkers)
+{
+    int i, rc, cpu, pin;
+    arch_task_pool *p;
+    pthread_attr_t attr;
+    cpu_set_t available, set;
+
+    if (pool == NULL || nworkers < 0)
+        return EINVAL;
+
+    if (nworkers == 0)
+        nworkers = get_ncpu();
+
+    if ((p = calloc(1, sizeof(arch_task_pool))) == NULL)
+        return ENOMEM;
+
+    p->workers = (arch_task_worker *) _aligned_malloc(nworkers * sizeof(arch_task_worker), ARCH_CACHE_LINE);
+    if (p->workers == NULL) {
+        free(p);
+        return ENOMEM;
+    }
+
+    memset(p->workers, 0, nworkers * sizeof(arch_task_worker));
+    p->nworkers = nworkers;
+
+    for (i = 0; i < nworkers; i++) {
+        p->workers[i].pool = p;
+        p->workers[i].seed = 2463534242UL + i * 2654435761UL;
+        if (p->workers[i].seed == 0)
+            p->workers[i].seed = 1;
+    }
+
+    if (pthread_attr_init(&attr) != 0) {
+        _aligned_free(p->workers);
+        free(p);
+        return ENOMEM;
+    }
+
+    /* One worker per CPU at most: pin them, in processor group order */
+    arch_cpu_available(&available);
+    pin = nworkers <= __sched_cpucount(sizeof(available), &available);
+
+    for (i = 0, cpu = -1; i < nworkers; i++) {
+        if (pin) {
+            do {
+                cpu++;
+            } while (!CPU_ISSET(cpu, &available));
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            (void) pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+
+        if ((rc = pthread_create(& p->workers[i].thread, &attr, task_worker_proxy, p->workers + i)) != 0) {
+            atomic_set(& p->stop, 1);
+            atomic_fetch_and_add(& p->seq, 1);
+            arch_wake_by_address_all(& p->seq);
+            while (--i >= 0)
+                (void) pthread_join(p->workers[i].thread, NULL);
+            (void) pthread_attr_destroy(&attr);
+            _aligned_free(p->workers);
+            free(p);
+            return rc;
+        }
+    }
+
+    (void) pthread_attr_destroy(&attr);
+    *pool = p;
+
+    return 0;
+}
+
+/**
+ * Destroy a task pool.
+ * @param pool The pointer of the task pool.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark The workers run the tasks left before they exit. It must not be
+ *         called by a worker of the pool.
+ */
+int pthread_task_pool_destroy(pthread_task_pool_t *pool)
+{
+    long i;
+    arch_task_pool *p;
+
+    if (pool == NULL || (p = (arch_task_pool *) *pool) == NULL || task_current(p) != NULL)
+        return EINVAL;
+
+    atomic_set(& p->stop, 1);
+    atomic_fetch_and_add(& p->seq, 1);
+    arch_wake_by_address_all(& p->seq);
+
+    for (i = 0; i < p->nworkers; i++)
+        (void) pthread_join(p->workers[i].thread, NULL);
+
+    _aligned_free(p->workers);
+    free(p);
+    *pool = NULL;
+
+    return 0;
+}
+
+/**
+ * Spawn a task.
+ * @param pool The pointer of the task pool.
+ * @param group The group the task is counted in, or NULL.
+ * @param routine The task routine.
+ * @param arg The argument of the task routine.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, an error number will be returned to indicate the error.
+ * @remark A worker pushes the task onto its own deque, other threads onto
+ *         the injection queue of the pool. If the deque of the worker is
+ *         full, the task is run at once.
+ */
+int pthread_task_spawn(pthread_task_pool_t *pool, pthread_task_group_t *group, void (* routine)(void *), void *arg)
+{
+    arch_task_pool *p;
+    arch_task_worker *w;
+    arch_task *task;
+
+    if (pool == NULL || (p = (arch_task_pool *) *pool) == NULL || routine == NULL)
+        return EINVAL;
+
+    if ((task = arch_slab_alloc(sizeof(arch_task))) == NULL)
+        return ENOMEM;
+
+    task->routine = routine;
+    task->arg = arg;
+    task->group = group;
+    task->next = NULL;
+
+    if (group != NULL)
+        atomic_fetch_and_add(& group->pending, TASK_PENDING);
+
+    if ((w = task_current(p)) != NULL) {
+        if (!task_push(w, task)) {
+            task_run(task);
+            return 0;
+        }
+    } else {
+        arch_spin_lock(& p->lock);
+        if (p->tail != NULL)
+            p->tail->next = task;
+        else
+            p->head = task;
+        p->tail = task;
+        arch_spin_unlock(& p->lock);
+    }
+
+    /* Pairs with the idle announcement of task_worker_proxy */
+    memory_barrier();
+    if (atomic_read(& p->idle) != 0) {
+        atomic_fetch_and_add(& p->seq, 1);
+        arch_wake_by_address_single(& p->seq);
+    }
+
+    return 0;
+}
+
+/**
+ * Wait for all tasks of a group.
+ * @param pool The pointer of the task pool.
+ * @param group The group to wait for.
+ * @return If the function succeeds, the return value is 0.
+ *         Otherwise, EINVAL returned to indicate the error.
+ * @remark The caller runs pending tasks of the pool while it waits, it only
+ *         parks when there is nothing left to run.
+ */
+int pthread_task_wait(pthread_task_pool_t *pool, pthread_task_group_t *group)
+{
+    long v, spins = 0;
+    arch_task_pool *p;
+    arch_task_worker *w;
+    arch_task *task;
+
+    if (pool == NULL || (p = (arch_task_pool *) *pool) == NULL || group == NULL)
+        return EINVAL;
+
+    w = task_current(p);
+
+    while ((v = atomic_read_acquire(& group->pending)) >= TASK_PENDING) {
+        if ((task = task_find(p, w)) != NULL) {
+            task_run(task);
+            spins = 0;
+            continue;
+        }
+
+        if (spins++ < libpthread_spin_count) {
+            cpu_relax();
+            continue;
+        }
+
+        if ((v & TASK_WAITERS) == 0 && atomic_cmpxchg(& group->pending, v | TASK_WAITERS, v) != v)
+            continue;
+
+        (void) arch_wait_on_address(& group->pending, v | TASK_WAITERS, INFINITE);
+    }
+
+    /* The tasks are done, drop the waiter flag so the group can be reused, keep a racing spawn */
+    while ((v & TASK_WAITERS) != 0 && atomic_cmpxchg(& group->pending, v & ~TASK_WAITERS, v) != v)
+        v = atomic_read(& group->pending);
+
+    return 0;
+}
+
+/**
+ * Get the index of the calling worker.
+ * @param pool The pointer of the task pool.
+ * @return The index of the calling thread among the workers of the pool,
+ *         from 0 to nworkers - 1, or -1 if it is not a worker of the pool.
+ */
+int pthread_task_self(pthread_task_pool_t *pool)
+{
+    arch_task_pool *p;
+    arch_task_worker *w;
+
+    if (pool == NULL || (p = (arch_task_pool *) *pool) == NULL || (w = task_current(p)) == NULL)
+        return -1;
+
+    return (int) (w - p->workers);
+}
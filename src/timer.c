@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file timer.c
+ * @brief Implementation Code of POSIX Timer Routines
+ */
+
+#include <stdio.h>
+#include <pthread_clock.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * All timers live in one hierarchical timing wheel of ARCH_TIMER_LEVELS
+ * levels of ARCH_TIMER_SLOTS slots, level n of which holds the timers due
+ * within 64^(n+1) ticks. Arming and disarming a timer is an O(1) list
+ * operation under the wheel lock, and the timer thread is only signaled
+ * when the new timer is due before the tick it sleeps until.
+ *
+ * The timer thread expires the slots of level 0 one tick after another,
+ * and moves the timers of a higher level slot down when level 0 wraps.
+ * It sleeps on its high-resolution timer (see nanosleep.c) until the next
+ * tick with a timer, or the next wrap of level 0 with timers to cascade.
+ */
+
+#define TIMER_MAX_DELTA     ((__int64) 1 << (ARCH_TIMER_LEVELS * ARCH_TIMER_BITS))
+
+static struct {
+    long lock;
+    long count; /* timers in the wheel */
+    __int64 tick; /* the next tick to expire */
+    __int64 wake; /* the tick the timer thread sleeps until, -1 if none */
+    HANDLE thread, event;
+    DWORD thread_id;
+    arch_timer *slots[ARCH_TIMER_LEVELS][ARCH_TIMER_SLOTS];
+} wheel;
+
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+
+/* Put a timer into the slot of its tick, with the wheel lock held */
+static void arch_timer_link(arch_timer *t)
+{
+    int level = 0;
+    arch_timer **slot;
+    __int64 tick = t->tick, delta = tick - wheel.tick;
+
+    if (delta < 0) {
+        tick = wheel.tick;
+        delta = 0;
+    } else if (delta >= TIMER_MAX_DELTA) {
+        tick = wheel.tick + TIMER_MAX_DELTA - 1;
+        delta = TIMER_MAX_DELTA - 1;
+    }
+
+    while (delta >= ((__int64) 1 << ((level + 1) * ARCH_TIMER_BITS)))
+        level++;
+
+    slot = & wheel.slots[level][(tick >> (level * ARCH_TIMER_BITS)) & (ARCH_TIMER_SLOTS - 1)];
+    if ((t->next = *slot) != NULL)
+        t->next->pprev = & t->next;
+    t->pprev = slot;
+    *slot = t;
+    wheel.count++;
+}
+
+/* Take a timer out of the wheel, with the wheel lock held */
+static void arch_timer_unlink(arch_timer *t)
+{
+    if (t->pprev != NULL) {
+        if ((*t->pprev = t->next) != NULL)
+            t->next->pprev = t->pprev;
+        t->pprev = NULL;
+        wheel.count--;
+    }
+}
+
+/* Move the timers of a higher level slot down */
+static void arch_timer_cascade(int level, long index)
+{
+    arch_timer *t = wheel.slots[level][index], *next;
+
+    wheel.slots[level][index] = NULL;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        t->pprev = NULL;
+        wheel.count--;
+        arch_timer_link(t);
+    }
+}
+
+/* Expire the next tick, append the expired timers to *tail */
+static void arch_timer_expire(arch_timer ***tail, __int64 now)
+{
+    int level;
+    long index = (long) (wheel.tick & (ARCH_TIMER_SLOTS - 1));
+    arch_timer *t, *next;
+
+    if (index == 0) {
+        for (level = 1; level < ARCH_TIMER_LEVELS; level++) {
+            long i = (long) ((wheel.tick >> (level * ARCH_TIMER_BITS)) & (ARCH_TIMER_SLOTS - 1));
+            arch_timer_cascade(level, i);
+            if (i != 0)
+                break;
+        }
+    }
+
+    t = wheel.slots[0][index];
+    wheel.slots[0][index] = NULL;
+    wheel.tick++;
+
+    for (; t != NULL; t = next) {
+        next = t->next;
+        t->pprev = NULL;
+        wheel.count--;
+
+        t->overrun = 0;
+        if (t->interval > 0) {
+            if (t->expires <= now) {
+                __int64 missed = (now - t->expires) / t->interval;
+                t->overrun = missed > INT_MAX ? INT_MAX : (long) missed;
+                t->expires += (missed + 1) * t->interval;
+            }
+            t->tick = (t->expires + ARCH_TIMER_TICK_NS - 1) / ARCH_TIMER_TICK_NS;
+            arch_timer_link(t);
+        }
+
+        if (t->notify == SIGEV_THREAD) {
+            t->running = 1;
+            t->run_next = NULL;
+            **tail = t;
+            *tail = & t->run_next;
+        }
+    }
+}
+
+/* The tick the timer thread should wake at, -1 if the wheel is empty */
+static __int64 arch_timer_next(void)
+{
+    __int64 tick;
+    long index;
+
+    if (wheel.count == 0)
+        return -1;
+
+    for (tick = wheel.tick; ; tick++) {
+        if (wheel.slots[0][tick & (ARCH_TIMER_SLOTS - 1)] != NULL)
+            return tick;
+
+        /* Level 0 wraps, cascade unless the level 1 slot is empty */
+        if ((tick & (ARCH_TIMER_SLOTS - 1)) == 0) {
+            index = (long) ((tick >> ARCH_TIMER_BITS) & (ARCH_TIMER_SLOTS - 1));
+            if (index == 0 || wheel.slots[1][index] != NULL)
+                return tick;
+        }
+    }
+}
+
+static unsigned int __stdcall arch_timer_thread(void *arg)
+{
+    DWORD count = 1;
+    HANDLE handles[2];
+    LARGE_INTEGER due;
+    __int64 now, next;
+    arch_timer *t, *expired, **tail;
+
+    handles[0] = wheel.event;
+    if ((handles[1] = arch_sleep_timer()) != NULL)
+        count = 2;
+
+    for (;;) {
+        expired = NULL;
+        tail = &expired;
+
+        arch_spin_lock(& wheel.lock);
+        now = arch_clock_monotonic_ns();
+        while (wheel.tick <= now / ARCH_TIMER_TICK_NS)
+            arch_timer_expire(&tail, now);
+        wheel.wake = next = arch_timer_next();
+        arch_spin_unlock(& wheel.lock);
+
+        if (expired != NULL) {
+            for (t = expired; t != NULL; t = expired) {
+                long deleted;
+
+                expired = t->run_next;
+                if (t->deleted == 0)
+                    t->function(t->value);
+
+                arch_spin_lock(& wheel.lock);
+                deleted = t->deleted;
+                t->running = 0;
+                arch_spin_unlock(& wheel.lock);
+
+                if (deleted == ARCH_TIMER_DELETED_SELF)
+                    arch_slab_free(t, sizeof(arch_timer));
+                else if (deleted == ARCH_TIMER_DELETED_WAIT)
+                    arch_wake_by_address_all(& t->running);
+            }
+            continue; /* time has passed */
+        }
+
+        if (next < 0) {
+            WaitForSingleObject(handles[0], INFINITE);
+        } else {
+            now = next * ARCH_TIMER_TICK_NS - arch_clock_monotonic_ns();
+            if (now <= 0)
+                continue;
+            due.QuadPart = -((now + 99) / 100);
+            if (count == 2 && SetWaitableTimer(handles[1], &due, 0, NULL, NULL, FALSE) != 0)
+                WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+            else
+                WaitForSingleObject(handles[0], (DWORD) ((now + POW10_6 - 1) / POW10_6));
+        }
+    }
+
+    return 0;
+}
+
+static void arch_timer_start(void)
+{
+    wheel.tick = arch_clock_monotonic_ns() / ARCH_TIMER_TICK_NS;
+    wheel.wake = -1;
+
+    if ((wheel.event = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+        return;
+
+    arch_module_pin();
+    wheel.thread = (HANDLE) _beginthreadex(NULL, 0, arch_timer_thread, NULL, 0, (unsigned int *) & wheel.thread_id);
+    if (wheel.thread == NULL) {
+        CloseHandle(wheel.event);
+        wheel.event = NULL;
+        return;
+    }
+    SetThreadPriority(wheel.thread, THREAD_PRIORITY_ABOVE_NORMAL);
+}
+
+/* A timespec of at least 0 and less than 10^9 ns, in ns */
+static int arch_timer_ns(const struct timespec *ts, __int64 *ns)
+{
+    if (ts->tv_sec < 0 || ts->tv_nsec < 0 || ts->tv_nsec >= POW10_9)
+        return EINVAL;
+
+    *ns = ts->tv_sec * POW10_9 + ts->tv_nsec;
+    return 0;
+}
+
+static void arch_timer_value(arch_timer *t, __int64 now, struct itimerspec *value)
+{
+    __int64 left = 0;
+
+    if (t->pprev != NULL && (left = t->expires - now) <= 0)
+        left = 1; /* due, but not yet expired */
+
+    value->it_value.tv_sec = left / POW10_9;
+    value->it_value.tv_nsec = (long) (left % POW10_9);
+    value->it_interval.tv_sec = t->interval / POW10_9;
+    value->it_interval.tv_nsec = (long) (t->interval % POW10_9);
+}
+
+/**
+ * Create a timer.
+ * @param  clock_id CLOCK_REALTIME or CLOCK_MONOTONIC.
+ * @param  evp NULL or SIGEV_NONE for no notification, or SIGEV_THREAD to
+ *         call evp->sigev_notify_function with evp->sigev_value on expiry.
+ * @param  timerid The new timer, disarmed.
+ * @return If the function succeeds, the return value is 0.
+ *         If the function fails, the return value is -1,
+ *         with errno set to indicate the error.
+ * @remark All notify functions are called by one timer thread, one after
+ *         another, so they should be short. The first timer starts it, and
+ *         the library is not unloaded by FreeLibrary from then on.
+ */
+int timer_create(clockid_t clock_id, struct sigevent *evp, timer_t *timerid)
+{
+    arch_timer *t;
+
+    if (timerid == NULL || (clock_id != CLOCK_REALTIME && clock_id != CLOCK_MONOTONIC))
+        return lc_set_errno(EINVAL);
+
+    if (evp != NULL && evp->sigev_notify != SIGEV_NONE
+        && (evp->sigev_notify != SIGEV_THREAD || evp->sigev_notify_function == NULL))
+        return lc_set_errno(EINVAL);
+
+    pthread_once(&timer_once, arch_timer_start);
+    if (wheel.thread == NULL)
+        return lc_set_errno(EAGAIN);
+
+    if ((t = arch_slab_alloc(sizeof(arch_timer))) == NULL)
+        return lc_set_errno(ENOMEM);
+
+    t->clock_id = clock_id;
+    t->notify = SIGEV_NONE;
+    if (evp != NULL && evp->sigev_notify == SIGEV_THREAD) {
+        t->notify = SIGEV_THREAD;
+        t->function = evp->sigev_notify_function;
+        t->value = evp->sigev_value;
+    }
+
+    *timerid = (timer_t) t;
+    return 0;
+}
+
+/**
+ * Arm or disarm a timer.
+ * @param  timerid The timer.
+ * @param  flags 0 if value->it_value is relative, TIMER_ABSTIME if it is
+ *         an absolute time of the clock of the timer.
+ * @param  value The first expiration in it_value, 0 to disarm the timer,
+ *         and the period in it_interval, 0 for a one-shot timer.
+ * @param  ovalue NULL, or the time left until the previous expiration and
+ *         the previous period.
+ * @return If the function succeeds, the return value is 0.
+ *         If the function fails, the return value is -1,
+ *         with errno set to indicate the error.
+ * @remark An absolute time of CLOCK_REALTIME is converted when the timer
+ *         is armed, later changes of the system time are not followed.
+ */
+int timer_settime(timer_t timerid, int flags, const struct itimerspec *value, struct itimerspec *ovalue)
+{
+    int signal = 0;
+    __int64 now, first, interval;
+    arch_timer *t = (arch_timer *) timerid;
+
+    if (t == NULL || value == NULL
+        || arch_timer_ns(&value->it_value, &first) != 0 || arch_timer_ns(&value->it_interval, &interval) != 0)
+        return lc_set_errno(EINVAL);
+
+    now = arch_clock_monotonic_ns();
+    if (first != 0 && (flags & TIMER_ABSTIME) != 0) {
+        if (t->clock_id == CLOCK_REALTIME) {
+            struct timespec tp;
+
+            clock_gettime(CLOCK_REALTIME, &tp);
+            first -= tp.tv_sec * POW10_9 + tp.tv_nsec;
+        } else {
+            first -= now;
+        }
+        if (first <= 0)
+            first = 1; /* already due */
+    }
+
+    arch_spin_lock(& wheel.lock);
+    if (ovalue != NULL)
+        arch_timer_value(t, now, ovalue);
+
+    arch_timer_unlink(t);
+    t->interval = interval;
+    if (first != 0) {
+        /* The wheel is idle, its tick may be far behind */
+        if (wheel.count == 0 && wheel.tick < now / ARCH_TIMER_TICK_NS)
+            wheel.tick = now / ARCH_TIMER_TICK_NS;
+
+        t->expires = now + first;
+        t->tick = (t->expires + ARCH_TIMER_TICK_NS - 1) / ARCH_TIMER_TICK_NS;
+        arch_timer_link(t);
+        signal = wheel.wake < 0 || t->tick < wheel.wake;
+        if (signal)
+            wheel.wake = t->tick;
+    }
+    arch_spin_unlock(& wheel.lock);
+
+    if (signal)
+        SetEvent(wheel.event);
+
+    return 0;
+}
+
+/**
+ * Get the time left until the next expiration of a timer.
+ * @param  timerid The timer.
+ * @param  value The time left in it_value, 0 if disarmed, and the period in
+ *         it_interval.
+ * @return If the function succeeds, the return value is 0.
+ *         If the function fails, the return value is -1,
+ *         with errno set to indicate the error.
+ */
+int timer_gettime(timer_t timerid, struct itimerspec *value)
+{
+    __int64 now = arch_clock_monotonic_ns();
+    arch_timer *t = (arch_timer *) timerid;
+
+    if (t == NULL || value == NULL)
+        return lc_set_errno(EINVAL);
+
+    arch_spin_lock(& wheel.lock);
+    arch_timer_value(t, now, value);
+    arch_spin_unlock(& wheel.lock);
+
+    return 0;
+}
+
+/**
+ * Get the overrun count of a timer.
+ * @param  timerid The timer.
+ * @return The number of expirations of a periodic timer missed before the
+ *         last one, or -1 with errno set to indicate the error.
+ */
+int timer_getoverrun(timer_t timerid)
+{
+    arch_timer *t = (arch_timer *) timerid;
+
+    if (t == NULL)
+        return lc_set_errno(EINVAL);
+
+    return (int) atomic_read(& t->overrun);
+}
+
+/**
+ * Delete a timer.
+ * @param  timerid The timer.
+ * @return If the function succeeds, the return value is 0.
+ *         If the function fails, the return value is -1,
+ *         with errno set to indicate the error.
+ * @remark If the notify function of the timer is running in another thread,
+ *         waits for it to return.
+ */
+int timer_delete(timer_t timerid)
+{
+    arch_timer *t = (arch_timer *) timerid;
+
+    if (t == NULL)
+        return lc_set_errno(EINVAL);
+
+    arch_spin_lock(& wheel.lock);
+    arch_timer_unlink(t);
+    if (t->running) {
+        if (GetCurrentThreadId() == wheel.thread_id) {
+            t->deleted = ARCH_TIMER_DELETED_SELF;
+            arch_spin_unlock(& wheel.lock);
+            return 0;
+        }
+        t->deleted = ARCH_TIMER_DELETED_WAIT;
+    }
+    arch_spin_unlock(& wheel.lock);
+
+    while (atomic_read_acquire(& t->running))
+        arch_wait_on_address(& t->running, 1, INFINITE);
+
+    arch_slab_free(t, sizeof(arch_timer));
+    return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file trace.c
+ * @brief Implementation Code of the ETW Trace Provider
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * ETW provider "libpthread", {33883c05-47e9-547c-fd87-77d3cd3529a2}, the
+ * EventSource hash of the name, so tools taking "*libpthread" (PerfView,
+ * tracelog) find it as well. Events are TraceLogging self-describing events:
+ * the provider and event metadata travel with every event, WPA decodes them
+ * without a manifest.
+ *
+ * The TraceLogging headers need a newer SDK and import the functions of
+ * Windows 7, so we encode the metadata ourselves and resolve the ntdll entry
+ * points behind EventRegister. On older systems tracing just stays off.
+ *
+ * Keywords: 0x1 mutex park/wake, 0x2 barrier phases, 0x4 semaphore waits,
+ * 0x8 thread create/start/exit. All events are at the informational level.
+ * The enable callback keeps libpthread_trace_keywords up to date, so a hook
+ * costs one load and one predictable branch while nobody listens.
+ */
+
+typedef struct {
+    USHORT id;
+    UCHAR version;
+    UCHAR channel;
+    UCHAR level;
+    UCHAR opcode;
+    USHORT task;
+    ULONGLONG keyword;
+} trace_event_descriptor;
+
+typedef struct {
+    ULONGLONG ptr;
+    ULONG size;
+    UCHAR type; /* TRACE_DATA_* */
+    UCHAR reserved1;
+    USHORT reserved2;
+} trace_data_descriptor;
+
+typedef VOID (NTAPI *trace_enable_callback_t)(const GUID *, ULONG, UCHAR, ULONGLONG, ULONGLONG, PVOID, PVOID);
+typedef ULONG (NTAPI *etw_event_register_t)(const GUID *, trace_enable_callback_t, PVOID, ULONGLONG *);
+typedef ULONG (NTAPI *etw_event_unregister_t)(ULONGLONG);
+typedef ULONG (NTAPI *etw_event_write_transfer_t)(ULONGLONG, const trace_event_descriptor *,
+    const GUID *, const GUID *, ULONG, trace_data_descriptor *);
+
+#define TRACE_DATA_EVENT_METADATA       1
+#define TRACE_DATA_PROVIDER_METADATA    2
+#define TRACE_CHANNEL_TRACELOGGING      11
+#define TRACE_LEVEL_INFO                4
+#define TRACE_OPCODE_INFO               0
+#define TRACE_OPCODE_START              1
+#define TRACE_OPCODE_STOP               2
+#define TRACE_CAPTURE_STATE             2 /* the IsEnabled of a rundown request */
+
+/* TraceLogging field types, every field is 64 bits wide */
+#define TRACE_IN_UINT64     10
+#define TRACE_IN_HEXINT64   21
+
+#define TRACE_FIELDS        4
+#define TRACE_META_SIZE     128
+
+typedef struct {
+    const char *name;
+    UCHAR opcode;
+    UCHAR keyword;
+    const char *fields[TRACE_FIELDS]; /* NULL after the last one */
+    UCHAR types[TRACE_FIELDS];
+} trace_event_info;
+
+/* Indexed by the event numbers of arch.h, ARCH_TRACE_MUTEX_WAIT_START and on */
+static const trace_event_info trace_events[ARCH_TRACE_EVENTS] = {
+    { "MutexWait", TRACE_OPCODE_START, ARCH_TRACE_MUTEX, { "Mutex" }, { TRACE_IN_HEXINT64 } },
+    { "MutexWait", TRACE_OPCODE_STOP, ARCH_TRACE_MUTEX, { "Mutex" }, { TRACE_IN_HEXINT64 } },
+    { "MutexWake", TRACE_OPCODE_INFO, ARCH_TRACE_MUTEX, { "Mutex" }, { TRACE_IN_HEXINT64 } },
+    { "BarrierWait", TRACE_OPCODE_START, ARCH_TRACE_BARRIER, { "Barrier", "Phase" },
+        { TRACE_IN_HEXINT64, TRACE_IN_UINT64 } },
+    { "BarrierWait", TRACE_OPCODE_STOP, ARCH_TRACE_BARRIER, { "Barrier", "Phase" },
+        { TRACE_IN_HEXINT64, TRACE_IN_UINT64 } },
+    { "BarrierPhase", TRACE_OPCODE_INFO, ARCH_TRACE_BARRIER, { "Barrier", "Phase", "Count" },
+        { TRACE_IN_HEXINT64, TRACE_IN_UINT64, TRACE_IN_UINT64 } },
+    { "SemWait", TRACE_OPCODE_START, ARCH_TRACE_SEM, { "Semaphore" }, { TRACE_IN_HEXINT64 } },
+    { "SemWait", TRACE_OPCODE_STOP, ARCH_TRACE_SEM, { "Semaphore", "TimedOut" },
+        { TRACE_IN_HEXINT64, TRACE_IN_UINT64 } },
+    { "ThreadCreate", TRACE_OPCODE_INFO, ARCH_TRACE_THREAD, { "Thread", "StartRoutine", "Arg", "StackSize" },
+        { TRACE_IN_HEXINT64, TRACE_IN_HEXINT64, TRACE_IN_HEXINT64, TRACE_IN_UINT64 } },
+    { "ThreadStart", TRACE_OPCODE_INFO, ARCH_TRACE_THREAD, { "Thread", "StartRoutine" },
+        { TRACE_IN_HEXINT64, TRACE_IN_HEXINT64 } },
+    { "ThreadExit", TRACE_OPCODE_INFO, ARCH_TRACE_THREAD, { "Thread", "ReturnValue" },
+        { TRACE_IN_HEXINT64, TRACE_IN_HEXINT64 } },
+};
+
+static const GUID trace_provider_id =
+    { 0x33883c05, 0x47e9, 0x547c, { 0xfd, 0x87, 0x77, 0xd3, 0xcd, 0x35, 0x29, 0xa2 } };
+
+static const char trace_provider_name[] = "libpthread";
+
+long libpthread_trace_keywords;
+
+static ULONGLONG trace_handle;
+static etw_event_unregister_t etw_event_unregister;
+static etw_event_write_transfer_t etw_event_write_transfer;
+
+static UCHAR trace_provider_meta[2 + sizeof(trace_provider_name)];
+static UCHAR trace_meta[ARCH_TRACE_EVENTS][TRACE_META_SIZE];
+static trace_event_descriptor trace_descriptors[ARCH_TRACE_EVENTS];
+static ULONG trace_nfields[ARCH_TRACE_EVENTS];
+
+/* Append a NUL-terminated string to a metadata blob */
+static size_t trace_meta_string(UCHAR *p, size_t n, const char *s)
+{
+    size_t len = strlen(s) + 1;
+
+    memcpy(p + n, s, len);
+    return n + len;
+}
+
+/*
+ * Event metadata: a 16-bit total size, one tag byte (none), the event name,
+ * then the name and type of each field.
+ */
+static void trace_meta_init(int event)
+{
+    int i;
+    size_t n = 2;
+    UCHAR *p = trace_meta[event];
+    const trace_event_info *e = & trace_events[event];
+
+    p[n++] = 0;
+    n = trace_meta_string(p, n, e->name);
+    for (i = 0; i < TRACE_FIELDS && e->fields[i] != NULL; i++) {
+        n = trace_meta_string(p, n, e->fields[i]);
+        p[n++] = e->types[i];
+    }
+    p[0] = (UCHAR) n;
+    p[1] = (UCHAR) (n >> 8);
+
+    trace_nfields[event] = i;
+    trace_descriptors[event].channel = TRACE_CHANNEL_TRACELOGGING;
+    trace_descriptors[event].level = TRACE_LEVEL_INFO;
+    trace_descriptors[event].opcode = e->opcode;
+    trace_descriptors[event].keyword = e->keyword;
+}
+
+static VOID NTAPI trace_enable(const GUID *source, ULONG is_enabled, UCHAR level,
+    ULONGLONG any, ULONGLONG all, PVOID filter, PVOID context)
+{
+    long keywords = 0;
+
+    if (is_enabled == TRACE_CAPTURE_STATE)
+        return;
+
+    if (is_enabled && (level == 0 || level >= TRACE_LEVEL_INFO))
+        keywords = (any == 0) ? ARCH_TRACE_ALL : (long) (any & ARCH_TRACE_ALL);
+
+    atomic_set(& libpthread_trace_keywords, keywords);
+}
+
+/**
+ * Register the ETW provider, called from DllMain.
+ * @remark Tracing stays off if EtwEventWriteTransfer is not available (before Windows 7).
+ */
+void arch_trace_init(void)
+{
+    int i;
+    HMODULE h;
+    etw_event_register_t etw_event_register;
+
+    if ((h = GetModuleHandleA("ntdll.dll")) == NULL)
+        return;
+
+    etw_event_register = (etw_event_register_t) GetProcAddress(h, "EtwEventRegister");
+    etw_event_unregister = (etw_event_unregister_t) GetProcAddress(h, "EtwEventUnregister");
+    etw_event_write_transfer = (etw_event_write_transfer_t) GetProcAddress(h, "EtwEventWriteTransfer");
+    if (etw_event_register == NULL || etw_event_unregister == NULL || etw_event_write_transfer == NULL)
+        return;
+
+    /* Provider metadata: a 16-bit total size and the name */
+    trace_provider_meta[0] = (UCHAR) sizeof(trace_provider_meta);
+    trace_provider_meta[1] = 0;
+    memcpy(trace_provider_meta + 2, trace_provider_name, sizeof(trace_provider_name));
+
+    for (i = 0; i < ARCH_TRACE_EVENTS; i++)
+        trace_meta_init(i);
+
+    /* The callback may run before EtwEventRegister returns */
+    if (etw_event_register(& trace_provider_id, trace_enable, NULL, & trace_handle) != 0) {
+        trace_handle = 0;
+        atomic_set(& libpthread_trace_keywords, 0);
+    }
+}
+
+/**
+ * Unregister the ETW provider, called from DllMain.
+ */
+void arch_trace_fini(void)
+{
+    if (trace_handle != 0) {
+        atomic_set(& libpthread_trace_keywords, 0);
+        etw_event_unregister(trace_handle);
+        trace_handle = 0;
+    }
+}
+
+/**
+ * Write an event, the caller checked arch_trace_enabled first.
+ * @param event The event number, ARCH_TRACE_MUTEX_WAIT_START and on.
+ * @param v0 The first field, v1 to v3 the next ones, ignored if the event
+ *        has fewer fields.
+ */
+void arch_trace(int event, unsigned __int64 v0, unsigned __int64 v1, unsigned __int64 v2, unsigned __int64 v3)
+{
+    ULONG i, n = trace_nfields[event];
+    unsigned __int64 values[TRACE_FIELDS];
+    trace_data_descriptor data[2 + TRACE_FIELDS];
+
+    if (trace_handle == 0)
+        return;
+
+    values[0] = v0;
+    values[1] = v1;
+    values[2] = v2;
+    values[3] = v3;
+
+    memset(data, 0, sizeof(data));
+    data[0].ptr = (ULONGLONG) (uintptr_t) trace_provider_meta;
+    data[0].size = sizeof(trace_provider_meta);
+    data[0].type = TRACE_DATA_PROVIDER_METADATA;
+    data[1].ptr = (ULONGLONG) (uintptr_t) trace_meta[event];
+    data[1].size = trace_meta[event][0] | (trace_meta[event][1] << 8);
+    data[1].type = TRACE_DATA_EVENT_METADATA;
+    for (i = 0; i < n; i++) {
+        data[2 + i].ptr = (ULONGLONG) (uintptr_t) & values[i];
+        data[2 + i].size = sizeof(unsigned __int64);
+    }
+
+    (void) etw_event_write_transfer(trace_handle, & trace_descriptors[event], NULL, NULL, 2 + n, data);
+}
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file wait.c
+ * @brief Implementation Code of Address Wait/Wake Routines
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "arch.h"
+#include "misc.h"
+
+/*
+ * Windows 8 or later: WaitOnAddress/WakeByAddressSingle/WakeByAddressAll.
+ *
+ * Windows XP/2003/Vista/7: one process-wide keyed event, plus a hashed table
+ * of wait queues. A waiter enqueues a node living on its own stack, and the
+ * address of the node is the key passed to NtWaitForKeyedEvent. Since
+ * NtReleaseKeyedEvent blocks until someone waits on the key, a waker only
+ * releases nodes it has removed from the queue itself.
+ *
+ * No kernel object is needed per synchronization object, and a wake only
+ * enters the kernel when there is a sleeping waiter. Applications get the
+ * same engine through pthread_wait_on_address_np and pthread_wake_np.
+ */
+
+typedef BOOL (WINAPI *wait_on_address_t)(volatile VOID *, PVOID, SIZE_T, DWORD);
+typedef VOID (WINAPI *wake_by_address_t)(PVOID);
+typedef LONG (NTAPI *nt_create_keyed_event_t)(HANDLE *, ULONG, PVOID, ULONG);
+typedef LONG (NTAPI *nt_keyed_event_t)(HANDLE, PVOID, BOOLEAN, PLARGE_INTEGER);
+
+#define KEYEDEVENT_ALL_ACCESS   0x000F0003
+#define WAIT_TABLE_SIZE         256 /* must be a power of 2 */
+
+typedef struct arch_wait_node {
+    volatile long *addr; /* NULL once a waker has dequeued us */
+    struct arch_wait_node *next, *prev;
+} arch_wait_node;
+
+typedef struct {
+    long lock;
+    arch_wait_node *head, *tail;
+} arch_wait_bucket;
+
+static wait_on_address_t wait_on_address;
+static wake_by_address_t wake_by_address_single;
+static wake_by_address_t wake_by_address_all;
+
+static HANDLE keyed_event;
+static nt_keyed_event_t nt_wait_for_keyed_event;
+static nt_keyed_event_t nt_release_keyed_event;
+
+static arch_wait_bucket wait_table[WAIT_TABLE_SIZE];
+
+static __inline arch_wait_bucket *wait_bucket(volatile long *addr)
+{
+    uintptr_t h = (uintptr_t) addr;
+
+    h = (h >> 4) ^ (h >> 12);
+    return & wait_table[h & (WAIT_TABLE_SIZE - 1)];
+}
+
+static __inline void bucket_remove(arch_wait_bucket *b, arch_wait_node *node)
+{
+    if (node->prev != NULL) node->prev->next = node->next;
+    else b->head = node->next;
+
+    if (node->next != NULL) node->next->prev = node->prev;
+    else b->tail = node->prev;
+
+    node->addr = NULL;
+}
+
+/* Dequeue up to count waiters of addr, and release them outside the bucket lock */
+static void keyed_wake(volatile long *addr, int count)
+{
+    arch_wait_node *node, *next, *wake = NULL;
+    arch_wait_bucket *b = wait_bucket(addr);
+
+    arch_spin_lock(& b->lock);
+    for (node = b->head; node != NULL && count > 0; node = next) {
+        next = node->next;
+        if (node->addr == addr) {
+            bucket_remove(b, node);
+            node->next = wake;
+            wake = node;
+            count--;
+        }
+    }
+    arch_spin_unlock(& b->lock);
+
+    while (wake != NULL) {
+        next = wake->next; /* The node is gone once released */
+        (void) nt_release_keyed_event(keyed_event, wake, FALSE, NULL);
+        wake = next;
+    }
+}
+
+static int keyed_wait(volatile long *addr, long expected, DWORD ms)
+{
+    LARGE_INTEGER timeout;
+    arch_wait_node node;
+    arch_wait_bucket *b = wait_bucket(addr);
+
+    arch_spin_lock(& b->lock);
+    if (atomic_read(addr) != expected) {
+        arch_spin_unlock(& b->lock);
+        return 0;
+    }
+
+    node.addr = addr;
+    node.next = NULL;
+    node.prev = b->tail;
+    if (b->tail != NULL) b->tail->next = &node;
+    else b->head = &node;
+    b->tail = &node;
+    arch_spin_unlock(& b->lock);
+
+    timeout.QuadPart = - (__int64) ms * POW10_4; /* relative, in 100ns */
+    if (nt_wait_for_keyed_event(keyed_event, &node, FALSE, ms == INFINITE ? NULL : &timeout) == 0)
+        return 0;
+
+    arch_spin_lock(& b->lock);
+    if (node.addr != NULL) {
+        bucket_remove(b, &node);
+        arch_spin_unlock(& b->lock);
+        return ETIMEDOUT;
+    }
+    arch_spin_unlock(& b->lock);
+
+    /* A waker has dequeued us and is about to release us, we must consume it. */
+    (void) nt_wait_for_keyed_event(keyed_event, &node, FALSE, NULL);
+    return 0;
+}
+
+/**
+ * Block while *addr == expected.
+ * @param addr The address to wait on.
+ * @param expected The value *addr should have for the caller to block.
+ * @param ms The timeout in milli-seconds, or INFINITE.
+ * @return 0 when woken or *addr != expected (callers must re-check, wakeups
+ *         may be spurious), ETIMEDOUT when the timeout elapsed.
+ */
+int arch_wait_on_address(volatile long *addr, long expected, DWORD ms)
+{
+    if (wait_on_address != NULL) {
+        if (wait_on_address(addr, &expected, sizeof(long), ms))
+            return 0;
+        return GetLastError() == ERROR_TIMEOUT ? ETIMEDOUT : 0;
+    }
+
+    return keyed_wait(addr, expected, ms);
+}
+
+/**
+ * Wake one thread blocked in arch_wait_on_address(addr, ...).
+ * @param addr The address to wake.
+ */
+void arch_wake_by_address_single(volatile long *addr)
+{
+    if (wake_by_address_single != NULL)
+        wake_by_address_single((PVOID) addr);
+    else
+        keyed_wake(addr, 1);
+}
+
+/**
+ * Wake all threads blocked in arch_wait_on_address(addr, ...).
+ * @param addr The address to wake.
+ */
+void arch_wake_by_address_all(volatile long *addr)
+{
+    if (wake_by_address_all != NULL)
+        wake_by_address_all((PVOID) addr);
+    else
+        keyed_wake(addr, INT_MAX);
+}
+
+/**
+ * Wake up to count threads blocked in arch_wait_on_address(addr, ...).
+ * @param addr The address to wake.
+ * @param count The number of threads to wake, INT_MAX for all.
+ */
+void arch_wake_by_address(volatile long *addr, int count)
+{
+    if (count == INT_MAX) {
+        arch_wake_by_address_all(addr);
+    } else if (wake_by_address_single != NULL) {
+        while (count-- > 0)
+            wake_by_address_single((PVOID) addr);
+    } else {
+        keyed_wake(addr, count);
+    }
+}
+
+/**
+ * Wake up to count of the threads a caller counts as parked on addr.
+ * @param addr The address to wake.
+ * @param count The number of threads to wake.
+ * @param waiters The number of threads counted in user space as parked, or
+ *        about to park, on addr.
+ * @remark Nothing is done without waiters, and when count covers them all
+ *         they are released with one WakeByAddressAll instead of count
+ *         WakeByAddressSingle calls.
+ */
+void arch_wake_by_address_waiters(volatile long *addr, int count, long waiters)
+{
+    if (waiters <= 0 || count <= 0)
+        return;
+
+    if (count >= waiters)
+        arch_wake_by_address_all(addr);
+    else
+        arch_wake_by_address(addr, count);
+}
+
+/**
+ * Block while *addr == expected, the futex-like primitive for lock-free
+ * structures of applications.
+ * @param addr The 32-bit word to wait on.
+ * @param expected The value *addr should have for the caller to block.
+ * @param clock_id The clock of abstime: CLOCK_REALTIME, CLOCK_MONOTONIC
+ *        or their coarse variants.
+ * @param abstime NULL to wait without timeout, or the absolute timeout.
+ * @return 0 when woken, possibly spuriously, callers must re-check *addr.
+ *         EAGAIN if *addr != expected on entry, ETIMEDOUT when abstime was
+ *         reached, or EINVAL if an argument is invalid.
+ * @remark No kernel object is kept per address, waking an address nobody
+ *         waits on, or one that was freed, is harmless.
+ */
+int pthread_wait_on_address_np(volatile long *addr, long expected, clockid_t clock_id, const struct timespec *abstime)
+{
+    DWORD ms;
+
+    if (addr == NULL)
+        return EINVAL;
+
+    if (abstime != NULL) {
+        if (clock_id != CLOCK_REALTIME && clock_id != CLOCK_MONOTONIC
+            && clock_id != CLOCK_REALTIME_COARSE && clock_id != CLOCK_MONOTONIC_COARSE)
+            return EINVAL;
+        if (abstime->tv_nsec < 0 || abstime->tv_nsec >= POW10_9)
+            return EINVAL;
+    }
+
+    if (atomic_read(addr) != expected)
+        return EAGAIN;
+
+    if (abstime == NULL) {
+        arch_wait_on_address(addr, expected, INFINITE);
+        return 0;
+    }
+
+    /* The timeout in ms is rounded up, and clamped below INFINITE */
+    while ((ms = arch_timeout_in_ms(clock_id, abstime)) != 0) {
+        if (arch_wait_on_address(addr, expected, ms) == 0)
+            return 0;
+    }
+
+    return atomic_read(addr) == expected ? ETIMEDOUT : 0;
+}
+
+/**
+ * Wake threads blocked in pthread_wait_on_address_np(addr, ...).
+ * @param addr The 32-bit word to wake.
+ * @param count The number of threads to wake, 1 or more, or
+ *        PTHREAD_WAKE_ALL_NP for all of them.
+ * @return 0 if succeeds, or EINVAL if an argument is invalid.
+ */
+int pthread_wake_np(volatile long *addr, int count)
+{
+    if (addr == NULL || count <= 0)
+        return EINVAL;
+
+    if (count == 1)
+        arch_wake_by_address_single(addr);
+    else
+        arch_wake_by_address(addr, count);
+    return 0;
+}
+
+/**
+ * Select the wait/wake engine, called from DllMain.
+ * @return TRUE if the engine is usable, FALSE otherwise.
+ */
+int arch_wait_init(void)
+{
+    HMODULE h;
+    nt_create_keyed_event_t nt_create_keyed_event;
+
+    if ((h = GetModuleHandleA("kernelbase.dll")) != NULL) {
+        wait_on_address = (wait_on_address_t) GetProcAddress(h, "WaitOnAddress");
+        wake_by_address_single = (wake_by_address_t) GetProcAddress(h, "WakeByAddressSingle");
+        wake_by_address_all = (wake_by_address_t) GetProcAddress(h, "WakeByAddressAll");
+
+        if (wait_on_address != NULL && wake_by_address_single != NULL && wake_by_address_all != NULL)
+            return TRUE;
+
+        wait_on_address = NULL;
+        wake_by_address_single = wake_by_address_all = NULL;
+    }
+
+    if ((h = GetModuleHandleA("ntdll.dll")) == NULL)
+        return FALSE;
+
+    nt_create_keyed_event = (nt_create_keyed_event_t) GetProcAddress(h, "NtCreateKeyedEvent");
+    nt_wait_for_keyed_event = (nt_keyed_event_t) GetProcAddress(h, "NtWaitForKeyedEvent");
+    nt_release_keyed_event = (nt_keyed_event_t) GetProcAddress(h, "NtReleaseKeyedEvent");
+
+    if (nt_create_keyed_event == NULL || nt_wait_for_keyed_event == NULL || nt_release_keyed_event == NULL)
+        return FALSE;
+
+    if (nt_create_keyed_event(&keyed_event, KEYEDEVENT_ALL_ACCESS, NULL, 0) != 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+/**
+ * Release the wait/wake engine, called from DllMain.
+ */
+void arch_wait_fini(void)
+{
+    if (keyed_event != NULL) {
+        CloseHandle(keyed_event);
+        keyed_event = NULL;
+    }
+}
@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+#include <pthread.h>
+#include <pthread_clock.h>
+#include <semaphore.h>
+
+#include "../src/misc.h"
+
+/*
+ * Contention benchmark: every primitive is run with 1, 2, 4 ... threads up
+ * to twice the CPUs, and with critical sections of 0, 100 and 1000 loops of
+ * work. The acquire latency of every operation goes to a histogram, the
+ * result is one CSV line per run:
+ *
+ *   primitive,threads,cs_loops,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns,fairness
+ *
+ * fairness is Jain's index of the operations per thread, 1.0 if all threads
+ * got the same share. Locks run for a fixed time, barrier, once and thread
+ * create/join for a fixed number of rounds.
+ *
+ * Usage: bench [ms per run] [max threads] > bench.csv
+ */
+
+#define MAX_THREADS     64
+#define HIST_SUB_BITS   4 /* 16 linear sub-buckets per power of 2, < 6.25% error */
+#define HIST_SIZE       (64 << HIST_SUB_BITS)
+#define BARRIER_ROUNDS  20000
+#define ONCE_ROUNDS     20000
+#define CREATE_ROUNDS   500
+
+typedef struct {
+    pthread_t thread;
+    long long ops;
+    unsigned long long max_ns;
+    unsigned long long hist[HIST_SIZE];
+} bench_thread;
+
+typedef struct {
+    char *name;
+    void *(* worker)(void *);
+    void (* lock)(long long op);
+    void (* unlock)(long long op);
+} bench_primitive;
+
+static LARGE_INTEGER freq;
+static pthread_barrier_t start;
+static long stop;
+static int cs_loops;
+static volatile long work_sink;
+
+static pthread_mutex_t mutex;
+static pthread_spinlock_t spin;
+static pthread_spin_rwlock_t spin_rwlock = PTHREAD_SPIN_RWLOCK_INITIALIZER;
+static sem_t sem;
+static pthread_barrier_t barrier;
+static pthread_once_t *once_controls;
+
+static void work(int loops)
+{
+    int i;
+
+    for (i = 0; i < loops; i++)
+        work_sink++;
+}
+
+static __inline unsigned long long now_ticks(void)
+{
+    LARGE_INTEGER t;
+
+    QueryPerformanceCounter(&t);
+    return (unsigned long long) t.QuadPart;
+}
+
+static int hist_index(unsigned long long ns)
+{
+    int e = 0;
+
+    if (ns < (1 << HIST_SUB_BITS))
+        return (int) ns;
+
+    while ((ns >> e) >= (2 << HIST_SUB_BITS))
+        e++;
+
+    return ((e + 1) << HIST_SUB_BITS) + (int) ((ns >> e) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* The lower bound of bucket i */
+static unsigned long long hist_value(int i)
+{
+    int e = (i >> HIST_SUB_BITS) - 1;
+
+    if (e < 0)
+        return i;
+
+    return (unsigned long long) ((1 << HIST_SUB_BITS) + (i & ((1 << HIST_SUB_BITS) - 1))) << e;
+}
+
+static __inline void record(bench_thread *t, unsigned long long t0, unsigned long long t1)
+{
+    unsigned long long ns = (t1 - t0) * POW10_9 / freq.QuadPart;
+
+    t->hist[hist_index(ns)]++;
+    if (ns > t->max_ns)
+        t->max_ns = ns;
+    t->ops++;
+}
+
+static void mutex_lock(long long op) { pthread_mutex_lock(&mutex); }
+static void mutex_unlock(long long op) { pthread_mutex_unlock(&mutex); }
+static void spin_lock(long long op) { pthread_spin_lock(&spin); }
+static void spin_unlock(long long op) { pthread_spin_unlock(&spin); }
+static void sem_lock(long long op) { sem_wait(sem); }
+static void sem_unlock(long long op) { sem_post(sem); }
+
+/* One write in 8 operations */
+static void spin_rwlock_lock(long long op)
+{
+    if ((op & 7) == 0)
+        pthread_spin_rwlock_writer_lock(&spin_rwlock);
+    else
+        pthread_spin_rwlock_reader_lock(&spin_rwlock);
+}
+
+static void spin_rwlock_unlock(long long op)
+{
+    if ((op & 7) == 0)
+        pthread_spin_rwlock_writer_unlock(&spin_rwlock);
+    else
+        pthread_spin_rwlock_reader_unlock(&spin_rwlock);
+}
+
+static bench_primitive *current;
+
+/* Until the main thread sets stop: acquire (timed), critical section, release */
+static void *lock_worker(void *arg)
+{
+    unsigned long long t0, t1;
+    bench_thread *t = (bench_thread *) arg;
+
+    pthread_barrier_wait(&start);
+    while (atomic_read(&stop) == 0) {
+        t0 = now_ticks();
+        current->lock(t->ops);
+        t1 = now_ticks();
+        work(cs_loops);
+        current->unlock(t->ops);
+        record(t, t0, t1);
+    }
+
+    return NULL;
+}
+
+/* Arrive after cs_loops of work, the wait is the latency */
+static void *barrier_worker(void *arg)
+{
+    int i;
+    unsigned long long t0;
+    bench_thread *t = (bench_thread *) arg;
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < BARRIER_ROUNDS; i++) {
+        work(cs_loops);
+        t0 = now_ticks();
+        pthread_barrier_wait(&barrier);
+        record(t, t0, now_ticks());
+    }
+
+    return NULL;
+}
+
+static void once_init(void)
+{
+    work(cs_loops);
+}
+
+/* All threads race through the same once controls */
+static void *once_worker(void *arg)
+{
+    int i;
+    unsigned long long t0;
+    bench_thread *t = (bench_thread *) arg;
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < ONCE_ROUNDS; i++) {
+        t0 = now_ticks();
+        pthread_once(&once_controls[i], once_init);
+        record(t, t0, now_ticks());
+    }
+
+    return NULL;
+}
+
+static void *worked(void *arg)
+{
+    work(cs_loops);
+    return NULL;
+}
+
+/* pthread_create and pthread_join of a thread doing cs_loops of work */
+static void *create_worker(void *arg)
+{
+    int i;
+    pthread_t child;
+    unsigned long long t0;
+    bench_thread *t = (bench_thread *) arg;
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < CREATE_ROUNDS; i++) {
+        t0 = now_ticks();
+        assert(pthread_create(&child, NULL, worked, NULL) == 0);
+        assert(pthread_join(child, NULL) == 0);
+        record(t, t0, now_ticks());
+    }
+
+    return NULL;
+}
+
+static bench_primitive primitives[] = {
+    { "mutex", lock_worker, mutex_lock, mutex_unlock },
+    { "spinlock", lock_worker, spin_lock, spin_unlock },
+    { "spin_rwlock", lock_worker, spin_rwlock_lock, spin_rwlock_unlock },
+    { "semaphore", lock_worker, sem_lock, sem_unlock },
+    { "barrier", barrier_worker, NULL, NULL },
+    { "once", once_worker, NULL, NULL },
+    { "create_join", create_worker, NULL, NULL },
+};
+
+static unsigned long long percentile(const unsigned long long *hist, long long total, double p)
+{
+    int i;
+    long long seen = 0, rank = (long long) (total * p);
+
+    for (i = 0; i < HIST_SIZE; i++) {
+        seen += hist[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+
+    return hist_value(HIST_SIZE - 1);
+}
+
+static void run(bench_primitive *p, int nthreads, int loops, int ms)
+{
+    int i, j;
+    double seconds, sum = 0, sum2 = 0;
+    long long total = 0;
+    unsigned long long t0, t1, max_ns = 0;
+    static unsigned long long hist[HIST_SIZE];
+    bench_thread *t[MAX_THREADS];
+
+    current = p;
+    cs_loops = loops;
+    atomic_set(&stop, 0);
+    assert(pthread_barrier_init(&start, NULL, nthreads + 1) == 0);
+    assert(pthread_barrier_init(&barrier, NULL, nthreads) == 0);
+    if (p->worker == once_worker)
+        assert((once_controls = calloc(ONCE_ROUNDS, sizeof(pthread_once_t))) != NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        assert((t[i] = calloc(1, sizeof(bench_thread))) != NULL);
+        assert(pthread_create(&t[i]->thread, NULL, p->worker, t[i]) == 0);
+    }
+
+    pthread_barrier_wait(&start);
+    t0 = now_ticks();
+    if (p->worker == lock_worker) {
+        Sleep(ms);
+        atomic_set(&stop, 1);
+    }
+    for (i = 0; i < nthreads; i++)
+        assert(pthread_join(t[i]->thread, NULL) == 0);
+    t1 = now_ticks();
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < nthreads; i++) {
+        for (j = 0; j < HIST_SIZE; j++)
+            hist[j] += t[i]->hist[j];
+        if (t[i]->max_ns > max_ns)
+            max_ns = t[i]->max_ns;
+        total += t[i]->ops;
+        sum += (double) t[i]->ops;
+        sum2 += (double) t[i]->ops * t[i]->ops;
+        free(t[i]);
+    }
+
+    seconds = (double) (t1 - t0) / freq.QuadPart;
+    fprintf(stdout, "%s,%d,%d,%I64d,%.6f,%.0f,%I64u,%I64u,%I64u,%I64u,%.4f\n",
+        p->name, nthreads, loops, total, seconds, total / seconds,
+        percentile(hist, total, 0.50), percentile(hist, total, 0.99),
+        percentile(hist, total, 0.999), max_ns,
+        sum2 > 0 ? sum * sum / (nthreads * sum2) : 1.0);
+    fflush(stdout);
+
+    if (p->worker == once_worker) {
+        free(once_controls);
+        once_controls = NULL;
+    }
+    pthread_barrier_destroy(&barrier);
+    pthread_barrier_destroy(&start);
+}
+
+int main(int argc, char *argv[])
+{
+    int i, j, n, ms = 200, max_threads = get_ncpu() * 2;
+    static const int loops[] = { 0, 100, 1000 };
+
+    if (argc > 1)
+        ms = atoi(argv[1]);
+    if (argc > 2)
+        max_threads = atoi(argv[2]);
+    if (max_threads > MAX_THREADS)
+        max_threads = MAX_THREADS;
+
+    QueryPerformanceFrequency(&freq);
+    assert(pthread_mutex_init(&mutex, NULL) == 0);
+    assert(pthread_spin_init(&spin, PTHREAD_PROCESS_PRIVATE) == 0);
+    assert(sem_init(&sem, PTHREAD_PROCESS_PRIVATE, 1) == 0);
+
+    fprintf(stdout, "primitive,threads,cs_loops,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns,fairness\n");
+    for (i = 0; i < sizeof(primitives) / sizeof(primitives[0]); i++) {
+        for (n = 1; n <= max_threads; n <<= 1) {
+            for (j = 0; j < sizeof(loops) / sizeof(loops[0]); j++)
+                run(&primitives[i], n, loops[j], ms);
+        }
+    }
+
+    sem_destroy(sem);
+    pthread_spin_destroy(&spin);
+    pthread_mutex_destroy(&mutex);
+
+    return 0;
+}
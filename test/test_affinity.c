@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+static int first_cpu(cpu_set_t *set)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set))
+            return cpu;
+    }
+
+    return -1;
+}
+
+/* Runs pinned to the CPU in arg */
+static void *pinned(void *arg)
+{
+    cpu_set_t set;
+    int cpu = *(int *) arg;
+
+    assert(pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+    assert(CPU_COUNT(&set) == 1 && CPU_ISSET(cpu, &set));
+    Sleep(1);
+    assert(sched_getcpu() == cpu);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int cpu;
+    pthread_t t;
+    pthread_attr_t attr;
+    cpu_set_t all, set, set2;
+
+    CPU_ZERO(&set);
+    assert(CPU_COUNT(&set) == 0);
+    CPU_SET(3, &set);
+    CPU_SET(64, &set);
+    CPU_SET(CPU_SETSIZE, &set);
+    assert(CPU_COUNT(&set) == 2);
+    assert(CPU_ISSET(3, &set) && CPU_ISSET(64, &set) && !CPU_ISSET(4, &set));
+    CPU_CLR(3, &set);
+    assert(CPU_COUNT(&set) == 1);
+    CPU_OR(&set2, &set, &set);
+    assert(CPU_EQUAL(&set, &set2));
+    printf("cpu_set_t passed\n");
+
+    cpu = sched_getcpu();
+    assert(cpu >= 0 && cpu < CPU_SETSIZE);
+    printf("sched_getcpu: %d\n", cpu);
+
+    /* the main thread */
+    assert(pthread_getaffinity_np(pthread_self(), sizeof(all), &all) == 0);
+    assert(CPU_COUNT(&all) >= 1);
+    printf("pthread_getaffinity_np: %d CPUs\n", CPU_COUNT(&all));
+
+    CPU_ZERO(&set);
+    assert(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == EINVAL);
+
+    cpu = first_cpu(&all);
+    CPU_SET(cpu, &set);
+    assert(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+    assert(pthread_getaffinity_np(pthread_self(), sizeof(set2), &set2) == 0);
+    assert(CPU_EQUAL(&set, &set2));
+    Sleep(1);
+    assert(sched_getcpu() == cpu);
+    assert(pthread_setaffinity_np(pthread_self(), sizeof(all), &all) == 0);
+    printf("pthread_setaffinity_np passed\n");
+
+    /* a new thread */
+    assert(pthread_attr_init(&attr) == 0);
+    assert(pthread_attr_getaffinity_np(&attr, sizeof(set2), &set2) == 0);
+    assert(CPU_COUNT(&set2) == 0);
+    CPU_ZERO(&set2);
+    assert(pthread_attr_setaffinity_np(&attr, sizeof(set2), &set2) == EINVAL);
+    assert(pthread_attr_setaffinity_np(&attr, sizeof(set), &set) == 0);
+    assert(pthread_attr_getaffinity_np(&attr, sizeof(set2), &set2) == 0);
+    assert(CPU_EQUAL(&set, &set2));
+    assert(pthread_create(&t, &attr, pinned, &cpu) == 0);
+    assert(pthread_join(t, NULL) == 0);
+    assert(pthread_attr_destroy(&attr) == 0);
+    printf("pthread_attr_setaffinity_np passed\n");
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define THREAD_COUNT    8
+#define PHASE_COUNT     10000
+
+static pthread_barrier_t barrier;
+static long arrived = 0, serial = 0;
+
+/* Nobody leaves a phase before everybody arrived in it */
+static void *worker(void *arg)
+{
+    int i, rc;
+
+    for (i = 0; i < PHASE_COUNT; i++) {
+        atomic_fetch_and_add(&arrived, 1);
+        rc = pthread_barrier_wait(&barrier);
+        assert(rc == 0 || rc == PTHREAD_BARRIER_SERIAL_THREAD);
+        if (rc == PTHREAD_BARRIER_SERIAL_THREAD)
+            atomic_fetch_and_add(&serial, 1);
+        assert(atomic_read(&arrived) >= (i + 1) * THREAD_COUNT);
+    }
+
+    return NULL;
+}
+
+static void test_barrier(pthread_barrierattr_t *attr, char *name)
+{
+    int i;
+    pthread_t t[THREAD_COUNT];
+
+    arrived = serial = 0;
+    assert(pthread_barrier_init(&barrier, attr, THREAD_COUNT) == 0);
+
+    for (i = 0; i < THREAD_COUNT; i++)
+        assert(pthread_create(&t[i], NULL, worker, NULL) == 0);
+    for (i = 0; i < THREAD_COUNT; i++)
+        assert(pthread_join(t[i], NULL) == 0);
+
+    assert(arrived == THREAD_COUNT * PHASE_COUNT);
+    assert(serial == PHASE_COUNT);
+    assert(pthread_barrier_destroy(&barrier) == 0);
+    printf("%s pthread_barrier_wait passed\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    int kind;
+    pthread_barrierattr_t attr;
+
+    assert(pthread_barrier_init(&barrier, NULL, 0) == -1 && errno == EINVAL);
+    assert(pthread_barrier_init(&barrier, NULL, 1) == 0);
+    assert(pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD);
+    assert(pthread_barrier_destroy(&barrier) == 0);
+
+    test_barrier(NULL, "PTHREAD_BARRIER_SPIN_NP");
+
+    assert(pthread_barrierattr_init(&attr) == 0);
+    assert(pthread_barrierattr_setkind_np(&attr, 2) == EINVAL);
+    assert(pthread_barrierattr_setkind_np(&attr, PTHREAD_BARRIER_PARK_NP) == 0);
+    assert(pthread_barrierattr_getkind_np(&attr, &kind) == 0 && kind == PTHREAD_BARRIER_PARK_NP);
+    test_barrier(&attr, "PTHREAD_BARRIER_PARK_NP");
+    assert(pthread_barrierattr_destroy(&attr) == 0);
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define PUSH_COUNT      1000000
+
+static long order[3];
+static long calls;
+
+static void record(void *arg)
+{
+    order[calls++] = (long) (intptr_t) arg;
+}
+
+static void count(void *arg)
+{
+    (*(long *) arg)++;
+}
+
+/* pthread_exit runs the live frames, innermost first */
+static void *exiting(void *arg)
+{
+    pthread_cleanup_push(record, (void *) 1);
+    pthread_cleanup_push(record, (void *) 2);
+    pthread_cleanup_push(record, (void *) 3);
+    pthread_exit(arg);
+    pthread_cleanup_pop(0);
+    pthread_cleanup_pop(0);
+    pthread_cleanup_pop(0);
+    return NULL;
+}
+
+static void *popping(void *arg)
+{
+    long i, n = 0;
+
+    for (i = 0; i < PUSH_COUNT; i++) {
+        pthread_cleanup_push(count, &n);
+        pthread_cleanup_pop(i & 1);
+    }
+    assert(n == PUSH_COUNT / 2);
+
+    /* a frame popped without executing is not run at exit */
+    pthread_cleanup_push(record, (void *) 4);
+    pthread_cleanup_pop(0);
+
+    return arg;
+}
+
+int main(int argc, char *argv[])
+{
+    void *value;
+    long n = 0;
+    pthread_t t;
+
+    assert(pthread_create(&t, NULL, exiting, (void *) 7) == 0);
+    assert(pthread_join(t, &value) == 0);
+    assert(value == (void *) 7);
+    assert(calls == 3 && order[0] == 3 && order[1] == 2 && order[2] == 1);
+    printf("pthread_exit cleanup passed\n");
+
+    calls = 0;
+    assert(pthread_create(&t, NULL, popping, (void *) 8) == 0);
+    assert(pthread_join(t, &value) == 0);
+    assert(value == (void *) 8);
+    assert(calls == 0);
+    printf("pthread_cleanup_pop passed\n");
+
+    /* the main thread runs its frames on pthread_cleanup_pop */
+    pthread_cleanup_push(count, &n);
+    pthread_cleanup_pop(1);
+    assert(n == 1);
+    printf("main thread cleanup passed\n");
+
+    return 0;
+}
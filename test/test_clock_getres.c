@@ -70,6 +70,8 @@ int main(int argc, char *argv[])
     test_clock_getres("         CLOCK_MONOTONIC", CLOCK_MONOTONIC);
     test_clock_getres("CLOCK_PROCESS_CPUTIME_ID", CLOCK_PROCESS_CPUTIME_ID);
     test_clock_getres(" CLOCK_THREAD_CPUTIME_ID", CLOCK_THREAD_CPUTIME_ID);
+    test_clock_getres("   CLOCK_REALTIME_COARSE", CLOCK_REALTIME_COARSE);
+    test_clock_getres("  CLOCK_MONOTONIC_COARSE", CLOCK_MONOTONIC_COARSE);
 
     return 0;
 }
@@ -25,13 +25,43 @@
 
 #include "../src/misc.h"
 
+#define PERIOD_NS       2000000
+#define PERIOD_TIMES    100
+
+/* A fixed-rate loop on absolute deadlines does not accumulate errors */
+void test_periodic()
+{
+    int i;
+    __int64 late, worst = 0;
+    struct timespec next, now;
+
+    assert(clock_gettime(CLOCK_MONOTONIC, &next) == 0);
+    for (i = 0; i < PERIOD_TIMES; i++) {
+        next.tv_nsec += PERIOD_NS;
+        if (next.tv_nsec >= POW10_9) {
+            next.tv_nsec -= POW10_9;
+            next.tv_sec++;
+        }
+        assert(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == 0);
+        assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+        late = (now.tv_sec - next.tv_sec) * POW10_9 + (now.tv_nsec - next.tv_nsec);
+        assert(late >= 0);
+        if (late > worst)
+            worst = late;
+    }
+
+    /* with absolute deadlines the lateness does not add up over the periods */
+    printf("periodic CLOCK_MONOTONIC: %d periods of %d ns, last late %d ns, worst %d ns\n",
+        PERIOD_TIMES, PERIOD_NS, (int) late, (int) worst);
+}
+
 void test_clock_nanosleep()
 {
     int rc;
     struct timespec tp, request = { 0, 125000000 }, remain;
 
     rc = clock_nanosleep(CLOCK_MONOTONIC, 0, &request, &remain);
-    assert(rc == -1 && errno == EINVAL);
+    assert(rc == 0);
 
     rc = clock_nanosleep(CLOCK_PROCESS_CPUTIME_ID, 0, &request, &remain);
     assert(rc == -1 && errno == EINVAL);
@@ -59,6 +89,21 @@ void test_clock_nanosleep()
     rc = clock_gettime(CLOCK_REALTIME, &tp);
     assert(rc == 0);
     printf("[%10"PRId64".%09d] clock_gettime (CLOCK_REALTIME)\n", (__int64) tp.tv_sec, (int) tp.tv_nsec);
+    assert(tp.tv_sec >= request.tv_sec);
+
+    /* a deadline in the past returns at once */
+    rc = clock_gettime(CLOCK_MONOTONIC, &tp);
+    assert(rc == 0);
+    request.tv_sec = tp.tv_sec - 1;
+    request.tv_nsec = tp.tv_nsec;
+    rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &request, NULL);
+    assert(rc == 0);
+    request.tv_sec = 0;
+    request.tv_nsec = POW10_9;
+    rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &request, NULL);
+    assert(rc == -1 && errno == EINVAL);
+
+    test_periodic();
 }
 
 int main(int argc, char *argv[])
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define THREAD_COUNT    8
+#define ITEM_COUNT      100000
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t go = PTHREAD_COND_INITIALIZER;
+
+static long items = 0, consumed = 0, started = 0, woken = 0;
+
+static void *producer(void *arg)
+{
+    int i;
+
+    for (i = 0; i < ITEM_COUNT; i++) {
+        pthread_mutex_lock(&mutex);
+        while (items >= 16)
+            pthread_cond_wait(&not_full, &mutex);
+        items++;
+        pthread_cond_signal(&not_empty);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    int i;
+
+    for (i = 0; i < ITEM_COUNT; i++) {
+        pthread_mutex_lock(&mutex);
+        while (items == 0)
+            pthread_cond_wait(&not_empty, &mutex);
+        items--;
+        consumed++;
+        pthread_cond_signal(&not_full);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    return NULL;
+}
+
+static void *waiter(void *arg)
+{
+    pthread_mutex_lock(&mutex);
+    started++;
+    while (started <= THREAD_COUNT)
+        pthread_cond_wait(&go, &mutex);
+    woken++;
+    pthread_mutex_unlock(&mutex);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int rc, i;
+    clockid_t clock_id;
+    struct timespec t1, t2;
+    pthread_cond_t cond;
+    pthread_condattr_t attr;
+    pthread_t t[THREAD_COUNT];
+
+    /* producer/consumer test */
+    for (i = 0; i < THREAD_COUNT; i += 2) {
+        rc = pthread_create(&t[i], NULL, producer, NULL);
+        assert(rc == 0);
+        rc = pthread_create(&t[i + 1], NULL, consumer, NULL);
+        assert(rc == 0);
+    }
+
+    for (i = 0; i < THREAD_COUNT; i++) {
+        rc = pthread_join(t[i], NULL);
+        assert(rc == 0);
+    }
+
+    assert(items == 0);
+    assert(consumed == THREAD_COUNT / 2 * ITEM_COUNT);
+    printf("pthread_cond_signal passed\n");
+
+    /* broadcast test */
+    for (i = 0; i < THREAD_COUNT; i++) {
+        rc = pthread_create(&t[i], NULL, waiter, NULL);
+        assert(rc == 0);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&mutex);
+        if (started == THREAD_COUNT) {
+            started++;
+            pthread_cond_broadcast(&go);
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+        pthread_mutex_unlock(&mutex);
+        Sleep(1);
+    }
+
+    for (i = 0; i < THREAD_COUNT; i++) {
+        rc = pthread_join(t[i], NULL);
+        assert(rc == 0);
+    }
+
+    assert(woken == THREAD_COUNT);
+    printf("pthread_cond_broadcast passed\n");
+
+    /* CLOCK_MONOTONIC timed wait test */
+    rc = pthread_condattr_init(&attr);
+    assert(rc == 0);
+    assert(pthread_condattr_setclock(&attr, CLOCK_PROCESS_CPUTIME_ID) == EINVAL);
+    rc = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    assert(rc == 0);
+    rc = pthread_condattr_getclock(&attr, &clock_id);
+    assert(rc == 0 && clock_id == CLOCK_MONOTONIC);
+    rc = pthread_cond_init(&cond, &attr);
+    assert(rc == 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t2 = t1;
+    t2.tv_nsec += 100 * POW10_6;
+    if (t2.tv_nsec >= POW10_9) {
+        t2.tv_sec++;
+        t2.tv_nsec -= POW10_9;
+    }
+
+    pthread_mutex_lock(&mutex);
+    rc = pthread_cond_timedwait(&cond, &mutex, &t2);
+    assert(rc == ETIMEDOUT);
+    pthread_mutex_unlock(&mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    assert((t2.tv_sec - t1.tv_sec) * POW10_9 + (t2.tv_nsec - t1.tv_nsec) >= 100 * POW10_6);
+
+    rc = pthread_cond_destroy(&cond);
+    assert(rc == 0);
+    rc = pthread_condattr_destroy(&attr);
+    assert(rc == 0);
+    printf("pthread_cond_timedwait passed\n");
+
+    return 0;
+}
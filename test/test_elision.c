@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define NTHREADS        4
+#define LOCK_COUNT      100000
+
+/* One counter per thread and cache line, elided sections do not conflict */
+static struct {
+    long value;
+    char __pad[PTHREAD_CACHE_LINE_SIZE - sizeof(long)];
+} slots[NTHREADS];
+
+static pthread_spinlock_t spin;
+static pthread_spin_rwlock_t rwlock;
+static long shared;
+
+static void *worker(void *arg)
+{
+    int i, n = (int) (intptr_t) arg;
+
+    for (i = 0; i < LOCK_COUNT; i++) {
+        pthread_spin_lock(&spin);
+        slots[n].value++;
+        /* Now and then a conflict, the transactions abort or take the lock */
+        if ((i & 63) == 0)
+            shared++;
+        pthread_spin_unlock(&spin);
+
+        pthread_spin_rwlock_writer_lock(&rwlock);
+        slots[n].value++;
+        pthread_spin_rwlock_writer_unlock(&rwlock);
+
+        pthread_spin_rwlock_reader_lock(&rwlock);
+        assert(slots[n].value == 2 * (i + 1));
+        pthread_spin_rwlock_reader_unlock(&rwlock);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, elide, rc;
+    pthread_t t[NTHREADS];
+
+    assert(pthread_spin_init(&spin, PTHREAD_PROCESS_PRIVATE) == 0);
+    assert(pthread_spin_rwlock_init(&rwlock, PTHREAD_PROCESS_PRIVATE) == 0);
+
+    assert(pthread_spin_getelision_np(&spin, &elide) == 0 && elide == 0);
+    assert(pthread_spin_rwlock_getelision_np(&rwlock, &elide) == 0 && elide == 0);
+
+    rc = pthread_spin_setelision_np(&spin, 1);
+    assert(rc == 0 || rc == ENOTSUP);
+    assert(pthread_spin_rwlock_setelision_np(&rwlock, 1) == rc);
+    if (rc == ENOTSUP) {
+        assert(pthread_spin_getelision_np(&spin, &elide) == 0 && elide == 0);
+        printf("no usable RTM, the locks are not elided\n");
+    }
+
+    for (i = 0; i < NTHREADS; i++)
+        assert(pthread_create(&t[i], NULL, worker, (void *) (intptr_t) i) == 0);
+    for (i = 0; i < NTHREADS; i++)
+        assert(pthread_join(t[i], NULL) == 0);
+
+    for (i = 0; i < NTHREADS; i++)
+        assert(slots[i].value == 2 * LOCK_COUNT);
+    assert(shared == NTHREADS * ((LOCK_COUNT + 63) / 64));
+
+    assert(pthread_spin_getelision_np(&spin, &elide) == 0);
+    printf("spinlock elision %s\n", elide ? "on" : "off");
+    assert(pthread_spin_rwlock_getelision_np(&rwlock, &elide) == 0);
+    printf("spin rwlock elision %s\n", elide ? "on" : "off");
+
+    assert(pthread_spin_setelision_np(&spin, 0) == 0);
+    assert(pthread_spin_getelision_np(&spin, &elide) == 0 && elide == 0);
+    assert(pthread_spin_rwlock_setelision_np(&rwlock, 0) == 0);
+    assert(pthread_spin_rwlock_getelision_np(&rwlock, &elide) == 0 && elide == 0);
+
+    pthread_spin_lock(&spin);
+    assert(pthread_spin_trylock(&spin) == EBUSY);
+    pthread_spin_unlock(&spin);
+    assert(pthread_spin_trylock(&spin) == 0);
+    pthread_spin_unlock(&spin);
+
+    assert(pthread_spin_destroy(&spin) == 0);
+    assert(pthread_spin_rwlock_destroy(&rwlock) == 0);
+
+    printf("test_elision passed\n");
+
+    return 0;
+}
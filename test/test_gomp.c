@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define NTHREADS    4
+
+static int first_cpu(cpu_set_t *set)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set))
+            return cpu;
+    }
+
+    return -1;
+}
+
+/* A team thread, bound to one CPU by OMP_PROC_BIND */
+static DWORD tids[2][NTHREADS];
+
+static void *member(void *arg)
+{
+    int i = *(int *) arg;
+    cpu_set_t set;
+
+    assert(pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+    assert(CPU_COUNT(&set) == 1);
+    *(int *) arg = first_cpu(&set);
+    tids[i / NTHREADS][i % NTHREADS] = GetCurrentThreadId();
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, j, size, reused, ncpu = get_ncpu();
+    int cpus[NTHREADS];
+    pthread_t t[NTHREADS];
+    cpu_set_t set;
+
+    /* Read by the first pthread_create */
+    assert(SetEnvironmentVariableA("LIBPTHREAD_GOMP", "1"));
+    assert(SetEnvironmentVariableA("OMP_PROC_BIND", "close,spread"));
+    assert(SetEnvironmentVariableA("OMP_WAIT_POLICY", "passive"));
+
+    for (i = 0; i < NTHREADS; i++) {
+        cpus[i] = i;
+        assert(pthread_create(&t[i], NULL, member, &cpus[i]) == 0);
+    }
+    for (i = 0; i < NTHREADS; i++)
+        assert(pthread_join(t[i], NULL) == 0);
+
+    /* The initial thread stays on its CPU, the team goes on the next ones */
+    assert(pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+    assert(CPU_COUNT(&set) == 1);
+    for (i = 0; i < NTHREADS && i + 1 < ncpu; i++) {
+        assert(cpus[i] != first_cpu(&set));
+        for (j = 0; j < i; j++)
+            assert(cpus[i] != cpus[j]);
+    }
+    printf("OMP_PROC_BIND=close passed\n");
+
+    assert(pthread_getcachesize_np(&size) == 0);
+    assert(size == ncpu);
+
+    /* The placed threads go back to the cache, a second team runs on them */
+    Sleep(100);
+    for (i = 0; i < NTHREADS; i++) {
+        cpus[i] = NTHREADS + i;
+        assert(pthread_create(&t[i], NULL, member, &cpus[i]) == 0);
+    }
+    for (i = 0; i < NTHREADS; i++)
+        assert(pthread_join(t[i], NULL) == 0);
+
+    for (i = 0, reused = 0; i < NTHREADS; i++) {
+        for (j = 0; j < NTHREADS; j++) {
+            if (tids[1][i] == tids[0][j])
+                reused++;
+        }
+    }
+    assert(reused > 0);
+    printf("thread cache of the libgomp profile passed\n");
+
+    return 0;
+}
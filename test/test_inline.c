@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+#include <pthread.h>
+#include <pthread_inline.h>
+
+#include "../src/misc.h"
+
+#define NTHREADS    8
+#define NLOOPS      100000
+
+static pthread_spinlock_t spin;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static volatile long spin_count, mutex_count, once_calls;
+
+static void once_routine(void)
+{
+    atomic_fetch_and_add(&once_calls, 1);
+}
+
+/* Contended, the fast paths fall back to the library and back */
+static void *worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < NLOOPS; i++) {
+        assert(pthread_once(&once, once_routine) == 0);
+
+        assert(pthread_spin_lock(&spin) == 0);
+        spin_count++;
+        assert(pthread_spin_unlock(&spin) == 0);
+
+        assert(pthread_mutex_lock(&mutex) == 0);
+        mutex_count++;
+        assert(pthread_mutex_unlock(&mutex) == 0);
+    }
+
+    return arg;
+}
+
+static void test_uncontended(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutex_t recursive;
+
+    assert(pthread_spin_trylock(&spin) == 0);
+    assert(pthread_spin_trylock(&spin) == EBUSY);
+    assert(pthread_spin_unlock(&spin) == 0);
+    assert(pthread_spin_lock(&spin) == 0);
+    assert(pthread_spin_unlock(&spin) == 0);
+    assert(spin.owner == spin.ticket && spin.owner == 2);
+
+    /* The first lock allocates the mutex in the library */
+    assert(pthread_mutex_lock(&mutex) == 0);
+    assert(pthread_mutex_trylock(&mutex) == EBUSY);
+    assert(pthread_mutex_unlock(&mutex) == 0);
+    assert(pthread_mutex_trylock(&mutex) == 0);
+    assert(pthread_mutex_unlock(&mutex) == 0);
+
+    /* Not PTHREAD_MUTEX_NORMAL, every call goes to the library */
+    assert(pthread_mutexattr_init(&attr) == 0);
+    assert(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) == 0);
+    assert(pthread_mutex_init(&recursive, &attr) == 0);
+    assert(pthread_mutex_lock(&recursive) == 0);
+    assert(pthread_mutex_trylock(&recursive) == 0);
+    assert(pthread_mutex_unlock(&recursive) == 0);
+    assert(pthread_mutex_unlock(&recursive) == 0);
+    assert(pthread_mutex_unlock(&recursive) == EPERM);
+    assert(pthread_mutex_destroy(&recursive) == 0);
+    assert(pthread_mutexattr_destroy(&attr) == 0);
+
+    printf("uncontended fast paths passed\n");
+}
+
+static void test_contended(void)
+{
+    int i;
+    void *result;
+    pthread_t t[NTHREADS];
+
+    for (i = 0; i < NTHREADS; i++)
+        assert(pthread_create(&t[i], NULL, worker, (void *) (intptr_t) i) == 0);
+    for (i = 0; i < NTHREADS; i++) {
+        assert(pthread_join(t[i], &result) == 0);
+        assert(result == (void *) (intptr_t) i);
+    }
+
+    assert(once_calls == 1);
+    assert(spin_count == NTHREADS * NLOOPS);
+    assert(mutex_count == NTHREADS * NLOOPS);
+    assert(spin.owner == spin.ticket);
+    printf("%d threads through the fast and slow paths passed\n", NTHREADS);
+}
+
+int main(int argc, char *argv[])
+{
+    assert(pthread_spin_init(&spin, PTHREAD_PROCESS_PRIVATE) == 0);
+
+    test_uncontended();
+    test_contended();
+
+    assert(pthread_spin_destroy(&spin) == 0);
+    assert(pthread_mutex_destroy(&mutex) == 0);
+
+    return 0;
+}
@@ -25,6 +25,32 @@
 
 #include "../src/misc.h"
 
+static pthread_key_t dkey, rkey;
+static long destructed, rearmed;
+
+static void destructor(void *value)
+{
+    assert(value == (void *) &dkey);
+    atomic_fetch_and_add(&destructed, 1);
+}
+
+/* Sets its value again once, the library runs it a second round */
+static void rearm(void *value)
+{
+    if (atomic_fetch_and_add(&rearmed, 1) == 0)
+        assert(pthread_setspecific(rkey, value) == 0);
+}
+
+static void *setter(void *arg)
+{
+    assert(pthread_getspecific(dkey) == NULL);
+    assert(pthread_setspecific(dkey, &dkey) == 0);
+    assert(pthread_setspecific(rkey, &rkey) == 0);
+    if (arg != NULL)
+        pthread_exit(NULL);
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
     int rc;
@@ -48,7 +74,46 @@ int main(int argc, char *argv[])
 
     rc = pthread_key_delete(key);
     assert(rc == 0);
+    assert(pthread_key_delete(key) == -1 && errno == EINVAL);
     printf("pthread_key_delete passed\n");
 
+    /* a recreated key does not see the old value */
+    assert(pthread_key_create(&key, NULL) == 0);
+    assert(pthread_getspecific(key) == NULL);
+    assert(pthread_key_delete(key) == 0);
+    printf("pthread_key_create after delete passed\n");
+
+    {
+        pthread_t t;
+
+        assert(pthread_key_create(&dkey, destructor) == 0);
+        assert(pthread_key_create(&rkey, rearm) == 0);
+        assert(pthread_create(&t, NULL, setter, NULL) == 0);
+        assert(pthread_join(t, NULL) == 0);
+        assert(destructed == 1 && rearmed == 2);
+        rearmed = 0;
+        assert(pthread_create(&t, NULL, setter, (void *) 1) == 0);
+        assert(pthread_join(t, NULL) == 0);
+        assert(destructed == 2 && rearmed == 2);
+        assert(pthread_key_delete(dkey) == 0 && pthread_key_delete(rkey) == 0);
+        printf("key destructors passed\n");
+    }
+
+    {
+        long i;
+        pthread_key_t keys[PTHREAD_KEYS_MAX];
+
+        for (i = 0; i < PTHREAD_KEYS_MAX; i++) {
+            assert(pthread_key_create(&keys[i], NULL) == 0);
+            assert(pthread_setspecific(keys[i], (void *) (intptr_t) (i + 1)) == 0);
+        }
+        assert(pthread_key_create(&key, NULL) == -1 && errno == EAGAIN);
+        for (i = 0; i < PTHREAD_KEYS_MAX; i++) {
+            assert(pthread_getspecific(keys[i]) == (void *) (intptr_t) (i + 1));
+            assert(pthread_key_delete(keys[i]) == 0);
+        }
+        printf("PTHREAD_KEYS_MAX keys passed\n");
+    }
+
     return 0;
 }
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define NTHREADS        4
+#define LOCK_COUNT      100000
+#define MAX_STATS       16
+
+static pthread_mutex_t mutex;
+static pthread_mutex_t static_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_spinlock_t spin;
+static long counter;
+
+static void *worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < LOCK_COUNT; i++) {
+        pthread_mutex_lock(&mutex);
+        counter++;
+        pthread_mutex_unlock(&mutex);
+
+        pthread_spin_lock(&spin);
+        counter++;
+        pthread_spin_unlock(&spin);
+    }
+
+    return NULL;
+}
+
+/* The record of lock, or NULL */
+static struct pthread_lock_stats_np *find(struct pthread_lock_stats_np *stats, int count, const void *lock)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (stats[i].lock == lock)
+            return & stats[i];
+    }
+
+    return NULL;
+}
+
+static const void *mutex_object(pthread_mutex_t *m)
+{
+#ifdef PTHREAD_MUTEX_INLINE
+    return m;
+#else
+    return *m;
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+    int i, count = MAX_STATS;
+    pthread_t t[NTHREADS];
+    struct pthread_lock_stats_np stats[MAX_STATS], *s;
+
+    if (pthread_lock_stats_np(stats, &count) == ENOSYS) {
+        printf("built without LIBPTHREAD_LOCK_STATS, skipped\n");
+        return 0;
+    }
+
+    assert(pthread_mutex_init(&mutex, NULL) == 0);
+    assert(pthread_spin_init(&spin, PTHREAD_PROCESS_PRIVATE) == 0);
+
+    for (i = 0; i < NTHREADS; i++)
+        assert(pthread_create(&t[i], NULL, worker, NULL) == 0);
+    for (i = 0; i < NTHREADS; i++)
+        assert(pthread_join(t[i], NULL) == 0);
+    assert(counter == 2 * NTHREADS * LOCK_COUNT);
+
+    pthread_mutex_lock(&static_mutex);
+    pthread_mutex_unlock(&static_mutex);
+
+    count = MAX_STATS;
+    assert(pthread_lock_stats_np(stats, &count) == 0);
+    assert(count >= 3);
+    for (i = 1; i < count; i++)
+        assert(stats[i - 1].wait_ns >= stats[i].wait_ns);
+
+    for (i = 0; i < count; i++) {
+        printf("%p kind %d caller %p: %I64u acquired, %I64u spins, %I64u parks, "
+            "wait %I64u ns (max %I64u), hold %I64u ns\n",
+            stats[i].lock, stats[i].kind, stats[i].caller,
+            stats[i].acquisitions, stats[i].spins, stats[i].parks,
+            stats[i].wait_ns, stats[i].max_wait_ns, stats[i].hold_ns);
+    }
+
+    s = find(stats, count, mutex_object(&mutex));
+    assert(s != NULL && s->kind == PTHREAD_LOCK_MUTEX_NP && s->caller != NULL);
+    assert(s->acquisitions == NTHREADS * LOCK_COUNT);
+    assert(s->spins + s->parks <= s->acquisitions);
+    assert(s->max_wait_ns <= s->wait_ns);
+
+    s = find(stats, count, &spin);
+    assert(s != NULL && s->kind == PTHREAD_LOCK_SPIN_NP && s->caller != NULL);
+    assert(s->acquisitions == NTHREADS * LOCK_COUNT);
+
+    s = find(stats, count, mutex_object(&static_mutex));
+    assert(s != NULL && s->caller == NULL && s->acquisitions == 1);
+    printf("pthread_lock_stats_np passed\n");
+
+    assert(pthread_lock_stats_reset_np() == 0);
+    count = MAX_STATS;
+    assert(pthread_lock_stats_np(stats, &count) == 0);
+    s = find(stats, count, &spin);
+    assert(s != NULL && s->acquisitions == 0 && s->wait_ns == 0 && s->hold_ns == 0);
+
+    assert(pthread_spin_destroy(&spin) == 0);
+    count = MAX_STATS;
+    assert(pthread_lock_stats_np(stats, &count) == 0);
+    assert(find(stats, count, &spin) == NULL);
+    printf("pthread_lock_stats_reset_np passed\n");
+
+    count = -1;
+    assert(pthread_lock_stats_np(stats, &count) == EINVAL);
+
+    pthread_mutex_destroy(&mutex);
+    pthread_mutex_destroy(&static_mutex);
+
+    return 0;
+}
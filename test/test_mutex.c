@@ -25,17 +25,42 @@
 
 #include "../src/misc.h"
 
+#define THREAD_COUNT    8
+#define LOOP_COUNT      100000
+
 pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static pthread_mutex_t c_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long c_counter = 0;
+
+static void *worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < LOOP_COUNT; i++) {
+        pthread_mutex_lock(&c_mutex);
+        c_counter++;
+        pthread_mutex_unlock(&c_mutex);
+    }
+
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
-    int rc;
+    int rc, i, spin;
     pthread_mutex_t mutex;
+    pthread_mutexattr_t attr;
+    pthread_t t[THREAD_COUNT];
 
     /* static initializer test */
+#ifndef PTHREAD_MUTEX_INLINE
     printf("g_mutex: %p, & g_mutex: %p\n", g_mutex, &g_mutex);
+#endif
     rc = pthread_mutex_lock(&g_mutex);
+#ifndef PTHREAD_MUTEX_INLINE
     printf("g_mutex: %p, & g_mutex: %p\n", g_mutex, &g_mutex);
+#endif
     assert(rc == 0);
     printf("static pthread_mutex_lock passed\n");
 
@@ -52,7 +77,9 @@ int main(int argc, char *argv[])
     printf("static pthread_mutex_destroy passed\n");
 
     /* normal initializer test */
+#ifndef PTHREAD_MUTEX_INLINE
     printf("mutex: %p, & mutex: %p\n", mutex, &mutex);
+#endif
     rc = pthread_mutex_init(&mutex, NULL);
     assert(rc == 0);
     printf("pthread_mutex_init passed\n");
@@ -73,5 +100,77 @@ int main(int argc, char *argv[])
     assert(rc == 0);
     printf("pthread_mutex_destroy passed\n");
 
+    /* fixed spin count test */
+    rc = pthread_mutexattr_init(&attr);
+    assert(rc == 0);
+    rc = pthread_mutexattr_getspin_np(&attr, &spin);
+    assert(rc == 0 && spin == PTHREAD_MUTEX_SPIN_ADAPTIVE_NP);
+    rc = pthread_mutexattr_setspin_np(&attr, 0);
+    assert(rc == 0);
+    rc = pthread_mutexattr_getspin_np(&attr, &spin);
+    assert(rc == 0 && spin == 0);
+
+    rc = pthread_mutex_init(&mutex, &attr);
+    assert(rc == 0);
+    rc = pthread_mutex_lock(&mutex);
+    assert(rc == 0);
+    rc = pthread_mutex_unlock(&mutex);
+    assert(rc == 0);
+    rc = pthread_mutex_destroy(&mutex);
+    assert(rc == 0);
+    rc = pthread_mutexattr_destroy(&attr);
+    assert(rc == 0);
+    printf("pthread_mutexattr_setspin_np passed\n");
+
+    /* recursive mutex test */
+    rc = pthread_mutexattr_init(&attr);
+    assert(rc == 0);
+    rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    assert(rc == 0);
+    rc = pthread_mutex_init(&mutex, &attr);
+    assert(rc == 0);
+    assert(pthread_mutex_lock(&mutex) == 0);
+    assert(pthread_mutex_lock(&mutex) == 0);
+    assert(pthread_mutex_trylock(&mutex) == 0);
+    assert(pthread_mutex_unlock(&mutex) == 0);
+    assert(pthread_mutex_unlock(&mutex) == 0);
+    assert(pthread_mutex_unlock(&mutex) == 0);
+    assert(pthread_mutex_unlock(&mutex) == EPERM);
+    assert(pthread_mutex_destroy(&mutex) == 0);
+    assert(pthread_mutexattr_destroy(&attr) == 0);
+    printf("PTHREAD_MUTEX_RECURSIVE passed\n");
+
+    /* error checking mutex test */
+    rc = pthread_mutexattr_init(&attr);
+    assert(rc == 0);
+    rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    assert(rc == 0);
+    rc = pthread_mutex_init(&mutex, &attr);
+    assert(rc == 0);
+    assert(pthread_mutex_unlock(&mutex) == EPERM);
+    assert(pthread_mutex_lock(&mutex) == 0);
+    assert(pthread_mutex_lock(&mutex) == EDEADLK);
+    assert(pthread_mutex_trylock(&mutex) == EBUSY);
+    assert(pthread_mutex_unlock(&mutex) == 0);
+    assert(pthread_mutex_destroy(&mutex) == 0);
+    assert(pthread_mutexattr_destroy(&attr) == 0);
+    printf("PTHREAD_MUTEX_ERRORCHECK passed\n");
+
+    /* contention test */
+    for (i = 0; i < THREAD_COUNT; i++) {
+        rc = pthread_create(&t[i], NULL, worker, NULL);
+        assert(rc == 0);
+    }
+
+    for (i = 0; i < THREAD_COUNT; i++) {
+        rc = pthread_join(t[i], NULL);
+        assert(rc == 0);
+    }
+
+    assert(c_counter == THREAD_COUNT * LOOP_COUNT);
+    rc = pthread_mutex_destroy(&c_mutex);
+    assert(rc == 0);
+    printf("contended pthread_mutex_lock passed\n");
+
     return 0;
 }
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+static pthread_mutex_t pi_mutex;
+static volatile long locked;
+static volatile long done;
+
+static int self_priority(void)
+{
+    return GetThreadPriority(GetCurrentThread());
+}
+
+/* Wait up to 5 seconds for the calling thread to run at priority */
+static int wait_priority(int priority)
+{
+    int i;
+
+    for (i = 0; i < 5000 && self_priority() != priority; i++)
+        Sleep(1);
+
+    return self_priority() == priority;
+}
+
+static void *low(void *arg)
+{
+    assert(pthread_setschedprio(pthread_self(), 3) == 0);
+    assert(self_priority() == THREAD_PRIORITY_LOWEST);
+
+    assert(pthread_mutex_lock(&pi_mutex) == 0);
+    atomic_set(&locked, 1);
+    /* The waiter lends us its priority */
+    assert(wait_priority(THREAD_PRIORITY_HIGHEST));
+    assert(pthread_mutex_unlock(&pi_mutex) == 0);
+    assert(self_priority() == THREAD_PRIORITY_LOWEST);
+
+    return NULL;
+}
+
+/* A detached holder has no handle of its own left to be boosted through */
+static void *low_detached(void *arg)
+{
+    low(arg);
+    atomic_set(&done, 1);
+
+    return NULL;
+}
+
+static void *high(void *arg)
+{
+    assert(pthread_setschedprio(pthread_self(), 13) == 0);
+
+    while (!atomic_read(&locked))
+        Sleep(1);
+    assert(pthread_mutex_lock(&pi_mutex) == 0);
+    assert(self_priority() == THREAD_PRIORITY_HIGHEST);
+    assert(pthread_mutex_unlock(&pi_mutex) == 0);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int ceiling, protocol;
+    pthread_t t1, t2;
+    pthread_mutex_t m1, m2;
+    pthread_mutexattr_t attr;
+
+    assert(pthread_mutexattr_init(&attr) == 0);
+    assert(pthread_mutexattr_getprotocol(&attr, &protocol) == 0 && protocol == PTHREAD_PRIO_NONE);
+    assert(pthread_mutexattr_getprioceiling(&attr, &ceiling) == 0 && ceiling == sched_get_priority_max(SCHED_FIFO));
+    assert(pthread_mutexattr_setprotocol(&attr, 3) == EINVAL);
+    assert(pthread_mutexattr_setprioceiling(&attr, 0) == EINVAL);
+    assert(pthread_mutexattr_setprioceiling(&attr, 16) == EINVAL);
+
+    assert(pthread_mutex_init(&m1, &attr) == 0);
+    assert(pthread_mutex_getprioceiling(&m1, &ceiling) == EINVAL);
+    assert(pthread_mutex_destroy(&m1) == 0);
+
+    /* Priority ceiling: the owner runs at the highest ceiling it holds */
+    assert(pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_PROTECT) == 0);
+    assert(pthread_mutexattr_setprioceiling(&attr, 13) == 0);
+    assert(pthread_mutex_init(&m1, &attr) == 0);
+    assert(pthread_mutexattr_setprioceiling(&attr, 15) == 0);
+    assert(pthread_mutex_init(&m2, &attr) == 0);
+    assert(pthread_mutex_getprioceiling(&m1, &ceiling) == 0 && ceiling == 13);
+
+    assert(self_priority() == THREAD_PRIORITY_NORMAL);
+    assert(pthread_mutex_lock(&m1) == 0);
+    assert(self_priority() == THREAD_PRIORITY_HIGHEST);
+    assert(pthread_mutex_trylock(&m2) == 0);
+    assert(self_priority() == THREAD_PRIORITY_TIME_CRITICAL);
+    assert(pthread_mutex_unlock(&m2) == 0);
+    assert(self_priority() == THREAD_PRIORITY_HIGHEST);
+
+    /* A new priority applies once the ceilings are gone */
+    assert(pthread_setschedprio(pthread_self(), 9) == 0);
+    assert(self_priority() == THREAD_PRIORITY_HIGHEST);
+    assert(pthread_mutex_unlock(&m1) == 0);
+    assert(self_priority() == THREAD_PRIORITY_ABOVE_NORMAL);
+    assert(pthread_setschedprio(pthread_self(), 8) == 0);
+
+    assert(pthread_mutex_setprioceiling(&m1, 9, &ceiling) == 0 && ceiling == 13);
+    assert(pthread_mutex_setprioceiling(&m1, 16, &ceiling) == EINVAL);
+    assert(pthread_setschedprio(pthread_self(), 13) == 0);
+    assert(pthread_mutex_lock(&m1) == EINVAL);
+    assert(pthread_setschedprio(pthread_self(), 8) == 0);
+    assert(pthread_mutex_unlock(&m1) == EPERM);
+
+    assert(pthread_mutex_destroy(&m1) == 0);
+    assert(pthread_mutex_destroy(&m2) == 0);
+    printf("PTHREAD_PRIO_PROTECT passed\n");
+
+    /* Priority inheritance, recursive */
+    assert(pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT) == 0);
+    assert(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) == 0);
+    assert(pthread_mutex_init(&pi_mutex, &attr) == 0);
+    assert(pthread_mutex_getprioceiling(&pi_mutex, &ceiling) == EINVAL);
+
+    assert(pthread_mutex_lock(&pi_mutex) == 0);
+    assert(pthread_mutex_lock(&pi_mutex) == 0);
+    assert(self_priority() == THREAD_PRIORITY_NORMAL);
+    assert(pthread_mutex_unlock(&pi_mutex) == 0);
+    assert(pthread_mutex_unlock(&pi_mutex) == 0);
+    assert(pthread_mutex_unlock(&pi_mutex) == EPERM);
+
+    assert(pthread_create(&t1, NULL, low, NULL) == 0);
+    assert(pthread_create(&t2, NULL, high, NULL) == 0);
+    assert(pthread_join(t1, NULL) == 0);
+    assert(pthread_join(t2, NULL) == 0);
+
+    atomic_set(&locked, 0);
+    assert(pthread_create(&t1, NULL, low_detached, NULL) == 0);
+    assert(pthread_detach(t1) == 0);
+    assert(pthread_create(&t2, NULL, high, NULL) == 0);
+    assert(pthread_join(t2, NULL) == 0);
+    while (!atomic_read(&done))
+        Sleep(1);
+
+    assert(pthread_mutex_destroy(&pi_mutex) == 0);
+    assert(pthread_mutexattr_destroy(&attr) == 0);
+    printf("PTHREAD_PRIO_INHERIT passed\n");
+
+    return 0;
+}
@@ -84,6 +84,37 @@ void test_apc()
     }
 }
 
+#define SLEEP_TIMES     200
+
+static int compare_ns(const void *a, const void *b)
+{
+    __int64 x = *(const __int64 *) a, y = *(const __int64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sleep SLEEP_TIMES times for ns, report the percentiles of the oversleep */
+void test_accuracy(long ns)
+{
+    int i;
+    __int64 over[SLEEP_TIMES];
+    struct timespec tp, tp2, request = { 0, 0 };
+
+    request.tv_nsec = ns;
+    for (i = 0; i < SLEEP_TIMES; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        assert(nanosleep(&request, NULL) == 0);
+        clock_gettime(CLOCK_MONOTONIC, &tp2);
+        over[i] = (tp2.tv_sec - tp.tv_sec) * POW10_9 + (tp2.tv_nsec - tp.tv_nsec) - ns;
+        assert(over[i] >= 0);
+    }
+
+    qsort(over, SLEEP_TIMES, sizeof(over[0]), compare_ns);
+    printf("nanosleep %7ld ns, oversleep p50 %8d ns, p90 %8d ns, p99 %8d ns, max %8d ns\n", ns,
+        (int) over[SLEEP_TIMES / 2], (int) over[SLEEP_TIMES * 9 / 10],
+        (int) over[SLEEP_TIMES * 99 / 100], (int) over[SLEEP_TIMES - 1]);
+}
+
 int main(int argc, char *argv[])
 {
     int rc;
@@ -101,6 +132,11 @@ int main(int argc, char *argv[])
     printf("%d.%09d\n", (int) tp2.tv_sec, (int) tp2.tv_nsec);
     printf("sleep %d ms\n\n", (int) timespec_diff_as_ms(&tp, &tp2));
 
+    test_accuracy(50000);
+    test_accuracy(200000);
+    test_accuracy(1000000);
+    printf("\n");
+
     test_apc();
 
     return 0;
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define MUTEX_COUNT     10000
+#define THREAD_COUNT    4
+
+static pthread_mutex_t mutexes[MUTEX_COUNT];
+
+/* Destroys a slice of the mutexes created by another thread */
+static void *destroyer(void *arg)
+{
+    int i, k = (int) (intptr_t) arg;
+    pthread_mutexattr_t attr;
+
+    for (i = k; i < MUTEX_COUNT; i += THREAD_COUNT)
+        assert(pthread_mutex_destroy(&mutexes[i]) == 0);
+
+    /* small blocks churn through the thread cache */
+    for (i = 0; i < MUTEX_COUNT; i++) {
+        assert(pthread_mutexattr_init(&attr) == 0);
+        assert(pthread_mutexattr_destroy(&attr) == 0);
+    }
+
+    return NULL;
+}
+
+/* Runs bound to the node in arg */
+static void *bound(void *arg)
+{
+    int node = *(int *) arg;
+    cpu_set_t set, cpus, both;
+
+    assert(sched_numa_cpus_np(node, sizeof(cpus), &cpus) == 0);
+    assert(pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+    CPU_AND(&both, &set, &cpus);
+    assert(CPU_EQUAL(&both, &set));
+    assert(sched_getnode_np() == node);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, n, node, cpus;
+    pthread_t t;
+    pthread_attr_t attr;
+    cpu_set_t set;
+
+    n = sched_numa_nodes_np();
+    assert(n >= 1);
+    for (i = 0; i < n; i++) {
+        assert(sched_numa_cpus_np(i, sizeof(set), &set) == 0);
+        printf("NUMA node %d: %d CPUs\n", i, CPU_COUNT(&set));
+    }
+    assert(sched_numa_cpus_np(n, sizeof(set), &set) == EINVAL);
+
+    node = sched_getnode_np();
+    assert(node >= 0 && node < n);
+    printf("sched_getnode_np: %d\n", node);
+
+    /* bind a thread to the first node with CPUs */
+    assert(pthread_attr_init(&attr) == 0);
+    assert(pthread_attr_getnumanode_np(&attr, &node) == 0 && node == -1);
+    assert(pthread_attr_setnumanode_np(&attr, n) == EINVAL);
+    for (node = 0; node < n; node++) {
+        assert(sched_numa_cpus_np(node, sizeof(set), &set) == 0);
+        if ((cpus = CPU_COUNT(&set)) > 0)
+            break;
+    }
+    assert(pthread_attr_setnumanode_np(&attr, node) == 0);
+    assert(pthread_create(&t, &attr, bound, &node) == 0);
+    assert(pthread_join(t, NULL) == 0);
+    assert(pthread_attr_destroy(&attr) == 0);
+    printf("pthread_attr_setnumanode_np passed\n");
+
+    /* control blocks come from the node-local arenas */
+    for (i = 0; i < MUTEX_COUNT; i++)
+        assert(pthread_mutex_init(&mutexes[i], NULL) == 0);
+#ifndef PTHREAD_MUTEX_INLINE
+    for (i = 0; i < MUTEX_COUNT; i++)
+        assert(((uintptr_t) mutexes[i] & (PTHREAD_CACHE_LINE_SIZE - 1)) == 0);
+#endif
+    for (i = 0; i < MUTEX_COUNT; i++) {
+        assert(pthread_mutex_lock(&mutexes[i]) == 0);
+        assert(pthread_mutex_unlock(&mutexes[i]) == 0);
+        assert(pthread_mutex_destroy(&mutexes[i]) == 0);
+    }
+    printf("node-local mutexes passed\n");
+
+    /* blocks freed by other threads go back through their caches */
+    for (i = 0; i < MUTEX_COUNT; i++)
+        assert(pthread_mutex_init(&mutexes[i], NULL) == 0);
+    {
+        pthread_t threads[THREAD_COUNT];
+
+        for (i = 0; i < THREAD_COUNT; i++)
+            assert(pthread_create(&threads[i], NULL, destroyer, (void *) (intptr_t) i) == 0);
+        for (i = 0; i < THREAD_COUNT; i++)
+            assert(pthread_join(threads[i], NULL) == 0);
+    }
+    for (i = 0; i < MUTEX_COUNT; i++)
+        assert(pthread_mutex_init(&mutexes[i], NULL) == 0);
+    for (i = 0; i < MUTEX_COUNT; i++)
+        assert(pthread_mutex_destroy(&mutexes[i]) == 0);
+    printf("cross-thread slab frees passed\n");
+
+    return 0;
+}
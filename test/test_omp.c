@@ -1,6 +1,9 @@
 /*
  * gcc -O2 -fopenmp -o test_omp test_omp.c
  *
+ * With a libgomp linked against libpthread.dll (see doc/note/libgomp-pthread.def),
+ * the libgomp profile of gomp.c applies, OMP_PROC_BIND=close binds the team.
+ *
  * [pthread-w32, gcc-4.6.2-20110801]
  * Hello World from thread = 0
  * Number of threads = 2
@@ -41,5 +44,18 @@ int main (int argc, char *argv[])
     }
     /* All threads join master thread and disband */
 
+    /* The cost of entering and leaving a parallel region, the team is docked in between */
+    {
+        int i, n = 10000;
+        double start = omp_get_wtime();
+
+        for (i = 0; i < n; i++) {
+            #pragma omp parallel
+            {
+            }
+        }
+        printf("%.2f us per parallel region\n", (omp_get_wtime() - start) * 1e6 / n);
+    }
+
     return 0;
 }
@@ -38,6 +38,70 @@ static void *wroker(void *arg)
     return NULL;
 }
 
+static pthread_once_t slow_control = PTHREAD_ONCE_INIT;
+static pthread_once_t exit_control = PTHREAD_ONCE_INIT;
+static volatile long slow_calls, exit_calls, slow_done;
+
+/* Every caller must see the results of the init routine */
+static void slow_routine(void)
+{
+    atomic_fetch_and_add(&slow_calls, 1);
+    Sleep(200);
+    slow_done = 1;
+}
+
+static void *slow_worker(void *arg)
+{
+    pthread_once(&slow_control, slow_routine);
+    assert(slow_done == 1);
+    return NULL;
+}
+
+/* The first run exits its thread, a later caller runs it again */
+static void exit_routine(void)
+{
+    if (atomic_fetch_and_add(&exit_calls, 1) == 0)
+        pthread_exit((void *) 1);
+}
+
+static void *exit_worker(void *arg)
+{
+    pthread_once(&exit_control, exit_routine);
+    return NULL;
+}
+
+static void test_slow(void)
+{
+    int i;
+    pthread_t t[64];
+
+    for (i = 0; i < sizeof(t) / sizeof(t[0]); i++)
+        assert(pthread_create(&t[i], NULL, slow_worker, NULL) == 0);
+    for (i = 0; i < sizeof(t) / sizeof(t[0]); i++)
+        assert(pthread_join(t[i], NULL) == 0);
+
+    assert(slow_calls == 1);
+    printf("%d threads behind a slow init routine passed\n", (int) (sizeof(t) / sizeof(t[0])));
+}
+
+static void test_exit(void)
+{
+    void *result;
+    pthread_t t;
+
+    assert(pthread_create(&t, NULL, exit_worker, NULL) == 0);
+    assert(pthread_join(t, &result) == 0);
+    assert(result == (void *) 1 && exit_calls == 1);
+
+    assert(pthread_create(&t, NULL, exit_worker, NULL) == 0);
+    assert(pthread_join(t, &result) == 0);
+    assert(result == NULL && exit_calls == 2);
+
+    pthread_once(&exit_control, exit_routine);
+    assert(exit_calls == 2);
+    printf("pthread_once after an exiting init routine passed\n");
+}
+
 int main(int argc, char *argv[])
 {
     int rc, i = 0;
@@ -56,5 +120,8 @@ int main(int argc, char *argv[])
         assert(result == NULL);
     }
     printf("pthread_once passed\n");
+
+    test_slow();
+    test_exit();
     return 0;
 }
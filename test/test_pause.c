@@ -17,12 +17,15 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
 #include <windows.h>
 
+#include "../src/misc.h"
+
 #ifdef _MSC_VER
 #include <intrin.h>
 #pragma intrinsic(_ReadWriteBarrier)
@@ -30,6 +33,7 @@
 #endif
 
 int x = 8;
+volatile long y = 1;
 
 /* mfence */
 __declspec(noinline) void test_sync(void)
@@ -43,16 +47,12 @@ int main(int argc, char *argv[])
 {
     test_sync();
 
-/* cpu_relax() */
-#ifdef _MSC_VER
-    /* __asm pause */
-    /* __asm rep nop */
-    /* _mm_pause(); */
-    YieldProcessor();
-#else
-    /* __builtin_ia32_pause(); gcc 4.7 */
-    asm volatile("rep; nop" ::: "memory");
-#endif
+    /* pause on x86, yield on ARM */
+    cpu_relax();
+
+    /* y is not 0, returns at once, also on ARM64 where it would sleep in WFE */
+    cpu_wait(&y, 0);
+    cpu_wake();
 
     printf("test_pause passed\n");
 
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define NPRODUCERS      4
+#define NCONSUMERS      4
+#define PUSH_COUNT      30000 /* per producer, the sum fits in a long */
+#define BATCH           8
+
+static pthread_queue_t queue;
+static volatile long sum, count;
+
+/* Items are (producer << 24) | sequence, sequence from 1 */
+static void *producer(void *arg)
+{
+    long id = (long) (size_t) arg, i, k;
+    void *batch[BATCH];
+
+    for (i = 1; i <= PUSH_COUNT; ) {
+        if (i & 1) {
+            assert(pthread_queue_push(&queue, (void *) (size_t) ((id << 24) | i)) == 0);
+            i++;
+            continue;
+        }
+        for (k = 0; k < BATCH && i <= PUSH_COUNT; k++, i++)
+            batch[k] = (void *) (size_t) ((id << 24) | i);
+        assert(pthread_queue_push_many(&queue, batch, (int) k) == 0);
+    }
+
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    int i, n;
+    long last[NPRODUCERS] = {0}, items = 0, id, v;
+    void *batch[BATCH];
+
+    for (;;) {
+        assert(pthread_queue_pop_many(&queue, batch, BATCH, &n) == 0);
+        assert(n >= 1 && n <= BATCH);
+        for (i = 0; i < n; i++) {
+            if (batch[i] == NULL) {
+                /* Only stop items follow, give the others back */
+                while (++i < n)
+                    assert(pthread_queue_push(&queue, NULL) == 0);
+                printf("consumer: %ld items\n", items);
+                return NULL;
+            }
+            id = (long) (size_t) batch[i] >> 24;
+            v = (long) (size_t) batch[i] & 0xffffff;
+            assert(id >= 0 && id < NPRODUCERS);
+            /* The items of one producer come out in order */
+            assert(v > last[id]);
+            last[id] = v;
+            atomic_fetch_and_add(&sum, v);
+            atomic_fetch_and_add(&count, 1);
+            items++;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int i, n;
+    void *item, *items[4];
+    pthread_t p[NPRODUCERS], c[NCONSUMERS];
+
+    assert(pthread_queue_init(&queue, 0) == EINVAL);
+    assert(pthread_queue_init(&queue, 64) == 0);
+
+    for (i = 0; i < NCONSUMERS; i++)
+        assert(pthread_create(&c[i], NULL, consumer, NULL) == 0);
+    for (i = 0; i < NPRODUCERS; i++)
+        assert(pthread_create(&p[i], NULL, producer, (void *) (size_t) i) == 0);
+
+    for (i = 0; i < NPRODUCERS; i++)
+        assert(pthread_join(p[i], NULL) == 0);
+    /* A NULL item stops a consumer */
+    for (i = 0; i < NCONSUMERS; i++)
+        assert(pthread_queue_push(&queue, NULL) == 0);
+    for (i = 0; i < NCONSUMERS; i++)
+        assert(pthread_join(c[i], NULL) == 0);
+
+    assert(count == (long) NPRODUCERS * PUSH_COUNT);
+    assert(sum == (long) NPRODUCERS * PUSH_COUNT / 2 * (PUSH_COUNT + 1));
+    printf("pthread_queue_push_many, pthread_queue_pop_many passed\n");
+
+    assert(pthread_queue_trypop(&queue, &item) == EAGAIN);
+    assert(pthread_queue_destroy(&queue) == 0);
+
+    /* Capacity 3 is rounded up to 4 */
+    assert(pthread_queue_init(&queue, 3) == 0);
+    for (i = 0; i < 4; i++)
+        assert(pthread_queue_trypush(&queue, (void *) (size_t) (i + 1)) == 0);
+    assert(pthread_queue_trypush(&queue, (void *) 5) == EAGAIN);
+    assert(pthread_queue_pop(&queue, &item) == 0 && item == (void *) 1);
+    assert(pthread_queue_trypush(&queue, (void *) 5) == 0);
+    assert(pthread_queue_pop_many(&queue, items, 4, &n) == 0 && n == 4);
+    for (i = 0; i < 4; i++)
+        assert(items[i] == (void *) (size_t) (i + 2));
+    assert(pthread_queue_trypop(&queue, &item) == EAGAIN);
+    assert(pthread_queue_pop_many(&queue, items, 0, &n) == EINVAL);
+    assert(pthread_queue_destroy(&queue) == 0);
+    printf("pthread_queue_trypush, pthread_queue_trypop passed\n");
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define NREADERS        4
+#define UPDATE_COUNT    20000
+
+/* An object the readers find through cur, poisoned once it is reclaimed */
+typedef struct {
+    pthread_rcu_head_t head; /* the first member */
+    volatile long value;
+    volatile long freed;
+} node;
+
+static node nodes[UPDATE_COUNT + 1];
+static node * volatile cur;
+static volatile long done, reclaimed;
+
+static void reclaim(pthread_rcu_head_t *head)
+{
+    node *p = (node *) head;
+
+    assert(p->freed == 0);
+    p->freed = 1;
+    atomic_fetch_and_add(&reclaimed, 1);
+}
+
+static void *updater(void *arg)
+{
+    long i;
+    node *old;
+
+    for (i = 1; i <= UPDATE_COUNT; i++) {
+        nodes[i].value = i;
+        old = atomic_xchg_ptr((void * volatile *) &cur, &nodes[i]);
+        if (i & 1) {
+            assert(pthread_rcu_call(&old->head, reclaim) == 0);
+        } else {
+            assert(pthread_rcu_synchronize() == 0);
+            old->freed = 1;
+        }
+    }
+
+    return NULL;
+}
+
+static void *reader(void *arg)
+{
+    long reads = 0, last = 0;
+    node *p;
+
+    while (!atomic_read(&done)) {
+        assert(pthread_rcu_read_lock() == 0);
+        assert(pthread_rcu_read_lock() == 0);
+        p = atomic_read_ptr_acquire((void * volatile *) &cur);
+        assert(p->value >= last);
+        last = p->value;
+        assert(pthread_rcu_read_unlock() == 0);
+        assert(p->freed == 0);
+        assert(p->value == last);
+        assert(pthread_rcu_read_unlock() == 0);
+        reads++;
+    }
+
+    assert(pthread_rcu_read_unlock() == EPERM);
+    printf("reader: %ld reads\n", reads);
+    return NULL;
+}
+
+/* A reader that exits inside its read section must not stall the updaters */
+static void *stray(void *arg)
+{
+    assert(pthread_rcu_read_lock() == 0);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int i;
+    pthread_t u, r[NREADERS];
+
+    cur = &nodes[0];
+
+    for (i = 0; i < NREADERS; i++)
+        assert(pthread_create(&r[i], NULL, reader, NULL) == 0);
+    assert(pthread_create(&u, NULL, updater, NULL) == 0);
+
+    assert(pthread_join(u, NULL) == 0);
+    atomic_set(&done, 1);
+    for (i = 0; i < NREADERS; i++)
+        assert(pthread_join(r[i], NULL) == 0);
+
+    assert(pthread_rcu_barrier() == 0);
+    assert(reclaimed == UPDATE_COUNT / 2);
+    for (i = 0; i < UPDATE_COUNT; i++)
+        assert(nodes[i].freed == 1);
+    assert(nodes[UPDATE_COUNT].freed == 0);
+    printf("pthread_rcu_synchronize, pthread_rcu_call, pthread_rcu_barrier passed\n");
+
+    assert(pthread_create(&u, NULL, stray, NULL) == 0);
+    assert(pthread_join(u, NULL) == 0);
+    assert(pthread_rcu_synchronize() == 0);
+
+    assert(pthread_rcu_read_unlock() == EPERM);
+    assert(pthread_rcu_read_lock() == 0);
+    assert(pthread_rcu_synchronize() == EDEADLK);
+    assert(pthread_rcu_barrier() == EDEADLK);
+    assert(pthread_rcu_read_unlock() == 0);
+    assert(pthread_rcu_synchronize() == 0);
+    assert(pthread_rcu_call(NULL, reclaim) == EINVAL);
+    printf("pthread_rcu_read_lock, pthread_rcu_read_unlock passed\n");
+
+    return 0;
+}
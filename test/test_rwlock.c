@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <pthread_clock.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define THREAD_COUNT    8
+#define LOOP_COUNT      100000
+
+static pthread_rwlock_t g_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_rwlock_t rwlock;
+static long value[2] = {0, 0};
+
+/* Readers must never see a half updated pair */
+static void *worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < LOOP_COUNT; i++) {
+        if (i % 16 == 0) {
+            pthread_rwlock_wrlock(&rwlock);
+            value[0]++;
+            value[1]++;
+            pthread_rwlock_unlock(&rwlock);
+        } else {
+            pthread_rwlock_rdlock(&rwlock);
+            assert(value[0] == value[1]);
+            pthread_rwlock_unlock(&rwlock);
+        }
+    }
+
+    return NULL;
+}
+
+static void *try_writer(void *arg)
+{
+    struct timespec t;
+
+    assert(pthread_rwlock_trywrlock(&rwlock) == EBUSY);
+
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_nsec += 50 * POW10_6;
+    if (t.tv_nsec >= POW10_9) {
+        t.tv_sec++;
+        t.tv_nsec -= POW10_9;
+    }
+    assert(pthread_rwlock_timedwrlock(&rwlock, &t) == ETIMEDOUT);
+
+    return NULL;
+}
+
+static void *try_reader(void *arg)
+{
+    struct timespec t;
+
+    assert(pthread_rwlock_tryrdlock(&rwlock) == EBUSY);
+
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_nsec += 50 * POW10_6;
+    if (t.tv_nsec >= POW10_9) {
+        t.tv_sec++;
+        t.tv_nsec -= POW10_9;
+    }
+    assert(pthread_rwlock_timedrdlock(&rwlock, &t) == ETIMEDOUT);
+
+    return NULL;
+}
+
+static void test_rwlock(pthread_rwlockattr_t *attr, char *name)
+{
+    int rc, i;
+    pthread_t t[THREAD_COUNT];
+
+    rc = pthread_rwlock_init(&rwlock, attr);
+    assert(rc == 0);
+
+    /* readers share the lock, writers time out */
+    assert(pthread_rwlock_rdlock(&rwlock) == 0);
+    assert(pthread_rwlock_tryrdlock(&rwlock) == 0);
+    assert(pthread_rwlock_destroy(&rwlock) == EBUSY);
+    rc = pthread_create(&t[0], NULL, try_writer, NULL);
+    assert(rc == 0);
+    rc = pthread_join(t[0], NULL);
+    assert(rc == 0);
+    assert(pthread_rwlock_unlock(&rwlock) == 0);
+    assert(pthread_rwlock_unlock(&rwlock) == 0);
+
+    /* a writer excludes readers */
+    assert(pthread_rwlock_wrlock(&rwlock) == 0);
+    rc = pthread_create(&t[0], NULL, try_reader, NULL);
+    assert(rc == 0);
+    rc = pthread_join(t[0], NULL);
+    assert(rc == 0);
+    assert(pthread_rwlock_unlock(&rwlock) == 0);
+
+    /* contention test */
+    for (i = 0; i < THREAD_COUNT; i++) {
+        rc = pthread_create(&t[i], NULL, worker, NULL);
+        assert(rc == 0);
+    }
+
+    for (i = 0; i < THREAD_COUNT; i++) {
+        rc = pthread_join(t[i], NULL);
+        assert(rc == 0);
+    }
+
+    assert(value[0] == value[1]);
+    rc = pthread_rwlock_destroy(&rwlock);
+    assert(rc == 0);
+    printf("%s pthread_rwlock_t passed\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    int rc, percpu;
+    pthread_rwlockattr_t attr;
+
+    /* static initializer test */
+    rc = pthread_rwlock_rdlock(&g_rwlock);
+    assert(rc == 0);
+    assert(pthread_rwlock_trywrlock(&g_rwlock) == EBUSY);
+    rc = pthread_rwlock_unlock(&g_rwlock);
+    assert(rc == 0);
+    rc = pthread_rwlock_destroy(&g_rwlock);
+    assert(rc == 0);
+
+    test_rwlock(NULL, "shared reader count");
+
+    rc = pthread_rwlockattr_init(&attr);
+    assert(rc == 0);
+    rc = pthread_rwlockattr_setpercpu_np(&attr, 1);
+    assert(rc == 0);
+    rc = pthread_rwlockattr_getpercpu_np(&attr, &percpu);
+    assert(rc == 0 && percpu == 1);
+    test_rwlock(&attr, "per-CPU reader count");
+    rc = pthread_rwlockattr_destroy(&attr);
+    assert(rc == 0);
+
+    return 0;
+}
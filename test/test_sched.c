@@ -17,6 +17,8 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,9 +28,28 @@
 
 #include "../src/misc.h"
 
+static void *fifo_worker(void *arg)
+{
+    int policy;
+    struct sched_param sp;
+
+    assert(pthread_getschedparam(pthread_self(), &policy, &sp) == 0);
+    assert(policy == SCHED_FIFO);
+    assert(sp.sched_priority == 13);
+    assert(sched_getscheduler(0) == SCHED_FIFO);
+
+    return arg;
+}
+
 int main(int argc, char *argv[])
 {
-    int rc, priority = SCHED_OTHER;
+    int rc, policy, priority = SCHED_OTHER;
+    unsigned long long tick;
+    DWORD timeAdjustment, timeIncrement;
+    BOOL isTimeAdjustmentDisabled;
+    void *result;
+    pthread_t thread;
+    pthread_attr_t attr;
     struct timespec tp;
     struct sched_param sp;
     pid_t pid = 0;
@@ -65,10 +86,53 @@ int main(int argc, char *argv[])
     assert(sp.sched_priority == 15);
     printf("sched_getparam passed\n");
 
+    sp.sched_priority = 10;
+    rc = sched_setscheduler(pid, SCHED_FIFO, &sp);
+    assert(rc == SCHED_OTHER);
+    assert(sched_getscheduler(pid) == SCHED_FIFO);
+    rc = sched_getparam(pid, &sp);
+    assert(rc == 0);
+    assert(sp.sched_priority == 10);
+    rc = pthread_getschedparam(pthread_self(), &policy, &sp);
+    assert(rc == 0);
+    assert(policy == SCHED_FIFO);
+    assert(sp.sched_priority == 10);
+
+    rc = sched_setscheduler(pid, SCHED_RR, &sp);
+    assert(rc == SCHED_FIFO);
+    assert(sched_getscheduler(pid) == SCHED_RR);
+
+    rc = sched_setscheduler(pid, SCHED_MAX + 1, &sp);
+    assert(rc == -1 && errno == EINVAL);
+    rc = sched_setscheduler((pid_t) GetCurrentProcessId() + 4, SCHED_OTHER, &sp);
+    assert(rc == -1 && errno == ESRCH);
+    assert(sched_getscheduler(pid) == SCHED_RR);
+
+    sp.sched_priority = 8;
+    rc = sched_setscheduler(pid, SCHED_OTHER, &sp);
+    assert(rc == SCHED_RR);
+    assert(sched_getscheduler(pid) == SCHED_OTHER);
+    printf("sched_setscheduler SCHED_FIFO/SCHED_RR passed\n");
+
+    assert(pthread_attr_init(&attr) == 0);
+    assert(pthread_attr_setschedpolicy(&attr, SCHED_MAX + 1) == EINVAL);
+    assert(pthread_attr_setschedpolicy(&attr, SCHED_FIFO) == 0);
+    sp.sched_priority = 13;
+    assert(pthread_attr_setschedparam(&attr, &sp) == 0);
+    assert(pthread_create(&thread, &attr, fifo_worker, &attr) == 0);
+    assert(pthread_join(thread, &result) == 0);
+    assert(result == &attr);
+    assert(pthread_attr_destroy(&attr) == 0);
+    printf("pthread_attr_setschedpolicy passed\n");
+
+    /* 2, 4, 6 or 12 clock ticks */
+    (void) GetSystemTimeAdjustment(&timeAdjustment, &timeIncrement, &isTimeAdjustmentDisabled);
+    tick = (unsigned long long) timeIncrement * 100;
     rc = sched_rr_get_interval(pid, &tp);
     assert(rc == 0);
     assert(tp.tv_sec == 0);
-    assert(tp.tv_nsec == 15625000);
+    assert(tp.tv_nsec % tick == 0);
+    assert(tp.tv_nsec / tick == 2 || tp.tv_nsec / tick == 4 || tp.tv_nsec / tick == 6 || tp.tv_nsec / tick == 12);
     printf("sched_rr_get_interval passed\n");
 
     return 0;
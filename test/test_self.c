@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define SELF_COUNT      10000000
+
+static pthread_t foreign_self;
+static long foreign_cleanups;
+
+static void count(void *arg)
+{
+    (*(long *) arg)++;
+}
+
+/* A thread of the system, not created by pthread_create */
+static DWORD WINAPI foreign(LPVOID arg)
+{
+    foreign_self = pthread_self();
+    assert(foreign_self != 0 && pthread_equal(foreign_self, pthread_self()));
+    assert(pthread_join(foreign_self, NULL) == EINVAL);
+
+    pthread_cleanup_push(count, &foreign_cleanups);
+    pthread_exit(arg);
+    pthread_cleanup_pop(0);
+    return 0;
+}
+
+static void *created(void *arg)
+{
+    return (void *) pthread_self();
+}
+
+int main(int argc, char *argv[])
+{
+    int i;
+    void *value;
+    pthread_t self = pthread_self(), t;
+    HANDLE handle;
+    DWORD code;
+    struct timespec start, end;
+
+    assert(self != 0);
+    assert(pthread_equal(self, pthread_self()));
+    assert(pthread_join(self, NULL) == EINVAL);
+    assert(pthread_detach(self) == EINVAL);
+    printf("main thread pthread_self passed\n");
+
+    assert(pthread_create(&t, NULL, created, NULL) == 0);
+    assert(pthread_join(t, &value) == 0);
+    assert((pthread_t) value == t && !pthread_equal(t, self));
+
+    handle = CreateThread(NULL, 0, foreign, (void *) 3, 0, NULL);
+    assert(handle != NULL);
+    assert(WaitForSingleObject(handle, INFINITE) == WAIT_OBJECT_0);
+    assert(GetExitCodeThread(handle, &code) && code == 0);
+    CloseHandle(handle);
+    assert(foreign_self != 0 && !pthread_equal(foreign_self, self));
+    assert(foreign_cleanups == 1);
+    printf("foreign thread pthread_self passed\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < SELF_COUNT; i++)
+        assert(pthread_self() == self);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("pthread_self: %.2f ns\n",
+        ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / SELF_COUNT);
+
+    return 0;
+}
@@ -17,6 +17,7 @@
  * limitations under the License.
  */
 
+#include <pthread.h>
 #include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,6 +26,29 @@
 
 #include "../src/misc.h"
 
+#define POST_COUNT      100000
+#define NWAITERS        8
+
+static sem_t ping, pong, batch;
+
+static void *ponger(void *arg)
+{
+    int i;
+
+    for (i = 0; i < POST_COUNT; i++) {
+        assert(sem_wait(ping) == 0);
+        assert(sem_post(pong) == 0);
+    }
+
+    return arg;
+}
+
+static void *waiter(void *arg)
+{
+    assert(sem_wait(batch) == 0);
+    return arg;
+}
+
 int main(int argc, char *argv[])
 {
     int rc;
@@ -65,6 +89,58 @@ int main(int argc, char *argv[])
     assert(rc == 0);
     printf("sem_destroy passed\n");
 
+    {
+        int i, value;
+        pthread_t t;
+
+        assert(sem_init(&ping, PTHREAD_PROCESS_PRIVATE, 0) == 0);
+        assert(sem_init(&pong, PTHREAD_PROCESS_PRIVATE, 0) == 0);
+        assert(pthread_create(&t, NULL, ponger, NULL) == 0);
+        for (i = 0; i < POST_COUNT; i++) {
+            assert(sem_post(ping) == 0);
+            assert(sem_wait(pong) == 0);
+        }
+        assert(pthread_join(t, NULL) == 0);
+
+        assert(sem_post(ping) == 0 && sem_post(ping) == 0);
+        assert(sem_getvalue(ping, &value) == 0 && value == 2);
+        assert(sem_trywait(ping) == 0 && sem_trywait(ping) == 0);
+        assert(sem_trywait(ping) == -1 && errno == EAGAIN);
+        assert(sem_destroy(ping) == 0 && sem_destroy(pong) == 0);
+        printf("private sem ping-pong passed\n");
+    }
+
+    {
+        int i, value;
+        pthread_t t[NWAITERS];
+
+        assert(sem_init(&batch, PTHREAD_PROCESS_PRIVATE, 0) == 0);
+        for (i = 0; i < NWAITERS; i++)
+            assert(pthread_create(&t[i], NULL, waiter, NULL) == 0);
+        assert(sem_post_multiple(batch, NWAITERS / 2) == 0);
+        assert(sem_post_multiple(batch, NWAITERS / 2 + 2) == 0);
+        for (i = 0; i < NWAITERS; i++)
+            assert(pthread_join(t[i], NULL) == 0);
+        assert(sem_getvalue(batch, &value) == 0 && value == 2);
+
+        assert(sem_post_multiple(batch, 0) == -1 && errno == EINVAL);
+        assert(sem_post_multiple(batch, SEM_VALUE_MAX - 1) == -1 && errno == EOVERFLOW);
+        assert(sem_getvalue(batch, &value) == 0 && value == 2);
+        assert(sem_destroy(batch) == 0);
+        printf("sem_post_multiple passed\n");
+    }
+
+    rc = sem_init(&sem, PTHREAD_PROCESS_SHARED, 1);
+    assert(rc == 0);
+    assert(sem_trywait(sem) == 0);
+    assert(sem_trywait(sem) == -1 && errno == EAGAIN);
+    assert(sem_post(sem) == 0);
+    assert(sem_post_multiple(sem, 2) == 0);
+    assert(sem_trywait(sem) == 0 && sem_trywait(sem) == 0 && sem_trywait(sem) == 0);
+    assert(sem_trywait(sem) == -1 && errno == EAGAIN);
+    assert(sem_destroy(sem) == 0);
+    printf("process-shared sem passed\n");
+
     sem = sem_open("MySem", 0, 0, 1);
     assert(sem == NULL);
     printf("sem_open passed\n");
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define NREADERS        4
+#define WRITE_COUNT     200000
+
+/* A snapshot the writers keep consistent: all fields are equal */
+typedef struct {
+    volatile long a, b, c;
+} snapshot;
+
+static pthread_seqlock_t lock = PTHREAD_SEQLOCK_INITIALIZER;
+static snapshot data;
+static volatile long done;
+
+static void *writer(void *arg)
+{
+    long i;
+
+    for (i = 1; i <= WRITE_COUNT; i++) {
+        pthread_seqlock_write_lock(&lock);
+        data.a = data.a + 1;
+        data.b = data.b + 1;
+        data.c = data.c + 1;
+        pthread_seqlock_write_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+static void *reader(void *arg)
+{
+    long seq, reads = 0, retries = 0, last = 0;
+    snapshot copy;
+
+    while (!atomic_read(&done)) {
+        do {
+            seq = pthread_seqlock_read_begin(&lock);
+            assert((seq & 1) == 0);
+            copy.a = data.a;
+            copy.b = data.b;
+            copy.c = data.c;
+        } while (pthread_seqlock_read_retry(&lock, seq) && ++retries);
+
+        assert(copy.a == copy.b && copy.b == copy.c);
+        assert(copy.a >= last);
+        last = copy.a;
+        reads++;
+    }
+
+    printf("reader: %ld reads, %ld retries\n", reads, retries);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int i;
+    long seq;
+    pthread_t w[2], r[NREADERS];
+
+    for (i = 0; i < NREADERS; i++)
+        assert(pthread_create(&r[i], NULL, reader, NULL) == 0);
+    for (i = 0; i < 2; i++)
+        assert(pthread_create(&w[i], NULL, writer, NULL) == 0);
+
+    for (i = 0; i < 2; i++)
+        assert(pthread_join(w[i], NULL) == 0);
+    atomic_set(&done, 1);
+    for (i = 0; i < NREADERS; i++)
+        assert(pthread_join(r[i], NULL) == 0);
+
+    assert(data.a == 2 * WRITE_COUNT && data.b == data.a && data.c == data.a);
+    printf("pthread_seqlock_read_begin, pthread_seqlock_write_lock passed\n");
+
+    seq = pthread_seqlock_read_begin(&lock);
+    assert(pthread_seqlock_read_retry(&lock, seq) == 0);
+    assert(pthread_seqlock_write_trylock(&lock) == 0);
+    assert(pthread_seqlock_write_trylock(&lock) == EBUSY);
+    assert(pthread_seqlock_read_retry(&lock, seq) == 1);
+    assert(pthread_seqlock_write_unlock(&lock) == 0);
+    assert(pthread_seqlock_read_retry(&lock, seq) == 1);
+    printf("pthread_seqlock_write_trylock passed\n");
+
+    assert(pthread_seqlock_destroy(&lock) == 0);
+    assert(pthread_seqlock_init(&lock, PTHREAD_PROCESS_SHARED) == EINVAL);
+    assert(pthread_seqlock_init(&lock, PTHREAD_PROCESS_PRIVATE) == 0);
+    assert(pthread_seqlock_destroy(&lock) == 0);
+
+    return 0;
+}
@@ -235,6 +235,91 @@ void test_mutex()
         (tp2.tv_nsec - tp.tv_nsec + (tp2.tv_sec - tp.tv_sec) * POW10_9) / (TEST_TIMES * 100000.0));
 }
 
+#define CONTENDED_TIMES 200000
+
+static pthread_mutex_t contended_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile long contended_counter = 0;
+
+static void *contended_worker(void *arg)
+{
+    int i;
+
+    for(i = CONTENDED_TIMES; i > 0; i--) {
+        pthread_mutex_lock(&contended_mutex);
+        contended_counter++;
+        pthread_mutex_unlock(&contended_mutex);
+    }
+
+    return NULL;
+}
+
+void test_mutex_contended(int nthreads)
+{
+    int i;
+    pthread_t t[16];
+    struct timespec tp, tp2;
+
+    contended_counter = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    for(i = 0; i < nthreads; i++) {
+        if (pthread_create(&t[i], NULL, contended_worker, NULL) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for(i = 0; i < nthreads; i++)
+        pthread_join(t[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tp2);
+
+    if (contended_counter != (long) nthreads * CONTENDED_TIMES) {
+        fprintf(stderr, "contended pthread_mutex_lock failed: %ld\n", contended_counter);
+        exit(1);
+    }
+
+    fprintf(stdout, " contended mutex lock/unlock %2d threads: %7.3lf us\n", nthreads,
+        (tp2.tv_nsec - tp.tv_nsec + (tp2.tv_sec - tp.tv_sec) * POW10_9) / (nthreads * CONTENDED_TIMES * 1000.0));
+}
+
+#define BARRIER_PHASES  100000
+
+static pthread_barrier_t phase_barrier;
+
+static void *barrier_worker(void *arg)
+{
+    int i;
+
+    for(i = BARRIER_PHASES; i > 0; i--)
+        pthread_barrier_wait(&phase_barrier);
+
+    return NULL;
+}
+
+void test_barrier(int nthreads)
+{
+    int i;
+    pthread_t t[16];
+    struct timespec tp, tp2;
+
+    pthread_barrier_init(&phase_barrier, NULL, nthreads);
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    for(i = 0; i < nthreads; i++) {
+        if (pthread_create(&t[i], NULL, barrier_worker, NULL) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for(i = 0; i < nthreads; i++)
+        pthread_join(t[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tp2);
+
+    pthread_barrier_destroy(&phase_barrier);
+
+    fprintf(stdout, "     pthread_barrier_wait phase %2d threads: %7.3lf us\n", nthreads,
+        (tp2.tv_nsec - tp.tv_nsec + (tp2.tv_sec - tp.tv_sec) * POW10_9) / (BARRIER_PHASES * 1000.0));
+}
+
 #ifndef _MSC_VER
 __attribute__ ((noinline))
 #endif
@@ -269,6 +354,23 @@ void test_mono()
         (tp2.tv_nsec - tp.tv_nsec + (tp2.tv_sec - tp.tv_sec) * POW10_9) / (TEST_TIMES * 1000.0));
 }
 
+void test_clock(const char *name, clockid_t clock_id)
+{
+    int i;
+    struct timespec tp, tp2, ti;
+
+    clock_gettime(clock_id, &ti);
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    for(i = 0; i < TEST_TIMES; i++) {
+        clock_gettime(clock_id, &ti);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp2);
+
+    fprintf(stdout, "%40s: %7.3lf us\n", name,
+        (tp2.tv_nsec - tp.tv_nsec + (tp2.tv_sec - tp.tv_sec) * POW10_9) / (TEST_TIMES * 1000.0));
+}
+
 int main(int argc, char *argv[])
 {
     struct timespec tp;
@@ -276,7 +378,17 @@ int main(int argc, char *argv[])
     clock_gettime(CLOCK_MONOTONIC, &tp);
 
     test_mono();
+    test_clock("clock_gettime(CLOCK_MONOTONIC)", CLOCK_MONOTONIC);
+    test_clock("clock_gettime(CLOCK_MONOTONIC_COARSE)", CLOCK_MONOTONIC_COARSE);
+    test_clock("clock_gettime(CLOCK_REALTIME)", CLOCK_REALTIME);
     test_mutex();
+    test_mutex_contended(2);
+    test_mutex_contended(4);
+    test_mutex_contended(8);
+    test_mutex_contended(16);
+    test_barrier(2);
+    test_barrier(4);
+    test_barrier(8);
     test_spin_count();
     test_spin();
     test_lps();
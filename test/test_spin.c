@@ -25,10 +25,52 @@
 
 #include "../src/misc.h"
 
+#define THREAD_COUNT    8
+#define LOOP_COUNT      100000
+
 pthread_spinlock_t lock;
 
+static pthread_spin_mcs_t mcs = PTHREAD_SPIN_MCS_INITIALIZER;
+static pthread_spin_mcs_numa_t mcs_numa = PTHREAD_SPIN_MCS_NUMA_INITIALIZER;
+static long mcs_counter = 0, mcs_numa_counter = 0, counter = 0;
+
+static void *ticket_worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < LOOP_COUNT; i++) {
+        pthread_spin_lock(&lock);
+        counter++;
+        pthread_spin_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+static void *worker(void *arg)
+{
+    int i;
+    pthread_spin_mcs_node_t node;
+
+    for (i = 0; i < LOOP_COUNT; i++) {
+        pthread_spin_mcs_lock(&mcs, &node);
+        mcs_counter++;
+        pthread_spin_mcs_unlock(&mcs, &node);
+
+        pthread_spin_mcs_numa_lock(&mcs_numa, &node);
+        mcs_numa_counter++;
+        pthread_spin_mcs_numa_unlock(&mcs_numa, &node);
+    }
+
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
+    int i, n, spin, yield;
+    pthread_t t[THREAD_COUNT];
+    pthread_spin_mcs_node_t node, node2;
+
     assert(pthread_spin_init(&lock, PTHREAD_PROCESS_PRIVATE) == 0);
     printf("pthread_spin_init passed\n");
 
@@ -44,5 +86,40 @@ int main(int argc, char *argv[])
     assert(pthread_spin_destroy(&lock) == 0);
     printf("pthread_spin_destroy passed\n");
 
+    /* oversubscribed, waiters must yield and park instead of spinning */
+    assert(pthread_spin_getspin_np(&spin, &yield) == 0);
+    assert(pthread_spin_setspin_np(-1, 0) == EINVAL);
+    assert(pthread_spin_setspin_np(0, 1) == 0);
+    assert(pthread_spin_init(&lock, PTHREAD_PROCESS_PRIVATE) == 0);
+    for (i = 0; i < THREAD_COUNT; i++)
+        assert(pthread_create(&t[i], NULL, ticket_worker, NULL) == 0);
+    for (i = 0; i < THREAD_COUNT; i++)
+        assert(pthread_join(t[i], NULL) == 0);
+    assert(counter == THREAD_COUNT * LOOP_COUNT);
+    assert(pthread_spin_destroy(&lock) == 0);
+    assert(pthread_spin_setspin_np(spin, yield) == 0);
+    printf("parked pthread_spin_lock passed\n");
+
+    assert(pthread_spin_mcs_init(&mcs, PTHREAD_PROCESS_PRIVATE) == 0);
+    assert(pthread_spin_mcs_lock(&mcs, &node) == 0);
+    assert(pthread_spin_mcs_trylock(&mcs, &node2) == EBUSY);
+    assert(pthread_spin_mcs_unlock(&mcs, &node) == 0);
+    assert(pthread_spin_mcs_trylock(&mcs, &node2) == 0);
+    assert(pthread_spin_mcs_unlock(&mcs, &node2) == 0);
+    printf("pthread_spin_mcs_lock passed\n");
+
+    /* contention test, spinning waiters must not outnumber the CPUs */
+    n = get_ncpu() < THREAD_COUNT ? get_ncpu() : THREAD_COUNT;
+    for (i = 0; i < n; i++)
+        assert(pthread_create(&t[i], NULL, worker, NULL) == 0);
+    for (i = 0; i < n; i++)
+        assert(pthread_join(t[i], NULL) == 0);
+
+    assert(mcs_counter == n * LOOP_COUNT);
+    assert(mcs_numa_counter == n * LOOP_COUNT);
+    assert(pthread_spin_mcs_destroy(&mcs) == 0);
+    assert(pthread_spin_mcs_numa_destroy(&mcs_numa) == 0);
+    printf("contended pthread_spin_mcs_lock/pthread_spin_mcs_numa_lock passed\n");
+
     return 0;
 }
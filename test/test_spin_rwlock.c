@@ -27,8 +27,18 @@
 
 pthread_spin_rwlock_t lock = PTHREAD_SPIN_RWLOCK_INITIALIZER;
 
+static void *reader(void *arg)
+{
+    assert(pthread_spin_rwlock_reader_lock(&lock) == 0);
+    assert(pthread_spin_rwlock_reader_unlock(&lock) == 0);
+
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
+    pthread_t t;
+
     assert(pthread_spin_rwlock_init(&lock, PTHREAD_PROCESS_PRIVATE) == 0);
     printf("pthread_spin_rwlock_init passed\n");
 
@@ -43,6 +53,11 @@ int main(int argc, char *argv[])
     assert(pthread_spin_rwlock_reader_lock(&lock) == 0);
     printf("pthread_spin_rwlock_reader_lock passed\n");
 
+    /* readers do not wait for each other */
+    assert(pthread_create(&t, NULL, reader, NULL) == 0);
+    assert(pthread_join(t, NULL) == 0);
+    printf("concurrent pthread_spin_rwlock_reader_lock passed\n");
+
     assert(pthread_spin_rwlock_reader_unlock(&lock) == 0);
     assert(pthread_spin_rwlock_reader_unlock(&lock) == 0);
     assert(pthread_spin_rwlock_reader_unlock(&lock) == 0);
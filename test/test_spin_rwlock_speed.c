@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+#include <pthread.h>
+#include <pthread_clock.h>
+
+#include "../src/misc.h"
+
+/*
+ * Read-mostly contention benchmark: every thread takes the lock
+ * TEST_TIMES times, one time in WRITE_RATIO for writing.
+ */
+
+#define TEST_TIMES      1000000
+#define WRITE_RATIO     100
+#define MAX_THREADS     64
+
+static pthread_spin_rwlock_t spin_rwlock = PTHREAD_SPIN_RWLOCK_INITIALIZER;
+static pthread_rwlock_t rwlock;
+static long value[2];
+
+static void *spin_rwlock_worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < TEST_TIMES; i++) {
+        if (i % WRITE_RATIO == 0) {
+            pthread_spin_rwlock_writer_lock(&spin_rwlock);
+            value[0]++;
+            value[1]++;
+            pthread_spin_rwlock_writer_unlock(&spin_rwlock);
+        } else {
+            pthread_spin_rwlock_reader_lock(&spin_rwlock);
+            assert(value[0] == value[1]);
+            pthread_spin_rwlock_reader_unlock(&spin_rwlock);
+        }
+    }
+
+    return NULL;
+}
+
+static void *rwlock_worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < TEST_TIMES; i++) {
+        if (i % WRITE_RATIO == 0) {
+            pthread_rwlock_wrlock(&rwlock);
+            value[0]++;
+            value[1]++;
+            pthread_rwlock_unlock(&rwlock);
+        } else {
+            pthread_rwlock_rdlock(&rwlock);
+            assert(value[0] == value[1]);
+            pthread_rwlock_unlock(&rwlock);
+        }
+    }
+
+    return NULL;
+}
+
+static void run(char *name, void *(*worker)(void *), int nthreads)
+{
+    int i;
+    struct timespec tp, tp2;
+    pthread_t t[MAX_THREADS];
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    for (i = 0; i < nthreads; i++)
+        assert(pthread_create(&t[i], NULL, worker, NULL) == 0);
+    for (i = 0; i < nthreads; i++)
+        assert(pthread_join(t[i], NULL) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &tp2);
+
+    fprintf(stdout, "%24s, %2d threads: %7.3lf ns/op\n", name, nthreads,
+        (tp2.tv_nsec - tp.tv_nsec + (tp2.tv_sec - tp.tv_sec) * POW10_9) / ((double) TEST_TIMES * nthreads));
+}
+
+int main(int argc, char *argv[])
+{
+    int n;
+    pthread_rwlockattr_t attr;
+
+    assert(pthread_rwlockattr_init(&attr) == 0);
+    assert(pthread_rwlockattr_setpercpu_np(&attr, 1) == 0);
+
+    for (n = 1; n <= MAX_THREADS && n <= get_ncpu() * 2; n <<= 1) {
+        run("pthread_spin_rwlock_t", spin_rwlock_worker, n);
+
+        assert(pthread_rwlock_init(&rwlock, NULL) == 0);
+        run("pthread_rwlock_t", rwlock_worker, n);
+        assert(pthread_rwlock_destroy(&rwlock) == 0);
+
+        assert(pthread_rwlock_init(&rwlock, &attr) == 0);
+        run("pthread_rwlock_t, percpu", rwlock_worker, n);
+        assert(pthread_rwlock_destroy(&rwlock) == 0);
+    }
+
+    assert(pthread_rwlockattr_destroy(&attr) == 0);
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+#include <pthread.h>
+#include <pthread_clock.h>
+
+#include "../src/misc.h"
+
+/*
+ * Contended spin lock benchmark: every thread takes the lock TEST_TIMES
+ * times, the ticket lock against the MCS and the NUMA-aware MCS locks.
+ */
+
+#define TEST_TIMES      1000000
+#define MAX_THREADS     64
+
+static pthread_spinlock_t ticket = PTHREAD_SPINLOCK_INITIALIZER;
+static pthread_spin_mcs_t mcs = PTHREAD_SPIN_MCS_INITIALIZER;
+static pthread_spin_mcs_numa_t mcs_numa = PTHREAD_SPIN_MCS_NUMA_INITIALIZER;
+static long counter;
+
+static void *ticket_worker(void *arg)
+{
+    int i;
+
+    for (i = 0; i < TEST_TIMES; i++) {
+        pthread_spin_lock(&ticket);
+        counter++;
+        pthread_spin_unlock(&ticket);
+    }
+
+    return NULL;
+}
+
+static void *mcs_worker(void *arg)
+{
+    int i;
+    pthread_spin_mcs_node_t node;
+
+    for (i = 0; i < TEST_TIMES; i++) {
+        pthread_spin_mcs_lock(&mcs, &node);
+        counter++;
+        pthread_spin_mcs_unlock(&mcs, &node);
+    }
+
+    return NULL;
+}
+
+static void *mcs_numa_worker(void *arg)
+{
+    int i;
+    pthread_spin_mcs_node_t node;
+
+    for (i = 0; i < TEST_TIMES; i++) {
+        pthread_spin_mcs_numa_lock(&mcs_numa, &node);
+        counter++;
+        pthread_spin_mcs_numa_unlock(&mcs_numa, &node);
+    }
+
+    return NULL;
+}
+
+static void run(char *name, void *(*worker)(void *), int nthreads)
+{
+    int i;
+    struct timespec tp, tp2;
+    pthread_t t[MAX_THREADS];
+
+    counter = 0;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    for (i = 0; i < nthreads; i++)
+        assert(pthread_create(&t[i], NULL, worker, NULL) == 0);
+    for (i = 0; i < nthreads; i++)
+        assert(pthread_join(t[i], NULL) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &tp2);
+    assert(counter == (long) TEST_TIMES * nthreads);
+
+    fprintf(stdout, "%24s, %2d threads: %7.3lf ns/op\n", name, nthreads,
+        (tp2.tv_nsec - tp.tv_nsec + (tp2.tv_sec - tp.tv_sec) * POW10_9) / ((double) TEST_TIMES * nthreads));
+}
+
+int main(int argc, char *argv[])
+{
+    int n;
+
+    for (n = 1; n <= MAX_THREADS && n <= get_ncpu(); n <<= 1) {
+        run("pthread_spinlock_t", ticket_worker, n);
+        run("pthread_spin_mcs_t", mcs_worker, n);
+        run("pthread_spin_mcs_numa_t", mcs_numa_worker, n);
+    }
+
+    return 0;
+}
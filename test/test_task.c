@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <pthread_clock.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define TASK_COUNT      100000
+#define FIB_N           24
+
+static pthread_task_pool_t pool;
+static long counter = 0;
+
+typedef struct {
+    int n;
+    long result;
+} fib_arg;
+
+/* Fork/join: every call spawns one half and runs the other itself */
+static void fib(void *arg)
+{
+    fib_arg *a = (fib_arg *) arg, a1, a2;
+    pthread_task_group_t group = PTHREAD_TASK_GROUP_INITIALIZER;
+
+    if (a->n < 2) {
+        a->result = a->n;
+        return;
+    }
+
+    a1.n = a->n - 1;
+    a2.n = a->n - 2;
+    assert(pthread_task_spawn(&pool, &group, fib, &a1) == 0);
+    fib(&a2);
+    assert(pthread_task_wait(&pool, &group) == 0);
+
+    a->result = a1.result + a2.result;
+}
+
+/* The waiting thread helps too, it is not a worker of the pool */
+static void count(void *arg)
+{
+    assert(pthread_task_self(&pool) < *(int *) arg);
+    atomic_fetch_and_add(&counter, 1);
+}
+
+static void test_pool(int nworkers)
+{
+    int i;
+    fib_arg a;
+    struct timespec tp, tp2;
+    pthread_task_group_t group = PTHREAD_TASK_GROUP_INITIALIZER;
+
+    assert(pthread_task_pool_init(&pool, nworkers) == 0);
+    if (nworkers == 0)
+        nworkers = get_ncpu();
+    assert(pthread_task_self(&pool) == -1);
+
+    /* tasks spawned from outside the pool */
+    counter = 0;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    for (i = 0; i < TASK_COUNT; i++)
+        assert(pthread_task_spawn(&pool, &group, count, &nworkers) == 0);
+    assert(pthread_task_wait(&pool, &group) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &tp2);
+    assert(counter == TASK_COUNT);
+    printf("%2d workers, spawn/run: %7.3lf us\n", nworkers,
+        (tp2.tv_nsec - tp.tv_nsec + (tp2.tv_sec - tp.tv_sec) * POW10_9) / (TASK_COUNT * 1000.0));
+
+    /* the group can be reused */
+    assert(pthread_task_spawn(&pool, &group, count, &nworkers) == 0);
+    assert(pthread_task_wait(&pool, &group) == 0);
+    assert(counter == TASK_COUNT + 1);
+
+    /* nested tasks */
+    a.n = FIB_N;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    assert(pthread_task_spawn(&pool, &group, fib, &a) == 0);
+    assert(pthread_task_wait(&pool, &group) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &tp2);
+    assert(a.result == 46368);
+    printf("%2d workers, fib(%d): %7.3lf ms\n", nworkers, FIB_N,
+        (tp2.tv_nsec - tp.tv_nsec + (tp2.tv_sec - tp.tv_sec) * POW10_9) / 1000000.0);
+
+    assert(pthread_task_pool_destroy(&pool) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    assert(pthread_task_pool_init(&pool, -1) == EINVAL);
+
+    test_pool(1);
+    test_pool(4);
+    test_pool(0);
+
+    return 0;
+}
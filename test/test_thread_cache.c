@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <pthread_clock.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define THREAD_COUNT    10000
+
+static pthread_key_t key;
+static long os_thread_ids[2];
+static long detached_count = 0;
+
+/* A cached thread must look like a new thread to every start routine */
+static void *worker(void *arg)
+{
+    assert(pthread_getspecific(key) == NULL);
+    assert(pthread_setspecific(key, arg) == 0);
+
+    if (((uintptr_t) arg) % 2)
+        pthread_exit(arg);
+
+    return arg;
+}
+
+static void *thread_id(void *arg)
+{
+    os_thread_ids[(uintptr_t) arg] = GetCurrentThreadId();
+    return NULL;
+}
+
+static void *detached(void *arg)
+{
+    atomic_fetch_and_add(&detached_count, 1);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, size;
+    void *rv;
+    pthread_t t;
+    pthread_attr_t attr;
+    struct timespec tp, tp2;
+
+    assert(pthread_setcachesize_np(-1) == EINVAL);
+    assert(pthread_setcachesize_np(4) == 0);
+    assert(pthread_getcachesize_np(&size) == 0 && size == 4);
+    assert(pthread_key_create(&key, NULL) == 0);
+
+    /* the second thread reuses the first one */
+    assert(pthread_create(&t, NULL, thread_id, (void *) 0) == 0);
+    assert(pthread_join(t, NULL) == 0);
+    Sleep(100);
+    assert(pthread_create(&t, NULL, thread_id, (void *) 1) == 0);
+    assert(pthread_join(t, NULL) == 0);
+    assert(os_thread_ids[0] == os_thread_ids[1]);
+    printf("cached thread reuse passed\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    for (i = 1; i <= THREAD_COUNT; i++) {
+        assert(pthread_create(&t, NULL, worker, (void *) (uintptr_t) i) == 0);
+        assert(pthread_join(t, &rv) == 0);
+        assert(rv == (void *) (uintptr_t) i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp2);
+    printf("cached pthread_create/pthread_join: %7.3lf us\n",
+        (tp2.tv_nsec - tp.tv_nsec + (tp2.tv_sec - tp.tv_sec) * POW10_9) / (THREAD_COUNT * 1000.0));
+
+    assert(pthread_attr_init(&attr) == 0);
+    assert(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0);
+    for (i = 0; i < 100; i++)
+        assert(pthread_create(&t, &attr, detached, NULL) == 0);
+    assert(pthread_attr_destroy(&attr) == 0);
+    for (i = 0; i < 100 && atomic_read(&detached_count) != 100; i++)
+        Sleep(10);
+    assert(detached_count == 100);
+    printf("cached detached threads passed\n");
+
+    assert(pthread_setcachesize_np(0) == 0);
+    assert(pthread_key_delete(key) == 0);
+
+    return 0;
+}
@@ -34,6 +34,76 @@ static void *wroker(void *arg)
     return 0;
 }
 
+#define STACK_SIZE      (1024 * 1024)
+#define STACK_THREADS   64
+
+/* The reserved and committed bytes of the stack of the calling thread */
+static void *stack_usage(void *arg)
+{
+    char *p;
+    void *base;
+    size_t *usage = (size_t *) arg;
+    MEMORY_BASIC_INFORMATION mbi;
+
+    VirtualQuery(&mbi, &mbi, sizeof(mbi));
+    base = mbi.AllocationBase;
+    usage[0] = usage[1] = 0;
+    for (p = (char *) base; VirtualQuery(p, &mbi, sizeof(mbi)) != 0 && mbi.AllocationBase == base; p += mbi.RegionSize) {
+        usage[0] += mbi.RegionSize;
+        if (mbi.State == MEM_COMMIT)
+            usage[1] += mbi.RegionSize;
+    }
+
+    return NULL;
+}
+
+static void test_stack(void)
+{
+    int i;
+    char *stack;
+    void *addr;
+    size_t size, usage[STACK_THREADS][2];
+    pthread_t t[STACK_THREADS];
+    pthread_attr_t attr;
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    assert(pthread_attr_init(&attr) == 0);
+    assert(pthread_attr_getguardsize(&attr, &size) == 0 && size == si.dwPageSize);
+    assert(pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN - 1) == EINVAL);
+    assert(pthread_attr_setstacksize(&attr, STACK_SIZE) == 0);
+
+    /* A stack size is reserved, only what the thread uses is committed */
+    for (i = 0; i < STACK_THREADS; i++)
+        assert(pthread_create(&t[i], &attr, stack_usage, usage[i]) == 0);
+    for (i = 0; i < STACK_THREADS; i++) {
+        assert(pthread_join(t[i], NULL) == 0);
+        assert(usage[i][0] >= STACK_SIZE);
+        assert(usage[i][1] < STACK_SIZE / 8);
+    }
+    printf("%d threads of %d KB stacks, %d KB committed each: passed\n",
+        STACK_THREADS, STACK_SIZE / 1024, (int) (usage[0][1] / 1024));
+
+    /* A guard size is rounded up to pages */
+    assert(pthread_attr_setguardsize(&attr, 3 * si.dwPageSize + 1) == 0);
+    assert(pthread_attr_getguardsize(&attr, &size) == 0 && size == 4 * si.dwPageSize);
+    assert(pthread_create(&t[0], &attr, stack_usage, usage[0]) == 0);
+    assert(pthread_join(t[0], NULL) == 0);
+
+    stack = malloc(STACK_SIZE);
+    assert(pthread_attr_setstack(&attr, NULL, STACK_SIZE) == EINVAL);
+    assert(pthread_attr_setstack(&attr, stack, STACK_SIZE) == 0);
+    assert(pthread_attr_getstack(&attr, &addr, &size) == 0);
+    assert(addr == stack && size == STACK_SIZE);
+    assert(pthread_create(&t[0], &attr, stack_usage, usage[0]) == 0);
+    assert(pthread_join(t[0], NULL) == 0);
+    assert(usage[0][0] >= STACK_SIZE);
+    free(stack);
+
+    assert(pthread_attr_destroy(&attr) == 0);
+    printf("pthread_attr_setguardsize and pthread_attr_setstack passed\n");
+}
+
 int main(int argc, char *argv[])
 {
     int rc, i = 0;
@@ -51,5 +121,7 @@ int main(int argc, char *argv[])
     assert(was_changed == 1);
     printf("pthread_create passed\n");
 
+    test_stack();
+
     return 0;
 }
@@ -34,6 +34,82 @@ static void *wroker(void *arg)
     return NULL;
 }
 
+#define MANY_COUNT  200
+
+static volatile long release;
+
+static void *blocker(void *arg)
+{
+    while (atomic_read(&release) == 0)
+        Sleep(1);
+    return arg;
+}
+
+static void deadline(struct timespec *ts, long ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * POW10_6;
+    if (ts->tv_nsec >= POW10_9) {
+        ts->tv_sec++;
+        ts->tv_nsec -= POW10_9;
+    }
+}
+
+static void test_try_timed(void)
+{
+    int rc;
+    void *result;
+    pthread_t t;
+    struct timespec ts;
+
+    release = 0;
+    assert(pthread_create(&t, NULL, blocker, (void *) 5) == 0);
+    assert(pthread_tryjoin_np(t, &result) == EBUSY);
+
+    deadline(&ts, 50);
+    assert(pthread_timedjoin_np(t, &result, &ts) == ETIMEDOUT);
+    ts.tv_nsec = -1;
+    assert(pthread_timedjoin_np(t, &result, &ts) == EINVAL);
+
+    atomic_set(&release, 1);
+    deadline(&ts, 5000);
+    assert(pthread_timedjoin_np(t, &result, &ts) == 0);
+    assert(result == (void *) 5);
+
+    assert(pthread_create(&t, NULL, wroker, NULL) == 0);
+    while ((rc = pthread_tryjoin_np(t, NULL)) == EBUSY)
+        Sleep(1);
+    assert(rc == 0);
+
+    printf("pthread_tryjoin_np and pthread_timedjoin_np passed\n");
+}
+
+static void test_many(void)
+{
+    int i;
+    struct timespec ts;
+    pthread_t t[MANY_COUNT];
+    void *values[MANY_COUNT];
+
+    release = 0;
+    for (i = 0; i < MANY_COUNT; i++)
+        assert(pthread_create(&t[i], NULL, blocker, (void *) (intptr_t) i) == 0);
+
+    /* none of them is joined on timeout */
+    deadline(&ts, 50);
+    assert(pthread_join_many_np(MANY_COUNT, t, values, &ts) == ETIMEDOUT);
+
+    atomic_set(&release, 1);
+    assert(pthread_join_many_np(MANY_COUNT, t, values, NULL) == 0);
+    for (i = 0; i < MANY_COUNT; i++)
+        assert(values[i] == (void *) (intptr_t) i);
+
+    assert(pthread_join_many_np(0, NULL, NULL, NULL) == 0);
+    assert(pthread_join_many_np(-1, t, NULL, NULL) == EINVAL);
+    printf("pthread_join_many_np of %d threads passed\n", MANY_COUNT);
+}
+
 int main(int argc, char *argv[])
 {
     int rc, i = 0;
@@ -55,5 +131,14 @@ int main(int argc, char *argv[])
 
     printf("pthread_join passed\n");
 
+    test_try_timed();
+    test_many();
+
+    /* cached threads do not exit, they are joined on their start routines */
+    pthread_setcachesize_np(MANY_COUNT);
+    test_try_timed();
+    test_many();
+    pthread_setcachesize_np(0);
+
     return 0;
 }
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread_clock.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define TIMER_COUNT     10000
+
+static long fired[TIMER_COUNT];
+static timer_t timers[TIMER_COUNT];
+
+static void count(union sigval value)
+{
+    atomic_fetch_and_add(& fired[value.sival_int], 1);
+}
+
+static void self_delete(union sigval value)
+{
+    assert(timer_delete(*(timer_t *) value.sival_ptr) == 0);
+    atomic_fetch_and_add(& fired[0], 1);
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec request;
+
+    request.tv_sec = ms / 1000;
+    request.tv_nsec = (ms % 1000) * 1000000;
+    assert(nanosleep(&request, NULL) == 0);
+}
+
+static void arm(timer_t t, long ms, long interval_ms)
+{
+    struct itimerspec value;
+
+    value.it_value.tv_sec = ms / 1000;
+    value.it_value.tv_nsec = (ms % 1000) * 1000000;
+    value.it_interval.tv_sec = interval_ms / 1000;
+    value.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    assert(timer_settime(t, 0, &value, NULL) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    int i;
+    long n;
+    timer_t t;
+    struct sigevent ev;
+    struct itimerspec value;
+    struct timespec tp, tp2;
+
+    ev.sigev_notify = SIGEV_THREAD;
+    ev.sigev_notify_function = count;
+    ev.sigev_notify_attributes = NULL;
+
+    /* one-shot */
+    ev.sigev_value.sival_int = 0;
+    assert(timer_create(CLOCK_MONOTONIC, &ev, &t) == 0);
+    assert(timer_gettime(t, &value) == 0);
+    assert(value.it_value.tv_sec == 0 && value.it_value.tv_nsec == 0);
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    arm(t, 20, 0);
+    assert(timer_gettime(t, &value) == 0);
+    assert(value.it_value.tv_sec == 0 && value.it_value.tv_nsec > 0 && value.it_value.tv_nsec <= 20000000);
+    while (atomic_read(& fired[0]) == 0)
+        sleep_ms(1);
+    clock_gettime(CLOCK_MONOTONIC, &tp2);
+    assert((tp2.tv_sec - tp.tv_sec) * POW10_9 + (tp2.tv_nsec - tp.tv_nsec) >= 20000000);
+    sleep_ms(50);
+    assert(fired[0] == 1);
+    assert(timer_delete(t) == 0);
+    printf("one-shot timer passed\n");
+
+    /* periodic, then disarmed */
+    ev.sigev_value.sival_int = 1;
+    assert(timer_create(CLOCK_MONOTONIC, &ev, &t) == 0);
+    arm(t, 5, 5);
+    sleep_ms(200);
+    assert(timer_gettime(t, &value) == 0);
+    assert(value.it_interval.tv_sec == 0 && value.it_interval.tv_nsec == 5000000);
+    arm(t, 0, 0);
+    n = atomic_read(& fired[1]);
+    printf("periodic timer fired %ld times in 200 ms, overrun %d\n", n, timer_getoverrun(t));
+    assert(n >= 10);
+    sleep_ms(50);
+    assert(atomic_read(& fired[1]) == n);
+    assert(timer_delete(t) == 0);
+    printf("periodic timer passed\n");
+
+    /* a notify function deleting its own timer */
+    fired[0] = 0;
+    ev.sigev_notify_function = self_delete;
+    ev.sigev_value.sival_ptr = &t;
+    assert(timer_create(CLOCK_REALTIME, &ev, &t) == 0);
+    arm(t, 1, 1);
+    while (atomic_read(& fired[0]) == 0)
+        sleep_ms(1);
+    sleep_ms(20);
+    assert(fired[0] == 1);
+    printf("self-deleting timer passed\n");
+
+    /* many timers, every other one cancelled */
+    ev.sigev_notify_function = count;
+    for (i = 0; i < TIMER_COUNT; i++) {
+        fired[i] = 0;
+        ev.sigev_value.sival_int = i;
+        assert(timer_create(CLOCK_MONOTONIC, &ev, &timers[i]) == 0);
+        arm(timers[i], 100 + rand() % 900, 0);
+    }
+    for (i = 0; i < TIMER_COUNT; i += 2)
+        arm(timers[i], 0, 0);
+    sleep_ms(1200);
+    for (i = 0; i < TIMER_COUNT; i++) {
+        assert(fired[i] == (i & 1));
+        assert(timer_delete(timers[i]) == 0);
+    }
+    printf("%d timers passed\n", TIMER_COUNT);
+
+    /* errors */
+    assert(timer_create(CLOCK_PROCESS_CPUTIME_ID, NULL, &t) == -1 && errno == EINVAL);
+    ev.sigev_notify = SIGEV_SIGNAL;
+    assert(timer_create(CLOCK_MONOTONIC, &ev, &t) == -1 && errno == EINVAL);
+    assert(timer_create(CLOCK_MONOTONIC, NULL, &t) == 0);
+    value.it_value.tv_sec = 0;
+    value.it_value.tv_nsec = POW10_9;
+    assert(timer_settime(t, 0, &value, NULL) == -1 && errno == EINVAL);
+    assert(timer_delete(t) == 0);
+    printf("timer errors passed\n");
+
+    return 0;
+}
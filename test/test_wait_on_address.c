@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2011, Dongsheng Song <songdongsheng@live.cn>
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winsock2.h>
+
+#include "../src/misc.h"
+
+#define PING_COUNT      100000
+#define WAITER_COUNT    8
+
+static volatile long turn;
+static volatile long gate;
+static volatile long tickets;
+static volatile long passed;
+
+/* Take one of the tickets handed out by main, parking while there is none */
+static void *waiter(void *arg)
+{
+    long n;
+
+    while (atomic_read(&gate) == 0)
+        pthread_wait_on_address_np(&gate, 0, CLOCK_REALTIME, NULL);
+
+    for (;;) {
+        while ((n = atomic_read(&tickets)) == 0)
+            pthread_wait_on_address_np(&tickets, 0, CLOCK_REALTIME, NULL);
+        if (atomic_cmpxchg(&tickets, n - 1, n) == n)
+            break;
+    }
+
+    atomic_fetch_and_add(&passed, 1);
+    return arg;
+}
+
+/* Wait for an odd turn, hand over an even one */
+static void *ponger(void *arg)
+{
+    long i, t;
+
+    for (i = 0; i < PING_COUNT; i++) {
+        while (((t = atomic_read(&turn)) & 1) == 0)
+            pthread_wait_on_address_np(&turn, t, CLOCK_REALTIME, NULL);
+        atomic_set(&turn, t + 1);
+        pthread_wake_np(&turn, 1);
+    }
+
+    return arg;
+}
+
+static void test_errors(void)
+{
+    long word = 1;
+    struct timespec ts = {0, 0};
+
+    assert(pthread_wait_on_address_np(&word, 0, CLOCK_REALTIME, NULL) == EAGAIN);
+    assert(pthread_wait_on_address_np(NULL, 0, CLOCK_REALTIME, NULL) == EINVAL);
+    assert(pthread_wait_on_address_np(&word, 1, CLOCK_PROCESS_CPUTIME_ID, &ts) == EINVAL);
+    ts.tv_nsec = POW10_9;
+    assert(pthread_wait_on_address_np(&word, 1, CLOCK_MONOTONIC, &ts) == EINVAL);
+    assert(pthread_wake_np(&word, 0) == EINVAL);
+    assert(pthread_wake_np(NULL, 1) == EINVAL);
+
+    /* nobody waits on it */
+    assert(pthread_wake_np(&word, PTHREAD_WAKE_ALL_NP) == 0);
+    printf("error cases passed\n");
+}
+
+static void test_timeout(clockid_t clock_id)
+{
+    long word = 0, ms;
+    struct timespec ts, start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(clock_id, &ts);
+    ts.tv_nsec += 50 * POW10_6;
+    if (ts.tv_nsec >= POW10_9) {
+        ts.tv_sec++;
+        ts.tv_nsec -= POW10_9;
+    }
+
+    assert(pthread_wait_on_address_np(&word, 0, clock_id, &ts) == ETIMEDOUT);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = (long) ((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / POW10_6);
+    assert(ms >= 40); /* coarse clocks tick every 10-16 ms */
+
+    /* a deadline in the past times out at once */
+    ts.tv_sec -= 1;
+    assert(pthread_wait_on_address_np(&word, 0, clock_id, &ts) == ETIMEDOUT);
+    printf("clock %d: timed out after %ld ms\n", (int) clock_id, ms);
+}
+
+static void test_ping_pong(void)
+{
+    long i, t;
+    pthread_t thread;
+
+    assert(pthread_create(&thread, NULL, ponger, NULL) == 0);
+    for (i = 0; i < PING_COUNT; i++) {
+        while (((t = atomic_read(&turn)) & 1) != 0)
+            pthread_wait_on_address_np(&turn, t, CLOCK_REALTIME, NULL);
+        atomic_set(&turn, t + 1);
+        pthread_wake_np(&turn, 1);
+    }
+    assert(pthread_join(thread, NULL) == 0);
+    assert(turn == 2 * PING_COUNT);
+    printf("ping-pong of %d rounds passed\n", PING_COUNT);
+}
+
+static void test_wake_n(void)
+{
+    int i;
+    pthread_t threads[WAITER_COUNT];
+
+    for (i = 0; i < WAITER_COUNT; i++)
+        assert(pthread_create(&threads[i], NULL, waiter, NULL) == 0);
+
+    Sleep(50);
+    atomic_set(&gate, 1);
+    assert(pthread_wake_np(&gate, PTHREAD_WAKE_ALL_NP) == 0);
+
+    /* hand out the tickets in batches of 3, only as many threads pass */
+    for (i = 0; i < WAITER_COUNT; i += 3) {
+        long n = WAITER_COUNT - i < 3 ? WAITER_COUNT - i : 3;
+
+        atomic_fetch_and_add(&tickets, n);
+        assert(pthread_wake_np(&tickets, (int) n) == 0);
+        while (atomic_read(&passed) < i + n)
+            Sleep(1);
+        Sleep(10);
+        assert(passed == i + n);
+    }
+
+    for (i = 0; i < WAITER_COUNT; i++)
+        assert(pthread_join(threads[i], NULL) == 0);
+    assert(tickets == 0);
+    printf("wake-n of %d waiters passed\n", WAITER_COUNT);
+}
+
+int main(int argc, char *argv[])
+{
+    test_errors();
+    test_timeout(CLOCK_MONOTONIC);
+    test_timeout(CLOCK_REALTIME);
+    test_timeout(CLOCK_MONOTONIC_COARSE);
+    test_ping_pong();
+    test_wake_n();
+
+    return 0;
+}